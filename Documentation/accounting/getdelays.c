@@ -199,6 +199,10 @@ void print_delayacct(struct taskstats *t)
 	       "SWAP  %15s%15s\n"
 	       "      %15llu%15llu\n"
 	       "RECLAIM  %12s%15s\n"
+	       "      %15llu%15llu\n"
+	       "COMPACT  %12s%15s\n"
+	       "      %15llu%15llu\n"
+	       "DIRTY    %12s%15s\n"
 	       "      %15llu%15llu\n",
 	       "count", "real total", "virtual total", "delay total",
 	       (unsigned long long)t->cpu_count,
@@ -213,7 +217,13 @@ void print_delayacct(struct taskstats *t)
 	       (unsigned long long)t->swapin_delay_total,
 	       "count", "delay total",
 	       (unsigned long long)t->freepages_count,
-	       (unsigned long long)t->freepages_delay_total);
+	       (unsigned long long)t->freepages_delay_total,
+	       "count", "delay total",
+	       (unsigned long long)t->compact_count,
+	       (unsigned long long)t->compact_delay_total,
+	       "count", "delay total",
+	       (unsigned long long)t->dirty_count,
+	       (unsigned long long)t->dirty_delay_total);
 }
 
 void task_context_switch_counts(struct taskstats *t)
@@ -0,0 +1,342 @@
+/*
+ * ashmem-stress.c
+ *
+ * Pin/unpin storm on ashmem areas under memory pressure.  -t threads each
+ * own -a areas of -p pages, and for -T seconds pin or unpin random page
+ * ranges of them.  A child process meanwhile keeps touching -m megabytes
+ * of anonymous memory so that the ashmem shrinker purges unpinned ranges,
+ * and with -P the main thread also purges everything every 10ms.
+ *
+ * Each page holds a pattern while it is pinned, so every pin checks that
+ * the pages it gets back kept their contents, or were zeroed if the pin
+ * reported ASHMEM_WAS_PURGED.  The pin and unpin latencies are reported,
+ * as they are what apps see while the shrinker runs.
+ *
+ *	adb shell /data/ashmem-stress -t 4 -a 16 -p 64 -m 128 -P
+ *
+ * Compile with
+ *	$(CC) -O2 -I include ashmem-stress.c -o ashmem-stress
+ * adding -lpthread if the C library needs it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <linux/types.h>
+#include <linux/ashmem.h>
+
+#define MAX_THREADS	64
+#define MAX_RANGE	8	/* pages per pin or unpin */
+
+struct area {
+	int fd;
+	uint32_t *map;
+	unsigned char *pinned;	/* per page */
+	uint32_t *gen;		/* per page, bumped on every pin */
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int id, seed;
+	struct area *areas;
+	unsigned long pins, unpins, purged, errors;
+	double pin_total, pin_max, unpin_max;
+};
+
+static int nr_areas = 16, nr_pages = 64, duration = 10;
+static size_t page_size;
+static volatile int stop;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t pattern(struct worker *w, int area, int page)
+{
+	return (w->id << 24 | area << 12 | page) ^
+		(w->areas[area].gen[page] * 0x9e3779b9);
+}
+
+static uint32_t *page_addr(struct area *a, int page)
+{
+	return a->map + page * (page_size / sizeof(uint32_t));
+}
+
+static void fill_page(struct worker *w, int area, int page)
+{
+	uint32_t *p = page_addr(&w->areas[area], page);
+	uint32_t v = pattern(w, area, page);
+	size_t i;
+
+	for (i = 0; i < page_size / sizeof(uint32_t); i++)
+		p[i] = v;
+}
+
+/* 1 if the page holds its pattern, 0 if zeroed, -1 if anything else */
+static int check_page(struct worker *w, int area, int page)
+{
+	uint32_t *p = page_addr(&w->areas[area], page);
+	uint32_t v = pattern(w, area, page);
+	size_t last = page_size / sizeof(uint32_t) - 1;
+
+	if (p[0] == v && p[last / 2] == v && p[last] == v)
+		return 1;
+	if (!p[0] && !p[last / 2] && !p[last])
+		return 0;
+	return -1;
+}
+
+static void area_create(struct area *a, const char *name)
+{
+	size_t size = nr_pages * page_size;
+
+	a->fd = open("/dev/ashmem", O_RDWR);
+	if (a->fd < 0)
+		die("/dev/ashmem");
+	if (ioctl(a->fd, ASHMEM_SET_NAME, name) < 0 ||
+	    ioctl(a->fd, ASHMEM_SET_SIZE, size) < 0)
+		die("ashmem setup");
+	a->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      a->fd, 0);
+	if (a->map == MAP_FAILED)
+		die("mmap ashmem");
+	a->pinned = malloc(nr_pages);
+	a->gen = calloc(nr_pages, sizeof(*a->gen));
+	if (!a->pinned || !a->gen)
+		die("malloc");
+	/* areas start out pinned */
+	memset(a->pinned, 1, nr_pages);
+}
+
+static void do_pin(struct worker *w, int area, int first, int count)
+{
+	struct area *a = &w->areas[area];
+	struct ashmem_pin pin = {
+		.offset = first * page_size,
+		.len = count * page_size,
+	};
+	double start, lat;
+	int ret, page, state;
+
+	start = now();
+	ret = ioctl(a->fd, ASHMEM_PIN, &pin);
+	lat = now() - start;
+	if (ret < 0)
+		die("ASHMEM_PIN");
+	w->pins++;
+	w->pin_total += lat;
+	if (lat > w->pin_max)
+		w->pin_max = lat;
+	if (ret == ASHMEM_WAS_PURGED)
+		w->purged++;
+
+	for (page = first; page < first + count; page++) {
+		state = check_page(w, area, page);
+		/* only unpinned pages may be purged, and only if reported */
+		if (state < 0 ||
+		    (!state && (a->pinned[page] || ret != ASHMEM_WAS_PURGED))) {
+			if (!w->errors)
+				fprintf(stderr, "thread %u area %d page %d: %s"
+					" after pin (%s)\n", w->id, area, page,
+					state < 0 ? "corrupt" : "zeroed",
+					ret == ASHMEM_WAS_PURGED ?
+					"purged" : "not purged");
+			w->errors++;
+		}
+		a->pinned[page] = 1;
+		a->gen[page]++;
+		fill_page(w, area, page);
+	}
+}
+
+static void do_unpin(struct worker *w, int area, int first, int count)
+{
+	struct area *a = &w->areas[area];
+	struct ashmem_pin pin = {
+		.offset = first * page_size,
+		.len = count * page_size,
+	};
+	double start, lat;
+	int page;
+
+	start = now();
+	if (ioctl(a->fd, ASHMEM_UNPIN, &pin) < 0)
+		die("ASHMEM_UNPIN");
+	lat = now() - start;
+	w->unpins++;
+	if (lat > w->unpin_max)
+		w->unpin_max = lat;
+	for (page = first; page < first + count; page++)
+		a->pinned[page] = 0;
+}
+
+static void *worker_loop(void *arg)
+{
+	struct worker *w = arg;
+	char name[32];
+	int i, area, first, count;
+
+	w->areas = calloc(nr_areas, sizeof(*w->areas));
+	if (!w->areas)
+		die("calloc");
+	for (i = 0; i < nr_areas; i++) {
+		snprintf(name, sizeof(name), "stress-%u-%d", w->id, i);
+		area_create(&w->areas[i], name);
+		for (first = 0; first < nr_pages; first++)
+			fill_page(w, i, first);
+	}
+
+	while (!stop) {
+		area = rand_r(&w->seed) % nr_areas;
+		first = rand_r(&w->seed) % nr_pages;
+		count = 1 + rand_r(&w->seed) % MAX_RANGE;
+		if (first + count > nr_pages)
+			count = nr_pages - first;
+		/* unpin what's pinned, and the other way around */
+		if (w->areas[area].pinned[first])
+			do_unpin(w, area, first, count);
+		else
+			do_pin(w, area, first, count);
+	}
+	return NULL;
+}
+
+/* Keep touching @mb megabytes until killed. */
+static void run_hog(int mb)
+{
+	size_t size = (size_t)mb << 20, i;
+	char *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p == MAP_FAILED)
+		die("mmap hog");
+	for (;;)
+		for (i = 0; i < size; i += page_size)
+			p[i]++;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t threads] [-a areas] [-p pages]"
+		" [-T seconds] [-m hog_mb] [-P]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static struct worker workers[MAX_THREADS];
+	int nr_threads = 4, hog_mb = 0, purge = 0, opt, fd = -1, i;
+	unsigned long pins = 0, unpins = 0, purged = 0, errors = 0;
+	double pin_total = 0, pin_max = 0, unpin_max = 0, end;
+	pid_t hog = 0;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	while ((opt = getopt(argc, argv, "t:a:p:T:m:P")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'a':
+			nr_areas = atoi(optarg);
+			break;
+		case 'p':
+			nr_pages = atoi(optarg);
+			break;
+		case 'T':
+			duration = atoi(optarg);
+			break;
+		case 'm':
+			hog_mb = atoi(optarg);
+			break;
+		case 'P':
+			purge = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_threads < 1 || nr_threads > MAX_THREADS || nr_areas < 1 ||
+	    nr_areas > 4096 || nr_pages < 1 || nr_pages > 4096 ||
+	    duration < 1 || hog_mb < 0)
+		usage(argv[0]);
+
+	if (hog_mb) {
+		hog = fork();
+		if (hog < 0)
+			die("fork");
+		if (!hog)
+			run_hog(hog_mb);
+	}
+	if (purge) {
+		fd = open("/dev/ashmem", O_RDWR);
+		if (fd < 0)
+			die("/dev/ashmem");
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].id = i;
+		workers[i].seed = i + 1;
+		if (pthread_create(&workers[i].thread, NULL, worker_loop,
+				   &workers[i]))
+			die("pthread_create");
+	}
+
+	end = now() + duration;
+	while (now() < end) {
+		if (purge && ioctl(fd, ASHMEM_PURGE_ALL_CACHES) < 0)
+			die("ASHMEM_PURGE_ALL_CACHES");
+		usleep(10000);
+	}
+	stop = 1;
+
+	for (i = 0; i < nr_threads; i++) {
+		struct worker *w = &workers[i];
+
+		pthread_join(w->thread, NULL);
+		pins += w->pins;
+		unpins += w->unpins;
+		purged += w->purged;
+		errors += w->errors;
+		pin_total += w->pin_total;
+		if (w->pin_max > pin_max)
+			pin_max = w->pin_max;
+		if (w->unpin_max > unpin_max)
+			unpin_max = w->unpin_max;
+	}
+	if (hog) {
+		kill(hog, SIGKILL);
+		waitpid(hog, NULL, 0);
+	}
+
+	printf("%lu pins (%lu purged), %lu unpins in %ds, %.0f ops/s\n",
+	       pins, purged, unpins, duration,
+	       (pins + unpins) / (double)duration);
+	printf("pin latency: avg %.1f us, max %.1f us; unpin max %.1f us\n",
+	       pins ? pin_total * 1e6 / pins : 0, pin_max * 1e6,
+	       unpin_max * 1e6);
+	printf("%lu errors\n", errors);
+	return errors ? 1 : 0;
+}
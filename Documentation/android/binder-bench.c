@@ -0,0 +1,666 @@
+/*
+ * binder-bench.c
+ *
+ * Binder transaction throughput versus the number of concurrent
+ * client/server process pairs.  Each client makes synchronous calls to
+ * its own server only, so the pairs share nothing but the driver.
+ *
+ * With -l, it measures the latency of the calls of one client to a server
+ * whose looper threads are kept busy by background clients instead, once
+ * with the client at normal priority and once at SCHED_FIFO priority -r.
+ * -b sets the number of background clients, -n the number of server
+ * threads and -w how long the server works on each call, in us.
+ *
+ * binder-bench hands the servers to the clients itself, as the context
+ * manager, so servicemanager and the framework must be stopped first:
+ *
+ *	adb shell stop
+ *	adb shell /data/binder-bench -p 8 -t 5
+ *	adb shell /data/binder-bench -l -b 8 -n 2 -w 500 -r 50
+ *	adb shell start
+ *
+ * Compile with
+ *	$(CC) -O2 -I drivers/staging/android binder-bench.c -o binder-bench
+ * adding -lpthread if the C library needs it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+#define BINDER_VM_SIZE	(128 * 1024)
+#define MAX_PAIRS	64
+#define MAX_THREADS	16
+#define MAX_SAMPLES	100000
+
+/* transaction codes */
+enum {
+	BENCH_REGISTER = 1,	/* server to manager: index and binder */
+	BENCH_LOOKUP,		/* client to manager: index, reply has handle */
+	BENCH_CALL,		/* client to server */
+};
+
+struct bench_register {
+	uint32_t index;
+	uint32_t pad;
+	struct flat_binder_object obj;
+};
+
+/* what a client reports back once its run is over */
+struct bench_result {
+	unsigned long calls;
+	double secs;
+};
+
+/* call latencies of the probe client, in us */
+struct bench_latency {
+	unsigned long calls;
+	double p50, p90, p99, max;
+};
+
+struct bench_thread {
+	int fd;
+	uint8_t out[256];
+	size_t out_len;
+	uint8_t in[256];
+	size_t in_pos, in_len;
+};
+
+static int duration = 5;
+static size_t payload = 128;
+static int work_us;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Keep the CPU busy for @us, like a server doing real work would. */
+static void spin(int us)
+{
+	double end = now() + us / 1e6;
+
+	while (now() < end)
+		;
+}
+
+static int binder_open(void)
+{
+	struct binder_version vers;
+	int fd;
+
+	fd = open("/dev/binder", O_RDWR);
+	if (fd < 0)
+		die("/dev/binder");
+	if (ioctl(fd, BINDER_VERSION, &vers) < 0 ||
+	    vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol version mismatch\n");
+		exit(1);
+	}
+	if (mmap(NULL, BINDER_VM_SIZE, PROT_READ, MAP_PRIVATE, fd, 0) ==
+	    MAP_FAILED)
+		die("mmap /dev/binder");
+	return fd;
+}
+
+/* Queue a command, it goes to the driver with the next bt_flush/bt_wait. */
+static void bt_queue(struct bench_thread *bt, uint32_t cmd,
+		     const void *arg, size_t len)
+{
+	if (bt->out_len + sizeof(cmd) + len > sizeof(bt->out)) {
+		fprintf(stderr, "command buffer overflow\n");
+		exit(1);
+	}
+	memcpy(bt->out + bt->out_len, &cmd, sizeof(cmd));
+	memcpy(bt->out + bt->out_len + sizeof(cmd), arg, len);
+	bt->out_len += sizeof(cmd) + len;
+}
+
+static void bt_talk(struct bench_thread *bt, int do_read)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = bt->out_len;
+	bwr.write_buffer = (unsigned long)bt->out;
+	if (do_read) {
+		bwr.read_size = sizeof(bt->in);
+		bwr.read_buffer = (unsigned long)bt->in;
+	}
+	while (ioctl(bt->fd, BINDER_WRITE_READ, &bwr) < 0)
+		if (errno != EINTR)
+			die("BINDER_WRITE_READ");
+	bt->out_len = 0;
+	if (do_read) {
+		bt->in_pos = 0;
+		bt->in_len = bwr.read_consumed;
+	}
+}
+
+static void bt_flush(struct bench_thread *bt)
+{
+	if (bt->out_len)
+		bt_talk(bt, 0);
+}
+
+/*
+ * Send what is queued and read until a transaction or a reply comes in.
+ * Reference count requests for our own nodes are acknowledged on the way.
+ */
+static uint32_t bt_wait(struct bench_thread *bt,
+			struct binder_transaction_data *tr)
+{
+	struct binder_ptr_cookie pc;
+	uint32_t cmd;
+
+	for (;;) {
+		if (bt->in_pos >= bt->in_len)
+			bt_talk(bt, 1);
+		if (bt->in_pos >= bt->in_len)
+			continue;
+		memcpy(&cmd, bt->in + bt->in_pos, sizeof(cmd));
+		bt->in_pos += sizeof(cmd);
+
+		switch (cmd) {
+		case BR_NOOP:
+		case BR_TRANSACTION_COMPLETE:
+		case BR_SPAWN_LOOPER:
+			break;
+		case BR_TRANSACTION:
+		case BR_REPLY:
+			memcpy(tr, bt->in + bt->in_pos, sizeof(*tr));
+			bt->in_pos += sizeof(*tr);
+			return cmd;
+		case BR_INCREFS:
+		case BR_ACQUIRE:
+			memcpy(&pc, bt->in + bt->in_pos, sizeof(pc));
+			bt->in_pos += sizeof(pc);
+			bt_queue(bt, cmd == BR_INCREFS ? BC_INCREFS_DONE :
+				 BC_ACQUIRE_DONE, &pc, sizeof(pc));
+			break;
+		case BR_RELEASE:
+		case BR_DECREFS:
+			bt->in_pos += sizeof(pc);
+			break;
+		case BR_DEAD_REPLY:
+		case BR_FAILED_REPLY:
+			fprintf(stderr, "transaction failed\n");
+			exit(1);
+		default:
+			fprintf(stderr, "unexpected binder command %#x\n", cmd);
+			exit(1);
+		}
+	}
+}
+
+static void bt_free(struct bench_thread *bt,
+		    struct binder_transaction_data *tr)
+{
+	const void *buffer = tr->data.ptr.buffer;
+
+	bt_queue(bt, BC_FREE_BUFFER, &buffer, sizeof(buffer));
+}
+
+static void bt_send(struct bench_thread *bt, uint32_t cmd, size_t handle,
+		    uint32_t code, const void *data, size_t size,
+		    const size_t *offsets, size_t nr_offsets)
+{
+	struct binder_transaction_data tr;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	tr.data_size = size;
+	tr.offsets_size = nr_offsets * sizeof(size_t);
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offsets;
+	bt_queue(bt, cmd, &tr, sizeof(tr));
+}
+
+/* Make a synchronous call, the caller frees the reply with bt_free(). */
+static void bt_call(struct bench_thread *bt, size_t handle, uint32_t code,
+		    const void *data, size_t size, const size_t *offsets,
+		    size_t nr_offsets, struct binder_transaction_data *reply)
+{
+	bt_send(bt, BC_TRANSACTION, handle, code, data, size,
+		offsets, nr_offsets);
+	if (bt_wait(bt, reply) != BR_REPLY) {
+		fprintf(stderr, "expected a reply\n");
+		exit(1);
+	}
+}
+
+/* Free the transaction and reply to it, right away. */
+static void bt_reply(struct bench_thread *bt,
+		     struct binder_transaction_data *tr,
+		     const void *data, size_t size,
+		     const size_t *offsets, size_t nr_offsets)
+{
+	bt_free(bt, tr);
+	bt_send(bt, BC_REPLY, 0, 0, data, size, offsets, nr_offsets);
+	bt_flush(bt);
+}
+
+/* The context manager, a thread of the main process. */
+static void *manager_loop(void *arg)
+{
+	static size_t handles[MAX_PAIRS * 16];
+	struct bench_thread bt = { .fd = (long)arg };
+	struct binder_transaction_data tr;
+	struct flat_binder_object obj;
+	const struct bench_register *reg;
+	static const size_t offset;
+	uint32_t index, desc;
+
+	bt_queue(&bt, BC_ENTER_LOOPER, NULL, 0);
+	for (;;) {
+		if (bt_wait(&bt, &tr) != BR_TRANSACTION)
+			continue;
+
+		switch (tr.code) {
+		case BENCH_REGISTER:
+			reg = tr.data.ptr.buffer;
+			if (tr.data_size < sizeof(*reg) ||
+			    reg->index >= ARRAY_SIZE(handles) ||
+			    reg->obj.type != BINDER_TYPE_HANDLE)
+				break;
+			/* hold on to the server past the transaction */
+			handles[reg->index] = reg->obj.handle;
+			desc = reg->obj.handle;
+			bt_queue(&bt, BC_ACQUIRE, &desc, sizeof(desc));
+			bt_reply(&bt, &tr, NULL, 0, NULL, 0);
+			continue;
+		case BENCH_LOOKUP:
+			if (tr.data_size < sizeof(index))
+				break;
+			memcpy(&index, tr.data.ptr.buffer, sizeof(index));
+			if (index >= ARRAY_SIZE(handles) || !handles[index])
+				break;
+			memset(&obj, 0, sizeof(obj));
+			obj.type = BINDER_TYPE_HANDLE;
+			obj.handle = handles[index];
+			bt_reply(&bt, &tr, &obj, sizeof(obj), &offset, 1);
+			continue;
+		}
+		/* unknown, or not registered yet: an empty reply */
+		bt_reply(&bt, &tr, NULL, 0, NULL, 0);
+	}
+	return NULL;
+}
+
+static void *server_loop(void *arg)
+{
+	struct bench_thread bt = { .fd = (long)arg };
+	struct binder_transaction_data tr;
+	char *buf = calloc(1, payload);
+
+	if (!buf)
+		die("calloc");
+	bt_queue(&bt, BC_ENTER_LOOPER, NULL, 0);
+	for (;;) {
+		if (bt_wait(&bt, &tr) != BR_TRANSACTION)
+			continue;
+		spin(work_us);
+		bt_reply(&bt, &tr, buf, tr.data_size < payload ?
+			 tr.data_size : payload, NULL, 0);
+	}
+	return NULL;
+}
+
+static void run_server(uint32_t index, int threads)
+{
+	struct bench_thread bt = { .fd = binder_open() };
+	struct binder_transaction_data reply;
+	struct bench_register reg;
+	static const size_t offset = offsetof(struct bench_register, obj);
+	pthread_t thread;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.index = index;
+	reg.obj.type = BINDER_TYPE_BINDER;
+	reg.obj.flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+	reg.obj.binder = &reg;
+	reg.obj.cookie = &reg;
+	bt_call(&bt, 0, BENCH_REGISTER, &reg, sizeof(reg), &offset, 1, &reply);
+	bt_free(&bt, &reply);
+	bt_flush(&bt);
+
+	while (--threads > 0)
+		if (pthread_create(&thread, NULL, server_loop,
+				   (void *)(long)bt.fd))
+			die("pthread_create");
+	server_loop((void *)(long)bt.fd);
+}
+
+/* Get a handle on server @index, waiting for it to register. */
+static uint32_t client_lookup(struct bench_thread *bt, uint32_t index)
+{
+	struct binder_transaction_data reply;
+	const struct flat_binder_object *obj;
+	uint32_t handle = 0;
+
+	while (!handle) {
+		bt_call(bt, 0, BENCH_LOOKUP, &index, sizeof(index),
+			NULL, 0, &reply);
+		obj = reply.data.ptr.buffer;
+		if (reply.data_size >= sizeof(*obj) &&
+		    obj->type == BINDER_TYPE_HANDLE) {
+			handle = obj->handle;
+			bt_queue(bt, BC_ACQUIRE, &handle, sizeof(handle));
+		}
+		bt_free(bt, &reply);
+		bt_flush(bt);
+		if (!handle)
+			usleep(1000);
+	}
+	return handle;
+}
+
+static void run_client(uint32_t index, int ready_fd, int go_fd, int result_fd)
+{
+	struct bench_thread bt = { .fd = binder_open() };
+	struct binder_transaction_data reply;
+	struct bench_result res;
+	uint32_t handle;
+	double start, end;
+	char *buf, c;
+
+	handle = client_lookup(&bt, index);
+	buf = calloc(1, payload);
+	if (!buf)
+		die("calloc");
+
+	/* one call to warm up, then wait for the others */
+	bt_call(&bt, handle, BENCH_CALL, buf, payload, NULL, 0, &reply);
+	bt_free(&bt, &reply);
+	if (write(ready_fd, "", 1) != 1 || read(go_fd, &c, 1) != 0)
+		die("start barrier");
+
+	res.calls = 0;
+	start = now();
+	end = start + duration;
+	do {
+		bt_call(&bt, handle, BENCH_CALL, buf, payload, NULL, 0, &reply);
+		bt_free(&bt, &reply);
+		/* don't look at the clock on every call */
+	} while ((++res.calls & 63) || now() < end);
+	res.secs = now() - start;
+
+	if (write(result_fd, &res, sizeof(res)) != sizeof(res))
+		die("write result");
+	exit(0);
+}
+
+static double run_pairs(int pairs, uint32_t *next_index)
+{
+	pid_t servers[MAX_PAIRS], clients[MAX_PAIRS];
+	int ready[2], go[2], result[2];
+	struct bench_result res;
+	double rate = 0;
+	char c;
+	int i;
+
+	if (pipe(ready) || pipe(go) || pipe(result))
+		die("pipe");
+
+	for (i = 0; i < pairs; i++) {
+		uint32_t index = (*next_index)++;
+
+		servers[i] = fork();
+		if (servers[i] < 0)
+			die("fork");
+		if (!servers[i]) {
+			close(go[1]);
+			run_server(index, 1);
+		}
+
+		clients[i] = fork();
+		if (clients[i] < 0)
+			die("fork");
+		if (!clients[i]) {
+			close(go[1]);
+			run_client(index, ready[1], go[0], result[1]);
+		}
+	}
+
+	for (i = 0; i < pairs; i++)
+		if (read(ready[0], &c, 1) != 1)
+			die("client startup");
+	close(go[1]);
+
+	for (i = 0; i < pairs; i++) {
+		if (read(result[0], &res, sizeof(res)) != sizeof(res))
+			die("client result");
+		rate += res.calls / res.secs;
+	}
+
+	for (i = 0; i < pairs; i++) {
+		kill(servers[i], SIGKILL);
+		waitpid(servers[i], NULL, 0);
+		waitpid(clients[i], NULL, 0);
+	}
+	close(ready[0]);
+	close(ready[1]);
+	close(go[0]);
+	close(result[0]);
+	close(result[1]);
+	return rate;
+}
+
+/* Call the server back to back until killed. */
+static void run_background(uint32_t index)
+{
+	struct bench_thread bt = { .fd = binder_open() };
+	struct binder_transaction_data reply;
+	uint32_t handle;
+	char *buf;
+
+	handle = client_lookup(&bt, index);
+	buf = calloc(1, payload);
+	if (!buf)
+		die("calloc");
+	for (;;) {
+		bt_call(&bt, handle, BENCH_CALL, buf, payload, NULL, 0, &reply);
+		bt_free(&bt, &reply);
+	}
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Call the server every 10ms, at @rt_prio if not 0, and time the calls. */
+static void run_probe(uint32_t index, int rt_prio, int result_fd)
+{
+	struct bench_thread bt = { .fd = binder_open() };
+	struct binder_transaction_data reply;
+	struct sched_param param = { .sched_priority = rt_prio };
+	struct bench_latency lat;
+	uint32_t handle;
+	double *samples, start, end;
+	unsigned long n = 0;
+	char *buf;
+
+	handle = client_lookup(&bt, index);
+	buf = calloc(1, payload);
+	samples = calloc(MAX_SAMPLES, sizeof(*samples));
+	if (!buf || !samples)
+		die("calloc");
+	if (rt_prio && sched_setscheduler(0, SCHED_FIFO, &param))
+		die("sched_setscheduler");
+
+	end = now() + duration;
+	while (n < MAX_SAMPLES && now() < end) {
+		start = now();
+		bt_call(&bt, handle, BENCH_CALL, buf, payload, NULL, 0, &reply);
+		samples[n++] = (now() - start) * 1e6;
+		bt_free(&bt, &reply);
+		bt_flush(&bt);
+		usleep(10000);
+	}
+
+	qsort(samples, n, sizeof(*samples), cmp_double);
+	lat.calls = n;
+	lat.p50 = samples[n / 2];
+	lat.p90 = samples[n * 9 / 10];
+	lat.p99 = samples[n * 99 / 100];
+	lat.max = samples[n - 1];
+	if (write(result_fd, &lat, sizeof(lat)) != sizeof(lat))
+		die("write result");
+	exit(0);
+}
+
+static void run_latency(int background, int threads, int rt_prio,
+			uint32_t *next_index)
+{
+	pid_t server, clients[MAX_PAIRS], probe;
+	uint32_t index = (*next_index)++;
+	struct bench_latency lat;
+	int result[2], pass, i;
+
+	if (pipe(result))
+		die("pipe");
+
+	server = fork();
+	if (server < 0)
+		die("fork");
+	if (!server)
+		run_server(index, threads);
+	for (i = 0; i < background; i++) {
+		clients[i] = fork();
+		if (clients[i] < 0)
+			die("fork");
+		if (!clients[i])
+			run_background(index);
+	}
+	/* let the background load settle */
+	sleep(1);
+
+	printf("%-10s %8s %10s %10s %10s %10s\n", "probe", "calls",
+	       "p50 us", "p90 us", "p99 us", "max us");
+	for (pass = 0; pass < 2; pass++) {
+		probe = fork();
+		if (probe < 0)
+			die("fork");
+		if (!probe)
+			run_probe(index, pass ? rt_prio : 0, result[1]);
+		if (read(result[0], &lat, sizeof(lat)) != sizeof(lat))
+			die("probe result");
+		waitpid(probe, NULL, 0);
+		if (pass)
+			printf("fifo %-5d", rt_prio);
+		else
+			printf("%-10s", "normal");
+		printf(" %8lu %10.0f %10.0f %10.0f %10.0f\n", lat.calls,
+		       lat.p50, lat.p90, lat.p99, lat.max);
+		fflush(stdout);
+	}
+
+	for (i = 0; i < background; i++) {
+		kill(clients[i], SIGKILL);
+		waitpid(clients[i], NULL, 0);
+	}
+	kill(server, SIGKILL);
+	waitpid(server, NULL, 0);
+	close(result[0]);
+	close(result[1]);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-p max_pairs] [-t seconds] [-s bytes]\n"
+		"       %s -l [-b background] [-n threads] [-w work_us]"
+		" [-r rt_prio] [-t seconds] [-s bytes]\n", prog, prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int max_pairs = 8, pairs, opt, fd;
+	int latency = 0, background = 4, threads = 2, rt_prio = 50;
+	uint32_t next_index = 1;
+	pthread_t manager;
+	double rate;
+
+	while ((opt = getopt(argc, argv, "p:t:s:lb:n:w:r:")) != -1) {
+		switch (opt) {
+		case 'p':
+			max_pairs = atoi(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 's':
+			payload = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			latency = 1;
+			break;
+		case 'b':
+			background = atoi(optarg);
+			break;
+		case 'n':
+			threads = atoi(optarg);
+			break;
+		case 'w':
+			work_us = atoi(optarg);
+			break;
+		case 'r':
+			rt_prio = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_pairs < 1 || max_pairs > MAX_PAIRS || duration < 1 ||
+	    background < 0 || background > MAX_PAIRS ||
+	    threads < 1 || threads > MAX_THREADS || rt_prio < 1)
+		usage(argv[0]);
+
+	fd = binder_open();
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR (is servicemanager running?)");
+	if (pthread_create(&manager, NULL, manager_loop, (void *)(long)fd))
+		die("pthread_create");
+
+	if (latency) {
+		run_latency(background, threads, rt_prio, &next_index);
+		return 0;
+	}
+
+	printf("%5s %12s %12s\n", "pairs", "calls/s", "per pair");
+	for (pairs = 1; pairs <= max_pairs; pairs *= 2) {
+		rate = run_pairs(pairs, &next_index);
+		printf("%5d %12.0f %12.0f\n", pairs, rate, rate / pairs);
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,415 @@
+/*
+ * logger-bench.c
+ *
+ * Throughput and consistency of the Android logger with concurrent
+ * writers and readers.  -w writer threads log as fast as they can through
+ * one shared descriptor, as liblog does, for -t seconds.  -r readers each
+ * open the log and read it with -s threads sharing the descriptor.
+ *
+ * Every message carries its writer and a sequence number, so each reader
+ * thread checks that it sees the entries of each writer in order and
+ * intact.  Entries none of the threads of a reader saw, because the
+ * writers lapped it, are counted as lost, anything out of place as an
+ * error.
+ *
+ * -m picks how readers read: one entry per read() (read), as many entries
+ * as fit per read() (batch, LOGGER_SET_BATCH_READ) or in place from a
+ * mapping of the log (mmap, one thread per reader).  The CPU time the
+ * readers spent is reported with their throughput.
+ *
+ *	adb shell /data/logger-bench -w 4 -r 2 -s 2 -t 5
+ *	adb shell /data/logger-bench -w 4 -m mmap
+ *
+ * Compile with
+ *	$(CC) -O2 -I drivers/staging/android logger-bench.c -o logger-bench
+ * adding -lpthread if the C library needs it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <linux/types.h>
+#include "logger.h"
+
+#define MAX_WRITERS	64
+#define MAX_READERS	64
+#define BENCH_TAG	"logbench"
+#define BATCH_SIZE	(16 * LOGGER_ENTRY_MAX_LEN)
+
+enum { MODE_READ, MODE_BATCH, MODE_MMAP };
+
+struct reader {
+	pthread_t thread;
+	int fd;
+	unsigned long last[MAX_WRITERS];
+	unsigned long entries, errors, laps;
+	double secs, cpu;
+};
+
+/* an entry copied out of a read buffer or the mapping, aligned */
+union entry_buf {
+	struct logger_entry entry;
+	char buf[LOGGER_ENTRY_MAX_LEN];
+};
+
+static const char *device = "/dev/log/main";
+static int mode = MODE_READ;
+static int duration = 5;
+static int msg_len = 64;
+static volatile int stop;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double clock_secs(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double now(void)
+{
+	return clock_secs(CLOCK_MONOTONIC);
+}
+
+static void log_write(int fd, const char *msg)
+{
+	static const unsigned char prio = 4;	/* info */
+	struct iovec vec[3];
+
+	vec[0].iov_base = (void *)&prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = BENCH_TAG;
+	vec[1].iov_len = sizeof(BENCH_TAG);
+	vec[2].iov_base = (void *)msg;
+	vec[2].iov_len = strlen(msg) + 1;
+	while (writev(fd, vec, 3) < 0)
+		if (errno != EINTR)
+			die("writev");
+}
+
+struct writer {
+	pthread_t thread;
+	int fd;
+	unsigned int id;
+	unsigned long seq;
+};
+
+static void *writer_loop(void *arg)
+{
+	struct writer *w = arg;
+	char msg[LOGGER_ENTRY_MAX_PAYLOAD];
+	int len;
+
+	while (!stop) {
+		len = snprintf(msg, sizeof(msg), "w%u s%lu ", w->id, ++w->seq);
+		if (len < msg_len) {
+			memset(msg + len, 'x', msg_len - len);
+			msg[msg_len] = '\0';
+		}
+		log_write(w->fd, msg);
+	}
+	return NULL;
+}
+
+/*
+ * Check one entry, returns 1 at the end of the run.  The payload is a
+ * priority byte, the tag and the message, the last two nul terminated.
+ */
+static int check_entry(struct reader *r, const struct logger_entry *entry)
+{
+	const char *tag = entry->msg + 1, *msg;
+	unsigned long seq;
+	unsigned int id;
+
+	if (entry->len < 1 + sizeof(BENCH_TAG) ||
+	    entry->len > LOGGER_ENTRY_MAX_PAYLOAD ||
+	    entry->msg[entry->len - 1] != '\0') {
+		r->errors++;
+		return 0;
+	}
+	if (strcmp(tag, BENCH_TAG))
+		return 0;	/* someone else's */
+	msg = tag + sizeof(BENCH_TAG);
+	if (!strcmp(msg, "stop"))
+		return 1;
+
+	if (sscanf(msg, "w%u s%lu ", &id, &seq) != 2 || id >= MAX_WRITERS ||
+	    strlen(msg) < (size_t)msg_len || seq <= r->last[id]) {
+		r->errors++;
+		return 0;
+	}
+	r->last[id] = seq;
+	r->entries++;
+	return 0;
+}
+
+/*
+ * Check the entries in @len bytes at @p.  Returns 1 at the end of the run,
+ * -1 if the last entry runs past @len, else 0.  *@used is the length of
+ * the entries checked.
+ */
+static int check_entries(struct reader *r, const char *p, size_t len,
+			 size_t *used)
+{
+	union entry_buf e;
+	size_t n = 0, elen;
+	int ret = 0;
+
+	while (!ret && n < len) {
+		if (len - n < sizeof(e.entry))
+			return -1;
+		memcpy(&e.entry, p + n, sizeof(e.entry));
+		elen = sizeof(e.entry) + e.entry.len;
+		if (elen > sizeof(e) || elen > len - n)
+			return -1;
+		memcpy(&e, p + n, elen);
+		ret = check_entry(r, &e.entry);
+		n += elen;
+		*used = n;
+	}
+	return ret;
+}
+
+static void read_entries(struct reader *r)
+{
+	size_t size = mode == MODE_BATCH ? BATCH_SIZE : LOGGER_ENTRY_MAX_LEN;
+	char *buf = malloc(size);
+	size_t used;
+	ssize_t ret;
+
+	if (!buf)
+		die("malloc");
+	if (mode == MODE_BATCH && ioctl(r->fd, LOGGER_SET_BATCH_READ, 1) < 0)
+		die("LOGGER_SET_BATCH_READ");
+
+	for (;;) {
+		ret = read(r->fd, buf, size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			die("read");
+		}
+		used = 0;
+		ret = check_entries(r, buf, ret, &used);
+		if (ret < 0)
+			r->errors++;
+		else if (ret)
+			break;
+	}
+	free(buf);
+}
+
+/*
+ * Parse the entries in place, from a mapping of the log twice over so that
+ * entries wrapping at the end of the ring are contiguous.  If the writers
+ * lap us meanwhile, what we parsed may have been overwritten and is
+ * discarded.
+ */
+static void read_mmap(struct reader *r)
+{
+	struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+	unsigned long last[MAX_WRITERS], entries, errors;
+	long size, off, len;
+	size_t used;
+	char *map;
+	int ret;
+
+	size = ioctl(r->fd, LOGGER_GET_LOG_BUF_SIZE);
+	if (size <= 0)
+		die("LOGGER_GET_LOG_BUF_SIZE");
+	map = mmap(NULL, 2 * size, PROT_READ, MAP_SHARED, r->fd, 0);
+	if (map == MAP_FAILED)
+		die("mmap");
+
+	for (;;) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("poll");
+		}
+		off = ioctl(r->fd, LOGGER_GET_READ_OFF);
+		len = ioctl(r->fd, LOGGER_GET_LOG_LEN);
+		if (off < 0 || len < 0)
+			die("LOGGER_GET_READ_OFF");
+
+		memcpy(last, r->last, sizeof(last));
+		entries = r->entries;
+		errors = r->errors;
+		used = 0;
+		ret = check_entries(r, map + off, len, &used);
+
+		if (ioctl(r->fd, LOGGER_ADVANCE_READ, used) < 0) {
+			if (errno != EOVERFLOW)
+				die("LOGGER_ADVANCE_READ");
+			memcpy(r->last, last, sizeof(last));
+			r->entries = entries;
+			r->errors = errors;
+			r->laps++;
+			continue;
+		}
+		if (ret < 0) {
+			/* not lapped, so the log itself is corrupt */
+			r->errors++;
+			return;
+		}
+		if (ret)
+			return;
+	}
+}
+
+static void *reader_loop(void *arg)
+{
+	struct reader *r = arg;
+	double start = now();
+	double cpu = clock_secs(CLOCK_THREAD_CPUTIME_ID);
+
+	if (mode == MODE_MMAP)
+		read_mmap(r);
+	else
+		read_entries(r);
+	r->secs = now() - start;
+	r->cpu = clock_secs(CLOCK_THREAD_CPUTIME_ID) - cpu;
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d device] [-w writers] [-r readers]"
+		" [-s threads per reader] [-t seconds] [-l msg_len]"
+		" [-m read|batch|mmap]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static struct writer writers[MAX_WRITERS];
+	static struct reader readers[MAX_READERS];
+	int nr_writers = 4, nr_readers = 1, shared = 1, rfd = -1, fd, opt, i;
+	unsigned long written = 0, entries, errors = 0, laps;
+	double start, secs, rate, cpu;
+	int j;
+
+	while ((opt = getopt(argc, argv, "d:w:r:s:t:l:m:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'w':
+			nr_writers = atoi(optarg);
+			break;
+		case 'r':
+			nr_readers = atoi(optarg);
+			break;
+		case 's':
+			shared = atoi(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'l':
+			msg_len = atoi(optarg);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "read"))
+				mode = MODE_READ;
+			else if (!strcmp(optarg, "batch"))
+				mode = MODE_BATCH;
+			else if (!strcmp(optarg, "mmap"))
+				mode = MODE_MMAP;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_writers < 1 || nr_writers > MAX_WRITERS || nr_readers < 0 ||
+	    shared < 1 || nr_readers * shared > MAX_READERS || duration < 1 ||
+	    msg_len < 0 || msg_len >= 1024 || (mode == MODE_MMAP && shared > 1))
+		usage(argv[0]);
+
+	for (i = 0; i < nr_readers * shared; i++) {
+		if (i % shared == 0) {
+			rfd = open(device, O_RDONLY);
+			if (rfd < 0)
+				die(device);
+			/* start at the end, past what is already logged */
+			while (ioctl(rfd, LOGGER_GET_LOG_LEN) > 0) {
+				char buf[LOGGER_ENTRY_MAX_LEN];
+
+				if (read(rfd, buf, sizeof(buf)) < 0)
+					die("read");
+			}
+		}
+		readers[i].fd = rfd;
+		if (pthread_create(&readers[i].thread, NULL, reader_loop,
+				   &readers[i]))
+			die("pthread_create");
+	}
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0)
+		die(device);
+	start = now();
+	for (i = 0; i < nr_writers; i++) {
+		writers[i].fd = fd;
+		writers[i].id = i;
+		if (pthread_create(&writers[i].thread, NULL, writer_loop,
+				   &writers[i]))
+			die("pthread_create");
+	}
+	sleep(duration);
+	stop = 1;
+	for (i = 0; i < nr_writers; i++) {
+		pthread_join(writers[i].thread, NULL);
+		written += writers[i].seq;
+	}
+	secs = now() - start;
+
+	/* each thread of each reader takes one of these and stops */
+	for (i = 0; i < shared; i++)
+		log_write(fd, "stop");
+
+	printf("%d writers: %lu entries, %.0f entries/s\n",
+	       nr_writers, written, written / secs);
+	for (i = 0; i < nr_readers; i++) {
+		entries = laps = 0;
+		rate = cpu = 0;
+		for (j = i * shared; j < (i + 1) * shared; j++) {
+			struct reader *r = &readers[j];
+
+			pthread_join(r->thread, NULL);
+			entries += r->entries;
+			rate += r->entries / r->secs;
+			cpu += r->cpu;
+			errors += r->errors;
+			laps += r->laps;
+		}
+		printf("reader %d: %lu entries, %.0f entries/s, %lu lost,"
+		       " %.2f us cpu/entry", i, entries, rate,
+		       written - entries, entries ? cpu * 1e6 / entries : 0);
+		if (mode == MODE_MMAP)
+			printf(", lapped %lu times", laps);
+		printf("\n");
+	}
+	printf("%lu errors\n", errors);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,233 @@
+/*
+ * pmem-bench.c
+ *
+ * Allocation latency and fragmentation of a pmem region.  Buffers of -s
+ * to -S kilobytes are allocated the way gralloc and the camera HAL do it,
+ * by opening the pmem device and mapping the size wanted, until the
+ * region is full.  Every other buffer is then freed to fragment it, and
+ * for -n steps a random buffer is freed or a new one allocated.  The
+ * allocation latency and the number of failed allocations are reported,
+ * along with the allocator statistics from debugfs, if present, before
+ * and after the run.
+ *
+ *	adb shell /data/pmem-bench -d /dev/pmem_adsp -s 64 -S 2048
+ *
+ * The debugfs file is named after the device and read from
+ * /sys/kernel/debug unless -D gives another path.
+ *
+ * Compile with
+ *	$(CC) -O2 -I include pmem-bench.c -o pmem-bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+/* android_pmem.h declares kernel interfaces taking these */
+struct file;
+struct inode;
+#include <linux/android_pmem.h>
+
+#define MAX_BUFS	1024
+
+struct buf {
+	int fd;
+	void *map;
+	size_t len;
+};
+
+static struct buf bufs[MAX_BUFS];
+static int nr_bufs;
+static const char *dev = "/dev/pmem";
+static size_t page_size;
+static double *lat;
+static unsigned long nr_lat, fails;
+static double free_max;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Allocate a buffer of @len bytes into the next slot, 0 on success. */
+static int buf_alloc(size_t len, int record)
+{
+	struct buf *b = &bufs[nr_bufs];
+	struct pmem_region region;
+	double start, t;
+
+	start = now();
+	b->fd = open(dev, O_RDWR);
+	if (b->fd < 0)
+		die(dev);
+	b->map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0);
+	t = now() - start;
+
+	if (b->map == MAP_FAILED) {
+		/* pmem_mmap() fails a full region with EINVAL */
+		if (errno != EINVAL)
+			die("mmap pmem");
+		close(b->fd);
+		if (record)
+			fails++;
+		return -1;
+	}
+	if (ioctl(b->fd, PMEM_GET_SIZE, &region) < 0)
+		die("PMEM_GET_SIZE");
+	if (region.len < len) {
+		fprintf(stderr, "asked for %zu bytes, got %lu\n", len,
+			region.len);
+		exit(1);
+	}
+	*(volatile int *)b->map = nr_bufs;
+	b->len = len;
+	nr_bufs++;
+	if (record)
+		lat[nr_lat++] = t;
+	return 0;
+}
+
+static void buf_free(int i)
+{
+	double start, t;
+
+	start = now();
+	munmap(bufs[i].map, bufs[i].len);
+	close(bufs[i].fd);
+	t = now() - start;
+	if (t > free_max)
+		free_max = t;
+	bufs[i] = bufs[--nr_bufs];
+}
+
+static size_t rand_len(size_t min, size_t max)
+{
+	size_t len = min + (size_t)rand() % (max - min + 1);
+
+	return (len + page_size - 1) & ~(page_size - 1);
+}
+
+static void show_debugfs(const char *path)
+{
+	char line[256];
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f))
+		fputs(line, stdout);
+	fclose(f);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d device] [-s min_kb] [-S max_kb]"
+		" [-n steps] [-D debugfs_file]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	size_t min = 64 << 10, max = 2048 << 10;
+	unsigned long steps = 10000, step;
+	char debugfs[256] = "";
+	struct pmem_region total;
+	const char *name;
+	int opt, fd, i;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	while ((opt = getopt(argc, argv, "d:s:S:n:D:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 's':
+			min = (size_t)atoi(optarg) << 10;
+			break;
+		case 'S':
+			max = (size_t)atoi(optarg) << 10;
+			break;
+		case 'n':
+			steps = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			snprintf(debugfs, sizeof(debugfs), "%s", optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || !min || max < min || !steps)
+		usage(argv[0]);
+	if (!debugfs[0]) {
+		name = strrchr(dev, '/');
+		snprintf(debugfs, sizeof(debugfs), "/sys/kernel/debug/%s",
+			 name ? name + 1 : dev);
+	}
+	lat = malloc(sizeof(*lat) * steps);
+	if (!lat)
+		die("malloc");
+	srand(1);
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0)
+		die(dev);
+	if (ioctl(fd, PMEM_GET_TOTAL_SIZE, &total) < 0)
+		die("PMEM_GET_TOTAL_SIZE");
+	close(fd);
+
+	/* fill the region, then free every other buffer */
+	while (nr_bufs < MAX_BUFS && !buf_alloc(rand_len(min, max), 0))
+		;
+	printf("%s: %lu KB, filled with %d buffers\n", dev, total.len >> 10,
+	       nr_bufs);
+	for (i = nr_bufs - 1; i >= 0; i -= 2)
+		buf_free(i);
+	printf("before:\n");
+	show_debugfs(debugfs);
+
+	for (step = 0; step < steps; step++) {
+		if (nr_bufs && (nr_bufs == MAX_BUFS || rand() % 2))
+			buf_free(rand() % nr_bufs);
+		else
+			buf_alloc(rand_len(min, max), 1);
+	}
+	printf("after:\n");
+	show_debugfs(debugfs);
+
+	qsort(lat, nr_lat, sizeof(*lat), cmp_double);
+	printf("%lu allocations, %lu failed\n", nr_lat, fails);
+	printf("alloc latency: p50 %.1f us, p99 %.1f us, max %.1f us;"
+	       " free max %.1f us\n",
+	       nr_lat ? lat[nr_lat / 2] * 1e6 : 0,
+	       nr_lat ? lat[nr_lat * 99 / 100] * 1e6 : 0,
+	       nr_lat ? lat[nr_lat - 1] * 1e6 : 0, free_max * 1e6);
+
+	while (nr_bufs)
+		buf_free(nr_bufs - 1);
+	return 0;
+}
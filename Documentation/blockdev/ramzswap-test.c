@@ -0,0 +1,192 @@
+/*
+ * ramzswap-test.c
+ *
+ * Memory hog that checks what comes back from swap.  It maps -m megabytes
+ * of anonymous memory, more than the RAM free, and fills it with a mix of
+ * pages: a quarter zero, half compressible and a quarter random, so that
+ * ramzswap stores pages in each of its three ways.  Each of -p passes then
+ * checks every page and rewrites a quarter of them, so that swap sees
+ * reads, writes and discards of freed slots.  Before and after, /proc/swaps
+ * and the statistics of the ramzswap device given with -d are shown.
+ *
+ *	modprobe ramzswap disksize_kb=65536
+ *	mkswap /dev/ramzswap0
+ *	swapon /dev/ramzswap0
+ *	ramzswap-test -m 192 -p 4
+ *	swapoff /dev/ramzswap0
+ *
+ * The ratio of orig_data_size to mem_used_total is what the device saves.
+ *
+ * Compile with
+ *	gcc -O2 -o ramzswap-test ramzswap-test.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static const char *stats[] = {
+	"disksize", "num_reads", "num_writes", "failed_reads",
+	"failed_writes", "invalid_io", "discards", "zero_pages",
+	"pages_stored", "pages_expand", "orig_data_size", "compr_data_size",
+	"mem_used_total", "compr_ratio",
+};
+
+static size_t page_size, nr_pages;
+static unsigned char *mem, *gen;
+static unsigned long errors;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The contents of page @i at generation @g, one word at a time: zero,
+ * a repeating pattern, or xorshift noise that LZO can't compress.
+ */
+static void page_words(size_t i, unsigned int g, uint32_t *w, size_t n)
+{
+	uint32_t x = (i * 2654435761u) ^ (g << 24) ^ 1;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		switch (i % 4) {
+		case 0:
+			w[k] = 0;
+			break;
+		case 1:
+		case 2:
+			w[k] = (i << 8 | g) + k % 16;
+			break;
+		default:
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			w[k] = x;
+		}
+	}
+}
+
+static void fill_page(size_t i)
+{
+	page_words(i, gen[i], (uint32_t *)(mem + i * page_size),
+		   page_size / sizeof(uint32_t));
+}
+
+static void check_page(size_t i, uint32_t *want)
+{
+	page_words(i, gen[i], want, page_size / sizeof(uint32_t));
+	if (!memcmp(mem + i * page_size, want, page_size))
+		return;
+	if (!errors)
+		fprintf(stderr, "page %zu (generation %u) is corrupt\n", i,
+			gen[i]);
+	errors++;
+}
+
+static void show(const char *path, const char *label)
+{
+	char line[256];
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f))
+		printf("%s%s", label, line);
+	fclose(f);
+}
+
+static void show_stats(const char *dev)
+{
+	char path[256], label[32];
+	size_t i;
+
+	show("/proc/swaps", "");
+	for (i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+		snprintf(path, sizeof(path), "/sys/block/%s/%s", dev, stats[i]);
+		snprintf(label, sizeof(label), "%-16s ", stats[i]);
+		show(path, label);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-m megabytes] [-p passes] [-d device]\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = "ramzswap0";
+	int mb = 128, passes = 4, pass, opt;
+	uint32_t *want;
+	double start;
+	size_t i;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	while ((opt = getopt(argc, argv, "m:p:d:")) != -1) {
+		switch (opt) {
+		case 'm':
+			mb = atoi(optarg);
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		case 'd':
+			dev = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || mb < 1 || passes < 0)
+		usage(argv[0]);
+
+	nr_pages = ((size_t)mb << 20) / page_size;
+	mem = mmap(NULL, nr_pages * page_size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	gen = calloc(nr_pages, 1);
+	want = malloc(page_size);
+	if (mem == MAP_FAILED || !gen || !want)
+		die("allocating");
+
+	start = now();
+	for (i = 0; i < nr_pages; i++)
+		fill_page(i);
+	printf("filled %d MB in %.2fs\n", mb, now() - start);
+	show_stats(dev);
+
+	for (pass = 0; pass < passes; pass++) {
+		start = now();
+		for (i = 0; i < nr_pages; i++) {
+			check_page(i, want);
+			/* a different quarter, of every kind, each pass */
+			if (i / 4 % 4 == (size_t)pass % 4) {
+				gen[i]++;
+				fill_page(i);
+			}
+		}
+		printf("pass %d: %.2fs, %lu errors\n", pass, now() - start,
+		       errors);
+	}
+	show_stats(dev);
+
+	printf("%lu errors\n", errors);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,329 @@
+/*
+ * randread.c
+ *
+ * Parallel random reads over a tree of files, the way an application
+ * launch faults in pieces of many libraries and resources at once.  For
+ * 1, 2, 4 and up to -j threads, the page cache is dropped and each thread
+ * then reads -b bytes at random page-aligned offsets of random files of
+ * the tree for -t seconds.  Each step reports the reads/s, MB/s, the
+ * read latency and the CPU time spent per MB read.
+ *
+ * With -s, the threads instead read the files whole, -b bytes at a time,
+ * each file once, or until -t seconds are up.  This is the cost per byte
+ * of streaming data out of the filesystem.
+ *
+ * To see how squashfs decompression scales with the number of readers:
+ *
+ *	mount -t squashfs -o ro /dev/block/mtdblock3 /system
+ *	randread -j 8 /system
+ *	randread -s -b 131072 -j 1 /system
+ *
+ * Dropping the page cache needs root, otherwise only the files are
+ * dropped, with posix_fadvise().
+ *
+ * Compile with
+ *	gcc -O2 -o randread randread.c -lpthread
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define MAX_THREADS	64
+#define MAX_FILES	8192
+#define MAX_SAMPLES	50000
+
+struct file {
+	char *path;
+	off_t size;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int seed;
+	unsigned long reads;
+	unsigned long long bytes;
+	double *lat;
+};
+
+static struct file files[MAX_FILES];
+static int nr_files;
+static size_t block_size = 4096;
+static int duration = 10;
+static int sequential;
+static int next_file;
+static long page_size;
+static volatile int stop;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void scan(const char *dir)
+{
+	char path[4096];
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+	while ((de = readdir(d)) && nr_files < MAX_FILES) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (lstat(path, &st))
+			continue;
+		if (S_ISDIR(st.st_mode))
+			scan(path);
+		else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+			files[nr_files].path = strdup(path);
+			files[nr_files].size = st.st_size;
+			if (!files[nr_files].path)
+				die("strdup");
+			nr_files++;
+		}
+	}
+	closedir(d);
+}
+
+static void drop_caches(void)
+{
+	int fd, i;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd >= 0) {
+		if (write(fd, "3", 1) == 1) {
+			close(fd);
+			return;
+		}
+		close(fd);
+	}
+	for (i = 0; i < nr_files; i++) {
+		fd = open(files[i].path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+static void *reader_loop(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = malloc(block_size);
+	struct file *f;
+	double start;
+	off_t off;
+	ssize_t ret;
+	int fd;
+
+	if (!buf)
+		die("malloc");
+	while (!stop) {
+		f = &files[rand_r(&w->seed) % nr_files];
+		off = (f->size + page_size - 1) / page_size;
+		off = rand_r(&w->seed) % off * page_size;
+
+		start = now();
+		fd = open(f->path, O_RDONLY);
+		if (fd < 0)
+			die(f->path);
+		ret = pread(fd, buf, block_size, off);
+		if (ret < 0)
+			die(f->path);
+		close(fd);
+
+		if (w->reads < MAX_SAMPLES)
+			w->lat[w->reads] = now() - start;
+		w->reads++;
+		w->bytes += ret;
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Read whole files, each once, with all threads taking the next one. */
+static void *stream_loop(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = malloc(block_size);
+	struct file *f;
+	double start;
+	off_t off;
+	ssize_t ret;
+	int fd, i;
+
+	if (!buf)
+		die("malloc");
+	while (!stop) {
+		i = __sync_fetch_and_add(&next_file, 1);
+		if (i >= nr_files)
+			break;
+		f = &files[i];
+		fd = open(f->path, O_RDONLY);
+		if (fd < 0)
+			die(f->path);
+		for (off = 0; !stop; off += ret) {
+			start = now();
+			ret = pread(fd, buf, block_size, off);
+			if (ret < 0)
+				die(f->path);
+			if (!ret)
+				break;
+			if (w->reads < MAX_SAMPLES)
+				w->lat[w->reads] = now() - start;
+			w->reads++;
+			w->bytes += ret;
+		}
+		close(fd);
+	}
+	free(buf);
+	return NULL;
+}
+
+static double cpu_secs(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void run(struct worker *workers, int nr_threads)
+{
+	unsigned long long bytes = 0;
+	unsigned long reads = 0, n = 0, i;
+	double start, secs, cpu, end, *lat;
+	int t;
+
+	lat = malloc(sizeof(*lat) * MAX_SAMPLES * nr_threads);
+	if (!lat)
+		die("malloc");
+
+	drop_caches();
+	stop = 0;
+	next_file = 0;
+	cpu = cpu_secs();
+	start = now();
+	for (t = 0; t < nr_threads; t++) {
+		workers[t].reads = 0;
+		workers[t].bytes = 0;
+		workers[t].lat = lat + t * MAX_SAMPLES;
+		if (pthread_create(&workers[t].thread, NULL,
+				   sequential ? stream_loop : reader_loop,
+				   &workers[t]))
+			die("pthread_create");
+	}
+	/*
+	 * A sequential pass may be over early: every thread bumps next_file
+	 * once more when it finds no file left.
+	 */
+	end = start + duration;
+	while (now() < end &&
+	       (!sequential || next_file < nr_files + nr_threads))
+		usleep(10000);
+	stop = 1;
+	for (t = 0; t < nr_threads; t++) {
+		pthread_join(workers[t].thread, NULL);
+		reads += workers[t].reads;
+		bytes += workers[t].bytes;
+		/* gather the samples at the start of the array */
+		for (i = 0; i < workers[t].reads && i < MAX_SAMPLES; i++)
+			lat[n++] = workers[t].lat[i];
+	}
+	secs = now() - start;
+	cpu = cpu_secs() - cpu;
+
+	qsort(lat, n, sizeof(*lat), cmp_double);
+	printf("%7d %10.0f %10.2f %10.0f %10.0f %10.0f %10.2f\n", nr_threads,
+	       reads / secs, bytes / secs / (1 << 20),
+	       n ? lat[n / 2] * 1e6 : 0, n ? lat[n * 99 / 100] * 1e6 : 0,
+	       n ? lat[n - 1] * 1e6 : 0,
+	       bytes ? cpu * 1e3 / bytes * (1 << 20) : 0);
+	fflush(stdout);
+	free(lat);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-s] [-j max_threads] [-t seconds]"
+		" [-b block_bytes] dir\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static struct worker workers[MAX_THREADS];
+	int max_threads = 8, nr_threads, opt, i;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	while ((opt = getopt(argc, argv, "sj:t:b:")) != -1) {
+		switch (opt) {
+		case 's':
+			sequential = 1;
+			break;
+		case 'j':
+			max_threads = atoi(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || max_threads < 1 ||
+	    max_threads > MAX_THREADS || duration < 1 || !block_size)
+		usage(argv[0]);
+
+	scan(argv[optind]);
+	if (!nr_files) {
+		fprintf(stderr, "no files under %s\n", argv[optind]);
+		return 1;
+	}
+	for (i = 0; i < MAX_THREADS; i++)
+		workers[i].seed = i + 1;
+
+	printf("%d files\n", nr_files);
+	printf("%7s %10s %10s %10s %10s %10s %10s\n", "threads", "reads/s",
+	       "MB/s", "p50 us", "p99 us", "max us", "cpu ms/MB");
+	for (nr_threads = 1; nr_threads <= max_threads; nr_threads *= 2)
+		run(workers, nr_threads);
+	return 0;
+}
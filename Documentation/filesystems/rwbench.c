@@ -0,0 +1,238 @@
+/*
+ * rwbench.c
+ *
+ * Mixed read/write throughput of a filesystem versus the number of
+ * reader threads.  For 1, 2, 4 and up to -r readers, each reader reads a
+ * file of its own from start to end over and over, dropping it from the
+ * page cache after every pass so that the reads reach the filesystem,
+ * while -w writer threads keep rewriting files of their own, syncing
+ * every megabyte.  Each step runs for -t seconds and reports the read
+ * and write throughput.
+ *
+ * To see how yaffs2 readers scale next to a writer on a simulated NAND:
+ *
+ *	modprobe nandsim first_id_byte=0x20 second_id_byte=0xaa \
+ *		third_id_byte=0x00 fourth_id_byte=0x15
+ *	mount -t yaffs2 /dev/mtdblock0 /mnt
+ *	rwbench -r 8 -w 1 -s 4 /mnt
+ *
+ * Compile with
+ *	gcc -O2 -o rwbench rwbench.c -lpthread
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define MAX_THREADS	64
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	unsigned long long bytes;
+};
+
+static size_t block_size = 64 * 1024;
+static off_t file_size = 8 << 20;
+static int duration = 10;
+static volatile int stop;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_file(const char *dir, const char *kind, int i, int flags)
+{
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/rwbench-%s-%d", dir, kind, i);
+	fd = open(path, flags, 0644);
+	if (fd < 0)
+		die(path);
+	return fd;
+}
+
+/* Write @size bytes of @fd from the start. */
+static void fill(int fd, char *buf, off_t size)
+{
+	off_t off;
+	ssize_t ret;
+
+	for (off = 0; off < size; off += ret) {
+		ret = pwrite(fd, buf, block_size, off);
+		if (ret <= 0)
+			die("write");
+	}
+}
+
+static void *reader_loop(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = malloc(block_size);
+	off_t off = 0;
+	ssize_t ret;
+
+	if (!buf)
+		die("malloc");
+	while (!stop) {
+		ret = pread(w->fd, buf, block_size, off);
+		if (ret < 0)
+			die("read");
+		w->bytes += ret;
+		off += ret;
+		if (ret == 0 || off >= file_size) {
+			posix_fadvise(w->fd, 0, 0, POSIX_FADV_DONTNEED);
+			off = 0;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static void *writer_loop(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = malloc(block_size);
+	off_t off = 0;
+	ssize_t ret;
+
+	if (!buf)
+		die("malloc");
+	memset(buf, 0x5a, block_size);
+	while (!stop) {
+		ret = pwrite(w->fd, buf, block_size, off);
+		if (ret <= 0)
+			die("write");
+		w->bytes += ret;
+		off += ret;
+		if (!(off & ((1 << 20) - 1)))
+			fdatasync(w->fd);
+		if (off >= file_size)
+			off = 0;
+	}
+	free(buf);
+	return NULL;
+}
+
+static void run(struct worker *readers, int nr_readers,
+		struct worker *writers, int nr_writers)
+{
+	unsigned long long rbytes = 0, wbytes = 0;
+	double start, secs;
+	int i;
+
+	stop = 0;
+	for (i = 0; i < nr_readers; i++) {
+		readers[i].bytes = 0;
+		posix_fadvise(readers[i].fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	for (i = 0; i < nr_writers; i++)
+		writers[i].bytes = 0;
+
+	start = now();
+	for (i = 0; i < nr_readers; i++)
+		if (pthread_create(&readers[i].thread, NULL, reader_loop,
+				   &readers[i]))
+			die("pthread_create");
+	for (i = 0; i < nr_writers; i++)
+		if (pthread_create(&writers[i].thread, NULL, writer_loop,
+				   &writers[i]))
+			die("pthread_create");
+	sleep(duration);
+	stop = 1;
+	for (i = 0; i < nr_readers; i++) {
+		pthread_join(readers[i].thread, NULL);
+		rbytes += readers[i].bytes;
+	}
+	for (i = 0; i < nr_writers; i++) {
+		pthread_join(writers[i].thread, NULL);
+		wbytes += writers[i].bytes;
+	}
+	secs = now() - start;
+
+	printf("%7d %7d %12.2f %12.2f\n", nr_readers, nr_writers,
+	       rbytes / secs / (1 << 20), wbytes / secs / (1 << 20));
+	fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-r max_readers] [-w writers] [-t seconds]"
+		" [-s file_mb] [-b block_kb] dir\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static struct worker readers[MAX_THREADS], writers[MAX_THREADS];
+	int max_readers = 8, nr_writers = 1, nr_readers, opt, i;
+	const char *dir;
+	char *buf;
+
+	while ((opt = getopt(argc, argv, "r:w:t:s:b:")) != -1) {
+		switch (opt) {
+		case 'r':
+			max_readers = atoi(optarg);
+			break;
+		case 'w':
+			nr_writers = atoi(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 's':
+			file_size = (off_t)atoi(optarg) << 20;
+			break;
+		case 'b':
+			block_size = (size_t)atoi(optarg) << 10;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || max_readers < 1 ||
+	    max_readers > MAX_THREADS || nr_writers < 0 ||
+	    nr_writers > MAX_THREADS || duration < 1 || file_size <= 0 ||
+	    !block_size || file_size % block_size)
+		usage(argv[0]);
+	dir = argv[optind];
+
+	buf = malloc(block_size);
+	if (!buf)
+		die("malloc");
+	memset(buf, 0xa5, block_size);
+	for (i = 0; i < max_readers; i++) {
+		readers[i].fd = open_file(dir, "read", i, O_RDWR | O_CREAT);
+		fill(readers[i].fd, buf, file_size);
+		fsync(readers[i].fd);
+	}
+	for (i = 0; i < nr_writers; i++)
+		writers[i].fd = open_file(dir, "write", i,
+					  O_WRONLY | O_CREAT | O_TRUNC);
+	free(buf);
+
+	printf("%7s %7s %12s %12s\n", "readers", "writers",
+	       "read MB/s", "write MB/s");
+	for (nr_readers = 1; nr_readers <= max_readers; nr_readers *= 2)
+		run(readers, nr_readers, writers, nr_writers);
+	return 0;
+}
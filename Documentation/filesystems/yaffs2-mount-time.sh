@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# yaffs2-mount-time.sh
+#
+# Time yaffs2 mounts that have to scan the whole device, for a range of
+# fill levels, on a fresh nandsim device for each level.  Each level is
+# mounted three times with no-checkpoint-read, which forces the scan,
+# and once with the checkpoint for comparison.
+#
+#	yaffs2-mount-time.sh [fill percentages...]
+#
+# NANDSIM_ARGS picks the simulated chip, 256MiB with 2KiB pages by
+# default.  MTD and MNT name the mtdblock device nandsim shows up as and
+# where to mount it.  Times are in milliseconds, to 10ms.
+
+NANDSIM_ARGS=${NANDSIM_ARGS:-"first_id_byte=0x20 second_id_byte=0xaa \
+third_id_byte=0x00 fourth_id_byte=0x15"}
+MTD=${MTD:-/dev/mtdblock0}
+MNT=${MNT:-/mnt/yaffs2-bench}
+LEVELS=${*:-"0 25 50 75 95"}
+
+die() {
+	echo "$*" >&2
+	exit 1
+}
+
+# centiseconds since boot
+uptime_cs() {
+	awk '{ printf "%d\n", $1 * 100 }' /proc/uptime
+}
+
+# time_mount [options]: mount, print the milliseconds it took
+time_mount() {
+	start=$(uptime_cs)
+	mount -t yaffs2 ${1:+-o "$1"} "$MTD" "$MNT" || die "mount $1 failed"
+	end=$(uptime_cs)
+	echo $(( (end - start) * 10 ))
+}
+
+# fill <percent>: write 1MiB files until the filesystem is that full
+fill() {
+	pct=$1
+	i=0
+	while :; do
+		set -- $(df -k "$MNT" | tail -1)
+		size=$2
+		used=$3
+		[ $(( used * 100 )) -ge $(( size * pct )) ] && break
+		[ $(( size - used )) -lt 2048 ] && break
+		dd if=/dev/zero of="$MNT/fill-$i" bs=65536 count=16 \
+			2>/dev/null || break
+		i=$((i + 1))
+	done
+	sync
+}
+
+mkdir -p "$MNT" || die "cannot create $MNT"
+printf "%6s %10s %10s %10s %12s\n" "fill%" "scan1 ms" "scan2 ms" \
+	"scan3 ms" "checkpt ms"
+
+for level in $LEVELS; do
+	rmmod nandsim 2>/dev/null
+	modprobe nandsim $NANDSIM_ARGS || die "cannot load nandsim"
+	[ -b "$MTD" ] || die "$MTD not found"
+
+	mount -t yaffs2 "$MTD" "$MNT" || die "cannot mount $MTD"
+	fill "$level"
+	umount "$MNT"
+
+	t1=$(time_mount no-checkpoint-read); umount "$MNT"
+	t2=$(time_mount no-checkpoint-read); umount "$MNT"
+	t3=$(time_mount no-checkpoint-read); umount "$MNT"
+	# the last unmount wrote a checkpoint
+	tc=$(time_mount); umount "$MNT"
+	[ -n "$t1" ] && [ -n "$t2" ] && [ -n "$t3" ] && [ -n "$tc" ] ||
+		die "mount failed at $level%"
+
+	printf "%6s %10s %10s %10s %12s\n" "$level" "$t1" "$t2" "$t3" "$tc"
+done
+
+rmmod nandsim
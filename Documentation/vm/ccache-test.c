@@ -0,0 +1,288 @@
+/*
+ * ccache-test.c
+ *
+ * Checks that the compressed cache speeds up re-reads and never returns
+ * stale data.  -f files of -s megabytes are written in dir, and each of
+ * -p passes then:
+ *
+ *  - runs a child that touches -m megabytes of anonymous memory, so
+ *    that reclaim evicts the file pages and ccache stores them;
+ *  - changes the files while their old contents are in ccache: every
+ *    other file is deleted and created again, and the rest are rewritten
+ *    in place, half of them with O_DIRECT;
+ *  - runs the memory hog again, then reads every file back, checking
+ *    its contents, and reports the time taken and the ccache_* counters
+ *    of /proc/vmstat for the read.
+ *
+ * Dropping the page cache would not do in place of the memory hog, as it
+ * invalidates ccache entries along with the pages.  Pick -m so that the
+ * hog and the files together are larger than the free memory.
+ *
+ *	echo 10 > /proc/sys/vm/ccache_percent
+ *	ccache-test -f 16 -s 4 -m 256 -p 4 /data/local/tmp
+ *
+ * Compile with
+ *	gcc -O2 -o ccache-test ccache-test.c
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define MAX_FILES	256
+#define NR_EVENTS	6
+
+static const char *events[NR_EVENTS] = {
+	"ccache_hit", "ccache_miss", "ccache_store", "ccache_reject",
+	"ccache_drop", "ccache_invalidate",
+};
+
+static const char *dir;
+static int nr_files = 16, file_mb = 4;
+static size_t page_size;
+static unsigned long errors;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void read_events(unsigned long long *val)
+{
+	char name[64];
+	unsigned long long v;
+	FILE *f = fopen("/proc/vmstat", "r");
+	int i;
+
+	memset(val, 0, NR_EVENTS * sizeof(*val));
+	if (!f)
+		return;
+	while (fscanf(f, "%63s %llu", name, &v) == 2)
+		for (i = 0; i < NR_EVENTS; i++)
+			if (!strcmp(name, events[i]))
+				val[i] = v;
+	fclose(f);
+}
+
+/*
+ * Page @page of file @file at generation @gen: a pattern that compresses
+ * well but differs between all three.
+ */
+static void fill_page(uint32_t *p, int file, size_t page, int gen)
+{
+	uint32_t v = (uint32_t)file << 24 ^ (uint32_t)page << 8 ^ gen;
+	size_t i;
+
+	for (i = 0; i < page_size / sizeof(*p); i++)
+		p[i] = v + i % 8;
+}
+
+static void path_of(char *path, size_t len, int file)
+{
+	snprintf(path, len, "%s/ccache-test-%d", dir, file);
+}
+
+/* Write file @file at generation @gen through @fd from the start. */
+static void write_file(int fd, int file, int gen, void *buf)
+{
+	size_t page, nr_pages = ((size_t)file_mb << 20) / page_size;
+
+	for (page = 0; page < nr_pages; page++) {
+		fill_page(buf, file, page, gen);
+		if (pwrite(fd, buf, page_size, page * page_size) !=
+		    (ssize_t)page_size)
+			die("write");
+	}
+	if (fsync(fd))
+		die("fsync");
+}
+
+/* Give @file new contents at @gen, in one of three ways. */
+static void change_file(int file, int gen, void *buf)
+{
+	char path[4096];
+	int fd = -1;
+
+	path_of(path, sizeof(path), file);
+	switch ((file + gen) % 4) {
+	case 0:
+	case 2:
+		if (unlink(path) && errno != ENOENT)
+			die(path);
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		break;
+	case 1:
+		fd = open(path, O_WRONLY | O_DIRECT);
+		/* fall back to a buffered write where O_DIRECT isn't there */
+		if (fd >= 0 || errno != EINVAL)
+			break;
+		/* fall through */
+	case 3:
+		fd = open(path, O_WRONLY);
+		break;
+	}
+	if (fd < 0)
+		die(path);
+	write_file(fd, file, gen, buf);
+	close(fd);
+}
+
+/* Check @file holds generation @gen, returning the bytes read. */
+static size_t check_file(int file, int gen, void *buf, void *want)
+{
+	size_t page, nr_pages = ((size_t)file_mb << 20) / page_size;
+	char path[4096];
+	ssize_t ret;
+	int fd;
+
+	path_of(path, sizeof(path), file);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die(path);
+	for (page = 0; page < nr_pages; page++) {
+		ret = pread(fd, buf, page_size, page * page_size);
+		if (ret < 0)
+			die("read");
+		fill_page(want, file, page, gen);
+		if (ret == (ssize_t)page_size && !memcmp(buf, want, page_size))
+			continue;
+		if (!errors)
+			fprintf(stderr, "%s page %zu: stale or corrupt data\n",
+				path, page);
+		errors++;
+	}
+	close(fd);
+	return nr_pages * page_size;
+}
+
+/* Touch @mb megabytes of anonymous memory, once, in a child. */
+static void hog(int mb)
+{
+	size_t size = (size_t)mb << 20, i;
+	pid_t pid;
+	char *p;
+
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			die("mmap hog");
+		for (i = 0; i < size; i += page_size)
+			p[i] = 1;
+		_exit(0);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-f files] [-s file_mb] [-m hog_mb]"
+		" [-p passes] dir\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long before[NR_EVENTS], after[NR_EVENTS];
+	int hog_mb = 256, passes = 4, pass, opt, file, i;
+	size_t bytes;
+	double start, secs;
+	void *buf, *want;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	while ((opt = getopt(argc, argv, "f:s:m:p:")) != -1) {
+		switch (opt) {
+		case 'f':
+			nr_files = atoi(optarg);
+			break;
+		case 's':
+			file_mb = atoi(optarg);
+			break;
+		case 'm':
+			hog_mb = atoi(optarg);
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || nr_files < 1 || nr_files > MAX_FILES ||
+	    file_mb < 1 || hog_mb < 0 || passes < 1)
+		usage(argv[0]);
+	dir = argv[optind];
+
+	/* O_DIRECT wants an aligned buffer */
+	if (posix_memalign(&buf, page_size, page_size) ||
+	    posix_memalign(&want, page_size, page_size))
+		die("posix_memalign");
+
+	for (file = 0; file < nr_files; file++) {
+		char path[4096];
+		int fd;
+
+		path_of(path, sizeof(path), file);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			die(path);
+		write_file(fd, file, 0, buf);
+		close(fd);
+	}
+
+	printf("%4s %8s %8s", "pass", "secs", "MB/s");
+	for (i = 0; i < NR_EVENTS; i++)
+		printf(" %10s", events[i] + strlen("ccache_"));
+	printf("\n");
+
+	for (pass = 1; pass <= passes; pass++) {
+		hog(hog_mb);
+		for (file = 0; file < nr_files; file++)
+			change_file(file, pass, buf);
+		hog(hog_mb);
+
+		read_events(before);
+		start = now();
+		bytes = 0;
+		for (file = 0; file < nr_files; file++)
+			bytes += check_file(file, pass, buf, want);
+		secs = now() - start;
+		read_events(after);
+
+		printf("%4d %8.2f %8.1f", pass, secs, bytes / secs / (1 << 20));
+		for (i = 0; i < NR_EVENTS; i++)
+			printf(" %10llu", after[i] - before[i]);
+		printf("\n");
+	}
+
+	for (file = 0; file < nr_files; file++) {
+		char path[4096];
+
+		path_of(path, sizeof(path), file);
+		unlink(path);
+	}
+	printf("%lu errors\n", errors);
+	return errors ? 1 : 0;
+}
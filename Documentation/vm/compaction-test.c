@@ -0,0 +1,175 @@
+/*
+ * compaction-test.c
+ *
+ * Fragments memory and runs a high-order allocation test in it.  -m
+ * megabytes of anonymous memory are faulted in and every other page is
+ * then freed, leaving free memory in single pages between pages that only
+ * compaction can move without swap.  The command given, usually the
+ * samples/compaction module, is then run and timed, with the compact_*
+ * counters of /proc/vmstat over its run.  /proc/buddyinfo and
+ * /proc/extfrag_index are shown before and after.
+ *
+ * With -c, /proc/sys/vm/compact_memory is written and timed before the
+ * command runs, and counted with it, to compare compaction on demand with
+ * direct compaction:
+ *
+ *	compaction-test -m 256 insmod highorder-sample.ko order=3 nr=64
+ *	rmmod highorder-sample
+ *	compaction-test -m 256 -c insmod highorder-sample.ko order=3 nr=64
+ *
+ * The module reports its allocation success and latency in the kernel
+ * log.
+ *
+ * Compile with
+ *	gcc -O2 -o compaction-test compaction-test.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define NR_EVENTS	6
+
+static const char *events[NR_EVENTS] = {
+	"compact_blocks_moved", "compact_pages_moved",
+	"compact_pagemigrate_failed", "compact_stall", "compact_fail",
+	"compact_success",
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void read_events(unsigned long long *val)
+{
+	char name[64];
+	unsigned long long v;
+	FILE *f = fopen("/proc/vmstat", "r");
+	int i;
+
+	memset(val, 0, NR_EVENTS * sizeof(*val));
+	if (!f)
+		return;
+	while (fscanf(f, "%63s %llu", name, &v) == 2)
+		for (i = 0; i < NR_EVENTS; i++)
+			if (!strcmp(name, events[i]))
+				val[i] = v;
+	fclose(f);
+}
+
+static void show(const char *path)
+{
+	char line[256];
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return;
+	printf("%s:\n", path);
+	while (fgets(line, sizeof(line), f))
+		fputs(line, stdout);
+	fclose(f);
+}
+
+static void compact_memory(void)
+{
+	double start;
+	int fd;
+
+	fd = open("/proc/sys/vm/compact_memory", O_WRONLY);
+	if (fd < 0)
+		die("/proc/sys/vm/compact_memory");
+	start = now();
+	if (write(fd, "1", 1) != 1)
+		die("compact_memory");
+	printf("compact_memory took %.3fs\n", now() - start);
+	close(fd);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-m megabytes] [-c] command...\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long before[NR_EVENTS], after[NR_EVENTS];
+	int mb = 128, compact = 0, status, opt, i;
+	size_t page_size, size, off;
+	double start, secs;
+	char *mem;
+	pid_t pid;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	/* stop at the command, whose options are its own */
+	while ((opt = getopt(argc, argv, "+m:c")) != -1) {
+		switch (opt) {
+		case 'm':
+			mb = atoi(optarg);
+			break;
+		case 'c':
+			compact = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc || mb < 1)
+		usage(argv[0]);
+
+	size = (size_t)mb << 20;
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		die("mmap");
+	for (off = 0; off < size; off += page_size)
+		mem[off] = 1;
+	for (off = page_size; off < size; off += 2 * page_size)
+		if (madvise(mem + off, page_size, MADV_DONTNEED))
+			die("madvise");
+	printf("fragmented %d MB\n", mb);
+	show("/proc/buddyinfo");
+	show("/proc/extfrag_index");
+
+	read_events(before);
+	if (compact)
+		compact_memory();
+	fflush(stdout);
+	start = now();
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		execvp(argv[optind], argv + optind);
+		die(argv[optind]);
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		die("waitpid");
+	secs = now() - start;
+	read_events(after);
+
+	printf("%s exited with %d after %.3fs\n", argv[optind],
+	       WIFEXITED(status) ? WEXITSTATUS(status) : -1, secs);
+	for (i = 0; i < NR_EVENTS; i++)
+		printf("%-28s %llu\n", events[i], after[i] - before[i]);
+	show("/proc/buddyinfo");
+
+	munmap(mem, size);
+	return 0;
+}
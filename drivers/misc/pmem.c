@@ -28,7 +28,8 @@
 #include <asm/cacheflush.h>
 
 #define PMEM_MAX_DEVICES 10
-#define PMEM_MAX_ORDER 128
+/* one free list per order, an order can't exceed the bits in num_entries */
+#define PMEM_NR_ORDERS BITS_PER_LONG
 #define PMEM_MIN_ALLOC PAGE_SIZE
 
 #define PMEM_DEBUG 1
@@ -84,6 +85,12 @@ struct pmem_bits {
 	unsigned order:7;		/* size of the region in pmem space */
 };
 
+/* links of a free slot's first entry on free_area[order], -1 at the ends */
+struct pmem_free_link {
+	int prev;
+	int next;
+};
+
 struct pmem_region_node {
 	struct pmem_region region;
 	struct list_head list;
@@ -116,6 +123,18 @@ struct pmem_info {
 	/* the bitmap for the region indicating which entries are allocated
 	 * and which are free */
 	struct pmem_bits *bitmap;
+	/* the free slots of each order: free_area[order] is the index of the
+	 * first one, or -1, and the rest are chained through free_link[],
+	 * indexed like the bitmap, so that the bitmap stays one word an entry.
+	 * Protected by bitmap_sem */
+	struct pmem_free_link *free_link;
+	int free_area[PMEM_NR_ORDERS];
+	unsigned long nr_free[PMEM_NR_ORDERS];
+	/* allocator statistics for debugfs, protected by bitmap_sem */
+	unsigned long nr_allocs;
+	unsigned long nr_alloc_fails;
+	unsigned long nr_splits;
+	unsigned long nr_merges;
 	/* indicates the region should not be managed with an allocator */
 	unsigned no_allocator;
 	/* indicates maps of this region should be cached, if a mix of
@@ -232,6 +251,37 @@ static int is_master_owner(struct file *file)
 	return ret;
 }
 
+static void pmem_add_free(int id, int index)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	int order = PMEM_ORDER(id, index);
+	int next = pmem[id].free_area[order];
+
+	pmem[id].bitmap[index].allocated = 0;
+	pmem[id].free_link[index].prev = -1;
+	pmem[id].free_link[index].next = next;
+	if (next >= 0)
+		pmem[id].free_link[next].prev = index;
+	pmem[id].free_area[order] = index;
+	pmem[id].nr_free[order]++;
+}
+
+static void pmem_del_free(int id, int index)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	int order = PMEM_ORDER(id, index);
+	int prev = pmem[id].free_link[index].prev;
+	int next = pmem[id].free_link[index].next;
+
+	if (prev >= 0)
+		pmem[id].free_link[prev].next = next;
+	else
+		pmem[id].free_area[order] = next;
+	if (next >= 0)
+		pmem[id].free_link[next].prev = prev;
+	pmem[id].nr_free[order]--;
+}
+
 static int pmem_free(int id, int index)
 {
 	/* caller should hold the write lock on pmem_sem! */
@@ -242,23 +292,23 @@ static int pmem_free(int id, int index)
 		pmem[id].allocated = 0;
 		return 0;
 	}
-	/* clean up the bitmap, merging any buddies */
-	pmem[id].bitmap[curr].allocated = 0;
 	/* find a slots buddy Buddy# = Slot# ^ (1 << order)
-	 * if the buddy is also free merge them
+	 * if the buddy is also free take it off its free list and merge them
 	 * repeat until the buddy is not free or end of the bitmap is reached
 	 */
-	do {
+	while (PMEM_ORDER(id, curr) < PMEM_NR_ORDERS - 1) {
 		buddy = PMEM_BUDDY_INDEX(id, curr);
-		if (PMEM_IS_FREE(id, buddy) &&
-				PMEM_ORDER(id, buddy) == PMEM_ORDER(id, curr)) {
-			PMEM_ORDER(id, buddy)++;
-			PMEM_ORDER(id, curr)++;
-			curr = min(buddy, curr);
-		} else {
+		if (buddy >= pmem[id].num_entries || !PMEM_IS_FREE(id, buddy) ||
+		    PMEM_ORDER(id, buddy) != PMEM_ORDER(id, curr))
 			break;
-		}
-	} while (curr < pmem[id].num_entries);
+		pmem_del_free(id, buddy);
+		PMEM_ORDER(id, buddy)++;
+		PMEM_ORDER(id, curr)++;
+		curr = min(buddy, curr);
+		pmem[id].nr_merges++;
+	}
+	/* put the merged slot on the free list for its order */
+	pmem_add_free(id, curr);
 
 	return 0;
 }
@@ -380,10 +430,8 @@ static int pmem_allocate(int id, unsigned long len)
 {
 	/* caller should hold the write lock on pmem_sem! */
 	/* return the corresponding pdata[] entry */
-	int curr = 0;
-	int end = pmem[id].num_entries;
-	int best_fit = -1;
-	unsigned long order = pmem_order(len);
+	int best_fit;
+	unsigned long curr, order = pmem_order(len);
 
 	if (pmem[id].no_allocator) {
 		DLOG("no allocator");
@@ -393,39 +441,32 @@ static int pmem_allocate(int id, unsigned long len)
 		return len;
 	}
 
-	if (order > PMEM_MAX_ORDER)
+	if (order >= PMEM_NR_ORDERS) {
+		pmem[id].nr_alloc_fails++;
 		return -1;
+	}
 	DLOG("order %lx\n", order);
 
-	/* look through the bitmap:
-	 * 	if you find a free slot of the correct order use it
+	/* look through the free lists:
+	 * 	if there is a free slot of the correct order use it
 	 * 	otherwise, use the best fit (smallest with size > order) slot
 	 */
-	while (curr < end) {
-		if (PMEM_IS_FREE(id, curr)) {
-			if (PMEM_ORDER(id, curr) == (unsigned char)order) {
-				/* set the not free bit and clear others */
-				best_fit = curr;
-				break;
-			}
-			if (PMEM_ORDER(id, curr) > (unsigned char)order &&
-			    (best_fit < 0 ||
-			     PMEM_ORDER(id, curr) < PMEM_ORDER(id, best_fit)))
-				best_fit = curr;
-		}
-		curr = PMEM_NEXT_INDEX(id, curr);
-	}
+	for (curr = order; curr < PMEM_NR_ORDERS; curr++)
+		if (pmem[id].free_area[curr] >= 0)
+			break;
 
-	/* if best_fit < 0, there are no suitable slots,
-	 * return an error
-	 */
-	if (best_fit < 0) {
+	/* if there are no suitable slots, return an error */
+	if (curr == PMEM_NR_ORDERS) {
 		printk("pmem: no space left to allocate!\n");
+		pmem[id].nr_alloc_fails++;
 		return -1;
 	}
+	best_fit = pmem[id].free_area[curr];
+	pmem_del_free(id, best_fit);
 
 	/* now partition the best fit:
 	 * 	split the slot into 2 buddies of order - 1
+	 * 	put the upper buddy on the free list
 	 * 	repeat until the slot is of the correct order
 	 */
 	while (PMEM_ORDER(id, best_fit) > (unsigned char)order) {
@@ -433,8 +474,11 @@ static int pmem_allocate(int id, unsigned long len)
 		PMEM_ORDER(id, best_fit) -= 1;
 		buddy = PMEM_BUDDY_INDEX(id, best_fit);
 		PMEM_ORDER(id, buddy) = PMEM_ORDER(id, best_fit);
+		pmem_add_free(id, buddy);
+		pmem[id].nr_splits++;
 	}
 	pmem[id].bitmap[best_fit].allocated = 1;
+	pmem[id].nr_allocs++;
 	return best_fit;
 }
 
@@ -1163,6 +1207,38 @@ static ssize_t debug_open(struct inode *inode, struct file *file)
 	return 0;
 }
 
+/* dump the free lists and an unusable free space index for the region: the
+ * share of free memory that can't satisfy an allocation of each order, in
+ * tenths of a percent */
+static int debug_read_allocator(int id, char *buffer, int size)
+{
+	unsigned long free = 0, unusable;
+	int i, top = 0, n = 0;
+
+	down_read(&pmem[id].bitmap_sem);
+	for (i = 0; i < PMEM_NR_ORDERS; i++) {
+		free += pmem[id].nr_free[i] << i;
+		if (pmem[id].nr_free[i])
+			top = i;
+	}
+
+	n += scnprintf(buffer + n, size - n,
+		       "allocs %lu failed %lu splits %lu merges %lu\n",
+		       pmem[id].nr_allocs, pmem[id].nr_alloc_fails,
+		       pmem[id].nr_splits, pmem[id].nr_merges);
+	n += scnprintf(buffer + n, size - n,
+		       "free %lu of %lu pages\norder: free slots, unusable\n",
+		       free, pmem[id].num_entries);
+	for (i = 0, unusable = 0; free && i <= top; i++) {
+		n += scnprintf(buffer + n, size - n, "%2d: %lu, %lu\n", i,
+			       pmem[id].nr_free[i], unusable * 1000 / free);
+		unusable += pmem[id].nr_free[i] << i;
+	}
+	up_read(&pmem[id].bitmap_sem);
+
+	return n;
+}
+
 static ssize_t debug_read(struct file *file, char __user *buf, size_t count,
 			  loff_t *ppos)
 {
@@ -1197,7 +1273,11 @@ static ssize_t debug_read(struct file *file, char __user *buf, size_t count,
 	}
 	up(&pmem[id].data_list_sem);
 
+	if (!pmem[id].no_allocator)
+		n += debug_read_allocator(id, buffer + n, debug_bufmax - n);
+
 	n++;
+	n = min(n, debug_bufmax - 1);
 	buffer[n] = 0;
 	return simple_read_from_buffer(buf, count, ppos, buffer, n);
 }
@@ -1254,9 +1334,18 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
 					  pmem[id].num_entries);
 
+	pmem[id].free_link = kmalloc(pmem[id].num_entries *
+				     sizeof(struct pmem_free_link), GFP_KERNEL);
+	if (!pmem[id].free_link)
+		goto err_no_mem_for_free_link;
+
+	for (i = 0; i < PMEM_NR_ORDERS; i++)
+		pmem[id].free_area[i] = -1;
+
 	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
 		if ((pmem[id].num_entries) &  1<<i) {
 			PMEM_ORDER(id, index) = i;
+			pmem_add_free(id, index);
 			index = PMEM_NEXT_INDEX(id, index);
 		}
 	}
@@ -1285,6 +1374,8 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 #endif
 	return 0;
 error_cant_remap:
+	kfree(pmem[id].free_link);
+err_no_mem_for_free_link:
 	kfree(pmem[id].bitmap);
 err_no_mem_for_metadata:
 	misc_deregister(&pmem[id].dev);
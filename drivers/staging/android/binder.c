@@ -16,6 +16,7 @@
  */
 
 #include <asm/cacheflush.h>
+#include <linux/debugfs.h>
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
@@ -29,17 +30,51 @@
 #include <linux/proc_fs.h>
 #include <linux/rbtree.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
+#include <trace/binder.h>
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+DEFINE_TRACE(binder_transaction);
+DEFINE_TRACE(binder_transaction_queued);
+DEFINE_TRACE(binder_transaction_received);
+DEFINE_TRACE(binder_reply);
+DEFINE_TRACE(binder_buffer_free);
+
+/*
+ * Locking:
+ *
+ * binder_refs_lock protects the node/ref graph that is shared between
+ * processes (binder_node, binder_ref and the per-proc node and ref trees),
+ * the transaction stacks linking threads of different processes, the
+ * buffer <-> transaction links, binder_procs, binder_dead_nodes, the
+ * context manager and proc->tmp_ref. It is only held for short sections;
+ * buffer allocation and copying of transaction data happen outside of it.
+ *
+ * proc->alloc_lock protects the buffer allocator of a process (buffers,
+ * free_buffers, free_classes, allocated_buffers, pages and
+ * free_async_space). binder_lru_lock nests inside it and protects
+ * binder_lru and the lru page counts.
+ *
+ * proc->inner_lock protects the work lists of a process (proc->todo,
+ * thread->todo, node->async_todo and proc->delivered_death), the threads
+ * tree and the looper, thread counting and return_error state.
+ * thread->transaction_stack is only modified with both binder_refs_lock
+ * and the owning proc's inner_lock held, so either is enough to read it.
+ *
+ * Lock order: binder_refs_lock -> proc->alloc_lock -> proc->inner_lock.
+ * No two inner_locks are ever held at the same time.
+ */
+static DEFINE_MUTEX(binder_refs_lock);
 static HLIST_HEAD(binder_procs);
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct proc_dir_entry *binder_proc_dir_entry_root;
 static struct proc_dir_entry *binder_proc_dir_entry_proc;
+static struct dentry *binder_debugfs_dir_entry_root;
 static struct hlist_head binder_dead_nodes;
 static HLIST_HEAD(binder_deferred_list);
 static DEFINE_MUTEX(binder_deferred_lock);
@@ -83,6 +118,8 @@ static uint32_t binder_debug_mask = BINDER_DEBUG_USER_ERROR |
 module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
+static int binder_hot_pages = 4;
+module_param_named(hot_pages, binder_hot_pages, int, S_IWUSR | S_IRUGO);
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 static int binder_set_stop_on_user_error(
@@ -105,7 +142,7 @@ module_param_call(stop_on_user_error, binder_set_stop_on_user_error,
 			binder_stop_on_user_error = 2; \
 	} while (0)
 
-enum {
+enum binder_stat_types {
 	BINDER_STAT_PROC,
 	BINDER_STAT_THREAD,
 	BINDER_STAT_NODE,
@@ -117,14 +154,61 @@ enum {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
+static inline void binder_stats_deleted(enum binder_stat_types type)
+{
+	atomic_inc(&binder_stats.obj_deleted[type]);
+}
+
+static inline void binder_stats_created(enum binder_stat_types type)
+{
+	atomic_inc(&binder_stats.obj_created[type]);
+}
+
+/*
+ * Latency histograms, bucket 0 counts latencies below
+ * 1 << BINDER_LATENCY_SHIFT us, bucket n latencies in
+ * [1 << (BINDER_LATENCY_SHIFT + n - 1), 1 << (BINDER_LATENCY_SHIFT + n)) us
+ * and the last bucket everything slower.
+ */
+#define BINDER_LATENCY_SHIFT   5
+#define BINDER_LATENCY_BUCKETS 16
+
+struct binder_latency_hist {
+	atomic_t count[BINDER_LATENCY_BUCKETS];
+};
+
+static void binder_latency_add(struct binder_latency_hist *hist, ktime_t latency)
+{
+	s64 us = ktime_to_us(latency);
+	int bucket;
+
+	if (us < 0)
+		us = 0;
+	us >>= BINDER_LATENCY_SHIFT;
+	bucket = us > INT_MAX ? BINDER_LATENCY_BUCKETS - 1 : fls(us);
+	if (bucket >= BINDER_LATENCY_BUCKETS)
+		bucket = BINDER_LATENCY_BUCKETS - 1;
+	atomic_inc(&hist->count[bucket]);
+}
+
+static int binder_latency_empty(struct binder_latency_hist *hist)
+{
+	int i;
+
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+		if (atomic_read(&hist->count[i]))
+			return 0;
+	return 1;
+}
+
 struct binder_transaction_log_entry {
 	int debug_id;
 	int call_type;
@@ -193,6 +277,8 @@ struct binder_node {
 	unsigned accept_fds : 1;
 	int min_priority : 8;
 	struct list_head async_todo;
+	struct binder_latency_hist deliver_hist;
+	struct binder_latency_hist reply_hist;
 };
 
 struct binder_ref_death {
@@ -221,6 +307,7 @@ struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
 	struct rb_node rb_node; /* free entry by size or allocated entry */
 				/* by address */
+	struct list_head free_entry; /* free entry by size class */
 	unsigned free : 1;
 	unsigned allow_user_free : 1;
 	unsigned async_transaction : 1;
@@ -234,6 +321,32 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+/*
+ * Free buffers are also kept on per-size-class lists so small
+ * allocations can be served without walking the free_buffers tree.
+ * Class 0 holds buffers smaller than BINDER_MIN_CLASS_SIZE, class n
+ * buffers of [BINDER_MIN_CLASS_SIZE << (n - 1), BINDER_MIN_CLASS_SIZE << n)
+ * and the last class everything larger.
+ */
+#define BINDER_MIN_CLASS_SIZE 64
+#define BINDER_FREE_CLASSES   8
+
+/*
+ * Pages that no buffer uses any more stay mapped and are put on
+ * binder_lru, so the next allocation touching them does not have to map
+ * them again. binder_shrink unmaps and frees them under memory pressure.
+ * The first proc->hot_pages pages of each process are mapped at mmap
+ * time and never put on the lru.
+ */
+struct binder_lru_page {
+	struct list_head lru;
+	struct binder_proc *proc;
+};
+
+static LIST_HEAD(binder_lru);
+static DEFINE_SPINLOCK(binder_lru_lock);
+static int binder_lru_count;
+
 enum {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -242,6 +355,10 @@ enum {
 
 struct binder_proc {
 	struct hlist_node proc_node;
+	spinlock_t inner_lock;
+	struct mutex alloc_lock;
+	int tmp_ref;
+	int is_dead;
 	struct rb_root threads;
 	struct rb_root nodes;
 	struct rb_root refs_by_desc;
@@ -257,21 +374,29 @@ struct binder_proc {
 
 	struct list_head buffers;
 	struct rb_root free_buffers;
+	struct list_head free_classes[BINDER_FREE_CLASSES];
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
 	struct page **pages;
+	struct binder_lru_page *lru_pages;
+	int hot_pages;
+	int lru_page_count;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
 	struct list_head delivered_death;
+	struct binder_latency_hist deliver_hist;
+	struct binder_latency_hist reply_hist;
 	int max_threads;
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
 	long default_priority;
+	int default_sched_policy;
+	int default_rt_priority;
 };
 
 enum {
@@ -314,10 +439,17 @@ struct binder_transaction {
 	unsigned int	flags;
 	long	priority;
 	long	saved_priority;
+	int	sched_policy;
+	int	rt_priority;
+	int	saved_sched_policy;
+	int	saved_rt_priority;
 	uid_t	sender_euid;
+	ktime_t	start_time;
 };
 
 static void binder_defer_work(struct binder_proc *proc, int defer);
+static void binder_proc_dec_tmpref(struct binder_proc *proc);
+static void binder_free_proc(struct binder_proc *proc);
 
 /*
  * copied from get_unused_fd_flags
@@ -474,6 +606,66 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static int binder_rt_policy(int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static void binder_set_sched(int policy, int rt_priority)
+{
+	struct sched_param param = { .sched_priority = rt_priority };
+	int ret;
+
+	if (current->policy == policy && current->rt_priority == rt_priority)
+		return;
+	ret = sched_setscheduler_nocheck(current, policy, &param);
+	if (ret && (binder_debug_mask & BINDER_DEBUG_PRIORITY_CAP))
+		printk(KERN_INFO "binder: %d: policy %d rt priority %d not "
+		       "allowed, %d\n", current->pid, policy, rt_priority, ret);
+}
+
+static void binder_restore_priority(struct binder_transaction *t)
+{
+	binder_set_sched(t->saved_sched_policy, t->saved_rt_priority);
+	binder_set_nice(t->saved_priority);
+}
+
+/*
+ * Only RT callers of synchronous transactions are queued ahead of other
+ * work, everything else keeps its FIFO position so background callers
+ * can not be starved by foreground ones. Lower values are more urgent.
+ */
+static int binder_transaction_prio(struct binder_transaction *t)
+{
+	if (!(t->flags & TF_ONE_WAY) && binder_rt_policy(t->sched_policy))
+		return MAX_RT_PRIO - 1 - t->rt_priority;
+	return MAX_RT_PRIO;
+}
+
+/*
+ * Queue t on a process todo list behind all work that is at least as
+ * urgent. Any idle looper can pick up work from proc->todo, so this is
+ * also what selects the thread that serves an RT caller: the first one
+ * to wake up. Called with the proc's inner_lock held.
+ */
+static void binder_enqueue_transaction(struct list_head *list,
+	struct binder_transaction *t)
+{
+	struct list_head *pos = list->prev;
+	int prio = binder_transaction_prio(t);
+
+	while (pos != list) {
+		struct binder_work *w = list_entry(pos, struct binder_work, entry);
+
+		if (w->type != BINDER_WORK_TRANSACTION ||
+		    binder_transaction_prio(container_of(w,
+				struct binder_transaction, work)) <= prio)
+			break;
+		pos = pos->prev;
+	}
+	list_add(&t->work.entry, pos);
+}
+
 static size_t binder_buffer_size(
 	struct binder_proc *proc, struct binder_buffer *buffer)
 {
@@ -484,6 +676,13 @@ static size_t binder_buffer_size(
 			struct binder_buffer, entry) - (size_t)buffer->data;
 }
 
+static int binder_size_class(size_t size)
+{
+	int class = fls(size / BINDER_MIN_CLASS_SIZE);
+
+	return min(class, BINDER_FREE_CLASSES - 1);
+}
+
 static void binder_insert_free_buffer(
 	struct binder_proc *proc, struct binder_buffer *new_buffer)
 {
@@ -515,6 +714,43 @@ static void binder_insert_free_buffer(
 	}
 	rb_link_node(&new_buffer->rb_node, parent, p);
 	rb_insert_color(&new_buffer->rb_node, &proc->free_buffers);
+	list_add(&new_buffer->free_entry,
+		 &proc->free_classes[binder_size_class(new_buffer_size)]);
+}
+
+static void binder_erase_free_buffer(
+	struct binder_proc *proc, struct binder_buffer *buffer)
+{
+	BUG_ON(!buffer->free);
+	rb_erase(&buffer->rb_node, &proc->free_buffers);
+	list_del(&buffer->free_entry);
+}
+
+/*
+ * Look for a free buffer of at least size bytes on the size class lists.
+ * Only the class of size itself has to be searched, any buffer in a
+ * larger bounded class fits. The last class is left to the best fit
+ * search in binder_alloc_buf so large free areas do not get split for
+ * small buffers.
+ */
+static struct binder_buffer *binder_class_fit(
+	struct binder_proc *proc, size_t size)
+{
+	struct binder_buffer *buffer;
+	int class = binder_size_class(size);
+
+	if (class >= BINDER_FREE_CLASSES - 1)
+		return NULL;
+	list_for_each_entry(buffer, &proc->free_classes[class], free_entry) {
+		if (binder_buffer_size(proc, buffer) >= size)
+			return buffer;
+	}
+	for (class++; class < BINDER_FREE_CLASSES - 1; class++) {
+		if (!list_empty(&proc->free_classes[class]))
+			return list_first_entry(&proc->free_classes[class],
+						struct binder_buffer, free_entry);
+	}
+	return NULL;
 }
 
 static void binder_insert_allocated_buffer(
@@ -566,6 +802,36 @@ static struct binder_buffer *binder_buffer_lookup(
 	return NULL;
 }
 
+static void binder_lru_add_page(struct binder_proc *proc, void *page_addr)
+{
+	size_t index = (page_addr - proc->buffer) / PAGE_SIZE;
+	struct binder_lru_page *lru_page = &proc->lru_pages[index];
+
+	BUG_ON(proc->pages[index] == NULL);
+	if (index < proc->hot_pages)
+		return;
+	spin_lock(&binder_lru_lock);
+	BUG_ON(!list_empty(&lru_page->lru));
+	list_add_tail(&lru_page->lru, &binder_lru);
+	binder_lru_count++;
+	proc->lru_page_count++;
+	spin_unlock(&binder_lru_lock);
+}
+
+static void binder_lru_del_page(struct binder_proc *proc, void *page_addr)
+{
+	size_t index = (page_addr - proc->buffer) / PAGE_SIZE;
+	struct binder_lru_page *lru_page = &proc->lru_pages[index];
+
+	spin_lock(&binder_lru_lock);
+	if (!list_empty(&lru_page->lru)) {
+		list_del_init(&lru_page->lru);
+		binder_lru_count--;
+		proc->lru_page_count--;
+	}
+	spin_unlock(&binder_lru_lock);
+}
+
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *start, void *end, struct vm_area_struct *vma)
 {
@@ -582,6 +848,13 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
+	if (allocate == 0) {
+		/* keep the pages mapped, binder_shrink frees them if needed */
+		for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE)
+			binder_lru_add_page(proc, page_addr);
+		return 0;
+	}
+
 	if (vma)
 		mm = NULL;
 	else
@@ -592,9 +865,6 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		vma = proc->vma;
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
 	if (vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
@@ -606,7 +876,11 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
+		if (*page) {
+			/* still mapped since it was last used */
+			binder_lru_del_page(proc, page_addr);
+			continue;
+		}
 		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
 		if (*page == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -640,21 +914,15 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	}
 	return 0;
 
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(*page);
+	*page = NULL;
 err_alloc_page_failed:
-		;
-	}
+	/* the pages before the failed one are mapped and unused */
+	for (page_addr -= PAGE_SIZE; page_addr >= start; page_addr -= PAGE_SIZE)
+		binder_lru_add_page(proc, page_addr);
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -663,7 +931,7 @@ err_no_vma:
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+static struct binder_buffer *__binder_alloc_buf(struct binder_proc *proc,
 	size_t data_size, size_t offsets_size, int is_async)
 {
 	struct rb_node *n = proc->free_buffers.rb_node;
@@ -697,19 +965,26 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
-	while (n) {
-		buffer = rb_entry(n, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
+	buffer = binder_class_fit(proc, size);
+	if (buffer) {
+		best_fit = &buffer->rb_node;
 		buffer_size = binder_buffer_size(proc, buffer);
-
-		if (size < buffer_size) {
-			best_fit = n;
-			n = n->rb_left;
-		} else if (size > buffer_size)
-			n = n->rb_right;
-		else {
-			best_fit = n;
-			break;
+		n = buffer_size == size ? best_fit : NULL;
+	} else {
+		while (n) {
+			buffer = rb_entry(n, struct binder_buffer, rb_node);
+			BUG_ON(!buffer->free);
+			buffer_size = binder_buffer_size(proc, buffer);
+
+			if (size < buffer_size) {
+				best_fit = n;
+				n = n->rb_left;
+			} else if (size > buffer_size)
+				n = n->rb_right;
+			else {
+				best_fit = n;
+				break;
+			}
 		}
 	}
 	if (best_fit == NULL) {
@@ -741,7 +1016,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
 		return NULL;
 
-	rb_erase(best_fit, &proc->free_buffers);
+	binder_erase_free_buffer(proc, buffer);
 	buffer->free = 0;
 	binder_insert_allocated_buffer(proc, buffer);
 	if (buffer_size != size) {
@@ -756,6 +1031,8 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
 	buffer->async_transaction = is_async;
+	buffer->allow_user_free = 0;
+	buffer->transaction = NULL;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
 		if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC_ASYNC)
@@ -767,6 +1044,17 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+	size_t data_size, size_t offsets_size, int is_async)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = __binder_alloc_buf(proc, data_size, offsets_size, is_async);
+	mutex_unlock(&proc->alloc_lock);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -824,7 +1112,7 @@ static void binder_delete_free_buffer(
 	}
 }
 
-static void binder_free_buf(
+static void __binder_free_buf(
 	struct binder_proc *proc, struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
@@ -861,7 +1149,7 @@ static void binder_free_buf(
 		struct binder_buffer *next = list_entry(buffer->entry.next,
 						struct binder_buffer, entry);
 		if (next->free) {
-			rb_erase(&next->rb_node, &proc->free_buffers);
+			binder_erase_free_buffer(proc, next);
 			binder_delete_free_buffer(proc, next);
 		}
 	}
@@ -870,13 +1158,87 @@ static void binder_free_buf(
 						struct binder_buffer, entry);
 		if (prev->free) {
 			binder_delete_free_buffer(proc, buffer);
-			rb_erase(&prev->rb_node, &proc->free_buffers);
+			binder_erase_free_buffer(proc, prev);
 			buffer = prev;
 		}
 	}
 	binder_insert_free_buffer(proc, buffer);
 }
 
+static void binder_free_buf(
+	struct binder_proc *proc, struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	__binder_free_buf(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
+}
+
+static int binder_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct binder_lru_page *lru_page;
+	struct binder_proc *proc;
+	struct mm_struct *mm;
+	size_t index;
+	void *page_addr;
+
+	while (nr_to_scan-- > 0) {
+		spin_lock(&binder_lru_lock);
+		if (list_empty(&binder_lru)) {
+			spin_unlock(&binder_lru_lock);
+			break;
+		}
+		lru_page = list_first_entry(&binder_lru, struct binder_lru_page, lru);
+		proc = lru_page->proc;
+		/*
+		 * The page keeps proc alive while binder_lru_lock is held.
+		 * Take the mm reference now, the final mmput can sleep and
+		 * must not happen under proc->alloc_lock.
+		 */
+		mm = get_task_mm(proc->tsk);
+		if (!mutex_trylock(&proc->alloc_lock)) {
+			list_move_tail(&lru_page->lru, &binder_lru);
+			spin_unlock(&binder_lru_lock);
+			if (mm)
+				mmput(mm);
+			continue;
+		}
+		list_del_init(&lru_page->lru);
+		binder_lru_count--;
+		proc->lru_page_count--;
+		spin_unlock(&binder_lru_lock);
+
+		index = lru_page - proc->lru_pages;
+		page_addr = proc->buffer + index * PAGE_SIZE;
+		if (mm) {
+			if (!down_read_trylock(&mm->mmap_sem)) {
+				binder_lru_add_page(proc, page_addr);
+				mutex_unlock(&proc->alloc_lock);
+				mmput(mm);
+				continue;
+			}
+			if (proc->vma)
+				zap_page_range(proc->vma, (uintptr_t)page_addr +
+					proc->user_buffer_offset, PAGE_SIZE, NULL);
+			up_read(&mm->mmap_sem);
+		}
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		__free_page(proc->pages[index]);
+		proc->pages[index] = NULL;
+		if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
+			printk(KERN_INFO "binder: %d: shrink freed page at %p\n",
+			       proc->pid, page_addr);
+		mutex_unlock(&proc->alloc_lock);
+		if (mm)
+			mmput(mm);
+	}
+	return binder_lru_count;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
 static struct binder_node *
 binder_get_node(struct binder_proc *proc, void __user *ptr)
 {
@@ -918,10 +1280,10 @@ binder_new_node(struct binder_proc *proc, void __user *ptr, void __user *cookie)
 	node = kzalloc(sizeof(*node), GFP_KERNEL);
 	if (node == NULL)
 		return NULL;
-	binder_stats.obj_created[BINDER_STAT_NODE]++;
+	binder_stats_created(BINDER_STAT_NODE);
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
@@ -939,6 +1301,11 @@ static int
 binder_inc_node(struct binder_node *node, int strong, int internal,
 		struct list_head *target_list)
 {
+	struct binder_proc *proc = node->proc;
+	int ret = 0;
+
+	if (proc)
+		spin_lock(&proc->inner_lock);
 	if (strong) {
 		if (internal) {
 			if (target_list == NULL &&
@@ -947,7 +1314,8 @@ binder_inc_node(struct binder_node *node, int strong, int internal,
 			    node->has_strong_ref)) {
 				printk(KERN_ERR "binder: invalid inc strong "
 					"node for %d\n", node->debug_id);
-				return -EINVAL;
+				ret = -EINVAL;
+				goto out;
 			}
 			node->internal_strong_refs++;
 		} else
@@ -963,17 +1331,23 @@ binder_inc_node(struct binder_node *node, int strong, int internal,
 			if (target_list == NULL) {
 				printk(KERN_ERR "binder: invalid inc weak node "
 					"for %d\n", node->debug_id);
-				return -EINVAL;
+				ret = -EINVAL;
+				goto out;
 			}
 			list_add_tail(&node->work.entry, target_list);
 		}
 	}
-	return 0;
+out:
+	if (proc)
+		spin_unlock(&proc->inner_lock);
+	return ret;
 }
 
 static int
 binder_dec_node(struct binder_node *node, int strong, int internal)
 {
+	struct binder_proc *proc = node->proc;
+
 	if (strong) {
 		if (internal)
 			node->internal_strong_refs--;
@@ -987,26 +1361,31 @@ binder_dec_node(struct binder_node *node, int strong, int internal)
 		if (node->local_weak_refs || !hlist_empty(&node->refs))
 			return 0;
 	}
-	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
+	if (proc && (node->has_strong_ref || node->has_weak_ref)) {
+		spin_lock(&proc->inner_lock);
 		if (list_empty(&node->work.entry)) {
-			list_add_tail(&node->work.entry, &node->proc->todo);
-			wake_up_interruptible(&node->proc->wait);
+			list_add_tail(&node->work.entry, &proc->todo);
+			wake_up_interruptible(&proc->wait);
 		}
+		spin_unlock(&proc->inner_lock);
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
 		    !node->local_weak_refs) {
-			list_del_init(&node->work.entry);
-			if (node->proc) {
-				rb_erase(&node->rb_node, &node->proc->nodes);
+			if (proc) {
+				spin_lock(&proc->inner_lock);
+				list_del_init(&node->work.entry);
+				spin_unlock(&proc->inner_lock);
+				rb_erase(&node->rb_node, &proc->nodes);
 				if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
 					printk(KERN_INFO "binder: refless node %d deleted\n", node->debug_id);
 			} else {
+				list_del_init(&node->work.entry);
 				hlist_del(&node->dead_node);
 				if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
 					printk(KERN_INFO "binder: dead node %d deleted\n", node->debug_id);
 			}
 			kfree(node);
-			binder_stats.obj_deleted[BINDER_STAT_NODE]++;
+			binder_stats_deleted(BINDER_STAT_NODE);
 		}
 	}
 
@@ -1055,8 +1434,8 @@ binder_get_ref_for_node(struct binder_proc *proc, struct binder_node *node)
 	new_ref = kzalloc(sizeof(*ref), GFP_KERNEL);
 	if (new_ref == NULL)
 		return NULL;
-	binder_stats.obj_created[BINDER_STAT_REF]++;
-	new_ref->debug_id = ++binder_last_id;
+	binder_stats_created(BINDER_STAT_REF);
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1117,12 +1496,14 @@ binder_delete_ref(struct binder_ref *ref)
 			printk(KERN_INFO "binder: %d delete ref %d desc %d "
 				"has death notification\n", ref->proc->pid,
 				ref->debug_id, ref->desc);
+		spin_lock(&ref->proc->inner_lock);
 		list_del(&ref->death->work.entry);
+		spin_unlock(&ref->proc->inner_lock);
 		kfree(ref->death);
-		binder_stats.obj_deleted[BINDER_STAT_DEATH]++;
+		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
 	kfree(ref);
-	binder_stats.obj_deleted[BINDER_STAT_REF]++;
+	binder_stats_deleted(BINDER_STAT_REF);
 }
 
 static int
@@ -1187,17 +1568,19 @@ binder_pop_transaction(
 	struct binder_thread *target_thread, struct binder_transaction *t)
 {
 	if (target_thread) {
+		spin_lock(&target_thread->proc->inner_lock);
 		BUG_ON(target_thread->transaction_stack != t);
 		BUG_ON(target_thread->transaction_stack->from != target_thread);
 		target_thread->transaction_stack =
 			target_thread->transaction_stack->from_parent;
+		spin_unlock(&target_thread->proc->inner_lock);
 		t->from = NULL;
 	}
 	t->need_reply = 0;
 	if (t->buffer)
 		t->buffer->transaction = NULL;
 	kfree(t);
-	binder_stats.obj_deleted[BINDER_STAT_TRANSACTION]++;
+	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
 
 static void
@@ -1208,6 +1591,10 @@ binder_send_failed_reply(struct binder_transaction *t, uint32_t error_code)
 	while (1) {
 		target_thread = t->from;
 		if (target_thread) {
+			struct binder_proc *target_proc = target_thread->proc;
+			int deliver = 0;
+
+			spin_lock(&target_proc->inner_lock);
 			if (target_thread->return_error != BR_OK &&
 			   target_thread->return_error2 == BR_OK) {
 				target_thread->return_error2 =
@@ -1217,18 +1604,22 @@ binder_send_failed_reply(struct binder_transaction *t, uint32_t error_code)
 			if (target_thread->return_error == BR_OK) {
 				if (binder_debug_mask & BINDER_DEBUG_FAILED_TRANSACTION)
 					printk(KERN_INFO "binder: send failed reply for transaction %d to %d:%d\n",
-					       t->debug_id, target_thread->proc->pid, target_thread->pid);
+					       t->debug_id, target_proc->pid, target_thread->pid);
 
-				binder_pop_transaction(target_thread, t);
 				target_thread->return_error = error_code;
-				wake_up_interruptible(&target_thread->wait);
+				deliver = 1;
 			} else {
 				printk(KERN_ERR "binder: reply failed, target "
 					"thread, %d:%d, has error code %d "
-					"already\n", target_thread->proc->pid,
+					"already\n", target_proc->pid,
 					target_thread->pid,
 					target_thread->return_error);
 			}
+			spin_unlock(&target_proc->inner_lock);
+			if (deliver) {
+				binder_pop_transaction(target_thread, t);
+				wake_up_interruptible(&target_thread->wait);
+			}
 			return;
 		} else {
 			struct binder_transaction *next = t->from_parent;
@@ -1273,6 +1664,7 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 	struct binder_transaction_log_entry *e;
 	uint32_t return_error;
 
+	mutex_lock(&binder_refs_lock);
 	e = binder_transaction_log_add(&binder_transaction_log);
 	e->call_type = reply ? 2 : !!(tr->flags & TF_ONE_WAY);
 	e->from_proc = proc->pid;
@@ -1290,7 +1682,7 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		binder_restore_priority(in_reply_to);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1304,7 +1696,9 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
+		spin_lock(&proc->inner_lock);
 		thread->transaction_stack = in_reply_to->to_parent;
+		spin_unlock(&proc->inner_lock);
 		target_thread = in_reply_to->from;
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
@@ -1324,6 +1718,7 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 			goto err_dead_binder;
 		}
 		target_proc = target_thread->proc;
+		e->to_thread = target_thread->pid;
 	} else {
 		if (tr->target.handle) {
 			struct binder_ref *ref;
@@ -1363,21 +1758,8 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
-			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
-				tmp = tmp->from_parent;
-			}
 		}
 	}
-	if (target_thread) {
-		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1386,17 +1768,21 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 		return_error = BR_FAILED_REPLY;
 		goto err_alloc_t_failed;
 	}
-	binder_stats.obj_created[BINDER_STAT_TRANSACTION]++;
+	binder_stats_created(BINDER_STAT_TRANSACTION);
 
 	tcomplete = kzalloc(sizeof(*tcomplete), GFP_KERNEL);
 	if (tcomplete == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_alloc_tcomplete_failed;
 	}
-	binder_stats.obj_created[BINDER_STAT_TRANSACTION_COMPLETE]++;
+	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
+	t->start_time = ktime_get();
+	trace_binder_transaction(t->debug_id, reply, target_proc->pid,
+				 target_node ? target_node->debug_id : 0,
+				 tr->code, tr->flags);
 
 	if (binder_debug_mask & BINDER_DEBUG_TRANSACTION) {
 		if (reply)
@@ -1415,28 +1801,36 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 			       tr->data_size, tr->offsets_size);
 	}
 
+	/*
+	 * Pin the target while binder_refs_lock is dropped for the buffer
+	 * allocation and the copy from userspace: the proc stays allocated
+	 * until tmp_ref drops and the node is kept by the local strong ref
+	 * that the transaction buffer holds anyway.
+	 */
+	target_proc->tmp_ref++;
+	if (target_node)
+		binder_inc_node(target_node, 1, 0, NULL);
+	mutex_unlock(&binder_refs_lock);
+
 	if (!reply && !(tr->flags & TF_ONE_WAY))
 		t->from = thread;
 	else
 		t->from = NULL;
 	t->sender_euid = proc->tsk->cred->euid;
 	t->to_proc = target_proc;
-	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
+	t->sched_policy = current->policy;
+	t->rt_priority = current->rt_priority;
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
 	t->buffer->debug_id = t->debug_id;
-	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
@@ -1459,6 +1853,52 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 		return_error = BR_FAILED_REPLY;
 		goto err_bad_offset;
 	}
+
+	mutex_lock(&binder_refs_lock);
+	t->buffer->transaction = t;
+	if (reply) {
+		if (in_reply_to->from == NULL) {
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_target;
+		}
+		if (target_thread->transaction_stack != in_reply_to) {
+			binder_user_error("binder: %d:%d got reply transaction "
+				"with bad target transaction stack %d, "
+				"expected %d\n",
+				proc->pid, thread->pid,
+				target_thread->transaction_stack ?
+				target_thread->transaction_stack->debug_id : 0,
+				in_reply_to->debug_id);
+			return_error = BR_FAILED_REPLY;
+			in_reply_to = NULL;
+			target_thread = NULL;
+			goto err_dead_target;
+		}
+	} else {
+		if (target_node->proc != target_proc) {
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_target;
+		}
+		if (!(tr->flags & TF_ONE_WAY)) {
+			struct binder_transaction *tmp;
+			tmp = thread->transaction_stack;
+			while (tmp) {
+				if (tmp->from && tmp->from->proc == target_proc)
+					target_thread = tmp->from;
+				tmp = tmp->from_parent;
+			}
+		}
+	}
+	if (target_thread) {
+		e->to_thread = target_thread->pid;
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
+	} else {
+		target_list = &target_proc->todo;
+		target_wait = &target_proc->wait;
+	}
+	t->to_thread = target_thread;
+
 	off_end = (void *)offp + tr->offsets_size;
 	for (; offp < off_end; offp++) {
 		struct flat_binder_object *fp;
@@ -1469,7 +1909,7 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 				"invalid offset, %zd\n",
 				proc->pid, thread->pid, *offp);
 			return_error = BR_FAILED_REPLY;
-			goto err_bad_offset;
+			goto err_bad_object_offset;
 		}
 		fp = (struct flat_binder_object *)(t->buffer->data + *offp);
 		switch (fp->type) {
@@ -1492,6 +1932,7 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
 			ref = binder_get_ref_for_node(target_proc, node);
@@ -1593,13 +2034,23 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 		}
 	}
 	if (reply) {
+		ktime_t latency = ktime_sub(t->start_time, in_reply_to->start_time);
+
 		BUG_ON(t->buffer->async_transaction != 0);
+		trace_binder_reply(t->debug_id, in_reply_to->debug_id,
+				   ktime_to_ns(latency));
+		binder_latency_add(&proc->reply_hist, latency);
+		/* the service may have freed the buffer before replying */
+		if (in_reply_to->buffer && in_reply_to->buffer->target_node)
+			binder_latency_add(&in_reply_to->buffer->target_node->reply_hist, latency);
 		binder_pop_transaction(target_thread, in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
 		t->need_reply = 1;
 		t->from_parent = thread->transaction_stack;
+		spin_lock(&proc->inner_lock);
 		thread->transaction_stack = t;
+		spin_unlock(&proc->inner_lock);
 	} else {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
@@ -1610,11 +2061,22 @@ binder_transaction(struct binder_proc *proc, struct binder_thread *thread,
 			target_node->has_async_transaction = 1;
 	}
 	t->work.type = BINDER_WORK_TRANSACTION;
-	list_add_tail(&t->work.entry, target_list);
+	spin_lock(&target_proc->inner_lock);
+	if (target_list == &target_proc->todo)
+		binder_enqueue_transaction(target_list, t);
+	else
+		list_add_tail(&t->work.entry, target_list);
+	spin_unlock(&target_proc->inner_lock);
+	trace_binder_transaction_queued(t->debug_id, target_proc->pid,
+					target_thread ? target_thread->pid : 0);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+	spin_lock(&proc->inner_lock);
 	list_add_tail(&tcomplete->entry, &thread->todo);
+	spin_unlock(&proc->inner_lock);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
+	binder_proc_dec_tmpref(target_proc);
+	mutex_unlock(&binder_refs_lock);
 	return;
 
 err_get_unused_fd_failed:
@@ -1624,17 +2086,31 @@ err_binder_get_ref_for_node_failed:
 err_binder_get_ref_failed:
 err_binder_new_node_failed:
 err_bad_object_type:
+err_bad_object_offset:
+err_dead_target:
+	binder_transaction_buffer_release(target_proc, t->buffer, offp);
+	t->buffer->transaction = NULL;
+	binder_free_buf(target_proc, t->buffer);
+	goto err_put_target;
+
 err_bad_offset:
 err_copy_data_failed:
+	mutex_lock(&binder_refs_lock);
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
-	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
+	goto err_put_target;
+
 err_binder_alloc_buf_failed:
+	mutex_lock(&binder_refs_lock);
+	if (target_node)
+		binder_dec_node(target_node, 1, 0);
+err_put_target:
+	binder_proc_dec_tmpref(target_proc);
 	kfree(tcomplete);
-	binder_stats.obj_deleted[BINDER_STAT_TRANSACTION_COMPLETE]++;
+	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 err_alloc_tcomplete_failed:
 	kfree(t);
-	binder_stats.obj_deleted[BINDER_STAT_TRANSACTION]++;
+	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 err_alloc_t_failed:
 err_bad_call_stack:
 err_empty_call_stack:
@@ -1653,12 +2129,21 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
-	BUG_ON(thread->return_error != BR_OK);
-	if (in_reply_to) {
+	spin_lock(&proc->inner_lock);
+	/*
+	 * A failed reply for an outgoing transaction of this thread may have
+	 * been posted while binder_refs_lock was not held, keep it in front.
+	 */
+	if (thread->return_error != BR_OK && thread->return_error2 == BR_OK)
+		thread->return_error2 = thread->return_error;
+	if (in_reply_to)
 		thread->return_error = BR_TRANSACTION_COMPLETE;
-		binder_send_failed_reply(in_reply_to, return_error);
-	} else
+	else
 		thread->return_error = return_error;
+	spin_unlock(&proc->inner_lock);
+	if (in_reply_to)
+		binder_send_failed_reply(in_reply_to, return_error);
+	mutex_unlock(&binder_refs_lock);
 }
 
 static void
@@ -1730,6 +2215,20 @@ binder_transaction_buffer_release(struct binder_proc *proc, struct binder_buffer
 	}
 }
 
+static void
+binder_queue_death_work(struct binder_proc *proc, struct binder_thread *thread,
+			struct binder_work *w)
+{
+	spin_lock(&proc->inner_lock);
+	if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
+		list_add_tail(&w->entry, &thread->todo);
+	} else {
+		list_add_tail(&w->entry, &proc->todo);
+		wake_up_interruptible(&proc->wait);
+	}
+	spin_unlock(&proc->inner_lock);
+}
+
 int
 binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 		    void __user *buffer, int size, signed long *consumed)
@@ -1743,9 +2242,9 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1759,6 +2258,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
+			mutex_lock(&binder_refs_lock);
 			if (target == 0 && binder_context_mgr_node &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
 				ref = binder_get_ref_for_node(proc,
@@ -1777,6 +2277,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
+				mutex_unlock(&binder_refs_lock);
 				break;
 			}
 			switch (cmd) {
@@ -1801,6 +2302,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (binder_debug_mask & BINDER_DEBUG_USER_REFS)
 				printk(KERN_INFO "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
 				       proc->pid, thread->pid, debug_string, ref->debug_id, ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+			mutex_unlock(&binder_refs_lock);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1815,6 +2317,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			mutex_lock(&binder_refs_lock);
 			node = binder_get_node(proc, node_ptr);
 			if (node == NULL) {
 				binder_user_error("binder: %d:%d "
@@ -1824,6 +2327,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" :
 					"BC_ACQUIRE_DONE",
 					node_ptr);
+				mutex_unlock(&binder_refs_lock);
 				break;
 			}
 			if (cookie != node->cookie) {
@@ -1834,6 +2338,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 					node_ptr, node->debug_id,
 					cookie, node->cookie);
+				mutex_unlock(&binder_refs_lock);
 				break;
 			}
 			if (cmd == BC_ACQUIRE_DONE) {
@@ -1843,6 +2348,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending acquire request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					mutex_unlock(&binder_refs_lock);
 					break;
 				}
 				node->pending_strong_ref = 0;
@@ -1853,6 +2359,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending increfs request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					mutex_unlock(&binder_refs_lock);
 					break;
 				}
 				node->pending_weak_ref = 0;
@@ -1861,6 +2368,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (binder_debug_mask & BINDER_DEBUG_USER_REFS)
 				printk(KERN_INFO "binder: %d:%d %s node %d ls %d lw %d\n",
 				       proc->pid, thread->pid, cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE", node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			mutex_unlock(&binder_refs_lock);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1878,20 +2386,31 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			mutex_lock(&proc->alloc_lock);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			/* claim it, so a racing BC_FREE_BUFFER fails above */
+			buffer->allow_user_free = 0;
+			mutex_unlock(&proc->alloc_lock);
+			trace_binder_buffer_free(proc->pid, buffer->debug_id,
+						 buffer->data_size,
+						 buffer->offsets_size);
+
+			mutex_lock(&binder_refs_lock);
 			if (binder_debug_mask & BINDER_DEBUG_FREE_BUFFER)
 				printk(KERN_INFO "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				       proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1903,12 +2422,15 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			}
 			if (buffer->async_transaction && buffer->target_node) {
 				BUG_ON(!buffer->target_node->has_async_transaction);
+				spin_lock(&proc->inner_lock);
 				if (list_empty(&buffer->target_node->async_todo))
 					buffer->target_node->has_async_transaction = 0;
 				else
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
+				spin_unlock(&proc->inner_lock);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
+			mutex_unlock(&binder_refs_lock);
 			binder_free_buf(proc, buffer);
 			break;
 		}
@@ -1928,6 +2450,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (binder_debug_mask & BINDER_DEBUG_THREADS)
 				printk(KERN_INFO "binder: %d:%d BC_REGISTER_LOOPER\n",
 				       proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -1945,11 +2468,13 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			spin_unlock(&proc->inner_lock);
 			break;
 		case BC_ENTER_LOOPER:
 			if (binder_debug_mask & BINDER_DEBUG_THREADS)
 				printk(KERN_INFO "binder: %d:%d BC_ENTER_LOOPER\n",
 				       proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -1958,12 +2483,15 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid);
 			}
 			thread->looper |= BINDER_LOOPER_STATE_ENTERED;
+			spin_unlock(&proc->inner_lock);
 			break;
 		case BC_EXIT_LOOPER:
 			if (binder_debug_mask & BINDER_DEBUG_THREADS)
 				printk(KERN_INFO "binder: %d:%d BC_EXIT_LOOPER\n",
 				       proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			thread->looper |= BINDER_LOOPER_STATE_EXITED;
+			spin_unlock(&proc->inner_lock);
 			break;
 
 		case BC_REQUEST_DEATH_NOTIFICATION:
@@ -1979,6 +2507,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			mutex_lock(&binder_refs_lock);
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
 				binder_user_error("binder: %d:%d %s "
@@ -1988,6 +2517,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_REQUEST_DEATH_NOTIFICATION" :
 					"BC_CLEAR_DEATH_NOTIFICATION",
 					target);
+				mutex_unlock(&binder_refs_lock);
 				break;
 			}
 
@@ -2007,29 +2537,28 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"FICATION death notific"
 						"ation already set\n",
 						proc->pid, thread->pid);
+					mutex_unlock(&binder_refs_lock);
 					break;
 				}
 				death = kzalloc(sizeof(*death), GFP_KERNEL);
 				if (death == NULL) {
+					spin_lock(&proc->inner_lock);
 					thread->return_error = BR_ERROR;
+					spin_unlock(&proc->inner_lock);
 					if (binder_debug_mask & BINDER_DEBUG_FAILED_TRANSACTION)
 						printk(KERN_INFO "binder: %d:%d "
 							"BC_REQUEST_DEATH_NOTIFICATION failed\n",
 							proc->pid, thread->pid);
+					mutex_unlock(&binder_refs_lock);
 					break;
 				}
-				binder_stats.obj_created[BINDER_STAT_DEATH]++;
+				binder_stats_created(BINDER_STAT_DEATH);
 				INIT_LIST_HEAD(&death->work.entry);
 				death->cookie = cookie;
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
-					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
-						list_add_tail(&ref->death->work.entry, &thread->todo);
-					} else {
-						list_add_tail(&ref->death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
-					}
+					binder_queue_death_work(proc, thread, &ref->death->work);
 				}
 			} else {
 				if (ref->death == NULL) {
@@ -2038,6 +2567,7 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"CATION death notificat"
 						"ion not active\n",
 						proc->pid, thread->pid);
+					mutex_unlock(&binder_refs_lock);
 					break;
 				}
 				death = ref->death;
@@ -2049,22 +2579,22 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"%p != %p\n",
 						proc->pid, thread->pid,
 						death->cookie, cookie);
+					mutex_unlock(&binder_refs_lock);
 					break;
 				}
 				ref->death = NULL;
+				spin_lock(&proc->inner_lock);
 				if (list_empty(&death->work.entry)) {
+					spin_unlock(&proc->inner_lock);
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
-					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
-						list_add_tail(&death->work.entry, &thread->todo);
-					} else {
-						list_add_tail(&death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
-					}
+					binder_queue_death_work(proc, thread, &death->work);
 				} else {
+					spin_unlock(&proc->inner_lock);
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
 			}
+			mutex_unlock(&binder_refs_lock);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2074,6 +2604,8 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			mutex_lock(&binder_refs_lock);
+			spin_lock(&proc->inner_lock);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2081,6 +2613,9 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					break;
 				}
 			}
+			if (death)
+				list_del_init(&death->work.entry);
+			spin_unlock(&proc->inner_lock);
 			if (binder_debug_mask & BINDER_DEBUG_DEAD_BINDER)
 				printk(KERN_INFO "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				       proc->pid, thread->pid, cookie, death);
@@ -2088,19 +2623,15 @@ binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
+				mutex_unlock(&binder_refs_lock);
 				break;
 			}
 
-			list_del_init(&death->work.entry);
 			if (death->work.type == BINDER_WORK_DEAD_BINDER_AND_CLEAR) {
 				death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
-				if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
-					list_add_tail(&death->work.entry, &thread->todo);
-				} else {
-					list_add_tail(&death->work.entry, &proc->todo);
-					wake_up_interruptible(&proc->wait);
-				}
+				binder_queue_death_work(proc, thread, &death->work);
 			}
+			mutex_unlock(&binder_refs_lock);
 		} break;
 
 		default:
@@ -2116,9 +2647,9 @@ void
 binder_stat_br(struct binder_proc *proc, struct binder_thread *thread, uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2144,6 +2675,7 @@ binder_thread_read(struct binder_proc *proc, struct binder_thread *thread,
 
 	int ret = 0;
 	int wait_for_proc_work;
+	int spawn_looper = 0;
 
 	if (*consumed == 0) {
 		if (put_user(BR_NOOP, (uint32_t __user *)ptr))
@@ -2152,21 +2684,28 @@ binder_thread_read(struct binder_proc *proc, struct binder_thread *thread,
 	}
 
 retry:
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL && list_empty(&thread->todo);
 
 	if (thread->return_error != BR_OK && ptr < end) {
+		uint32_t errors[2];
+		int i, count = 0;
+
+		/* consume the errors under the lock, a failed reply may race */
 		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
+			errors[count++] = thread->return_error2;
+			thread->return_error2 = BR_OK;
+		}
+		if (ptr + count * sizeof(uint32_t) < end) {
+			errors[count++] = thread->return_error;
+			thread->return_error = BR_OK;
+		}
+		spin_unlock(&proc->inner_lock);
+		for (i = 0; i < count; i++) {
+			if (put_user(errors[i], (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (ptr == end)
-				goto done;
-			thread->return_error2 = BR_OK;
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
-			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		thread->return_error = BR_OK;
 		goto done;
 	}
 
@@ -2174,7 +2713,7 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->inner_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2184,6 +2723,8 @@ retry:
 				proc->pid, thread->pid, thread->looper);
 			wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 		}
+		binder_set_sched(proc->default_sched_policy,
+				 proc->default_rt_priority);
 		binder_set_nice(proc->default_priority);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
@@ -2197,10 +2738,11 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	spin_lock(&proc->inner_lock);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
+	spin_unlock(&proc->inner_lock);
 
 	if (ret)
 		return ret;
@@ -2210,19 +2752,55 @@ retry:
 		struct binder_transaction_data tr;
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
+		struct list_head *list;
+		int refs_locked = 0;
+		ktime_t latency;
 
+		spin_lock(&proc->inner_lock);
 		if (!list_empty(&thread->todo))
-			w = list_first_entry(&thread->todo, struct binder_work, entry);
+			list = &thread->todo;
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
-			w = list_first_entry(&proc->todo, struct binder_work, entry);
+			list = &proc->todo;
 		else {
-			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
+			int need_return = thread->looper & BINDER_LOOPER_STATE_NEED_RETURN;
+
+			spin_unlock(&proc->inner_lock);
+			if (ptr - buffer == 4 && !need_return) /* no data added */
 				goto retry;
 			break;
 		}
 
-		if (end - ptr < sizeof(tr) + 4)
+		if (end - ptr < sizeof(tr) + 4) {
+			spin_unlock(&proc->inner_lock);
 			break;
+		}
+
+		w = list_first_entry(list, struct binder_work, entry);
+		if (w->type != BINDER_WORK_TRANSACTION &&
+		    w->type != BINDER_WORK_TRANSACTION_COMPLETE) {
+			/*
+			 * Node and death work look at the ref graph, take
+			 * binder_refs_lock first and look at the list again.
+			 */
+			spin_unlock(&proc->inner_lock);
+			mutex_lock(&binder_refs_lock);
+			refs_locked = 1;
+			spin_lock(&proc->inner_lock);
+			if (list_empty(list)) {
+				spin_unlock(&proc->inner_lock);
+				mutex_unlock(&binder_refs_lock);
+				continue;
+			}
+			w = list_first_entry(list, struct binder_work, entry);
+			if (w->type == BINDER_WORK_TRANSACTION ||
+			    w->type == BINDER_WORK_TRANSACTION_COMPLETE) {
+				mutex_unlock(&binder_refs_lock);
+				refs_locked = 0;
+			}
+		}
+		if (!refs_locked)
+			list_del_init(&w->entry);
+		spin_unlock(&proc->inner_lock);
 
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
@@ -2230,8 +2808,12 @@ retry:
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
 			cmd = BR_TRANSACTION_COMPLETE;
-			if (put_user(cmd, (uint32_t __user *)ptr))
+			if (put_user(cmd, (uint32_t __user *)ptr)) {
+				spin_lock(&proc->inner_lock);
+				list_add(&w->entry, list);
+				spin_unlock(&proc->inner_lock);
 				return -EFAULT;
+			}
 			ptr += sizeof(uint32_t);
 
 			binder_stat_br(proc, thread, cmd);
@@ -2239,9 +2821,8 @@ retry:
 				printk(KERN_INFO "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				       proc->pid, thread->pid);
 
-			list_del(&w->entry);
 			kfree(w);
-			binder_stats.obj_deleted[BINDER_STAT_TRANSACTION_COMPLETE]++;
+			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
 		case BINDER_WORK_NODE: {
 			struct binder_node *node = container_of(w, struct binder_node, work);
@@ -2271,35 +2852,36 @@ retry:
 				node->has_weak_ref = 0;
 			}
 			if (cmd != BR_NOOP) {
-				if (put_user(cmd, (uint32_t __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
+				if (put_user(cmd, (uint32_t __user *)ptr) ||
+				    put_user(node->ptr, (void * __user *)(ptr + sizeof(uint32_t))) ||
+				    put_user(node->cookie, (void * __user *)(ptr + sizeof(uint32_t) + sizeof(void *)))) {
+					mutex_unlock(&binder_refs_lock);
 					return -EFAULT;
-				ptr += sizeof(void *);
+				}
+				ptr += sizeof(uint32_t) + 2 * sizeof(void *);
 
 				binder_stat_br(proc, thread, cmd);
 				if (binder_debug_mask & BINDER_DEBUG_USER_REFS)
 					printk(KERN_INFO "binder: %d:%d %s %d u%p c%p\n",
 					       proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
 			} else {
+				spin_lock(&proc->inner_lock);
 				list_del_init(&w->entry);
+				spin_unlock(&proc->inner_lock);
 				if (!weak && !strong) {
 					if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
 						printk(KERN_INFO "binder: %d:%d node %d u%p c%p deleted\n",
 						       proc->pid, thread->pid, node->debug_id, node->ptr, node->cookie);
 					rb_erase(&node->rb_node, &proc->nodes);
 					kfree(node);
-					binder_stats.obj_deleted[BINDER_STAT_NODE]++;
+					binder_stats_deleted(BINDER_STAT_NODE);
 				} else {
 					if (binder_debug_mask & BINDER_DEBUG_INTERNAL_REFS)
 						printk(KERN_INFO "binder: %d:%d node %d u%p c%p state unchanged\n",
 						       proc->pid, thread->pid, node->debug_id, node->ptr, node->cookie);
 				}
 			}
+			mutex_unlock(&binder_refs_lock);
 		} break;
 		case BINDER_WORK_DEAD_BINDER:
 		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
@@ -2310,12 +2892,12 @@ retry:
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
 			else
 				cmd = BR_DEAD_BINDER;
-			if (put_user(cmd, (uint32_t __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
+			if (put_user(cmd, (uint32_t __user *)ptr) ||
+			    put_user(death->cookie, (void * __user *)(ptr + sizeof(uint32_t)))) {
+				mutex_unlock(&binder_refs_lock);
 				return -EFAULT;
-			ptr += sizeof(void *);
+			}
+			ptr += sizeof(uint32_t) + sizeof(void *);
 			if (binder_debug_mask & BINDER_DEBUG_DEATH_NOTIFICATION)
 				printk(KERN_INFO "binder: %d:%d %s %p\n",
 				       proc->pid, thread->pid,
@@ -2325,11 +2907,17 @@ retry:
 				       death->cookie);
 
 			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
+				spin_lock(&proc->inner_lock);
 				list_del(&w->entry);
+				spin_unlock(&proc->inner_lock);
 				kfree(death);
-				binder_stats.obj_deleted[BINDER_STAT_DEATH]++;
-			} else
+				binder_stats_deleted(BINDER_STAT_DEATH);
+			} else {
+				spin_lock(&proc->inner_lock);
 				list_move(&w->entry, &proc->delivered_death);
+				spin_unlock(&proc->inner_lock);
+			}
+			mutex_unlock(&binder_refs_lock);
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
@@ -2344,12 +2932,20 @@ retry:
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
 			t->saved_priority = task_nice(current);
+			t->saved_sched_policy = current->policy;
+			t->saved_rt_priority = current->rt_priority;
 			if (t->priority < target_node->min_priority &&
 			    !(t->flags & TF_ONE_WAY))
 				binder_set_nice(t->priority);
 			else if (!(t->flags & TF_ONE_WAY) ||
 				 t->saved_priority > target_node->min_priority)
 				binder_set_nice(target_node->min_priority);
+			/* RT callers lend their policy until the reply */
+			if (!(t->flags & TF_ONE_WAY) &&
+			    binder_rt_policy(t->sched_policy) &&
+			    (!binder_rt_policy(current->policy) ||
+			     current->rt_priority < t->rt_priority))
+				binder_set_sched(t->sched_policy, t->rt_priority);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2360,26 +2956,38 @@ retry:
 		tr.flags = t->flags;
 		tr.sender_euid = t->sender_euid;
 
+		mutex_lock(&binder_refs_lock);
 		if (t->from) {
 			struct task_struct *sender = t->from->proc->tsk;
 			tr.sender_pid = task_tgid_nr_ns(sender, current->nsproxy->pid_ns);
 		} else {
 			tr.sender_pid = 0;
 		}
+		mutex_unlock(&binder_refs_lock);
 
 		tr.data_size = t->buffer->data_size;
 		tr.offsets_size = t->buffer->offsets_size;
 		tr.data.ptr.buffer = (void *)t->buffer->data + proc->user_buffer_offset;
 		tr.data.ptr.offsets = tr.data.ptr.buffer + ALIGN(t->buffer->data_size, sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
+		if (put_user(cmd, (uint32_t __user *)ptr) ||
+		    copy_to_user(ptr + sizeof(uint32_t), &tr, sizeof(tr))) {
+			/* put it back, it was not delivered */
+			spin_lock(&proc->inner_lock);
+			list_add(&t->work.entry, list);
+			spin_unlock(&proc->inner_lock);
 			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
-			return -EFAULT;
-		ptr += sizeof(tr);
+		}
+		ptr += sizeof(uint32_t) + sizeof(tr);
 
 		binder_stat_br(proc, thread, cmd);
+		latency = ktime_sub(ktime_get(), t->start_time);
+		trace_binder_transaction_received(t->debug_id, ktime_to_ns(latency));
+		if (cmd == BR_TRANSACTION) {
+			binder_latency_add(&proc->deliver_hist, latency);
+			binder_latency_add(&t->buffer->target_node->deliver_hist, latency);
+		}
+		mutex_lock(&binder_refs_lock);
 		if (binder_debug_mask & BINDER_DEBUG_TRANSACTION)
 			printk(KERN_INFO "binder: %d:%d %s %d %d:%d, cmd %d"
 				"size %zd-%zd ptr %p-%p\n",
@@ -2390,16 +2998,21 @@ retry:
 			       t->buffer->data_size, t->buffer->offsets_size,
 			       tr.data.ptr.buffer, tr.data.ptr.offsets);
 
-		list_del(&t->work.entry);
+		mutex_lock(&proc->alloc_lock);
 		t->buffer->allow_user_free = 1;
+		mutex_unlock(&proc->alloc_lock);
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
+			spin_lock(&proc->inner_lock);
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
 			thread->transaction_stack = t;
+			spin_unlock(&proc->inner_lock);
+			mutex_unlock(&binder_refs_lock);
 		} else {
 			t->buffer->transaction = NULL;
+			mutex_unlock(&binder_refs_lock);
 			kfree(t);
-			binder_stats.obj_deleted[BINDER_STAT_TRANSACTION]++;
+			binder_stats_deleted(BINDER_STAT_TRANSACTION);
 		}
 		break;
 	}
@@ -2407,12 +3020,17 @@ retry:
 done:
 
 	*consumed = ptr - buffer;
+	spin_lock(&proc->inner_lock);
 	if (proc->requested_threads + proc->ready_threads == 0 &&
 	    proc->requested_threads_started < proc->max_threads &&
 	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 	     BINDER_LOOPER_STATE_ENTERED)) /* the user-space code fails to */
 	     /*spawn a new thread if we leave this out */) {
 		proc->requested_threads++;
+		spawn_looper = 1;
+	}
+	spin_unlock(&proc->inner_lock);
+	if (spawn_looper) {
 		if (binder_debug_mask & BINDER_DEBUG_THREADS)
 			printk(KERN_INFO "binder: %d:%d BR_SPAWN_LOOPER\n",
 			       proc->pid, thread->pid);
@@ -2422,12 +3040,18 @@ done:
 	return 0;
 }
 
-static void binder_release_work(struct list_head *list)
+static void binder_release_work(struct binder_proc *proc, struct list_head *list)
 {
 	struct binder_work *w;
-	while (!list_empty(list)) {
+	while (1) {
+		spin_lock(&proc->inner_lock);
+		if (list_empty(list)) {
+			spin_unlock(&proc->inner_lock);
+			break;
+		}
 		w = list_first_entry(list, struct binder_work, entry);
 		list_del_init(&w->entry);
+		spin_unlock(&proc->inner_lock);
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
 			struct binder_transaction *t = container_of(w, struct binder_transaction, work);
@@ -2436,7 +3060,7 @@ static void binder_release_work(struct list_head *list)
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
 			kfree(w);
-			binder_stats.obj_deleted[BINDER_STAT_TRANSACTION_COMPLETE]++;
+			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
 		default:
 			break;
@@ -2448,9 +3072,14 @@ static void binder_release_work(struct list_head *list)
 static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 {
 	struct binder_thread *thread = NULL;
-	struct rb_node *parent = NULL;
-	struct rb_node **p = &proc->threads.rb_node;
-
+	struct binder_thread *new_thread = NULL;
+	struct rb_node *parent;
+	struct rb_node **p;
+
+	spin_lock(&proc->inner_lock);
+again:
+	parent = NULL;
+	p = &proc->threads.rb_node;
 	while (*p) {
 		parent = *p;
 		thread = rb_entry(parent, struct binder_thread, rb_node);
@@ -2463,10 +3092,17 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 			break;
 	}
 	if (*p == NULL) {
-		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
-		if (thread == NULL)
-			return NULL;
-		binder_stats.obj_created[BINDER_STAT_THREAD]++;
+		if (new_thread == NULL) {
+			spin_unlock(&proc->inner_lock);
+			new_thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+			if (new_thread == NULL)
+				return NULL;
+			spin_lock(&proc->inner_lock);
+			goto again;
+		}
+		thread = new_thread;
+		new_thread = NULL;
+		binder_stats_created(BINDER_STAT_THREAD);
 		thread->proc = proc;
 		thread->pid = current->pid;
 		init_waitqueue_head(&thread->wait);
@@ -2477,6 +3113,8 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		thread->return_error = BR_OK;
 		thread->return_error2 = BR_OK;
 	}
+	spin_unlock(&proc->inner_lock);
+	kfree(new_thread);
 	return thread;
 }
 
@@ -2486,7 +3124,9 @@ static int binder_free_thread(struct binder_proc *proc, struct binder_thread *th
 	struct binder_transaction *send_reply = NULL;
 	int active_transactions = 0;
 
+	spin_lock(&proc->inner_lock);
 	rb_erase(&thread->rb_node, &proc->threads);
+	spin_unlock(&proc->inner_lock);
 	t = thread->transaction_stack;
 	if (t && t->to_thread == thread)
 		send_reply = t;
@@ -2511,9 +3151,9 @@ static int binder_free_thread(struct binder_proc *proc, struct binder_thread *th
 	}
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
-	binder_release_work(&thread->todo);
+	binder_release_work(proc, &thread->todo);
 	kfree(thread);
-	binder_stats.obj_deleted[BINDER_STAT_THREAD]++;
+	binder_stats_deleted(BINDER_STAT_THREAD);
 	return active_transactions;
 }
 
@@ -2523,12 +3163,14 @@ static unsigned int binder_poll(struct file *filp, struct poll_table_struct *wai
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
 	thread = binder_get_thread(proc);
+	if (thread == NULL)
+		return POLLERR;
 
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->inner_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2560,7 +3202,6 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2616,10 +3257,11 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	case BINDER_SET_CONTEXT_MGR:
+		mutex_lock(&binder_refs_lock);
 		if (binder_context_mgr_node != NULL) {
 			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
 			ret = -EBUSY;
-			goto err;
+			goto err_unlock;
 		}
 		if (binder_context_mgr_uid != -1) {
 			if (binder_context_mgr_uid != current->cred->euid) {
@@ -2628,25 +3270,28 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 				       current->cred->euid,
 				       binder_context_mgr_uid);
 				ret = -EPERM;
-				goto err;
+				goto err_unlock;
 			}
 		} else
 			binder_context_mgr_uid = current->cred->euid;
 		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
 		if (binder_context_mgr_node == NULL) {
 			ret = -ENOMEM;
-			goto err;
+			goto err_unlock;
 		}
 		binder_context_mgr_node->local_weak_refs++;
 		binder_context_mgr_node->local_strong_refs++;
 		binder_context_mgr_node->has_strong_ref = 1;
 		binder_context_mgr_node->has_weak_ref = 1;
+		mutex_unlock(&binder_refs_lock);
 		break;
 	case BINDER_THREAD_EXIT:
 		if (binder_debug_mask & BINDER_DEBUG_THREADS)
 			printk(KERN_INFO "binder: %d:%d exit\n",
 			       proc->pid, thread->pid);
+		mutex_lock(&binder_refs_lock);
 		binder_free_thread(proc, thread);
+		mutex_unlock(&binder_refs_lock);
 		thread = NULL;
 		break;
 	case BINDER_VERSION:
@@ -2664,10 +3309,15 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		goto err;
 	}
 	ret = 0;
+	goto err;
+err_unlock:
+	mutex_unlock(&binder_refs_lock);
 err:
-	if (thread)
+	if (thread) {
+		spin_lock(&proc->inner_lock);
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+		spin_unlock(&proc->inner_lock);
+	}
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2711,6 +3361,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
 	struct binder_buffer *buffer;
+	int i, page_count;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2759,17 +3410,32 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	page_count = proc->buffer_size / PAGE_SIZE;
+
+	proc->lru_pages = kzalloc(sizeof(proc->lru_pages[0]) * page_count, GFP_KERNEL);
+	if (proc->lru_pages == NULL) {
+		ret = -ENOMEM;
+		failure_string = "alloc lru page array";
+		goto err_alloc_lru_pages_failed;
+	}
+	for (i = 0; i < page_count; i++) {
+		INIT_LIST_HEAD(&proc->lru_pages[i].lru);
+		proc->lru_pages[i].proc = proc;
+	}
+	proc->hot_pages = clamp(binder_hot_pages, 1, page_count);
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
 
-	if (binder_update_page_range(proc, 1, proc->buffer, proc->buffer + PAGE_SIZE, vma)) {
+	if (binder_update_page_range(proc, 1, proc->buffer, proc->buffer + proc->hot_pages * PAGE_SIZE, vma)) {
 		ret = -ENOMEM;
 		failure_string = "alloc small buf";
 		goto err_alloc_small_buf_failed;
 	}
 	buffer = proc->buffer;
 	INIT_LIST_HEAD(&proc->buffers);
+	for (i = 0; i < BINDER_FREE_CLASSES; i++)
+		INIT_LIST_HEAD(&proc->free_classes[i]);
 	list_add(&buffer->entry, &proc->buffers);
 	buffer->free = 1;
 	binder_insert_free_buffer(proc, buffer);
@@ -2782,6 +3448,15 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 
 err_alloc_small_buf_failed:
+	for (i = 0; i < proc->hot_pages; i++) {
+		if (proc->pages[i]) {
+			__free_page(proc->pages[i]);
+			proc->pages[i] = NULL;
+		}
+	}
+	kfree(proc->lru_pages);
+	proc->lru_pages = NULL;
+err_alloc_lru_pages_failed:
 	kfree(proc->pages);
 	proc->pages = NULL;
 err_alloc_pages_failed:
@@ -2809,13 +3484,17 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
-	binder_stats.obj_created[BINDER_STAT_PROC]++;
-	hlist_add_head(&proc->proc_node, &binder_procs);
+	proc->default_sched_policy = current->policy;
+	proc->default_rt_priority = current->rt_priority;
+	spin_lock_init(&proc->inner_lock);
+	mutex_init(&proc->alloc_lock);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
+	mutex_lock(&binder_refs_lock);
+	binder_stats_created(BINDER_STAT_PROC);
+	hlist_add_head(&proc->proc_node, &binder_procs);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	mutex_unlock(&binder_refs_lock);
 
 	if (binder_proc_dir_entry_proc) {
 		char strbuf[11];
@@ -2840,6 +3519,8 @@ static void binder_deferred_flush(struct binder_proc *proc)
 {
 	struct rb_node *n;
 	int wake_count = 0;
+
+	spin_lock(&proc->inner_lock);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n)) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2848,6 +3529,7 @@ static void binder_deferred_flush(struct binder_proc *proc)
 			wake_count++;
 		}
 	}
+	spin_unlock(&proc->inner_lock);
 	wake_up_interruptible_all(&proc->wait);
 
 	if (binder_debug_mask & BINDER_DEBUG_OPEN_CLOSE)
@@ -2871,9 +3553,8 @@ static int binder_release(struct inode *nodp, struct file *filp)
 static void binder_deferred_release(struct binder_proc *proc)
 {
 	struct hlist_node *pos;
-	struct binder_transaction *t;
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
@@ -2887,8 +3568,15 @@ static void binder_deferred_release(struct binder_proc *proc)
 
 	threads = 0;
 	active_transactions = 0;
-	while ((n = rb_first(&proc->threads))) {
-		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
+	while (1) {
+		struct binder_thread *thread;
+
+		spin_lock(&proc->inner_lock);
+		n = rb_first(&proc->threads);
+		spin_unlock(&proc->inner_lock);
+		if (n == NULL)
+			break;
+		thread = rb_entry(n, struct binder_thread, rb_node);
 		threads++;
 		active_transactions += binder_free_thread(proc, thread);
 	}
@@ -2899,10 +3587,12 @@ static void binder_deferred_release(struct binder_proc *proc)
 
 		nodes++;
 		rb_erase(&node->rb_node, &proc->nodes);
+		spin_lock(&proc->inner_lock);
 		list_del_init(&node->work.entry);
+		spin_unlock(&proc->inner_lock);
 		if (hlist_empty(&node->refs)) {
 			kfree(node);
-			binder_stats.obj_deleted[BINDER_STAT_NODE]++;
+			binder_stats_deleted(BINDER_STAT_NODE);
 		} else {
 			struct binder_ref *ref;
 			int death = 0;
@@ -2916,12 +3606,14 @@ static void binder_deferred_release(struct binder_proc *proc)
 				incoming_refs++;
 				if (ref->death) {
 					death++;
+					spin_lock(&ref->proc->inner_lock);
 					if (list_empty(&ref->death->work.entry)) {
 						ref->death->work.type = BINDER_WORK_DEAD_BINDER;
 						list_add_tail(&ref->death->work.entry, &ref->proc->todo);
 						wake_up_interruptible(&ref->proc->wait);
 					} else
 						BUG();
+					spin_unlock(&ref->proc->inner_lock);
 				}
 			}
 			if (binder_debug_mask & BINDER_DEBUG_DEAD_BINDER)
@@ -2934,9 +3626,29 @@ static void binder_deferred_release(struct binder_proc *proc)
 		outgoing_refs++;
 		binder_delete_ref(ref);
 	}
-	binder_release_work(&proc->todo);
-	buffers = 0;
+	binder_release_work(proc, &proc->todo);
 
+	if (binder_debug_mask & BINDER_DEBUG_OPEN_CLOSE)
+		printk(KERN_INFO "binder_release: %d threads %d, nodes %d (ref %d), refs %d, active transactions %d\n",
+		       proc->pid, threads, nodes, incoming_refs, outgoing_refs, active_transactions);
+
+	proc->is_dead = 1;
+	if (proc->tmp_ref == 0)
+		binder_free_proc(proc);
+}
+
+/*
+ * Called with binder_refs_lock held once the proc is dead and no
+ * transaction in flight holds a temporary reference on it any more,
+ * so nobody can be copying into its buffers.
+ */
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct binder_transaction *t;
+	struct rb_node *n;
+	int buffers, page_count;
+
+	buffers = 0;
 	while ((n = rb_first(&proc->allocated_buffers))) {
 		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer, rb_node);
 		t = buffer->transaction;
@@ -2950,11 +3662,25 @@ static void binder_deferred_release(struct binder_proc *proc)
 		buffers++;
 	}
 
-	binder_stats.obj_deleted[BINDER_STAT_PROC]++;
+	binder_stats_deleted(BINDER_STAT_PROC);
 
 	page_count = 0;
 	if (proc->pages) {
 		int i;
+
+		/* waits for binder_shrink if it is freeing one of our pages */
+		mutex_lock(&proc->alloc_lock);
+		spin_lock(&binder_lru_lock);
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+			if (!list_empty(&proc->lru_pages[i].lru)) {
+				list_del_init(&proc->lru_pages[i].lru);
+				binder_lru_count--;
+			}
+		}
+		proc->lru_page_count = 0;
+		spin_unlock(&binder_lru_lock);
+		mutex_unlock(&proc->alloc_lock);
+
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
 			if (proc->pages[i]) {
 				if (binder_debug_mask & BINDER_DEBUG_BUFFER_ALLOC)
@@ -2963,6 +3689,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 				page_count++;
 			}
 		}
+		kfree(proc->lru_pages);
 		kfree(proc->pages);
 		vfree(proc->buffer);
 	}
@@ -2970,12 +3697,19 @@ static void binder_deferred_release(struct binder_proc *proc)
 	put_task_struct(proc->tsk);
 
 	if (binder_debug_mask & BINDER_DEBUG_OPEN_CLOSE)
-		printk(KERN_INFO "binder_release: %d threads %d, nodes %d (ref %d), refs %d, active transactions %d, buffers %d, pages %d\n",
-		       proc->pid, threads, nodes, incoming_refs, outgoing_refs, active_transactions, buffers, page_count);
+		printk(KERN_INFO "binder_release: %d buffers %d, pages %d\n",
+		       proc->pid, buffers, page_count);
 
 	kfree(proc);
 }
 
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	proc->tmp_ref--;
+	if (proc->is_dead && proc->tmp_ref == 0)
+		binder_free_proc(proc);
+}
+
 static void binder_deferred_func(struct work_struct *work)
 {
 	struct binder_proc *proc;
@@ -2983,7 +3717,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		mutex_lock(&binder_refs_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3008,7 +3742,7 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 	
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_refs_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3278,18 +4012,20 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix, struct
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) != ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+		if (temp)
 			buf += snprintf(buf, end - buf, "%s%s: %d\n", prefix,
-					binder_command_strings[i], stats->bc[i]);
+					binder_command_strings[i], temp);
 		if (buf >= end)
 			return buf;
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) != ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+		if (temp)
 			buf += snprintf(buf, end - buf, "%s%s: %d\n", prefix,
-					binder_return_strings[i], stats->br[i]);
+					binder_return_strings[i], temp);
 		if (buf >= end)
 			return buf;
 	}
@@ -3297,11 +4033,12 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix, struct
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) != ARRAY_SIZE(binder_objstat_strings));
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) != ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+		if (created || deleted)
 			buf += snprintf(buf, end - buf, "%s%s: active %d total %d\n", prefix,
 					binder_objstat_strings[i],
-					stats->obj_created[i] - stats->obj_deleted[i],
-					stats->obj_created[i]);
+					created - deleted, created);
 		if (buf >= end)
 			return buf;
 	}
@@ -3355,6 +4092,10 @@ static char *print_binder_proc_stats(char *buf, char *end, struct binder_proc *p
 	buf += snprintf(buf, end - buf, "  buffers: %d\n", count);
 	if (buf >= end)
 		return buf;
+	buf += snprintf(buf, end - buf, "  pages: %d hot, %d lru\n",
+			proc->hot_pages, proc->lru_page_count);
+	if (buf >= end)
+		return buf;
 
 	count = 0;
 	list_for_each_entry(w, &proc->todo, entry) {
@@ -3376,6 +4117,22 @@ static char *print_binder_proc_stats(char *buf, char *end, struct binder_proc *p
 }
 
 
+/*
+ * The proc files take binder_refs_lock and then both per-proc locks of
+ * the proc being printed, so the whole state is seen consistently.
+ */
+static void binder_lock_proc_state(struct binder_proc *proc)
+{
+	mutex_lock(&proc->alloc_lock);
+	spin_lock(&proc->inner_lock);
+}
+
+static void binder_unlock_proc_state(struct binder_proc *proc)
+{
+	spin_unlock(&proc->inner_lock);
+	mutex_unlock(&proc->alloc_lock);
+}
+
 static int binder_read_proc_state(
 	char *page, char **start, off_t off, int count, int *eof, void *data)
 {
@@ -3391,7 +4148,7 @@ static int binder_read_proc_state(
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		mutex_lock(&binder_refs_lock);
 
 	buf += snprintf(buf, end - buf, "binder state:\n");
 
@@ -3406,10 +4163,14 @@ static int binder_read_proc_state(
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
 		if (buf >= end)
 			break;
+		if (do_lock)
+			binder_lock_proc_state(proc);
 		buf = print_binder_proc(buf, end, proc, 1);
+		if (do_lock)
+			binder_unlock_proc_state(proc);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_refs_lock);
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -3437,7 +4198,7 @@ static int binder_read_proc_stats(
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		mutex_lock(&binder_refs_lock);
 
 	p += snprintf(p, PAGE_SIZE, "binder stats:\n");
 
@@ -3446,10 +4207,14 @@ static int binder_read_proc_stats(
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
 		if (p >= page + PAGE_SIZE)
 			break;
+		if (do_lock)
+			binder_lock_proc_state(proc);
 		p = print_binder_proc_stats(p, page + PAGE_SIZE, proc);
+		if (do_lock)
+			binder_unlock_proc_state(proc);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_refs_lock);
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
 
@@ -3478,16 +4243,20 @@ static int binder_read_proc_transactions(
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		mutex_lock(&binder_refs_lock);
 
 	buf += snprintf(buf, end - buf, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
 		if (buf >= end)
 			break;
+		if (do_lock)
+			binder_lock_proc_state(proc);
 		buf = print_binder_proc(buf, end, proc, 0);
+		if (do_lock)
+			binder_unlock_proc_state(proc);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_refs_lock);
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -3514,11 +4283,15 @@ static int binder_read_proc_proc(
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		mutex_lock(&binder_refs_lock);
 	p += snprintf(p, PAGE_SIZE, "binder proc state:\n");
+	if (do_lock)
+		binder_lock_proc_state(proc);
 	p = print_binder_proc(p, page + PAGE_SIZE, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock_proc_state(proc);
+	if (do_lock)
+		mutex_unlock(&binder_refs_lock);
 
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
@@ -3595,6 +4368,66 @@ static struct miscdevice binder_miscdev = {
 	.fops = &binder_fops
 };
 
+static void binder_print_latency(struct seq_file *m, const char *prefix,
+	struct binder_latency_hist *hist)
+{
+	int i;
+
+	seq_printf(m, "%s", prefix);
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+		seq_printf(m, " %d", atomic_read(&hist->count[i]));
+	seq_printf(m, "\n");
+}
+
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	struct rb_node *n;
+	int i;
+
+	seq_printf(m, "binder latency, bucket limits in us:");
+	for (i = 0; i < BINDER_LATENCY_BUCKETS - 1; i++)
+		seq_printf(m, " %d", 1 << (BINDER_LATENCY_SHIFT + i));
+	seq_printf(m, " inf\n");
+
+	mutex_lock(&binder_refs_lock);
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (binder_latency_empty(&proc->deliver_hist) &&
+		    binder_latency_empty(&proc->reply_hist))
+			continue;
+		seq_printf(m, "proc %d\n", proc->pid);
+		binder_print_latency(m, "  deliver:", &proc->deliver_hist);
+		binder_print_latency(m, "  reply:", &proc->reply_hist);
+		for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
+			struct binder_node *node = rb_entry(n, struct binder_node, rb_node);
+
+			if (binder_latency_empty(&node->deliver_hist) &&
+			    binder_latency_empty(&node->reply_hist))
+				continue;
+			seq_printf(m, "  node %d: u%p c%p\n", node->debug_id,
+				   node->ptr, node->cookie);
+			binder_print_latency(m, "    deliver:", &node->deliver_hist);
+			binder_print_latency(m, "    reply:", &node->reply_hist);
+		}
+	}
+	mutex_unlock(&binder_refs_lock);
+	return 0;
+}
+
+static int binder_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, binder_latency_show, inode->i_private);
+}
+
+static const struct file_operations binder_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = binder_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static int __init binder_init(void)
 {
 	int ret;
@@ -3603,6 +4436,13 @@ static int __init binder_init(void)
 	if (binder_proc_dir_entry_root)
 		binder_proc_dir_entry_proc = proc_mkdir("proc", binder_proc_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	if (ret == 0)
+		register_shrinker(&binder_shrinker);
+	binder_debugfs_dir_entry_root = debugfs_create_dir("binder", NULL);
+	if (binder_debugfs_dir_entry_root)
+		debugfs_create_file("latency", S_IRUGO,
+				    binder_debugfs_dir_entry_root, NULL,
+				    &binder_latency_fops);
 	if (binder_proc_dir_entry_root) {
 		create_proc_read_entry("state", S_IRUGO, binder_proc_dir_entry_root, binder_read_proc_state, NULL);
 		create_proc_read_entry("stats", S_IRUGO, binder_proc_dir_entry_root, binder_read_proc_stats, NULL);
@@ -20,9 +20,13 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/time.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -32,15 +36,24 @@
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * spinlock 'lock'.
+ *
+ * Writers only hold the lock long enough to reserve room for their entry; the
+ * payload is copied in with the lock dropped, so any number of writers can be
+ * filling their entries at once. A reserved entry becomes visible to readers
+ * once it and every entry reserved before it have been completed, at which
+ * point 'commit' moves past it. Readers never read beyond 'commit'.
  */
 struct logger_log {
 	unsigned char *		buffer;	/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
+	wait_queue_head_t	wwq;	/* wait queue for writers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	struct list_head	writers; /* writes in flight, oldest first */
+	spinlock_t		lock;	/* lock protecting the offsets */
 	size_t			w_off;	/* current write head offset */
+	size_t			commit;	/* readers may read up to here */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
 };
@@ -49,12 +62,32 @@ struct logger_log {
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock, except for
+ * 'buf', which is protected by 'mutex'. Threads sharing the file descriptor
+ * take 'mutex' across the whole read, so that one cannot overwrite the bounce
+ * buffer while another is still copying it out.
  */
 struct logger_reader {
 	struct logger_log *	log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
+	struct mutex		mutex;	/* serializes read() */
 	size_t			r_off;	/* current read head offset */
+	int			batch;	/* read() returns many entries */
+	int			lapped;	/* r_off was pulled forward */
+	size_t			moved;	/* bytes r_off was moved by others */
+	unsigned char		buf[LOGGER_ENTRY_MAX_LEN]; /* bounce buffer */
+};
+
+/*
+ * struct logger_write - a write in flight
+ *
+ * Lives on the writer's stack from reservation until the entry is complete.
+ * Protected by log->lock.
+ */
+struct logger_write {
+	struct list_head	list;	/* entry in logger_log's writers */
+	size_t			start;	/* offset of the reserved entry */
+	size_t			off;	/* offset the payload is copied to */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -87,7 +120,7 @@ static inline struct logger_log * file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -106,15 +139,16 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log - reads exactly 'count' bytes from 'log' into the reader's
+ * bounce buffer, so that the copy out to user-space can be done without
+ * holding log->lock. Returns 'count'. The entries are only consumed, by
+ * commit_read(), once they have reached user-space.
  *
- * Caller must hold log->mutex.
+ * Caller must hold reader->mutex and log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static ssize_t do_read_log(struct logger_log *log,
+			   struct logger_reader *reader,
+			   size_t count)
 {
 	size_t len;
 
@@ -124,22 +158,93 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the log, whichever comes first.
 	 */
 	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
-		return -EFAULT;
+	memcpy(reader->buf, log->buffer + reader->r_off, len);
 
 	/*
 	 * Second, we read any remaining bytes, starting back at the head of
 	 * the log.
 	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
-
-	reader->r_off = logger_offset(reader->r_off + count);
+		memcpy(reader->buf + len, log->buffer, count - len);
 
 	return count;
 }
 
+/*
+ * move_reader - move 'reader' forward to 'off' on behalf of someone other
+ * than its read(), i.e. a lapping writer, a flush or an mmap reader.
+ *
+ * Caller must hold log->lock.
+ */
+static void move_reader(struct logger_log *log, struct logger_reader *reader,
+			size_t off)
+{
+	reader->moved += logger_offset(off - reader->r_off);
+	reader->r_off = off;
+}
+
+/*
+ * commit_read - consume the 'count' bytes that were read at 'start' and have
+ * now been copied out to user-space. 'moved' is reader->moved as it was at
+ * the time of the read. If the reader was moved forward meanwhile, but not
+ * past these entries, it still ends up just after them.
+ *
+ * Caller must hold reader->mutex and log->lock.
+ */
+static void commit_read(struct logger_log *log, struct logger_reader *reader,
+			size_t start, size_t moved, size_t count)
+{
+	if (reader->moved - moved < count)
+		reader->r_off = logger_offset(start + count);
+}
+
+/*
+ * logger_read_batch - fills 'buf' with as many complete entries as fit in
+ * 'count' bytes, a bounce buffer at a time. Returns the number of bytes read.
+ *
+ * Caller must hold reader->mutex and log->lock; log->lock is dropped on
+ * return. The first entry must be known to fit.
+ */
+static ssize_t logger_read_batch(struct logger_log *log,
+				 struct logger_reader *reader,
+				 char __user *buf, size_t count)
+{
+	ssize_t ret = 0;
+
+	while (1) {
+		size_t room = min_t(size_t, count - ret, LOGGER_ENTRY_MAX_LEN);
+		size_t start = reader->r_off;
+		size_t moved = reader->moved;
+		size_t off = start;
+		size_t n = 0;
+
+		while (off != log->commit) {
+			size_t len = get_entry_len(log, off);
+
+			if (n + len > room)
+				break;
+			n += len;
+			off = logger_offset(off + len);
+		}
+		if (!n)
+			break;
+
+		do_read_log(log, reader, n);
+		spin_unlock(&log->lock);
+
+		if (copy_to_user(buf + ret, reader->buf, n))
+			return ret ? ret : -EFAULT;
+		ret += n;
+
+		spin_lock(&log->lock);
+		commit_read(log, reader, start, moved, n);
+	}
+
+	spin_unlock(&log->lock);
+
+	return ret;
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -147,16 +252,19 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or in batch mode (see
+ * 	  LOGGER_SET_BATCH_READ) as many complete entries as fit
  *
- * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * Optimal read size is LOGGER_ENTRY_MAX_LEN, or as large as possible in batch
+ * mode. Will set errno to EINVAL if read buffer is insufficient to hold next
+ * entry.
  */
 static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	size_t start, moved;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -164,9 +272,9 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		ret = (log->commit == reader->r_off);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -187,27 +295,53 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	if (unlikely(log->commit == reader->r_off)) {
+		spin_unlock(&log->lock);
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
 	/* get the size of the next entry */
 	ret = get_entry_len(log, reader->r_off);
 	if (count < ret) {
+		spin_unlock(&log->lock);
 		ret = -EINVAL;
 		goto out;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (reader->batch) {
+		ret = logger_read_batch(log, reader, buf, count);
+		goto out;
+	}
 
-out:
-	mutex_unlock(&log->mutex);
+	/*
+	 * Get exactly one entry from the log. It is copied out of the ring
+	 * under the lock, so writers lapping us cannot tear it, and then on to
+	 * user-space with the lock dropped, so a faulting reader does not hold
+	 * up writers. It is only consumed once it has got there, so a fault
+	 * leaves it to be read again.
+	 */
+	start = reader->r_off;
+	moved = reader->moved;
+	ret = do_read_log(log, reader, ret);
+
+	spin_unlock(&log->lock);
+
+	if (copy_to_user(buf, reader->buf, ret)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	spin_lock(&log->lock);
+	commit_read(log, reader, start, moved, ret);
+	spin_unlock(&log->lock);
 
+out:
+	mutex_unlock(&reader->mutex);
 	return ret;
 }
 
@@ -215,7 +349,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -253,7 +387,7 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -265,55 +399,160 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 		log->head = get_next_entry(log, log->head, len);
 
 	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+		if (clock_interval(old, new, reader->r_off)) {
+			move_reader(log, reader,
+				    get_next_entry(log, reader->r_off, len));
+			reader->lapped = 1;
+		}
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * write_fits - can an entry of 'len' bytes be reserved without wrapping onto
+ * the oldest write still in flight?
  *
- * The caller needs to hold log->mutex.
+ * We keep a further LOGGER_ENTRY_MAX_LEN bytes clear of it, as that is as far
+ * as fix_up_readers() may walk past the end of the new entry. A writer only
+ * ever has to wait here if another one stalls while most of the log is
+ * written around it.
+ *
+ * The caller needs to hold log->lock.
+ */
+static int write_fits(struct logger_log *log, size_t len)
+{
+	struct logger_write *w;
+
+	if (list_empty(&log->writers))
+		return 1;
+
+	w = list_first_entry(&log->writers, struct logger_write, list);
+	return logger_offset(log->w_off - w->start) + len +
+		LOGGER_ENTRY_MAX_LEN <= log->size;
+}
+
+/*
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at offset 'off'
+ *
+ * The caller needs to own the range, either by holding log->lock or by
+ * having reserved it.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t off, const void *buf,
+			 size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_write_log_user - writes 'count' bytes from the user-space buffer 'buf'
+ * to the log 'log' at offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to have reserved the range; log->lock is not held, as
+ * the copy may fault.
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
+/*
+ * do_clear_log - zeroes 'count' bytes of 'log' at offset 'off'
+ *
+ * The caller needs to have reserved the range.
+ */
+static void do_clear_log(struct logger_log *log, size_t off, size_t count)
+{
+	size_t len;
+
+	len = min(count, log->size - off);
+	memset(log->buffer + off, 0, len);
+
+	if (count != len)
+		memset(log->buffer, 0, count - len);
+}
+
+/*
+ * reserve_write - reserve room for an entry of 'len' bytes, fixing up any
+ * readers it laps, and write its header. The entry is not readable until
+ * it is passed to commit_write().
+ */
+static void reserve_write(struct logger_log *log, struct logger_write *w,
+			  struct logger_entry *header, size_t len)
+{
+	DEFINE_WAIT(wait);
+
+	spin_lock(&log->lock);
+	while (unlikely(!write_fits(log, len))) {
+		prepare_to_wait(&log->wwq, &wait, TASK_UNINTERRUPTIBLE);
+		spin_unlock(&log->lock);
+		schedule();
+		spin_lock(&log->lock);
+	}
+	finish_wait(&log->wwq, &wait);
+
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new write offset. We do this now
+	 * because once the lock is dropped other writers may already be
+	 * clobbering the entries after ours.
+	 */
+	fix_up_readers(log, len);
+
+	w->start = log->w_off;
+	w->off = logger_offset(w->start + sizeof(struct logger_entry));
+	list_add_tail(&w->list, &log->writers);
+	log->w_off = logger_offset(log->w_off + len);
+
+	do_write_log(log, w->start, header, sizeof(struct logger_entry));
+
+	spin_unlock(&log->lock);
+}
+
+/*
+ * commit_write - mark the write 'w' complete, making it and any completed
+ * writes behind it readable once all earlier writes are complete as well.
+ */
+static void commit_write(struct logger_log *log, struct logger_write *w)
+{
+	int oldest;
+
+	spin_lock(&log->lock);
+	oldest = (log->writers.next == &w->list);
+	list_del(&w->list);
+	if (oldest) {
+		if (list_empty(&log->writers))
+			log->commit = log->w_off;
+		else
+			log->commit = list_first_entry(&log->writers,
+					struct logger_write, list)->start;
+	}
+	spin_unlock(&log->lock);
+
+	if (oldest) {
+		/* wake up any blocked readers and writers */
+		wake_up_interruptible(&log->wq);
+		if (waitqueue_active(&log->wwq))
+			wake_up(&log->wwq);
+	}
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -323,7 +562,7 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	struct logger_write w;
 	struct logger_entry header;
 	struct timespec now;
 	ssize_t ret = 0;
@@ -340,17 +579,8 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	reserve_write(log, &w, &header,
+		      sizeof(struct logger_entry) + header.len);
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -360,21 +590,24 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, w.off, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			/*
+			 * Other writers may already own the space after
+			 * ours, so the entry cannot be taken back. Blank
+			 * out the rest of it instead.
+			 */
+			do_clear_log(log, w.off, header.len - ret);
+			ret = nr;
+			break;
 		}
 
+		w.off = logger_offset(w.off + nr);
 		iov++;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	commit_write(log, &w);
 
 	return ret;
 }
@@ -407,12 +640,16 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
+		reader->batch = 0;
+		reader->lapped = 0;
+		reader->moved = 0;
 		INIT_LIST_HEAD(&reader->list);
+		mutex_init(&reader->mutex);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -430,7 +667,11 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
 		kfree(reader);
 	}
 
@@ -460,21 +701,103 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	if (log->commit != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the ring buffer read-only into the reader's address space. The reader
+ * finds its position with LOGGER_GET_READ_OFF and the readable length with
+ * LOGGER_GET_LOG_LEN, parses the entries in place and then consumes them with
+ * LOGGER_ADVANCE_READ. Writers may lap a slow reader and overwrite what it is
+ * parsing; LOGGER_ADVANCE_READ then fails with EOVERFLOW and the entries seen
+ * since LOGGER_GET_READ_OFF must be discarded.
+ *
+ * The mapping may be up to twice the size of the log, in which case the
+ * second half maps the log again. An entry that wraps at the end of the ring
+ * can then be parsed in place, as it continues straight into the second copy.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long addr;
+	size_t off = 0;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	if (vma->vm_pgoff || size > 2 * log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_RESERVED;
+
+	for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE) {
+		struct page *page = vmalloc_to_page(log->buffer + off);
+		int ret;
+
+		ret = vm_insert_page(vma, addr, page);
+		if (ret)
+			return ret;
+		off = logger_offset(off + PAGE_SIZE);
+	}
+
+	return 0;
+}
+
+/*
+ * advance_reader - consume 'count' bytes of entries on behalf of an mmap
+ * reader. 'count' must end on an entry boundary at or before log->commit.
+ *
+ * Caller must hold log->lock.
+ */
+static long advance_reader(struct logger_log *log,
+			   struct logger_reader *reader, size_t count)
+{
+	size_t off = reader->r_off;
+	size_t n = 0;
+
+	if (reader->lapped) {
+		reader->lapped = 0;
+		return -EOVERFLOW;
+	}
+
+	while (n < count) {
+		size_t len;
+
+		if (off == log->commit)
+			return -EINVAL;
+		len = get_entry_len(log, off);
+		off = logger_offset(off + len);
+		n += len;
+	}
+	if (n != count)
+		return -EINVAL;
+
+	move_reader(log, reader, off);
+
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -486,10 +809,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
+		if (log->commit >= reader->r_off)
+			ret = log->commit - reader->r_off;
 		else
-			ret = (log->size - reader->r_off) + log->w_off;
+			ret = (log->size - reader->r_off) + log->commit;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -497,7 +820,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
+		if (log->commit != reader->r_off)
 			ret = get_entry_len(log, reader->r_off);
 		else
 			ret = 0;
@@ -508,13 +831,38 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+			move_reader(log, reader, log->commit);
+		log->head = log->commit;
+		ret = 0;
+		break;
+	case LOGGER_GET_READ_OFF:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->lapped = 0;
+		ret = reader->r_off;
+		break;
+	case LOGGER_ADVANCE_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		ret = advance_reader(log, file->private_data, arg);
+		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -524,6 +872,7 @@ static struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -533,12 +882,13 @@ static struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * LONG_MAX minus LOGGER_ENTRY_MAX_LEN. The buffer itself is allocated by
+ * init_log() with vmalloc_user(), so that readers can map it whether or not
+ * the driver is built as a module.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
+	.buffer = NULL, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -546,9 +896,12 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
+	.wwq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wwq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.writers = LIST_HEAD_INIT(VAR .writers), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.commit = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -572,10 +925,19 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->buffer = vmalloc_user(log->size);
+	if (unlikely(!log->buffer)) {
+		printk(KERN_ERR "logger: failed to allocate buffer "
+		       "for log '%s'!\n", log->misc.name);
+		return -ENOMEM;
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		vfree(log->buffer);
+		log->buffer = NULL;
 		return ret;
 	}
 
@@ -44,5 +44,8 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_GET_READ_OFF		_IO(__LOGGERIO, 5) /* mmap read offset */
+#define LOGGER_ADVANCE_READ		_IO(__LOGGERIO, 6) /* consume mmap'd */
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 7) /* multi-entry read */
 
 #endif /* _LINUX_LOGGER_H */
@@ -18,6 +18,14 @@
 #include <linux/mm.h>
 #include <linux/oom.h>
 #include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+#include <linux/swap.h>
 
 static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask);
 
@@ -41,12 +49,288 @@ static size_t lowmem_minfree[6] = {
 };
 static int lowmem_minfree_size = 4;
 
+/*
+ * Every process is kept on the bucket for its oomkilladj, so victim selection
+ * only looks at the buckets at or above the adj being killed rather than at
+ * every task. The buckets are filled in once at init time and then kept up to
+ * date by lowmem_task_add/del/adj, called from fork, exit, exec and writes to
+ * /proc/<pid>/oom_adj. All of it is protected by lowmem_lock, which nests
+ * inside tasklist_lock. tasklist_lock is read-locked from interrupts, and
+ * fork and exit take lowmem_lock under write_lock_irq(&tasklist_lock), so
+ * lowmem_lock must always be taken with interrupts disabled.
+ */
+#define LOWMEM_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+static struct list_head lowmem_buckets[LOWMEM_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_lock);
+static int lowmem_ready;
+
+/* the last task we killed and when, to measure how long it takes to die */
+static struct task_struct *lowmem_victim;
+static ktime_t lowmem_victim_time;
+
+/* statistics, exported read-only for tuning the adj/minfree tables */
+static unsigned int lowmem_kills[6];	/* kills per adj/minfree level */
+static int lowmem_kills_size = 6;
+static unsigned int lowmem_select_us_max;	/* victim selection time */
+static unsigned int lowmem_select_us_last;
+static unsigned int lowmem_death_us_max;	/* SIGKILL to exit time */
+static unsigned int lowmem_death_us_last;
+
+/*
+ * Memory pressure notification. /dev/lowmem_notify reports how many of the
+ * notify_minfree levels free and file pages are both below, from 0 (none)
+ * up to the size of that table, so userspace can release memory before we
+ * have to kill. The notify_minfree levels sit above the minfree ones, so a
+ * level is reported before the killer acts on the matching minfree level.
+ * A level only relaxes once the pages are 'notify_hysteresis' pages clear
+ * of its value, and readers are woken at most once every 'notify_ms'
+ * milliseconds.
+ *
+ * The level is never computed from direct reclaim, where it would come too
+ * late: lowmem_notify_work polls it every 'notify_ms' while the device is
+ * open, on a deferrable timer so an idle system is not woken for it, and
+ * kswapd checks it whenever it calls our shrinker.
+ */
+static size_t lowmem_notify_minfree[6] = {
+	4*512, // 8MB
+	3*1024, // 12MB
+	6*1024, // 24MB
+	20*1024, // 80MB
+};
+static int lowmem_notify_minfree_size = 4;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_notify_wq);
+static DEFINE_SPINLOCK(lowmem_notify_lock);
+static int lowmem_notify_level;		/* level last reported */
+static unsigned long lowmem_notify_time;	/* when, in jiffies */
+static atomic_t lowmem_notify_users = ATOMIC_INIT(0);
+static unsigned int lowmem_notify_ms = 200;
+static unsigned int lowmem_notify_hysteresis = 256;
+
+static struct delayed_work lowmem_notify_work;
+
 #define lowmem_print(level, x...) do { if(lowmem_debug_level >= (level)) printk(x); } while(0)
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
 module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size, S_IRUGO | S_IWUSR);
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size, S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_array_named(kills, lowmem_kills, uint, &lowmem_kills_size, S_IRUGO);
+module_param_named(select_us_max, lowmem_select_us_max, uint, S_IRUGO);
+module_param_named(select_us_last, lowmem_select_us_last, uint, S_IRUGO);
+module_param_named(death_us_max, lowmem_death_us_max, uint, S_IRUGO);
+module_param_named(death_us_last, lowmem_death_us_last, uint, S_IRUGO);
+module_param_named(notify_ms, lowmem_notify_ms, uint, S_IRUGO | S_IWUSR);
+module_param_named(notify_hysteresis, lowmem_notify_hysteresis, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_array_named(notify_minfree, lowmem_notify_minfree, uint,
+			 &lowmem_notify_minfree_size, S_IRUGO | S_IWUSR);
+
+static inline struct list_head *lowmem_bucket(int adj)
+{
+	return &lowmem_buckets[adj - OOM_DISABLE];
+}
+
+/*
+ * lowmem_task_add - called for every new task once it is on the task list,
+ * and for a thread taking over as group leader in exec. Only group leaders
+ * are put on a bucket.
+ */
+void lowmem_task_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	INIT_LIST_HEAD(&p->lowmem_node);
+	if (!thread_group_leader(p))
+		return;
+
+	spin_lock_irqsave(&lowmem_lock, flags);
+	if (lowmem_ready)
+		list_add_tail(&p->lowmem_node, lowmem_bucket(p->oomkilladj));
+	spin_unlock_irqrestore(&lowmem_lock, flags);
+}
+
+/* lowmem_task_del - called for every task leaving the task list */
+void lowmem_task_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_lock, flags);
+	if (!list_empty(&p->lowmem_node))
+		list_del_init(&p->lowmem_node);
+	if (p == lowmem_victim) {
+		s64 us = ktime_to_us(ktime_sub(ktime_get(), lowmem_victim_time));
+
+		lowmem_death_us_last = us;
+		if (us > lowmem_death_us_max)
+			lowmem_death_us_max = us;
+		lowmem_victim = NULL;
+	}
+	spin_unlock_irqrestore(&lowmem_lock, flags);
+}
+
+/* lowmem_task_adj - called after p->oomkilladj has changed */
+void lowmem_task_adj(struct task_struct *p)
+{
+	if (!thread_group_leader(p))
+		return;
+
+	spin_lock_irq(&lowmem_lock);
+	if (!list_empty(&p->lowmem_node))
+		list_move_tail(&p->lowmem_node, lowmem_bucket(p->oomkilladj));
+	spin_unlock_irq(&lowmem_lock);
+}
+
+static int lowmem_array_size(void)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	if(lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if(lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	return array_size;
+}
+
+/*
+ * lowmem_pressure - returns the number of notify_minfree levels that free
+ * and file pages are both below. Levels at or under the current 'level' must
+ * be cleared by lowmem_notify_hysteresis pages before they count as left.
+ */
+static int lowmem_pressure(int other_free, int other_file, int level)
+{
+	int array_size = lowmem_notify_minfree_size;
+	int i;
+
+	for(i = 0; i < array_size; i++) {
+		int minfree = lowmem_notify_minfree[i];
+
+		if (array_size - i <= level)
+			minfree += lowmem_notify_hysteresis;
+		if (other_free < minfree && other_file < minfree)
+			return array_size - i;
+	}
+	return 0;
+}
+
+static void lowmem_notify_check(void)
+{
+	unsigned long interval = msecs_to_jiffies(lowmem_notify_ms);
+	int other_free = global_page_state(NR_FREE_PAGES);
+	int other_file = global_page_state(NR_FILE_PAGES);
+	int level;
+	int wake = 0;
+
+	spin_lock(&lowmem_notify_lock);
+	level = lowmem_pressure(other_free, other_file, lowmem_notify_level);
+	/*
+	 * A change held back here is picked up by the next poll. The range
+	 * check, unlike a plain time_before(), stays right however long it
+	 * has been since the last change.
+	 */
+	if (level != lowmem_notify_level &&
+	    !time_in_range_open(jiffies, lowmem_notify_time,
+				lowmem_notify_time + interval)) {
+		lowmem_print(3, "lowmem_notify level %d -> %d, ofree %d %d\n",
+		             lowmem_notify_level, level, other_free, other_file);
+		lowmem_notify_level = level;
+		lowmem_notify_time = jiffies;
+		wake = 1;
+	}
+	spin_unlock(&lowmem_notify_lock);
+
+	if (wake)
+		wake_up_interruptible(&lowmem_notify_wq);
+}
+
+static void lowmem_notify_work_fn(struct work_struct *work)
+{
+	lowmem_notify_check();
+	if (atomic_read(&lowmem_notify_users))
+		schedule_delayed_work(&lowmem_notify_work,
+				      msecs_to_jiffies(lowmem_notify_ms));
+}
+
+static int lowmem_notify_open(struct inode *inode, struct file *file)
+{
+	int ret;
+
+	ret = nonseekable_open(inode, file);
+	if (ret)
+		return ret;
+
+	/* the first read returns the current level */
+	file->private_data = (void *)-1L;
+	lowmem_notify_check();
+	if (atomic_inc_return(&lowmem_notify_users) == 1)
+		schedule_delayed_work(&lowmem_notify_work,
+				      msecs_to_jiffies(lowmem_notify_ms));
+	return 0;
+}
+
+static int lowmem_notify_release(struct inode *inode, struct file *file)
+{
+	atomic_dec(&lowmem_notify_users);
+	return 0;
+}
+
+static inline int lowmem_notify_changed(struct file *file)
+{
+	return (long)file->private_data != lowmem_notify_level;
+}
+
+/*
+ * lowmem_notify_read - blocks until the level differs from the one this file
+ * last read, then returns it as a decimal string
+ */
+static ssize_t lowmem_notify_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *pos)
+{
+	char tmp[16];
+	int level;
+	int len;
+	int ret;
+
+	if (file->f_flags & O_NONBLOCK) {
+		if (!lowmem_notify_changed(file))
+			return -EAGAIN;
+	} else {
+		ret = wait_event_interruptible(lowmem_notify_wq,
+					       lowmem_notify_changed(file));
+		if (ret)
+			return ret;
+	}
+
+	level = lowmem_notify_level;
+	len = snprintf(tmp, sizeof(tmp), "%d\n", level);
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, tmp, len))
+		return -EFAULT;
+	file->private_data = (void *)(long)level;
+	return len;
+}
+
+static unsigned int lowmem_notify_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &lowmem_notify_wq, wait);
+	if (lowmem_notify_changed(file))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations lowmem_notify_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_notify_open,
+	.release = lowmem_notify_release,
+	.read = lowmem_notify_read,
+	.poll = lowmem_notify_poll,
+};
+
+static struct miscdevice lowmem_notify_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmem_notify",
+	.fops = &lowmem_notify_fops,
+};
 
 static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
@@ -55,19 +339,22 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	int rem = 0;
 	int tasksize;
 	int i;
+	int adj;
+	int level = 0;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
-	int array_size = ARRAY_SIZE(lowmem_adj);
+	ktime_t start;
+	unsigned int us;
+	int array_size = lowmem_array_size();
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES);
-	if(lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if(lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
+	if (current_is_kswapd())
+		lowmem_notify_check();
 	for(i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
 			min_adj = lowmem_adj[i];
+			level = i;
 			break;
 		}
 	}
@@ -82,39 +369,81 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 		return rem;
 	}
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		if (p->oomkilladj < min_adj || !p->mm)
-			continue;
-		tasksize = get_mm_rss(p->mm);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (p->oomkilladj < selected->oomkilladj)
+	if (min_adj < OOM_DISABLE)
+		min_adj = OOM_DISABLE;
+
+	/*
+	 * Take the largest task from the highest non-empty bucket. Tasks that
+	 * are already dying are skipped, so we do not pick the same victim
+	 * over and over while it exits.
+	 */
+	start = ktime_get();
+	spin_lock_irq(&lowmem_lock);
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj && !selected; adj--) {
+		list_for_each_entry(p, lowmem_bucket(adj), lowmem_node) {
+			if (!p->mm || fatal_signal_pending(p) ||
+			    test_tsk_thread_flag(p, TIF_MEMDIE))
 				continue;
-			if (p->oomkilladj == selected->oomkilladj &&
-			    tasksize <= selected_tasksize)
+			tasksize = get_mm_rss(p->mm);
+			if (tasksize <= 0)
 				continue;
+			if (selected && tasksize <= selected_tasksize)
+				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+			             p->pid, p->comm, p->oomkilladj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-		             p->pid, p->comm, p->oomkilladj, tasksize);
 	}
+	if(selected != NULL) {
+		get_task_struct(selected);
+		lowmem_victim = selected;
+		lowmem_victim_time = ktime_get();
+		lowmem_kills[level]++;
+	}
+	spin_unlock_irq(&lowmem_lock);
+
+	us = ktime_to_us(ktime_sub(ktime_get(), start));
+	lowmem_select_us_last = us;
+	if (us > lowmem_select_us_max)
+		lowmem_select_us_max = us;
+
 	if(selected != NULL) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 		             selected->pid, selected->comm,
 		             selected->oomkilladj, selected_tasksize);
 		force_sig(SIGKILL, selected);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
 	}
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n", nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int ret;
+	int i;
+
+	/* the first change after boot is reported straight away */
+	lowmem_notify_time = jiffies - msecs_to_jiffies(lowmem_notify_ms);
+	INIT_DELAYED_WORK_DEFERRABLE(&lowmem_notify_work,
+				     lowmem_notify_work_fn);
+	ret = misc_register(&lowmem_notify_misc);
+	if (ret)
+		return ret;
+
+	read_lock(&tasklist_lock);
+	spin_lock_irq(&lowmem_lock);
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+	for_each_process(p)
+		list_add_tail(&p->lowmem_node, lowmem_bucket(p->oomkilladj));
+	lowmem_ready = 1;
+	spin_unlock_irq(&lowmem_lock);
+	read_unlock(&tasklist_lock);
+
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -122,6 +451,8 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	misc_deregister(&lowmem_notify_misc);
+	cancel_delayed_work_sync(&lowmem_notify_work);
 }
 
 module_init(lowmem_init);
@@ -0,0 +1,509 @@
+/*
+ * drivers/staging/ramzswap/ramzswap_drv.c
+ *
+ * Compressed RAM based swap device.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * A block device that keeps its data in RAM, LZO compressed.  Used as a
+ * swap device it lets anonymous memory be reclaimed without any backing
+ * storage: a swapped out page costs only its compressed size.
+ *
+ * The device only takes whole, page aligned pages, as swap writes them.
+ * Pages that are all zeros are only flagged, pages that don't compress to
+ * at most ZS_MAX_ALLOC bytes are kept as is in a page of their own, and
+ * the rest are stored in a zspool.  Discard requests, which swap issues
+ * for clusters it is about to reuse, free the pages they cover.
+ *
+ *   modprobe ramzswap disksize_kb=65536
+ *   mkswap /dev/ramzswap0 && swapon /dev/ramzswap0
+ *
+ * Usage statistics are in /sys/block/ramzswap<id>/.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/genhd.h>
+#include <linux/device.h>
+#include <linux/highmem.h>
+#include <linux/lzo.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "ramzswap_drv.h"
+
+static int ramzswap_major;
+static struct ramzswap *devices;
+
+static unsigned int num_devices = 1;
+module_param(num_devices, uint, S_IRUGO);
+MODULE_PARM_DESC(num_devices, "Number of ramzswap devices");
+
+static unsigned long disksize_kb;
+module_param(disksize_kb, ulong, S_IRUGO);
+MODULE_PARM_DESC(disksize_kb, "Size of each ramzswap device in KiB "
+		 "(default: 25% of RAM)");
+
+static int rzs_test_flag(struct ramzswap *rzs, u32 index,
+			 enum rzs_pageflags flag)
+{
+	return rzs->table[index].flags & (1 << flag);
+}
+
+static void rzs_set_flag(struct ramzswap *rzs, u32 index,
+			 enum rzs_pageflags flag)
+{
+	rzs->table[index].flags |= (1 << flag);
+}
+
+static int page_zero_filled(void *ptr)
+{
+	unsigned long *page = ptr;
+	unsigned int pos;
+
+	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++)
+		if (page[pos])
+			return 0;
+	return 1;
+}
+
+static void ramzswap_free_page(struct ramzswap *rzs, u32 index)
+{
+	struct ramzswap_table *entry = &rzs->table[index];
+
+	if (rzs_test_flag(rzs, index, RZS_ZERO)) {
+		rzs->stats.pages_zero--;
+	} else if (rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
+		__free_page(entry->page);
+		rzs->stats.pages_expand--;
+		rzs->stats.pages_stored--;
+		rzs->stats.compr_size -= PAGE_SIZE;
+	} else if (entry->size) {
+		zs_free(rzs->pool, &entry->handle);
+		rzs->stats.pages_stored--;
+		rzs->stats.compr_size -= entry->size;
+	}
+	memset(entry, 0, sizeof(*entry));
+}
+
+static int ramzswap_read(struct ramzswap *rzs, struct page *page, u32 index)
+{
+	struct ramzswap_table *entry = &rzs->table[index];
+	size_t clen = PAGE_SIZE;
+	void *src, *dst;
+	int ret;
+
+	rzs->stats.num_reads++;
+
+	if (rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
+		copy_highpage(page, entry->page);
+		flush_dcache_page(page);
+		return 0;
+	}
+
+	if (!entry->size) {
+		/* zero page, or never written */
+		dst = kmap_atomic(page, KM_USER1);
+		memset(dst, 0, PAGE_SIZE);
+		kunmap_atomic(dst, KM_USER1);
+		flush_dcache_page(page);
+		return 0;
+	}
+
+	src = zs_map_object(rzs->pool, &entry->handle, rzs->compress_buffer);
+	dst = kmap_atomic(page, KM_USER1);
+	ret = lzo1x_decompress_safe(src, entry->size, dst, &clen);
+	kunmap_atomic(dst, KM_USER1);
+	zs_unmap_object(rzs->pool, &entry->handle, src);
+	flush_dcache_page(page);
+
+	if (unlikely(ret != LZO_E_OK || clen != PAGE_SIZE)) {
+		pr_err("ramzswap: decompression failed, err %d, page %u\n",
+		       ret, index);
+		rzs->stats.failed_reads++;
+		return -EIO;
+	}
+	return 0;
+}
+
+static int ramzswap_write(struct ramzswap *rzs, struct page *page, u32 index)
+{
+	struct ramzswap_table *entry = &rzs->table[index];
+	size_t clen;
+	void *src;
+	int ret;
+
+	rzs->stats.num_writes++;
+
+	/* the old contents are going away, free them before allocating */
+	ramzswap_free_page(rzs, index);
+
+	src = kmap_atomic(page, KM_USER1);
+	if (page_zero_filled(src)) {
+		kunmap_atomic(src, KM_USER1);
+		rzs_set_flag(rzs, index, RZS_ZERO);
+		rzs->stats.pages_zero++;
+		return 0;
+	}
+
+	ret = lzo1x_1_compress(src, PAGE_SIZE, rzs->compress_buffer, &clen,
+			       rzs->compress_workmem);
+	kunmap_atomic(src, KM_USER1);
+
+	if (unlikely(ret != LZO_E_OK)) {
+		pr_err("ramzswap: compression failed, err %d, page %u\n",
+		       ret, index);
+		goto out_error;
+	}
+
+	if (clen > ZS_MAX_ALLOC) {
+		entry->page = alloc_page(GFP_NOIO | __GFP_HIGHMEM |
+					 __GFP_NOWARN);
+		if (!entry->page)
+			goto out_error;
+		copy_highpage(entry->page, page);
+		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
+		rzs->stats.pages_expand++;
+		clen = PAGE_SIZE;
+	} else {
+		if (zs_malloc(rzs->pool, clen, &entry->handle))
+			goto out_error;
+		zs_write_object(rzs->pool, &entry->handle,
+				rzs->compress_buffer, clen);
+		entry->size = clen;
+	}
+
+	rzs->stats.pages_stored++;
+	rzs->stats.compr_size += clen;
+	return 0;
+
+out_error:
+	rzs->stats.failed_writes++;
+	return -ENOMEM;
+}
+
+static void ramzswap_discard(struct ramzswap *rzs, struct bio *bio)
+{
+	/* only free the pages the discard covers entirely */
+	u64 start = bio->bi_sector + SECTORS_PER_PAGE - 1;
+	u64 end = bio->bi_sector + (bio->bi_size >> SECTOR_SHIFT);
+	u32 index = start >> SECTORS_PER_PAGE_SHIFT;
+	u32 last = min_t(u64, end >> SECTORS_PER_PAGE_SHIFT,
+			 rzs->disksize >> PAGE_SHIFT);
+
+	mutex_lock(&rzs->lock);
+	for (; index < last; index++) {
+		if (rzs->table[index].flags || rzs->table[index].size)
+			rzs->stats.discards++;
+		ramzswap_free_page(rzs, index);
+	}
+	mutex_unlock(&rzs->lock);
+}
+
+static int valid_io_request(struct ramzswap *rzs, struct bio *bio)
+{
+	if (unlikely(bio->bi_sector & (SECTORS_PER_PAGE - 1) ||
+		     bio->bi_size & ~PAGE_MASK))
+		return 0;
+
+	if (unlikely(((u64)bio->bi_sector << SECTOR_SHIFT) + bio->bi_size >
+		     rzs->disksize))
+		return 0;
+
+	return 1;
+}
+
+static int ramzswap_make_request(struct request_queue *queue, struct bio *bio)
+{
+	struct ramzswap *rzs = queue->queuedata;
+	struct bio_vec *bvec;
+	u32 index;
+	int i, ret = 0;
+
+	if (bio_discard(bio)) {
+		ramzswap_discard(rzs, bio);
+		bio_endio(bio, 0);
+		return 0;
+	}
+
+	if (!valid_io_request(rzs, bio)) {
+		mutex_lock(&rzs->lock);
+		rzs->stats.invalid_io++;
+		mutex_unlock(&rzs->lock);
+		bio_io_error(bio);
+		return 0;
+	}
+
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+
+	mutex_lock(&rzs->lock);
+	bio_for_each_segment(bvec, bio, i) {
+		if (unlikely(bvec->bv_len != PAGE_SIZE || bvec->bv_offset)) {
+			rzs->stats.invalid_io++;
+			ret = -EINVAL;
+			break;
+		}
+
+		if (bio_data_dir(bio) == READ)
+			ret = ramzswap_read(rzs, bvec->bv_page, index);
+		else
+			ret = ramzswap_write(rzs, bvec->bv_page, index);
+		if (ret)
+			break;
+		index++;
+	}
+	mutex_unlock(&rzs->lock);
+
+	if (!ret)
+		set_bit(BIO_UPTODATE, &bio->bi_flags);
+	bio_endio(bio, ret);
+	return 0;
+}
+
+/*
+ * Discards are handled in ramzswap_make_request(), but the block layer
+ * only passes them on to queues that have a prepare_discard_fn.
+ */
+static int ramzswap_prepare_discard(struct request_queue *queue,
+				    struct request *req)
+{
+	return 0;
+}
+
+static struct block_device_operations ramzswap_devops = {
+	.owner = THIS_MODULE,
+};
+
+/*
+ * sysfs statistics, in /sys/block/ramzswap<id>/
+ */
+
+static struct ramzswap *dev_to_rzs(struct device *dev)
+{
+	return dev_to_disk(dev)->private_data;
+}
+
+#define RAMZSWAP_ATTR(_name, _expr)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct ramzswap *rzs = dev_to_rzs(dev);				\
+	u64 val;							\
+									\
+	mutex_lock(&rzs->lock);						\
+	val = (_expr);							\
+	mutex_unlock(&rzs->lock);					\
+	return sprintf(buf, "%llu\n", (unsigned long long)val);	\
+}									\
+static DEVICE_ATTR(_name, S_IRUGO, _name##_show, NULL)
+
+RAMZSWAP_ATTR(disksize, rzs->disksize);
+RAMZSWAP_ATTR(num_reads, rzs->stats.num_reads);
+RAMZSWAP_ATTR(num_writes, rzs->stats.num_writes);
+RAMZSWAP_ATTR(failed_reads, rzs->stats.failed_reads);
+RAMZSWAP_ATTR(failed_writes, rzs->stats.failed_writes);
+RAMZSWAP_ATTR(invalid_io, rzs->stats.invalid_io);
+RAMZSWAP_ATTR(discards, rzs->stats.discards);
+RAMZSWAP_ATTR(zero_pages, rzs->stats.pages_zero);
+RAMZSWAP_ATTR(pages_stored, rzs->stats.pages_stored);
+RAMZSWAP_ATTR(pages_expand, rzs->stats.pages_expand);
+/* bytes swapped out, and their compressed size */
+RAMZSWAP_ATTR(orig_data_size, (u64)rzs->stats.pages_stored << PAGE_SHIFT);
+RAMZSWAP_ATTR(compr_data_size, rzs->stats.compr_size);
+/* memory actually used, including allocator overhead */
+RAMZSWAP_ATTR(mem_used_total, zs_get_total_size(rzs->pool) +
+	      ((u64)rzs->stats.pages_expand << PAGE_SHIFT));
+/* compressed size as a percentage of the original size */
+RAMZSWAP_ATTR(compr_ratio, rzs->stats.pages_stored ?
+	      div64_u64(rzs->stats.compr_size * 100,
+			(u64)rzs->stats.pages_stored << PAGE_SHIFT) : 0);
+
+static struct attribute *ramzswap_attrs[] = {
+	&dev_attr_disksize.attr,
+	&dev_attr_num_reads.attr,
+	&dev_attr_num_writes.attr,
+	&dev_attr_failed_reads.attr,
+	&dev_attr_failed_writes.attr,
+	&dev_attr_invalid_io.attr,
+	&dev_attr_discards.attr,
+	&dev_attr_zero_pages.attr,
+	&dev_attr_pages_stored.attr,
+	&dev_attr_pages_expand.attr,
+	&dev_attr_orig_data_size.attr,
+	&dev_attr_compr_data_size.attr,
+	&dev_attr_mem_used_total.attr,
+	&dev_attr_compr_ratio.attr,
+	NULL,
+};
+
+static struct attribute_group ramzswap_attr_group = {
+	.attrs = ramzswap_attrs,
+};
+
+static void destroy_device(struct ramzswap *rzs)
+{
+	u32 index;
+
+	if (rzs->disk) {
+		sysfs_remove_group(&disk_to_dev(rzs->disk)->kobj,
+				   &ramzswap_attr_group);
+		del_gendisk(rzs->disk);
+		put_disk(rzs->disk);
+	}
+	if (rzs->queue)
+		blk_cleanup_queue(rzs->queue);
+
+	if (rzs->table) {
+		for (index = 0; index < rzs->disksize >> PAGE_SHIFT; index++)
+			ramzswap_free_page(rzs, index);
+		vfree(rzs->table);
+	}
+	if (rzs->pool)
+		zs_destroy_pool(rzs->pool);
+	free_pages((unsigned long)rzs->compress_buffer, 1);
+	kfree(rzs->compress_workmem);
+}
+
+static int create_device(struct ramzswap *rzs, int device_id, u64 disksize)
+{
+	size_t num_pages = disksize >> PAGE_SHIFT;
+	int ret;
+
+	mutex_init(&rzs->lock);
+	rzs->disksize = disksize;
+
+	rzs->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+	/* lzo can expand incompressible data, allow for its worst case */
+	rzs->compress_buffer = (void *)__get_free_pages(GFP_KERNEL, 1);
+	rzs->table = vmalloc(num_pages * sizeof(*rzs->table));
+	rzs->pool = zs_create_pool(GFP_NOIO | __GFP_HIGHMEM | __GFP_NOWARN);
+	if (!rzs->compress_workmem || !rzs->compress_buffer || !rzs->table ||
+	    !rzs->pool) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	memset(rzs->table, 0, num_pages * sizeof(*rzs->table));
+
+	rzs->queue = blk_alloc_queue(GFP_KERNEL);
+	if (!rzs->queue) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	blk_queue_make_request(rzs->queue, ramzswap_make_request);
+	blk_queue_hardsect_size(rzs->queue, PAGE_SIZE);
+	blk_queue_set_discard(rzs->queue, ramzswap_prepare_discard);
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, rzs->queue);
+	rzs->queue->queuedata = rzs;
+
+	rzs->disk = alloc_disk(1);
+	if (!rzs->disk) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	rzs->disk->major = ramzswap_major;
+	rzs->disk->first_minor = device_id;
+	rzs->disk->fops = &ramzswap_devops;
+	rzs->disk->queue = rzs->queue;
+	rzs->disk->private_data = rzs;
+	snprintf(rzs->disk->disk_name, sizeof(rzs->disk->disk_name),
+		 "ramzswap%d", device_id);
+	set_capacity(rzs->disk, disksize >> SECTOR_SHIFT);
+	add_disk(rzs->disk);
+
+	ret = sysfs_create_group(&disk_to_dev(rzs->disk)->kobj,
+				 &ramzswap_attr_group);
+	if (ret) {
+		del_gendisk(rzs->disk);
+		put_disk(rzs->disk);
+		rzs->disk = NULL;
+		goto out;
+	}
+
+	return 0;
+
+out:
+	destroy_device(rzs);
+	return ret;
+}
+
+static int __init ramzswap_init(void)
+{
+	struct sysinfo si;
+	u64 disksize;
+	int i, ret;
+
+	if (!num_devices || num_devices > 32) {
+		pr_err("ramzswap: invalid num_devices: %u\n", num_devices);
+		return -EINVAL;
+	}
+
+	if (disksize_kb) {
+		disksize = (u64)disksize_kb << 10;
+	} else {
+		si_meminfo(&si);
+		disksize = div_u64((u64)si.totalram * si.mem_unit *
+				   RAMZSWAP_DEFAULT_DISKSIZE_PERCENT, 100);
+	}
+	disksize &= PAGE_MASK;
+	if (!disksize)
+		return -EINVAL;
+
+	ramzswap_major = register_blkdev(0, "ramzswap");
+	if (ramzswap_major <= 0)
+		return -EBUSY;
+
+	devices = kzalloc(num_devices * sizeof(*devices), GFP_KERNEL);
+	if (!devices) {
+		ret = -ENOMEM;
+		goto out_unregister;
+	}
+
+	for (i = 0; i < num_devices; i++) {
+		ret = create_device(&devices[i], i, disksize);
+		if (ret)
+			goto out_destroy;
+	}
+
+	pr_info("ramzswap: %u device(s) of %llu KiB\n", num_devices,
+		(unsigned long long)disksize >> 10);
+	return 0;
+
+out_destroy:
+	while (i--)
+		destroy_device(&devices[i]);
+	kfree(devices);
+out_unregister:
+	unregister_blkdev(ramzswap_major, "ramzswap");
+	return ret;
+}
+
+static void __exit ramzswap_exit(void)
+{
+	int i;
+
+	for (i = 0; i < num_devices; i++)
+		destroy_device(&devices[i]);
+	kfree(devices);
+	unregister_blkdev(ramzswap_major, "ramzswap");
+}
+
+module_init(ramzswap_init);
+module_exit(ramzswap_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Compressed RAM based swap device");
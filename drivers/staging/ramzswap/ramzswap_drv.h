@@ -0,0 +1,82 @@
+/*
+ * drivers/staging/ramzswap/ramzswap_drv.h
+ *
+ * Compressed RAM based swap device.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _RAMZSWAP_DRV_H
+#define _RAMZSWAP_DRV_H
+
+#include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/blkdev.h>
+#include <linux/genhd.h>
+
+#include "zspool.h"
+
+#define SECTOR_SHIFT		9
+#define SECTORS_PER_PAGE_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
+#define SECTORS_PER_PAGE	(1 << SECTORS_PER_PAGE_SHIFT)
+
+/* default disk size as a percentage of RAM */
+#define RAMZSWAP_DEFAULT_DISKSIZE_PERCENT	25
+
+/* flags for ramzswap_table entries */
+enum rzs_pageflags {
+	/* page is filled with zeros, nothing is stored */
+	RZS_ZERO,
+	/* page didn't compress and is stored as is in its own page */
+	RZS_UNCOMPRESSED,
+};
+
+/*
+ * One entry per page of the device.  An entry with no flags and no size
+ * has never been written, or was discarded, and reads as zeros.
+ */
+struct ramzswap_table {
+	union {
+		struct zs_handle handle;
+		struct page *page;
+	};
+	u16 size;	/* compressed size in bytes */
+	u8 flags;
+};
+
+struct ramzswap_stats {
+	u64 num_reads;
+	u64 num_writes;
+	u64 failed_reads;
+	u64 failed_writes;
+	u64 invalid_io;		/* misaligned or out of range requests */
+	u64 discards;		/* pages freed by discard requests */
+	u64 compr_size;		/* compressed size of the stored pages */
+	u32 pages_zero;
+	u32 pages_stored;	/* excluding zero pages */
+	u32 pages_expand;	/* stored uncompressed */
+};
+
+struct ramzswap {
+	struct zs_pool *pool;
+	struct ramzswap_table *table;
+	/* lzo workspace, and the compressed data for a page being written
+	 * or a straddling object being read */
+	void *compress_workmem;
+	void *compress_buffer;
+	/* serialises all i/o and protects the table, pool and stats */
+	struct mutex lock;
+	struct request_queue *queue;
+	struct gendisk *disk;
+	u64 disksize;		/* bytes */
+	struct ramzswap_stats stats;
+};
+
+#endif /* _RAMZSWAP_DRV_H */
@@ -0,0 +1,305 @@
+/*
+ * drivers/staging/ramzswap/zspool.c
+ *
+ * Size class allocator for compressed pages.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Compressed pages come in every size up to ZS_MAX_ALLOC, so kmalloc()
+ * would waste up to half of each object rounding it to a power of two.
+ * Instead objects are rounded to ZS_ALIGN bytes and each size class
+ * carves them out of a "zspage": a group of up to ZS_MAX_PAGES_PER_ZSPAGE
+ * pages, not necessarily contiguous, whose count is picked so that the
+ * objects fill it as tightly as possible.  Objects may straddle a page
+ * boundary within the zspage, these are copied out when they are mapped.
+ *
+ * The pages may come from highmem.  A freed object holds the index of the
+ * next free object of its zspage in its first word.  The pool does no
+ * locking of its own, callers serialise all operations on a pool.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/string.h>
+
+#include "zspool.h"
+
+#define ZS_NR_CLASSES	((ZS_MAX_ALLOC - ZS_MIN_ALLOC) / ZS_ALIGN + 1)
+#define ZS_NO_OBJ	(~0U)
+
+struct zs_size_class {
+	unsigned int size;
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+	/* zspages with at least one free object */
+	struct list_head partial;
+};
+
+struct zspage {
+	struct list_head list;
+	struct zs_size_class *class;
+	/* objects currently allocated */
+	unsigned int inuse;
+	/* objects below this index have been handed out at least once */
+	unsigned int nr_used;
+	/* first freed object, ZS_NO_OBJ if none */
+	unsigned int freelist;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+};
+
+struct zs_pool {
+	gfp_t flags;
+	unsigned long pages_allocated;
+	struct zs_size_class classes[ZS_NR_CLASSES];
+};
+
+static unsigned int zs_pages_per_zspage(unsigned int size)
+{
+	unsigned int i, used, best = 1, best_used = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		/* in 1/1024ths of the zspage */
+		used = (i * PAGE_SIZE / size) * size * 1024 / (i * PAGE_SIZE);
+		if (used > best_used) {
+			best_used = used;
+			best = i;
+		}
+	}
+	return best;
+}
+
+struct zs_pool *zs_create_pool(gfp_t flags)
+{
+	struct zs_pool *pool;
+	struct zs_size_class *class;
+	int i;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	pool->flags = flags;
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		class = &pool->classes[i];
+		class->size = ZS_MIN_ALLOC + i * ZS_ALIGN;
+		class->pages_per_zspage = zs_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+					 class->size;
+		INIT_LIST_HEAD(&class->partial);
+	}
+	return pool;
+}
+
+static void zs_free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	int i;
+
+	for (i = 0; i < zspage->class->pages_per_zspage; i++)
+		if (zspage->pages[i])
+			__free_page(zspage->pages[i]);
+	pool->pages_allocated -= zspage->class->pages_per_zspage;
+	kfree(zspage);
+}
+
+static struct zspage *zs_alloc_zspage(struct zs_pool *pool,
+				      struct zs_size_class *class)
+{
+	struct zspage *zspage;
+	int i;
+
+	zspage = kzalloc(sizeof(*zspage), pool->flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	zspage->class = class;
+	zspage->freelist = ZS_NO_OBJ;
+	pool->pages_allocated += class->pages_per_zspage;
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(pool->flags);
+		if (!zspage->pages[i]) {
+			zs_free_zspage(pool, zspage);
+			return NULL;
+		}
+	}
+	list_add(&zspage->list, &class->partial);
+	return zspage;
+}
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	struct zspage *zspage, *next;
+	int i;
+
+	/* full zspages aren't on any list, all objects must be freed first */
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		list_for_each_entry_safe(zspage, next,
+					 &pool->classes[i].partial, list) {
+			WARN_ON(zspage->inuse);
+			zs_free_zspage(pool, zspage);
+		}
+	}
+	WARN_ON(pool->pages_allocated);
+	kfree(pool);
+}
+
+static struct page *zs_obj_page(struct zs_handle *handle,
+				unsigned long *offset)
+{
+	unsigned long off = handle->index * handle->zspage->class->size;
+
+	*offset = off & ~PAGE_MASK;
+	return handle->zspage->pages[off >> PAGE_SHIFT];
+}
+
+static unsigned int *zs_map_link(struct zs_handle *handle)
+{
+	unsigned long offset;
+	struct page *page = zs_obj_page(handle, &offset);
+
+	/* objects are ZS_ALIGN aligned, so the link never straddles pages */
+	return kmap_atomic(page, KM_USER0) + offset;
+}
+
+static void zs_unmap_link(unsigned int *link)
+{
+	kunmap_atomic((void *)((unsigned long)link & PAGE_MASK), KM_USER0);
+}
+
+int zs_malloc(struct zs_pool *pool, size_t size, struct zs_handle *handle)
+{
+	struct zs_size_class *class;
+	struct zspage *zspage;
+	unsigned int *link;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC))
+		return -EINVAL;
+
+	if (size < ZS_MIN_ALLOC)
+		size = ZS_MIN_ALLOC;
+	class = &pool->classes[(size - ZS_MIN_ALLOC + ZS_ALIGN - 1) /
+			       ZS_ALIGN];
+
+	if (list_empty(&class->partial)) {
+		zspage = zs_alloc_zspage(pool, class);
+		if (!zspage)
+			return -ENOMEM;
+	} else
+		zspage = list_first_entry(&class->partial, struct zspage,
+					  list);
+
+	handle->zspage = zspage;
+	if (zspage->freelist != ZS_NO_OBJ) {
+		handle->index = zspage->freelist;
+		link = zs_map_link(handle);
+		zspage->freelist = *link;
+		zs_unmap_link(link);
+	} else
+		handle->index = zspage->nr_used++;
+
+	if (++zspage->inuse == class->objs_per_zspage)
+		list_del_init(&zspage->list);
+	return 0;
+}
+
+void zs_free(struct zs_pool *pool, struct zs_handle *handle)
+{
+	struct zspage *zspage = handle->zspage;
+	struct zs_size_class *class = zspage->class;
+	unsigned int *link;
+
+	if (zspage->inuse-- == class->objs_per_zspage)
+		list_add(&zspage->list, &class->partial);
+
+	if (!zspage->inuse) {
+		list_del(&zspage->list);
+		zs_free_zspage(pool, zspage);
+		return;
+	}
+
+	link = zs_map_link(handle);
+	*link = zspage->freelist;
+	zs_unmap_link(link);
+	zspage->freelist = handle->index;
+}
+
+/*
+ * Copy size bytes between buf and the object, a piece at a time for
+ * objects that straddle a page boundary.
+ */
+static void zs_copy_object(struct zs_handle *handle, void *buf, size_t size,
+			   int write)
+{
+	unsigned long off = handle->index * handle->zspage->class->size;
+	unsigned long offset;
+	size_t len;
+	void *addr;
+
+	while (size) {
+		offset = off & ~PAGE_MASK;
+		len = min_t(size_t, size, PAGE_SIZE - offset);
+		addr = kmap_atomic(handle->zspage->pages[off >> PAGE_SHIFT],
+				   KM_USER0);
+		if (write)
+			memcpy(addr + offset, buf, len);
+		else
+			memcpy(buf, addr + offset, len);
+		kunmap_atomic(addr, KM_USER0);
+		buf += len;
+		size -= len;
+		off += len;
+	}
+}
+
+void zs_write_object(struct zs_pool *pool, struct zs_handle *handle,
+		     const void *src, size_t size)
+{
+	zs_copy_object(handle, (void *)src, size, 1);
+}
+
+/*
+ * Map an object for reading.  An object within one page is mapped in
+ * place, one straddling two pages is copied into buf, which must hold
+ * ZS_MAX_ALLOC bytes.  Must be paired with zs_unmap_object() before
+ * sleeping or mapping another object.
+ */
+void *zs_map_object(struct zs_pool *pool, struct zs_handle *handle,
+		    void *buf)
+{
+	unsigned long offset;
+	struct page *page = zs_obj_page(handle, &offset);
+
+	if (offset + handle->zspage->class->size <= PAGE_SIZE)
+		return kmap_atomic(page, KM_USER0) + offset;
+
+	zs_copy_object(handle, buf, handle->zspage->class->size, 0);
+	return buf;
+}
+
+void zs_unmap_object(struct zs_pool *pool, struct zs_handle *handle,
+		     void *addr)
+{
+	unsigned long offset;
+
+	zs_obj_page(handle, &offset);
+	if (offset + handle->zspage->class->size <= PAGE_SIZE)
+		kunmap_atomic((void *)((unsigned long)addr & PAGE_MASK),
+			      KM_USER0);
+}
+
+u64 zs_get_total_size(struct zs_pool *pool)
+{
+	return (u64)pool->pages_allocated << PAGE_SHIFT;
+}
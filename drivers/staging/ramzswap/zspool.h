@@ -0,0 +1,54 @@
+/*
+ * drivers/staging/ramzswap/zspool.h
+ *
+ * Size class allocator for compressed pages.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _ZSPOOL_H
+#define _ZSPOOL_H
+
+#include <linux/types.h>
+
+/* objects are rounded up to a multiple of ZS_ALIGN bytes */
+#define ZS_ALIGN		16
+#define ZS_MIN_ALLOC		32
+/* larger objects don't save enough to be worth compressing */
+#define ZS_MAX_ALLOC		(PAGE_SIZE / 4 * 3)
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+struct zs_pool;
+struct zspage;
+
+/*
+ * An allocated object: the zspage it lives in and its index there.
+ */
+struct zs_handle {
+	struct zspage *zspage;
+	unsigned int index;
+};
+
+struct zs_pool *zs_create_pool(gfp_t flags);
+void zs_destroy_pool(struct zs_pool *pool);
+
+int zs_malloc(struct zs_pool *pool, size_t size, struct zs_handle *handle);
+void zs_free(struct zs_pool *pool, struct zs_handle *handle);
+
+void zs_write_object(struct zs_pool *pool, struct zs_handle *handle,
+		     const void *src, size_t size);
+void *zs_map_object(struct zs_pool *pool, struct zs_handle *handle,
+		    void *buf);
+void zs_unmap_object(struct zs_pool *pool, struct zs_handle *handle,
+		     void *addr);
+
+u64 zs_get_total_size(struct zs_pool *pool);
+
+#endif /* _ZSPOOL_H */
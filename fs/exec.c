@@ -52,6 +52,7 @@
 #include <linux/tracehook.h>
 #include <linux/kmod.h>
 #include <linux/fsnotify.h>
+#include <linux/oom.h>
 
 #include <asm/uaccess.h>
 #include <asm/mmu_context.h>
@@ -885,6 +886,8 @@ static int de_thread(struct task_struct *tsk)
 
 		tsk->group_leader = tsk;
 		leader->group_leader = tsk;
+		lowmem_task_del(leader);
+		lowmem_task_add(tsk);
 
 		tsk->exit_signal = SIGCHLD;
 
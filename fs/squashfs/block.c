@@ -31,7 +31,10 @@
 #include <linux/slab.h>
 #include <linux/mutex.h>
 #include <linux/string.h>
+#include <linux/cpumask.h>
+#include <linux/wait.h>
 #include <linux/buffer_head.h>
+#include <linux/highmem.h>
 #include <linux/zlib.h>
 
 #include "squashfs_fs.h"
@@ -39,6 +42,86 @@
 #include "squashfs_fs_i.h"
 #include "squashfs.h"
 
+/*
+ * Decompression streams.  Each filesystem has a small pool of zlib streams
+ * so that blocks can be decompressed in parallel, one per stream.  Readers
+ * take a free stream, sleeping if they are all busy.
+ */
+int squashfs_streams_init(struct squashfs_sb_info *msblk)
+{
+	int i, count = SQUASHFS_DECOMP_STREAMS;
+
+	if (count <= 0)
+		count = num_online_cpus();
+
+	INIT_LIST_HEAD(&msblk->free_streams);
+	spin_lock_init(&msblk->stream_lock);
+	init_waitqueue_head(&msblk->stream_wait);
+
+	msblk->streams = kcalloc(count, sizeof(*msblk->streams), GFP_KERNEL);
+	if (msblk->streams == NULL)
+		return -ENOMEM;
+	msblk->stream_count = count;
+
+	for (i = 0; i < count; i++) {
+		msblk->streams[i].stream.workspace =
+			kmalloc(zlib_inflate_workspacesize(), GFP_KERNEL);
+		if (msblk->streams[i].stream.workspace == NULL) {
+			squashfs_streams_delete(msblk);
+			return -ENOMEM;
+		}
+		list_add(&msblk->streams[i].list, &msblk->free_streams);
+	}
+
+	return 0;
+}
+
+
+void squashfs_streams_delete(struct squashfs_sb_info *msblk)
+{
+	int i;
+
+	if (msblk->streams == NULL)
+		return;
+
+	for (i = 0; i < msblk->stream_count; i++)
+		kfree(msblk->streams[i].stream.workspace);
+	kfree(msblk->streams);
+	msblk->streams = NULL;
+	msblk->stream_count = 0;
+}
+
+
+static struct squashfs_stream *get_stream(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream *stream;
+
+	spin_lock(&msblk->stream_lock);
+	while (list_empty(&msblk->free_streams)) {
+		spin_unlock(&msblk->stream_lock);
+		wait_event(msblk->stream_wait,
+			!list_empty(&msblk->free_streams));
+		spin_lock(&msblk->stream_lock);
+	}
+	stream = list_first_entry(&msblk->free_streams, struct squashfs_stream,
+		list);
+	list_del(&stream->list);
+	spin_unlock(&msblk->stream_lock);
+
+	return stream;
+}
+
+
+static void put_stream(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *stream)
+{
+	spin_lock(&msblk->stream_lock);
+	list_add(&stream->list, &msblk->free_streams);
+	spin_unlock(&msblk->stream_lock);
+	wake_up(&msblk->stream_wait);
+}
+
+
 /*
  * Read the metadata block length, this is stored in the first two
  * bytes of the metadata block.
@@ -71,6 +154,45 @@ static struct buffer_head *get_block_length(struct super_block *sb,
 }
 
 
+/*
+ * The output of squashfs_read_data_actor().  It fills either an array of
+ * buffers, or page cache pages, which are kmapped one at a time while they
+ * are being filled rather than all at once for the whole read.  A highmem
+ * reader thus never holds more than one kmap slot, however large the block.
+ */
+struct squashfs_page_actor {
+	void **buffer;
+	struct page **page;
+	int pages;
+	int next;
+	struct page *mapped;
+};
+
+
+static void squashfs_actor_finish(struct squashfs_page_actor *actor)
+{
+	if (actor->mapped) {
+		kunmap(actor->mapped);
+		actor->mapped = NULL;
+	}
+}
+
+
+static void *squashfs_actor_next(struct squashfs_page_actor *actor)
+{
+	squashfs_actor_finish(actor);
+
+	if (actor->next == actor->pages)
+		return NULL;
+
+	if (actor->page == NULL)
+		return actor->buffer[actor->next++];
+
+	actor->mapped = actor->page[actor->next++];
+	return kmap(actor->mapped);
+}
+
+
 /*
  * Read and decompress a metadata block or datablock.  Length is non-zero
  * if a datablock is being read (the size is stored elsewhere in the
@@ -79,14 +201,18 @@ static struct buffer_head *get_block_length(struct super_block *sb,
  * is stored uncompressed in the filesystem (usually because compression
  * generated a larger block - this does occasionally happen with zlib).
  */
-int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
-			int length, u64 *next_index, int srclength, int pages)
+static int squashfs_read_data_actor(struct super_block *sb,
+			struct squashfs_page_actor *actor, u64 index,
+			int length, u64 *next_index, int srclength)
 {
 	struct squashfs_sb_info *msblk = sb->s_fs_info;
 	struct buffer_head **bh;
 	int offset = index & ((1 << msblk->devblksize_log2) - 1);
 	u64 cur_index = index >> msblk->devblksize_log2;
-	int bytes, compressed, b = 0, k = 0, page = 0, avail;
+	int bytes, compressed, b = 0, k = 0, avail;
+	struct squashfs_stream *s = NULL;
+	z_stream *stream;
+	void *out;
 
 
 	bh = kcalloc((msblk->block_size >> msblk->devblksize_log2) + 1,
@@ -159,19 +285,20 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 		 * Uncompress block.
 		 */
 
-		mutex_lock(&msblk->read_data_mutex);
+		s = get_stream(msblk);
+		stream = &s->stream;
 
-		msblk->stream.avail_out = 0;
-		msblk->stream.avail_in = 0;
+		stream->avail_out = 0;
+		stream->avail_in = 0;
 
 		bytes = length;
 		do {
-			if (msblk->stream.avail_in == 0 && k < b) {
+			if (stream->avail_in == 0 && k < b) {
 				avail = min(bytes, msblk->devblksize - offset);
 				bytes -= avail;
 				wait_on_buffer(bh[k]);
 				if (!buffer_uptodate(bh[k]))
-					goto release_mutex;
+					goto release_stream;
 
 				if (avail == 0) {
 					offset = 0;
@@ -179,46 +306,51 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 					continue;
 				}
 
-				msblk->stream.next_in = bh[k]->b_data + offset;
-				msblk->stream.avail_in = avail;
+				stream->next_in = bh[k]->b_data + offset;
+				stream->avail_in = avail;
 				offset = 0;
 			}
 
-			if (msblk->stream.avail_out == 0 && page < pages) {
-				msblk->stream.next_out = buffer[page++];
-				msblk->stream.avail_out = PAGE_CACHE_SIZE;
+			if (stream->avail_out == 0) {
+				out = squashfs_actor_next(actor);
+				if (out != NULL) {
+					stream->next_out = out;
+					stream->avail_out = PAGE_CACHE_SIZE;
+				}
 			}
 
 			if (!zlib_init) {
-				zlib_err = zlib_inflateInit(&msblk->stream);
+				zlib_err = zlib_inflateInit(stream);
 				if (zlib_err != Z_OK) {
 					ERROR("zlib_inflateInit returned"
 						" unexpected result 0x%x,"
 						" srclength %d\n", zlib_err,
 						srclength);
-					goto release_mutex;
+					goto release_stream;
 				}
 				zlib_init = 1;
 			}
 
-			zlib_err = zlib_inflate(&msblk->stream, Z_SYNC_FLUSH);
+			zlib_err = zlib_inflate(stream, Z_SYNC_FLUSH);
 
-			if (msblk->stream.avail_in == 0 && k < b)
+			if (stream->avail_in == 0 && k < b)
 				put_bh(bh[k++]);
 		} while (zlib_err == Z_OK);
 
+		squashfs_actor_finish(actor);
+
 		if (zlib_err != Z_STREAM_END) {
 			ERROR("zlib_inflate error, data probably corrupt\n");
-			goto release_mutex;
+			goto release_stream;
 		}
 
-		zlib_err = zlib_inflateEnd(&msblk->stream);
+		zlib_err = zlib_inflateEnd(stream);
 		if (zlib_err != Z_OK) {
 			ERROR("zlib_inflate error, data probably corrupt\n");
-			goto release_mutex;
+			goto release_stream;
 		}
-		length = msblk->stream.total_out;
-		mutex_unlock(&msblk->read_data_mutex);
+		length = stream->total_out;
+		put_stream(msblk, s);
 	} else {
 		/*
 		 * Block is uncompressed.
@@ -231,17 +363,18 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 				goto block_release;
 		}
 
+		out = squashfs_actor_next(actor);
 		for (bytes = length; k < b; k++) {
 			in = min(bytes, msblk->devblksize - offset);
 			bytes -= in;
 			while (in) {
 				if (pg_offset == PAGE_CACHE_SIZE) {
-					page++;
+					out = squashfs_actor_next(actor);
 					pg_offset = 0;
 				}
 				avail = min_t(int, in, PAGE_CACHE_SIZE -
 						pg_offset);
-				memcpy(buffer[page] + pg_offset,
+				memcpy(out + pg_offset,
 						bh[k]->b_data + offset, avail);
 				in -= avail;
 				pg_offset += avail;
@@ -250,15 +383,17 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 			offset = 0;
 			put_bh(bh[k]);
 		}
+		squashfs_actor_finish(actor);
 	}
 
 	kfree(bh);
 	return length;
 
-release_mutex:
-	mutex_unlock(&msblk->read_data_mutex);
+release_stream:
+	put_stream(msblk, s);
 
 block_release:
+	squashfs_actor_finish(actor);
 	for (; k < b; k++)
 		put_bh(bh[k]);
 
@@ -268,3 +403,33 @@ read_failure:
 	kfree(bh);
 	return -EIO;
 }
+
+
+int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
+			int length, u64 *next_index, int srclength, int pages)
+{
+	struct squashfs_page_actor actor = {
+		.buffer = buffer,
+		.pages = pages,
+	};
+
+	return squashfs_read_data_actor(sb, &actor, index, length, next_index,
+				srclength);
+}
+
+
+/*
+ * As squashfs_read_data(), but into page cache pages, each of which is
+ * only kmapped while it is being filled.
+ */
+int squashfs_read_data_pages(struct super_block *sb, struct page **page,
+			u64 index, int length, int srclength, int pages)
+{
+	struct squashfs_page_actor actor = {
+		.page = page,
+		.pages = pages,
+	};
+
+	return squashfs_read_data_actor(sb, &actor, index, length, NULL,
+				srclength);
+}
@@ -372,18 +372,183 @@ static int read_blocklist(struct inode *inode, int index, u64 *block)
 }
 
 
-static int squashfs_readpage(struct file *file, struct page *page)
+/*
+ * Copy a datablock or fragment held in the squashfs cache into the page
+ * cache.  As the datablock likely covers many PAGE_CACHE_SIZE pages (default
+ * block size is 128 KiB) explicitly grab the pages from the page cache,
+ * except for the page that we've been called to fill.  A NULL buffer is a
+ * hole, and the pages are zero filled.
+ */
+static void squashfs_copy_cache(struct page *page,
+	struct squashfs_cache_entry *buffer, int bytes, int offset)
 {
 	struct inode *inode = page->mapping->host;
 	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
-	int bytes, i, offset = 0, sparse = 0;
-	struct squashfs_cache_entry *buffer = NULL;
 	void *pageaddr;
+	int i, mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
+	int start_index = page->index & ~mask, end_index = start_index | mask;
+
+	for (i = start_index; i <= end_index && bytes > 0; i++,
+			bytes -= PAGE_CACHE_SIZE, offset += PAGE_CACHE_SIZE) {
+		struct page *push_page;
+		int avail = buffer ? min_t(int, bytes, PAGE_CACHE_SIZE) : 0;
+
+		TRACE("bytes %d, i %d, available_bytes %d\n", bytes, i, avail);
+
+		push_page = (i == page->index) ? page :
+			grab_cache_page_nowait(page->mapping, i);
+
+		if (!push_page)
+			continue;
+
+		if (PageUptodate(push_page))
+			goto skip_page;
+
+		pageaddr = kmap_atomic(push_page, KM_USER0);
+		squashfs_copy_data(pageaddr, buffer, offset, avail);
+		memset(pageaddr + avail, 0, PAGE_CACHE_SIZE - avail);
+		kunmap_atomic(pageaddr, KM_USER0);
+		flush_dcache_page(push_page);
+		SetPageUptodate(push_page);
+skip_page:
+		unlock_page(push_page);
+		if (i != page->index)
+			page_cache_release(push_page);
+	}
+}
+
+
+/*
+ * Read a datablock through the "data" squashfs cache.  Used when the
+ * datablock can't be decompressed straight into the page cache.
+ */
+static int squashfs_read_cache(struct page *page, u64 block, int bsize)
+{
+	struct squashfs_cache_entry *buffer;
 
+	buffer = squashfs_get_datablock(page->mapping->host->i_sb, block,
+								bsize);
+	if (buffer->error) {
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+								bsize);
+		squashfs_cache_put(buffer);
+		return -EIO;
+	}
+
+	squashfs_copy_cache(page, buffer, buffer->length, 0);
+	squashfs_cache_put(buffer);
+
+	return 0;
+}
+
+
+/*
+ * Read a datablock, decompressing it directly into the page cache pages it
+ * covers.  This avoids both the intermediate squashfs cache buffer and the
+ * copy out of it.  All the pages of the block (up to the end of the file)
+ * must be grabbed and not already uptodate, otherwise fall back to reading
+ * the block through the squashfs cache.  The pages are only kmapped one at
+ * a time, while they are being filled.  On failure the page we've been
+ * called to fill is left locked for the caller.
+ */
+static int squashfs_readpage_block(struct page *target_page, u64 block,
+								int bsize)
+{
+	struct address_space *mapping = target_page->mapping;
+	struct inode *inode = mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
 	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
-	int index = page->index >> (msblk->block_log - PAGE_CACHE_SHIFT);
-	int start_index = page->index & ~mask;
+	int start_index = target_page->index & ~mask;
 	int end_index = start_index | mask;
+	int file_end = (i_size_read(inode) - 1) >> PAGE_CACHE_SHIFT;
+	int i, n, pages, res, avail;
+	struct page **page;
+	void *pageaddr;
+
+	if (end_index > file_end)
+		end_index = file_end;
+	pages = end_index - start_index + 1;
+
+	page = kmalloc(pages * sizeof(*page), GFP_KERNEL);
+	if (page == NULL) {
+		n = 0;
+		goto read_cache;
+	}
+
+	for (n = 0, i = start_index; i <= end_index; n++, i++) {
+		if (i == target_page->index) {
+			page[n] = target_page;
+			continue;
+		}
+
+		page[n] = grab_cache_page_nowait(mapping, i);
+		if (page[n] == NULL)
+			goto read_cache;
+
+		if (PageUptodate(page[n])) {
+			unlock_page(page[n]);
+			page_cache_release(page[n]);
+			goto read_cache;
+		}
+	}
+
+	/*
+	 * The pages only cover the block up to the end of the file, so bound
+	 * the source length by them too.  A block stored uncompressed is
+	 * copied as is, and mustn't overrun the last page.
+	 */
+	res = squashfs_read_data_pages(inode->i_sb, page, block, bsize,
+				pages << PAGE_CACHE_SHIFT, pages);
+	if (res < 0)
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+								bsize);
+
+	for (n = 0; n < pages; n++) {
+		if (res >= 0) {
+			avail = clamp_t(int, res - n * (int) PAGE_CACHE_SIZE,
+						0, PAGE_CACHE_SIZE);
+			pageaddr = kmap_atomic(page[n], KM_USER0);
+			memset(pageaddr + avail, 0, PAGE_CACHE_SIZE - avail);
+			kunmap_atomic(pageaddr, KM_USER0);
+			flush_dcache_page(page[n]);
+			SetPageUptodate(page[n]);
+		} else if (page[n] == target_page)
+			continue;
+
+		unlock_page(page[n]);
+		if (page[n] != target_page)
+			page_cache_release(page[n]);
+	}
+
+	kfree(page);
+	return res < 0 ? res : 0;
+
+read_cache:
+	/*
+	 * Release the pages grabbed so far, squashfs_copy_cache() grabs
+	 * them again.
+	 */
+	while (n--) {
+		if (page[n] == target_page)
+			continue;
+		unlock_page(page[n]);
+		page_cache_release(page[n]);
+	}
+	kfree(page);
+
+	return squashfs_read_cache(target_page, block, bsize);
+}
+
+
+static int squashfs_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int bytes;
+	struct squashfs_cache_entry *buffer;
+	void *pageaddr;
+
+	int index = page->index >> (msblk->block_log - PAGE_CACHE_SHIFT);
 	int file_end = i_size_read(inode) >> msblk->block_log;
 
 	TRACE("Entered squashfs_readpage, page index %lx, start block %llx\n",
@@ -408,21 +573,9 @@ static int squashfs_readpage(struct file *file, struct page *page)
 			bytes = index == file_end ?
 				(i_size_read(inode) & (msblk->block_size - 1)) :
 				 msblk->block_size;
-			sparse = 1;
-		} else {
-			/*
-			 * Read and decompress datablock.
-			 */
-			buffer = squashfs_get_datablock(inode->i_sb,
-								block, bsize);
-			if (buffer->error) {
-				ERROR("Unable to read page, block %llx, size %x"
-					"\n", block, bsize);
-				squashfs_cache_put(buffer);
-				goto error_out;
-			}
-			bytes = buffer->length;
-		}
+			squashfs_copy_cache(page, NULL, bytes, 0);
+		} else if (squashfs_readpage_block(page, block, bsize) < 0)
+			goto error_out;
 	} else {
 		/*
 		 * Datablock is stored inside a fragment (tail-end packed
@@ -440,45 +593,10 @@ static int squashfs_readpage(struct file *file, struct page *page)
 			goto error_out;
 		}
 		bytes = i_size_read(inode) & (msblk->block_size - 1);
-		offset = squashfs_i(inode)->fragment_offset;
-	}
-
-	/*
-	 * Loop copying datablock into pages.  As the datablock likely covers
-	 * many PAGE_CACHE_SIZE pages (default block size is 128 KiB) explicitly
-	 * grab the pages from the page cache, except for the page that we've
-	 * been called to fill.
-	 */
-	for (i = start_index; i <= end_index && bytes > 0; i++,
-			bytes -= PAGE_CACHE_SIZE, offset += PAGE_CACHE_SIZE) {
-		struct page *push_page;
-		int avail = sparse ? 0 : min_t(int, bytes, PAGE_CACHE_SIZE);
-
-		TRACE("bytes %d, i %d, available_bytes %d\n", bytes, i, avail);
-
-		push_page = (i == page->index) ? page :
-			grab_cache_page_nowait(page->mapping, i);
-
-		if (!push_page)
-			continue;
-
-		if (PageUptodate(push_page))
-			goto skip_page;
-
-		pageaddr = kmap_atomic(push_page, KM_USER0);
-		squashfs_copy_data(pageaddr, buffer, offset, avail);
-		memset(pageaddr + avail, 0, PAGE_CACHE_SIZE - avail);
-		kunmap_atomic(pageaddr, KM_USER0);
-		flush_dcache_page(push_page);
-		SetPageUptodate(push_page);
-skip_page:
-		unlock_page(push_page);
-		if (i != page->index)
-			page_cache_release(push_page);
-	}
-
-	if (!sparse)
+		squashfs_copy_cache(page, buffer, bytes,
+				squashfs_i(inode)->fragment_offset);
 		squashfs_cache_put(buffer);
+	}
 
 	return 0;
 
@@ -35,6 +35,10 @@ static inline struct squashfs_inode_info *squashfs_i(struct inode *inode)
 /* block.c */
 extern int squashfs_read_data(struct super_block *, void **, u64, int, u64 *,
 				int, int);
+extern int squashfs_read_data_pages(struct super_block *, struct page **, u64,
+				int, int, int);
+extern int squashfs_streams_init(struct squashfs_sb_info *);
+extern void squashfs_streams_delete(struct squashfs_sb_info *);
 
 /* cache.c */
 extern struct squashfs_cache *squashfs_cache_init(char *, int, int);
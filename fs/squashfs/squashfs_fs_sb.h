@@ -51,6 +51,11 @@ struct squashfs_cache_entry {
 	void			**data;
 };
 
+struct squashfs_stream {
+	z_stream		stream;
+	struct list_head	list;
+};
+
 struct squashfs_sb_info {
 	int			devblksize;
 	int			devblksize_log2;
@@ -61,10 +66,13 @@ struct squashfs_sb_info {
 	__le64			*id_table;
 	__le64			*fragment_index;
 	unsigned int		*fragment_index_2;
-	struct mutex		read_data_mutex;
 	struct mutex		meta_index_mutex;
 	struct meta_index	*meta_index;
-	z_stream		stream;
+	struct squashfs_stream	*streams;
+	int			stream_count;
+	struct list_head	free_streams;
+	spinlock_t		stream_lock;
+	wait_queue_head_t	stream_wait;
 	__le64			*inode_lookup_table;
 	u64			inode_table;
 	u64			directory_table;
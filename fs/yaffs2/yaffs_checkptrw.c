@@ -73,6 +73,7 @@ static void yaffs_CheckpointFindNextErasedBlock(yaffs_Device *dev)
 
 	if (dev->checkpointNextBlock >= 0 &&
 			dev->checkpointNextBlock <= dev->internalEndBlock &&
+			dev->blocksInCheckpoint < dev->checkpointMaxBlocks &&
 			blocksAvailable > 0) {
 
 		for (i = dev->checkpointNextBlock; i <= dev->internalEndBlock; i++) {
@@ -132,6 +133,7 @@ int yaffs_CheckpointOpen(yaffs_Device *dev, int forWriting)
 
 
 	dev->checkpointOpenForWrite = forWriting;
+	dev->checkpointOpenBlocks = 0;
 
 	/* Got the functions we need? */
 	if (!dev->writeChunkWithTagsToNAND ||
@@ -157,6 +159,11 @@ int yaffs_CheckpointOpen(yaffs_Device *dev, int forWriting)
 	dev->checkpointCurrentChunk = -1;
 	dev->checkpointNextBlock = dev->internalStartBlock;
 
+	/* A checkpoint block list of 1 checkpoint block per 16 block is (hopefully)
+	 * going to be way more than we need. Never write more than can be read back.
+	 */
+	dev->checkpointMaxBlocks = (dev->internalEndBlock - dev->internalStartBlock)/16 + 2;
+
 	/* Erase all the blocks in the checkpoint area */
 	if (forWriting) {
 		memset(dev->checkpointBuffer, 0, dev->nDataBytesPerChunk);
@@ -166,10 +173,7 @@ int yaffs_CheckpointOpen(yaffs_Device *dev, int forWriting)
 		int i;
 		/* Set to a value that will kick off a read */
 		dev->checkpointByteOffset = dev->nDataBytesPerChunk;
-		/* A checkpoint block list of 1 checkpoint block per 16 block is (hopefully)
-		 * going to be way more than we need */
 		dev->blocksInCheckpoint = 0;
-		dev->checkpointMaxBlocks = (dev->internalEndBlock - dev->internalStartBlock)/16 + 2;
 		dev->checkpointBlockList = YMALLOC(sizeof(int) * dev->checkpointMaxBlocks);
 		if(!dev->checkpointBlockList)
 			return 0;
@@ -181,6 +185,66 @@ int yaffs_CheckpointOpen(yaffs_Device *dev, int forWriting)
 	return 1;
 }
 
+/*
+ * Reopen the checkpoint written earlier in this mount to append to it.
+ * Writing carries on at the page after the last one written, with a fresh
+ * checksum, so the reader can tell where the appended record starts.
+ */
+int yaffs_CheckpointOpenAppend(yaffs_Device *dev)
+{
+	dev->checkpointOpenBlocks = dev->blocksInCheckpoint;
+
+	if (!dev->writeChunkWithTagsToNAND ||
+			!dev->readChunkWithTagsFromNAND ||
+			!dev->eraseBlockInNAND ||
+			!dev->markNANDBlockBad)
+		return 0;
+
+	if (!dev->checkpointBuffer)
+		dev->checkpointBuffer = YMALLOC_DMA(dev->totalBytesPerChunk);
+	if (!dev->checkpointBuffer)
+		return 0;
+
+	dev->checkpointOpenForWrite = 1;
+	dev->checkpointByteCount = 0;
+	dev->checkpointSum = 0;
+	dev->checkpointXor = 0;
+	dev->checkpointMaxBlocks = (dev->internalEndBlock - dev->internalStartBlock)/16 + 2;
+
+	memset(dev->checkpointBuffer, 0, dev->nDataBytesPerChunk);
+	dev->checkpointByteOffset = 0;
+
+	return 1;
+}
+
+/*
+ * Records always start on a fresh page. Tell notes the page after the
+ * record just read, Seek goes back there and starts a fresh checksum, so
+ * the reader can try the next record and return to where the stream ended
+ * if there is none.
+ */
+void yaffs_CheckpointTell(yaffs_Device *dev, yaffs_CheckpointPosition *pos)
+{
+	pos->currentBlock = dev->checkpointCurrentBlock;
+	pos->currentChunk = dev->checkpointCurrentChunk;
+	pos->nextBlock = dev->checkpointNextBlock;
+	pos->pageSequence = dev->checkpointPageSequence;
+	pos->nBlocks = dev->blocksInCheckpoint;
+}
+
+void yaffs_CheckpointSeek(yaffs_Device *dev, const yaffs_CheckpointPosition *pos)
+{
+	dev->checkpointCurrentBlock = pos->currentBlock;
+	dev->checkpointCurrentChunk = pos->currentChunk;
+	dev->checkpointNextBlock = pos->nextBlock;
+	dev->checkpointPageSequence = pos->pageSequence;
+	dev->blocksInCheckpoint = pos->nBlocks;
+
+	dev->checkpointByteOffset = dev->nDataBytesPerChunk;
+	dev->checkpointSum = 0;
+	dev->checkpointXor = 0;
+}
+
 int yaffs_GetCheckpointSum(yaffs_Device *dev, __u32 *sum)
 {
 	__u32 compositeSum;
@@ -227,8 +291,10 @@ static int yaffs_CheckpointFlushBuffer(yaffs_Device *dev)
 
 	dev->nPageWrites++;
 
-	dev->writeChunkWithTagsToNAND(dev, realignedChunk,
-			dev->checkpointBuffer, &tags);
+	if (dev->writeChunkWithTagsToNAND(dev, realignedChunk,
+			dev->checkpointBuffer, &tags) != YAFFS_OK)
+		return 0;
+
 	dev->checkpointByteOffset = 0;
 	dev->checkpointPageSequence++;
 	dev->checkpointCurrentChunk++;
@@ -354,10 +420,11 @@ int yaffs_CheckpointRead(yaffs_Device *dev, void *data, int nBytes)
 
 int yaffs_CheckpointClose(yaffs_Device *dev)
 {
+	int ok = 1;
 
 	if (dev->checkpointOpenForWrite) {
 		if (dev->checkpointByteOffset != 0)
-			yaffs_CheckpointFlushBuffer(dev);
+			ok = yaffs_CheckpointFlushBuffer(dev);
 	} else if(dev->checkpointBlockList){
 		int i;
 		for (i = 0; i < dev->blocksInCheckpoint && dev->checkpointBlockList[i] >= 0; i++) {
@@ -375,8 +442,9 @@ int yaffs_CheckpointClose(yaffs_Device *dev)
 		dev->checkpointBlockList = NULL;
 	}
 
-	dev->nFreeChunks -= dev->blocksInCheckpoint * dev->nChunksPerBlock;
-	dev->nErasedBlocks -= dev->blocksInCheckpoint;
+	dev->nFreeChunks -= (dev->blocksInCheckpoint - dev->checkpointOpenBlocks) *
+				dev->nChunksPerBlock;
+	dev->nErasedBlocks -= (dev->blocksInCheckpoint - dev->checkpointOpenBlocks);
 
 
 	T(YAFFS_TRACE_CHECKPOINT, (TSTR("checkpoint byte count %d" TENDSTR),
@@ -386,7 +454,7 @@ int yaffs_CheckpointClose(yaffs_Device *dev)
 		/* free the buffer */
 		YFREE(dev->checkpointBuffer);
 		dev->checkpointBuffer = NULL;
-		return 1;
+		return ok;
 	} else
 		return 0;
 }
@@ -20,6 +20,12 @@
 
 int yaffs_CheckpointOpen(yaffs_Device *dev, int forWriting);
 
+int yaffs_CheckpointOpenAppend(yaffs_Device *dev);
+
+void yaffs_CheckpointTell(yaffs_Device *dev, yaffs_CheckpointPosition *pos);
+
+void yaffs_CheckpointSeek(yaffs_Device *dev, const yaffs_CheckpointPosition *pos);
+
 int yaffs_CheckpointWrite(yaffs_Device *dev, const void *data, int nBytes);
 
 int yaffs_CheckpointRead(yaffs_Device *dev, void *data, int nBytes);
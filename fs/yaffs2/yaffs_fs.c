@@ -50,6 +50,9 @@ extern const char *yaffs_guts_c_version;
 #include <linux/mtd/mtd.h>
 #include <linux/interrupt.h>
 #include <linux/string.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/jiffies.h>
 #include <linux/ctype.h>
 
 #include "asm/div64.h"
@@ -121,12 +124,20 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 unsigned int yaffs_traceMask = YAFFS_TRACE_BAD_BLOCKS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
+unsigned int yaffs_bg_gc = 1;		/* start a background gc thread */
+unsigned int yaffs_bg_gc_blocks = 4;	/* erased blocks it keeps spare */
+unsigned int yaffs_bg_gc_idle_ms = 100;	/* quiet time before it runs */
+unsigned int yaffs_short_op_caches = 10; /* chunks in the short op cache */
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_traceMask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
+module_param(yaffs_bg_gc, uint, 0644);
+module_param(yaffs_bg_gc_blocks, uint, 0644);
+module_param(yaffs_bg_gc_idle_ms, uint, 0644);
+module_param(yaffs_short_op_caches, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
@@ -169,6 +180,7 @@ static struct inode *yaffs_iget(struct super_block *sb, unsigned long ino);
 		} while(0)
 		
 static void yaffs_put_super(struct super_block *sb);
+static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data);
 
 static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 				loff_t *pos);
@@ -359,6 +371,7 @@ static const struct super_operations yaffs_super_ops = {
 	.put_inode = yaffs_put_inode,
 #endif
 	.put_super = yaffs_put_super,
+	.remount_fs = yaffs_remount_fs,
 	.delete_inode = yaffs_delete_inode,
 	.clear_inode = yaffs_clear_inode,
 	.sync_fs = yaffs_sync_fs,
@@ -370,11 +383,17 @@ static void yaffs_GrossLock(yaffs_Device *dev)
 	T(YAFFS_TRACE_OS, ("yaffs locking %p\n", current));
 	down(&dev->grossLock);
 	T(YAFFS_TRACE_OS, ("yaffs locked %p\n", current));
+	dev->lastForegroundOp = jiffies;
 }
 
 static void yaffs_GrossUnlock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_OS, ("yaffs unlocking %p\n", current));
+	/* Kick an idle background gc thread once something has been written */
+	if (dev->gcIdle && dev->nPageWrites != dev->gcIdleWrites) {
+		dev->gcIdle = 0;
+		wake_up_process(dev->gcThread);
+	}
 	up(&dev->grossLock);
 }
 
@@ -712,6 +731,62 @@ static int yaffs_file_flush(struct file *file)
 	return 0;
 }
 
+/*
+ * Read file data for readpage. Whole chunks are looked up under treeLock
+ * and read from NAND without grossLock, so that readers are not held up
+ * behind writers and garbage collection or behind each other. Anything
+ * else, or a chunk whose block may have been erased while it was read, is
+ * read under grossLock. Called with no yaffs lock held.
+ */
+static int yaffs_ReadDataUnlocked(yaffs_Object *obj, __u8 *buf, loff_t offset,
+				int nBytes)
+{
+	yaffs_Device *dev = obj->myDev;
+	int nDone = 0;
+	int n;
+	int ret;
+	int chunkInNAND;
+	int erasures;
+
+	while (nDone < nBytes) {
+		n = nBytes - nDone;
+		if (n > dev->nDataBytesPerChunk)
+			n = dev->nDataBytesPerChunk;
+
+		/* Any erase after this could have reused the chunk found */
+		erasures = ACCESS_ONCE(dev->nBlockErasures);
+		smp_rmb();
+
+		chunkInNAND = yaffs_FindChunkForUnlockedRead(obj,
+						offset + nDone, n);
+		if (chunkInNAND > 0) {
+			ret = yaffs_ReadChunkUnlocked(dev, chunkInNAND,
+						buf + nDone);
+			smp_rmb();
+
+			if (ret == YAFFS_OK &&
+			    ACCESS_ONCE(dev->nBlockErasures) == erasures) {
+				atomic_inc(&dev->nUnlockedReads);
+				nDone += n;
+				continue;
+			}
+
+			/* Moved by gc or an ECC problem, do it properly */
+			atomic_inc(&dev->nUnlockedReadRetries);
+		}
+
+		yaffs_GrossLock(dev);
+		ret = yaffs_ReadDataFromFile(obj, buf + nDone,
+					offset + nDone, n);
+		yaffs_GrossUnlock(dev);
+		if (ret < 0)
+			return ret;
+		nDone += n;
+	}
+
+	return nDone;
+}
+
 static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 {
 	/* Lifted from jffs2 */
@@ -720,16 +795,12 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	unsigned char *pg_buf;
 	int ret;
 
-	yaffs_Device *dev;
-
 	T(YAFFS_TRACE_OS, ("yaffs_readpage at %08x, size %08x\n",
 			(unsigned)(pg->index << PAGE_CACHE_SHIFT),
 			(unsigned)PAGE_CACHE_SIZE));
 
 	obj = yaffs_DentryToObject(f->f_dentry);
 
-	dev = obj->myDev;
-
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 	BUG_ON(!PageLocked(pg));
 #else
@@ -740,14 +811,10 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
-
-	ret = yaffs_ReadDataFromFile(obj, pg_buf,
+	ret = yaffs_ReadDataUnlocked(obj, pg_buf,
 				pg->index << PAGE_CACHE_SHIFT,
 				PAGE_CACHE_SIZE);
 
-	yaffs_GrossUnlock(dev);
-
 	if (ret >= 0)
 		ret = 0;
 
@@ -1845,17 +1912,125 @@ static void yaffs_read_inode(struct inode *inode)
 
 static YLIST_HEAD(yaffs_dev_list);
 
-#if 0 /* not used */
+/*
+ * Background garbage collection.
+ *
+ * This thread keeps yaffs_bg_gc_blocks blocks above the aggressive gc
+ * threshold erased, one passive gc step at a time, and only once the file
+ * system has been left alone for yaffs_bg_gc_idle_ms. Writes leave passive
+ * gc to it until half of those blocks are used up, so that a steady stream
+ * of writes, which never lets the thread run, still collects as it goes. It
+ * does not run on a checkpointed (clean) file system, where collecting would
+ * only throw the checkpoint away, nor on a read only mount.
+ *
+ * Once there is nothing left to collect, the thread sleeps until
+ * yaffs_GrossUnlock() kicks it after the next write. It is freezable, and
+ * only freezes between gc steps, so it never holds grossLock or has flash
+ * I/O in flight across a suspend.
+ */
+static int yaffs_BackgroundGCThread(void *data)
+{
+	yaffs_Device *dev = (yaffs_Device *)data;
+	unsigned long idle;
+	unsigned long delay;
+	int more;
+
+	T(YAFFS_TRACE_GC, ("yaffs: background gc thread for %s\n", dev->name));
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		try_to_freeze();
+
+		idle = msecs_to_jiffies(yaffs_bg_gc_idle_ms);
+
+		if (time_before(jiffies, dev->lastForegroundOp + idle)) {
+			/* Busy, back off */
+			delay = dev->lastForegroundOp + idle - jiffies;
+			schedule_timeout_interruptible(delay);
+			continue;
+		}
+
+		down(&dev->grossLock);
+		if (dev->gcThread)
+			dev->backgroundGC = yaffs_bg_gc_blocks;
+		more = yaffs_BackgroundGarbageCollect(dev, yaffs_bg_gc_blocks);
+		if (!more && dev->gcThread) {
+			dev->gcIdleWrites = dev->nPageWrites;
+			dev->gcIdle = 1;
+		}
+		up(&dev->grossLock);
+
+		if (more) {
+			schedule_timeout_interruptible(1);
+			continue;
+		}
+
+		/* Nothing to do until the next write, or until we are stopped */
+		set_current_state(TASK_INTERRUPTIBLE);
+		if ((dev->gcIdle || !dev->gcThread) && !kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+static void yaffs_StartBackgroundGC(yaffs_Device *dev)
+{
+	struct task_struct *thread;
+
+	if (!yaffs_bg_gc || !dev->isYaffs2 || dev->gcThread)
+		return;
+
+	thread = kthread_create(yaffs_BackgroundGCThread, dev, "yaffs-gc-%s",
+				dev->name);
+	if (IS_ERR(thread)) {
+		T(YAFFS_TRACE_ALWAYS,
+		  ("yaffs: could not start background gc for %s\n",
+		   dev->name));
+		return;
+	}
+
+	down(&dev->grossLock);
+	dev->gcThread = thread;
+	dev->backgroundGC = yaffs_bg_gc_blocks;
+	up(&dev->grossLock);
+	wake_up_process(thread);
+}
+
+/*
+ * gcThread and gcIdle only change under grossLock, so yaffs_GrossUnlock()
+ * never kicks a thread that has already been stopped.
+ */
+static void yaffs_StopBackgroundGC(yaffs_Device *dev)
+{
+	struct task_struct *thread;
+
+	down(&dev->grossLock);
+	thread = dev->gcThread;
+	dev->gcThread = NULL;
+	dev->gcIdle = 0;
+	dev->backgroundGC = 0;
+	up(&dev->grossLock);
+
+	if (thread)
+		kthread_stop(thread);
+}
+
 static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data)
 {
 	yaffs_Device    *dev = yaffs_SuperToDevice(sb);
 
-	if (*flags & MS_RDONLY) {
+	if ((*flags & MS_RDONLY) && !(sb->s_flags & MS_RDONLY)) {
 		struct mtd_info *mtd = yaffs_SuperToDevice(sb)->genericDevice;
 
 		T(YAFFS_TRACE_OS,
 			("yaffs_remount_fs: %s: RO\n", dev->name));
 
+		/* Nothing may be written behind a read only mount */
+		yaffs_StopBackgroundGC(dev);
+
 		yaffs_GrossLock(dev);
 
 		yaffs_FlushEntireDeviceCache(dev);
@@ -1866,14 +2041,15 @@ static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data)
 			mtd->sync(mtd);
 
 		yaffs_GrossUnlock(dev);
-	} else {
+	} else if (!(*flags & MS_RDONLY) && (sb->s_flags & MS_RDONLY)) {
 		T(YAFFS_TRACE_OS,
 			("yaffs_remount_fs: %s: RW\n", dev->name));
+
+		yaffs_StartBackgroundGC(dev);
 	}
 
 	return 0;
 }
-#endif
 
 static void yaffs_put_super(struct super_block *sb)
 {
@@ -1881,6 +2057,8 @@ static void yaffs_put_super(struct super_block *sb)
 
 	T(YAFFS_TRACE_OS, ("yaffs_put_super\n"));
 
+	yaffs_StopBackgroundGC(dev);
+
 	yaffs_GrossLock(dev);
 
 	yaffs_FlushEntireDeviceCache(dev);
@@ -2187,7 +2365,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	dev->nChunksPerBlock = YAFFS_CHUNKS_PER_BLOCK;
 	dev->totalBytesPerChunk = YAFFS_BYTES_PER_CHUNK;
 	dev->nReservedBlocks = 5;
-	dev->nShortOpCaches = (options.no_cache) ? 0 : 10;
+	dev->nShortOpCaches = (options.no_cache) ? 0 : yaffs_short_op_caches;
 	dev->inbandTags = options.inband_tags;
 
 	/* ... and the functions. */
@@ -2198,6 +2376,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 		    nandmtd2_ReadChunkWithTagsFromNAND;
 		dev->markNANDBlockBad = nandmtd2_MarkNANDBlockBad;
 		dev->queryNANDBlock = nandmtd2_QueryNANDBlock;
+		dev->readBlockTagsFromNAND = nandmtd2_ReadBlockTagsFromNAND;
 		dev->spareBuffer = YMALLOC(mtd->oobsize);
 		dev->isYaffs2 = 1;
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
@@ -2255,6 +2434,9 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
         dev->removeObjectCallback = yaffs_RemoveObjectCallback;
 
 	init_MUTEX(&dev->grossLock);
+	init_rwsem(&dev->treeLock);
+	atomic_set(&dev->nUnlockedReads, 0);
+	atomic_set(&dev->nUnlockedReadRetries, 0);
 
 	yaffs_GrossLock(dev);
 
@@ -2290,6 +2472,9 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	}
 	sb->s_root = root;
 	sb->s_dirt = !dev->isCheckpointed;
+
+	if (!(sb->s_flags & MS_RDONLY))
+		yaffs_StartBackgroundGC(dev);
 	T(YAFFS_TRACE_ALWAYS,
 	  ("yaffs_read_super: isCheckpointed %d\n", dev->isCheckpointed));
 
@@ -2412,11 +2597,17 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "nFreeChunks........ %d\n", dev->nFreeChunks);
 	buf += sprintf(buf, "nPageWrites........ %d\n", dev->nPageWrites);
 	buf += sprintf(buf, "nPageReads......... %d\n", dev->nPageReads);
+	buf += sprintf(buf, "nUnlockedReads..... %d\n",
+		    atomic_read(&dev->nUnlockedReads));
+	buf += sprintf(buf, "nUnlockedRetries... %d\n",
+		    atomic_read(&dev->nUnlockedReadRetries));
 	buf += sprintf(buf, "nBlockErasures..... %d\n", dev->nBlockErasures);
 	buf += sprintf(buf, "nGCCopies.......... %d\n", dev->nGCCopies);
 	buf += sprintf(buf, "garbageCollections. %d\n", dev->garbageCollections);
 	buf += sprintf(buf, "passiveGCs......... %d\n",
 		    dev->passiveGarbageCollections);
+	buf += sprintf(buf, "backgroundGCs...... %d\n",
+		    dev->backgroundGarbageCollections);
 	buf += sprintf(buf, "nRetriedWrites..... %d\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->nShortOpCaches);
 	buf += sprintf(buf, "nRetireBlocks...... %d\n", dev->nRetiredBlocks);
@@ -2425,6 +2616,8 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "tagsEccFixed....... %d\n", dev->tagsEccFixed);
 	buf += sprintf(buf, "tagsEccUnfixed..... %d\n", dev->tagsEccUnfixed);
 	buf += sprintf(buf, "cacheHits.......... %d\n", dev->cacheHits);
+	buf += sprintf(buf, "cacheMisses........ %d\n", dev->cacheMisses);
+	buf += sprintf(buf, "cacheFlushes....... %d\n", dev->cacheFlushes);
 	buf += sprintf(buf, "nDeletedFiles...... %d\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %d\n", dev->nUnlinkedFiles);
 	buf +=
@@ -34,9 +34,27 @@ const char *yaffs_guts_c_version =
 
 
 #define YAFFS_PASSIVE_GC_CHUNKS 2
+#define YAFFS_GC_TIEBREAK_BLOCKS 4
 
 #include "yaffs_ecc.h"
 
+/*
+ * dev->treeLock lets readers look up chunks without grossLock (see
+ * yaffs_FindChunkForUnlockedRead()). Everything that changes a file's tnode
+ * tree or the chunk cache index holds it for writing, inside grossLock.
+ */
+#ifdef __KERNEL__
+#define yaffs_TreeLock(dev)		down_write(&(dev)->treeLock)
+#define yaffs_TreeUnlock(dev)		up_write(&(dev)->treeLock)
+#define yaffs_TreeReadLock(dev)		down_read(&(dev)->treeLock)
+#define yaffs_TreeReadUnlock(dev)	up_read(&(dev)->treeLock)
+#else
+#define yaffs_TreeLock(dev)		do { } while (0)
+#define yaffs_TreeUnlock(dev)		do { } while (0)
+#define yaffs_TreeReadLock(dev)		do { } while (0)
+#define yaffs_TreeReadUnlock(dev)	do { } while (0)
+#endif
+
 
 /* Robustification (if it ever comes about...) */
 static void yaffs_RetireBlock(yaffs_Device *dev, int blockInNAND);
@@ -103,6 +121,14 @@ static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in);
 static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId);
 
 static void yaffs_InvalidateCheckpoint(yaffs_Device *dev);
+static void yaffs_MarkCheckpointStale(yaffs_Device *dev);
+static void yaffs_CheckpointChunksChanged(yaffs_Object *obj, __u32 low,
+					__u32 high);
+static void yaffs_CheckpointObjectGone(yaffs_Device *dev, __u32 objectId);
+static int yaffs_CheckpointRollForward(yaffs_Device *dev);
+static int yaffs_CountFreeChunks(yaffs_Device *dev);
+
+static void yaffs_UpdateDirtyIndex(yaffs_Device *dev, int blockNo);
 
 static int yaffs_FindChunkInFile(yaffs_Object *in, int chunkInInode,
 				yaffs_ExtendedTags *tags);
@@ -927,7 +953,7 @@ static int yaffs_WriteNewChunkWithTagsToNAND(struct yaffs_DeviceStruct *dev,
 	int writeOk = 0;
 	int chunk;
 
-	yaffs_InvalidateCheckpoint(dev);
+	yaffs_MarkCheckpointStale(dev);
 
 	do {
 		yaffs_BlockInfo *bi = 0;
@@ -1019,7 +1045,7 @@ static void yaffs_RetireBlock(yaffs_Device *dev, int blockInNAND)
 {
 	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blockInNAND);
 
-	yaffs_InvalidateCheckpoint(dev);
+	yaffs_MarkCheckpointStale(dev);
 
 	if (yaffs_MarkBlockBad(dev, blockInNAND) != YAFFS_OK) {
 		if (yaffs_EraseBlockInNAND(dev, blockInNAND) != YAFFS_OK) {
@@ -1126,8 +1152,52 @@ static __u16 yaffs_CalcNameSum(const YCHAR *name)
 	return sum;
 }
 
+/*
+ * Directory entries are found by name through a device wide hash keyed on
+ * the parent and the name sum. A child whose name is not known yet (it was
+ * lazy loaded or has no object header) sits on its parent's unindexed list
+ * instead, and is moved into the hash by the next lookup in that directory.
+ */
+static int yaffs_NameHashFunction(yaffs_Object *dir, __u16 sum)
+{
+	return (dir->objectId * 31 + sum) % YAFFS_NNAME_BUCKETS;
+}
+
+static int yaffs_NameIndexable(yaffs_Object *obj)
+{
+	return !obj->lazyLoaded && obj->hdrChunk > 0 &&
+		obj->objectId != YAFFS_OBJECTID_LOSTNFOUND;
+}
+
+static void yaffs_IndexObjectName(yaffs_Object *obj)
+{
+	yaffs_Object *parent = obj->parent;
+
+	ylist_del_init(&obj->nameLink);
+	obj->nameIndexed = 0;
+
+	if (!parent)
+		return;
+
+	if (yaffs_NameIndexable(obj)) {
+		ylist_add(&obj->nameLink,
+			&obj->myDev->nameBucket[yaffs_NameHashFunction(parent, obj->sum)]);
+		obj->nameIndexed = 1;
+	} else
+		ylist_add(&obj->nameLink,
+			&parent->variant.directoryVariant.unindexed);
+}
+
 static void yaffs_SetObjectName(yaffs_Object *obj, const YCHAR *name)
 {
+	/* The sum is about to change, so take it out of the hash */
+	if (obj->nameIndexed) {
+		ylist_del_init(&obj->nameLink);
+		obj->nameIndexed = 0;
+		ylist_add(&obj->nameLink,
+			&obj->parent->variant.directoryVariant.unindexed);
+	}
+
 #ifdef CONFIG_YAFFS_SHORT_NAMES_IN_RAM
 	memset(obj->shortName, 0, sizeof(YCHAR) * (YAFFS_SHORT_NAME_LENGTH+1));
 	if (name && yaffs_strlen(name) <= YAFFS_SHORT_NAME_LENGTH)
@@ -1642,6 +1712,9 @@ static int yaffs_DeleteWorker(yaffs_Object *in, yaffs_Tnode *tn, __u32 level,
 					}
 
 					yaffs_PutLevel0Tnode(dev, tn, i, 0);
+					yaffs_CheckpointChunksChanged(in,
+							chunkInInode,
+							chunkInInode);
 				}
 
 			}
@@ -1665,6 +1738,7 @@ static void yaffs_SoftDeleteChunk(yaffs_Device *dev, int chunk)
 	if (theBlock) {
 		theBlock->softDeletions++;
 		dev->nFreeChunks++;
+		yaffs_UpdateDirtyIndex(dev, chunk / dev->nChunksPerBlock);
 	}
 }
 
@@ -1738,18 +1812,23 @@ static void yaffs_SoftDeleteFile(yaffs_Object *obj)
 	    obj->variantType == YAFFS_OBJECT_TYPE_FILE && !obj->softDeleted) {
 		if (obj->nDataChunks <= 0) {
 			/* Empty file with no duplicate object headers, just delete it immediately */
+			yaffs_TreeLock(obj->myDev);
 			yaffs_FreeTnode(obj->myDev,
 					obj->variant.fileVariant.top);
 			obj->variant.fileVariant.top = NULL;
+			yaffs_TreeUnlock(obj->myDev);
 			T(YAFFS_TRACE_TRACING,
 			  (TSTR("yaffs: Deleting empty file %d" TENDSTR),
 			   obj->objectId));
 			yaffs_DoGenericObjectDeletion(obj);
 		} else {
+			yaffs_TreeLock(obj->myDev);
 			yaffs_SoftDeleteWorker(obj,
 					       obj->variant.fileVariant.top,
 					       obj->variant.fileVariant.
 					       topLevel, 0);
+			yaffs_TreeUnlock(obj->myDev);
+			yaffs_CheckpointChunksChanged(obj, 0, YAFFS_MAX_CHUNK_ID);
 			obj->softDeleted = 1;
 		}
 	}
@@ -1921,12 +2000,15 @@ static yaffs_Object *yaffs_AllocateEmptyObject(yaffs_Device *dev)
 		YINIT_LIST_HEAD(&(tn->hardLinks));
 		YINIT_LIST_HEAD(&(tn->hashLink));
 		YINIT_LIST_HEAD(&tn->siblings);
+		YINIT_LIST_HEAD(&tn->nameLink);
+		YINIT_LIST_HEAD(&tn->cacheList);
 
 
 		/* Now make the directory sane */
 		if (dev->rootDir) {
 			tn->parent = dev->rootDir;
 			ylist_add(&(tn->siblings), &dev->rootDir->variant.directoryVariant.children);
+			ylist_add(&tn->nameLink, &dev->rootDir->variant.directoryVariant.unindexed);
 		}
 
 		/* Add it to the lost and found directory.
@@ -1992,6 +2074,7 @@ static void yaffs_FreeObject(yaffs_Object *tn)
 	if (!ylist_empty(&tn->siblings))
 		YBUG();
 
+	yaffs_CheckpointObjectGone(dev, tn->objectId);
 
 #ifdef __KERNEL__
 	if (tn->myInode) {
@@ -2056,6 +2139,9 @@ static void yaffs_InitialiseObjects(yaffs_Device *dev)
 		YINIT_LIST_HEAD(&dev->objectBucket[i].list);
 		dev->objectBucket[i].count = 0;
 	}
+
+	for (i = 0; i < YAFFS_NNAME_BUCKETS; i++)
+		YINIT_LIST_HEAD(&dev->nameBucket[i]);
 }
 
 static int yaffs_FindNiceObjectBucket(yaffs_Device *dev)
@@ -2211,6 +2297,8 @@ yaffs_Object *yaffs_CreateNewObject(yaffs_Device *dev, int number,
 		case YAFFS_OBJECT_TYPE_DIRECTORY:
 			YINIT_LIST_HEAD(&theObject->variant.directoryVariant.
 					children);
+			YINIT_LIST_HEAD(&theObject->variant.directoryVariant.
+					unindexed);
 			break;
 		case YAFFS_OBJECT_TYPE_SYMLINK:
 		case YAFFS_OBJECT_TYPE_HARDLINK:
@@ -2558,8 +2646,26 @@ static int yaffs_InitialiseBlocks(yaffs_Device *dev)
 	}
 
 	if (dev->blockInfo && dev->chunkBits) {
+		dev->dirtyBuckets = YMALLOC((dev->nChunksPerBlock + 1) *
+					sizeof(struct ylist_head));
+		dev->dirtyLinks = YMALLOC(nBlocks * sizeof(struct ylist_head));
+		if (!dev->dirtyLinks) {
+			dev->dirtyLinks = YMALLOC_ALT(nBlocks * sizeof(struct ylist_head));
+			dev->dirtyLinksAlt = 1;
+		} else
+			dev->dirtyLinksAlt = 0;
+	}
+
+	if (dev->blockInfo && dev->chunkBits &&
+	    dev->dirtyBuckets && dev->dirtyLinks) {
+		int i;
+
 		memset(dev->blockInfo, 0, nBlocks * sizeof(yaffs_BlockInfo));
 		memset(dev->chunkBits, 0, dev->chunkBitmapStride * nBlocks);
+		for (i = 0; i <= dev->nChunksPerBlock; i++)
+			YINIT_LIST_HEAD(&dev->dirtyBuckets[i]);
+		for (i = 0; i < nBlocks; i++)
+			YINIT_LIST_HEAD(&dev->dirtyLinks[i]);
 		return YAFFS_OK;
 	}
 
@@ -2583,6 +2689,73 @@ static void yaffs_DeinitialiseBlocks(yaffs_Device *dev)
 		YFREE(dev->chunkBits);
 	dev->chunkBitsAlt = 0;
 	dev->chunkBits = NULL;
+
+	if (dev->dirtyBuckets)
+		YFREE(dev->dirtyBuckets);
+	dev->dirtyBuckets = NULL;
+
+	if (dev->dirtyLinksAlt && dev->dirtyLinks)
+		YFREE_ALT(dev->dirtyLinks);
+	else if (dev->dirtyLinks)
+		YFREE(dev->dirtyLinks);
+	dev->dirtyLinksAlt = 0;
+	dev->dirtyLinks = NULL;
+
+	if (dev->checkpointBlockInfo)
+		YFREE_ALT(dev->checkpointBlockInfo);
+	dev->checkpointBlockInfo = NULL;
+	if (dev->checkpointChunkBits)
+		YFREE_ALT(dev->checkpointChunkBits);
+	dev->checkpointChunkBits = NULL;
+	if (dev->checkpointGone)
+		YFREE(dev->checkpointGone);
+	dev->checkpointGone = NULL;
+	dev->nCheckpointGone = 0;
+	dev->checkpointGoneSize = 0;
+	dev->checkpointAppendOk = 0;
+}
+
+/*
+ * Dirty block index.
+ *
+ * FULL blocks are kept in dev->dirtyBuckets by their live chunk count so
+ * that gc can pick a victim without walking the block array. Blocks are
+ * (re)filed when they fill up and whenever a chunk in them is deleted.
+ * Leaving the FULL state is not tracked: yaffs_FindBlockForGarbageCollection()
+ * checks each entry it looks at and refiles or drops the stale ones.
+ */
+static void yaffs_UpdateDirtyIndex(yaffs_Device *dev, int blockNo)
+{
+	yaffs_BlockInfo *bi;
+	struct ylist_head *link;
+	int live;
+
+	if (!dev->dirtyLinks)
+		return;
+
+	bi = yaffs_GetBlockInfo(dev, blockNo);
+	link = &dev->dirtyLinks[blockNo - dev->internalStartBlock];
+
+	ylist_del_init(link);
+
+	if (bi->blockState != YAFFS_BLOCK_STATE_FULL)
+		return;
+
+	live = bi->pagesInUse - bi->softDeletions;
+	if (live < 0)
+		live = 0;
+	if (live > dev->nChunksPerBlock)
+		live = dev->nChunksPerBlock;
+
+	ylist_add_tail(link, &dev->dirtyBuckets[live]);
+}
+
+static void yaffs_RebuildDirtyIndex(yaffs_Device *dev)
+{
+	int i;
+
+	for (i = dev->internalStartBlock; i <= dev->internalEndBlock; i++)
+		yaffs_UpdateDirtyIndex(dev, i);
 }
 
 static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
@@ -2629,15 +2802,16 @@ static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
 static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 					int aggressive)
 {
-	int b = dev->currentDirtyChecker;
-
+	int b;
 	int i;
-	int iterations;
+	int candidates;
 	int dirtiest = -1;
 	int pagesInUse = 0;
 	int prioritised = 0;
 	yaffs_BlockInfo *bi;
 	int pendingPrioritisedExist = 0;
+	struct ylist_head *link;
+	struct ylist_head *next;
 
 	/* First let's see if we need to grab a prioritised block */
 	if (dev->hasPendingPrioritisedGCs) {
@@ -2677,39 +2851,37 @@ static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 		pagesInUse =
 			(aggressive) ? dev->nChunksPerBlock : YAFFS_PASSIVE_GC_CHUNKS + 1;
 
-	if (aggressive)
-		iterations =
-		    dev->internalEndBlock - dev->internalStartBlock + 1;
-	else {
-		iterations =
-		    dev->internalEndBlock - dev->internalStartBlock + 1;
-		iterations = iterations / 16;
-		if (iterations > 200)
-			iterations = 200;
-	}
+	/* Take the dirtiest bucket with a block we may collect in it. Among
+	 * the first few such blocks prefer the oldest, for wear levelling.
+	 */
+	for (i = 0; i < pagesInUse && !prioritised && dirtiest < 0; i++) {
+		candidates = 0;
 
-	for (i = 0; i <= iterations && pagesInUse > 0 && !prioritised; i++) {
-		b++;
-		if (b < dev->internalStartBlock || b > dev->internalEndBlock)
-			b = dev->internalStartBlock;
+		ylist_for_each_safe(link, next, &dev->dirtyBuckets[i]) {
+			b = dev->internalStartBlock + (link - dev->dirtyLinks);
+			bi = yaffs_GetBlockInfo(dev, b);
 
-		if (b < dev->internalStartBlock || b > dev->internalEndBlock) {
-			T(YAFFS_TRACE_ERROR,
-			  (TSTR("**>> Block %d is not valid" TENDSTR), b));
-			YBUG();
-		}
+			if (bi->blockState != YAFFS_BLOCK_STATE_FULL ||
+			    bi->pagesInUse - bi->softDeletions != i) {
+				/* Stale, put it where it belongs */
+				yaffs_UpdateDirtyIndex(dev, b);
+				continue;
+			}
+
+			if (!yaffs_BlockNotDisqualifiedFromGC(dev, bi))
+				continue;
 
-		bi = yaffs_GetBlockInfo(dev, b);
+			if (dirtiest < 0 || bi->sequenceNumber <
+			    yaffs_GetBlockInfo(dev, dirtiest)->sequenceNumber)
+				dirtiest = b;
 
-		if (bi->blockState == YAFFS_BLOCK_STATE_FULL &&
-			(bi->pagesInUse - bi->softDeletions) < pagesInUse &&
-				yaffs_BlockNotDisqualifiedFromGC(dev, bi)) {
-			dirtiest = b;
-			pagesInUse = (bi->pagesInUse - bi->softDeletions);
+			if (++candidates >= YAFFS_GC_TIEBREAK_BLOCKS)
+				break;
 		}
-	}
 
-	dev->currentDirtyChecker = b;
+		if (dirtiest > 0)
+			pagesInUse = i;
+	}
 
 	if (dirtiest > 0) {
 		T(YAFFS_TRACE_GC,
@@ -2742,7 +2914,7 @@ static void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 	bi->blockState = YAFFS_BLOCK_STATE_DIRTY;
 
 	if (!bi->needsRetiring) {
-		yaffs_InvalidateCheckpoint(dev);
+		yaffs_MarkCheckpointStale(dev);
 		erasedOk = yaffs_EraseBlockInNAND(dev, blockNo);
 		if (!erasedOk) {
 			dev->nErasureFailures++;
@@ -2934,6 +3106,7 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 		/* If the block is full set the state to full */
 		if (dev->allocationPage >= dev->nChunksPerBlock) {
 			bi->blockState = YAFFS_BLOCK_STATE_FULL;
+			yaffs_UpdateDirtyIndex(dev, dev->allocationBlock);
 			dev->allocationBlock = -1;
 		}
 
@@ -3088,6 +3261,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 					 */
 
 					object->nDataChunks--;
+					object->checkpointDirty = 1;
 
 					if (object->nDataChunks <= 0) {
 						/* remeber to clean up the object */
@@ -3150,6 +3324,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 							/* It's a header */
 							object->hdrChunk =  newChunk;
 							object->serial =   tags.serialNumber;
+							object->checkpointDirty = 1;
 						} else {
 							/* It's a data chunk */
 							yaffs_PutChunkIntoFile
@@ -3176,10 +3351,12 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 			    yaffs_FindObjectByNumber(dev,
 						     dev->gcCleanupList[i]);
 			if (object) {
+				yaffs_TreeLock(dev);
 				yaffs_FreeTnode(dev,
 						object->variant.fileVariant.
 						top);
 				object->variant.fileVariant.top = NULL;
+				yaffs_TreeUnlock(dev);
 				T(YAFFS_TRACE_GC,
 				  (TSTR
 				   ("yaffs: About to finally delete object %d"
@@ -3236,6 +3413,12 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 		return YAFFS_OK;
 	}
 
+	/* A stale checkpoint is only kept while there is room to spare */
+	if (!dev->isCheckpointed && dev->blocksInCheckpoint > 0 &&
+	    dev->nErasedBlocks < dev->nReservedBlocks +
+	    yaffs_CalcCheckpointBlocksRequired(dev) + 2)
+		yaffs_InvalidateCheckpoint(dev);
+
 	/* This loop should pass the first time.
 	 * We'll only see looping here if the erase of the collected block fails.
 	 */
@@ -3253,6 +3436,16 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 		} else {
 			/* We're in no hurry */
 			aggressive = 0;
+
+			/*
+			 * ... and the background thread will get to it, as long
+			 * as it still has half of its spare blocks erased. Once
+			 * writes outrun it, collect here as well.
+			 */
+			if (dev->backgroundGC &&
+			    dev->nErasedBlocks >= dev->nReservedBlocks +
+			    checkpointBlockAdjust + 2 + (dev->backgroundGC + 1) / 2)
+				break;
 		}
 
 		if (dev->gcBlock <= 0) {
@@ -3288,6 +3481,51 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	return aggressive ? gcOk : YAFFS_OK;
 }
 
+/*
+ * yaffs_BackgroundGarbageCollect()
+ * Does one passive gc step (up to a handful of chunk copies, and the erase
+ * once the block is empty) while fewer than nSpareBlocks blocks above the
+ * aggressive gc threshold are erased. Runs from the background gc thread
+ * when the file system is idle, so that writes rarely have to collect.
+ * Returns 1 if there is more to do.
+ */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, int nSpareBlocks)
+{
+	int checkpointBlockAdjust;
+	int block;
+
+	/* Collecting would leave the checkpoint stale */
+	if (dev->isDoingGC || dev->isCheckpointed)
+		return 0;
+
+	checkpointBlockAdjust = yaffs_CalcCheckpointBlocksRequired(dev) - dev->blocksInCheckpoint;
+	if (checkpointBlockAdjust < 0)
+		checkpointBlockAdjust = 0;
+
+	if (dev->gcBlock <= 0) {
+		if (dev->nErasedBlocks >= dev->nReservedBlocks +
+		    checkpointBlockAdjust + 2 + nSpareBlocks)
+			return 0;
+
+		dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev, 0);
+		dev->gcChunk = 0;
+	}
+
+	block = dev->gcBlock;
+	if (block <= 0)
+		return 0;
+
+	dev->backgroundGarbageCollections++;
+
+	T(YAFFS_TRACE_GC,
+	  (TSTR("yaffs: background GC block %d erasedBlocks %d" TENDSTR),
+	   block, dev->nErasedBlocks));
+
+	yaffs_GarbageCollectBlock(dev, block, 0);
+
+	return 1;
+}
+
 /*-------------------------  TAGS --------------------------------*/
 
 static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
@@ -3356,8 +3594,13 @@ static int yaffs_FindAndDeleteChunkInFile(yaffs_Object *in, int chunkInInode,
 					   chunkInInode);
 
 		/* Delete the entry in the filestructure (if found) */
-		if (retVal != -1)
+		if (retVal != -1) {
+			yaffs_TreeLock(dev);
 			yaffs_PutLevel0Tnode(dev, tn, chunkInInode, 0);
+			yaffs_TreeUnlock(dev);
+			yaffs_CheckpointChunksChanged(in, chunkInInode,
+						chunkInInode);
+		}
 	}
 
 	return retVal;
@@ -3452,12 +3695,16 @@ static int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 		return YAFFS_OK;
 	}
 
+	yaffs_TreeLock(dev);
+
 	tn = yaffs_AddOrFindLevel0Tnode(dev,
 					&in->variant.fileVariant,
 					chunkInInode,
 					NULL);
-	if (!tn)
+	if (!tn) {
+		yaffs_TreeUnlock(dev);
 		return YAFFS_FAIL;
+	}
 
 	existingChunk = yaffs_GetChunkGroupBase(dev, tn, chunkInInode);
 
@@ -3530,6 +3777,7 @@ static int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 				 */
 				yaffs_DeleteChunk(dev, chunkInNAND, 1,
 						  __LINE__);
+				yaffs_TreeUnlock(dev);
 				return YAFFS_OK;
 			}
 		}
@@ -3540,6 +3788,9 @@ static int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 		in->nDataChunks++;
 
 	yaffs_PutLevel0Tnode(dev, tn, chunkInInode, chunkInNAND);
+	yaffs_CheckpointChunksChanged(in, chunkInInode, chunkInInode);
+
+	yaffs_TreeUnlock(dev);
 
 	return YAFFS_OK;
 }
@@ -3613,6 +3864,7 @@ void yaffs_DeleteChunk(yaffs_Device *dev, int chunkId, int markNAND, int lyn)
 		yaffs_ClearChunkBit(dev, block, page);
 
 		bi->pagesInUse--;
+		yaffs_UpdateDirtyIndex(dev, block);
 
 		if (bi->pagesInUse == 0 &&
 		    !bi->hasShrinkHeader &&
@@ -3818,6 +4070,7 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
 		if (newChunkId >= 0) {
 
 			in->hdrChunk = newChunkId;
+			in->checkpointDirty = 1;
 
 			if (prevChunkId > 0) {
 				yaffs_DeleteChunk(dev, prevChunkId, 1,
@@ -3859,17 +4112,77 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
  *   need a very intelligent search.
  */
 
+/*
+ * The short op cache.
+ *
+ * Entries in use are hashed on (object, chunkId) in dev->srHash, and are on
+ * their object's cacheList in chunkId order. All the entries are on
+ * dev->srLru in least recently used order, with free ones moved to the
+ * front. Finding and reusing an entry does not depend on the size of the
+ * cache, and flushing or invalidating an object, which is also what
+ * evicting a dirty entry does, only walks that object's entries.
+ */
+static int yaffs_CacheHash(const yaffs_Object *obj, int chunkId)
+{
+	return (obj->objectId * 7 + chunkId) % YAFFS_NCACHE_BUCKETS;
+}
+
+static void yaffs_SetCacheDirty(yaffs_Device *dev, yaffs_ChunkCache *cache,
+				int dirty)
+{
+	if (cache->dirty && !dirty)
+		dev->srDirty--;
+	else if (!cache->dirty && dirty)
+		dev->srDirty++;
+	cache->dirty = dirty;
+}
+
+/* Hook a free cache entry up to a chunk of an object */
+static void yaffs_AttachChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
+				yaffs_Object *obj, int chunkId)
+{
+	struct ylist_head *pos;
+
+	yaffs_TreeLock(dev);
+	cache->object = obj;
+	cache->chunkId = chunkId;
+	yaffs_SetCacheDirty(dev, cache, 0);
+	cache->locked = 0;
+	ylist_add(&cache->hashLink, &dev->srHash[yaffs_CacheHash(obj, chunkId)]);
+
+	/* Writes mostly go forwards, so look for our place from the end */
+	for (pos = obj->cacheList.prev; pos != &obj->cacheList; pos = pos->prev) {
+		if (ylist_entry(pos, yaffs_ChunkCache, objLink)->chunkId <
+		    chunkId)
+			break;
+	}
+	ylist_add(&cache->objLink, pos);
+	yaffs_TreeUnlock(dev);
+}
+
+/* Drop whatever is in a cache entry, and put it at the front of the LRU */
+static void yaffs_ReleaseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	yaffs_TreeLock(dev);
+	ylist_del_init(&cache->hashLink);
+	ylist_del_init(&cache->objLink);
+	cache->object = NULL;
+	yaffs_TreeUnlock(dev);
+	yaffs_SetCacheDirty(dev, cache, 0);
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, &dev->srLru);
+}
+
 static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
-	yaffs_ChunkCache *cache;
-	int nCaches = obj->myDev->nShortOpCaches;
+	struct ylist_head *i;
+
+	if (!dev->srDirty)
+		return 0;
 
-	for (i = 0; i < nCaches; i++) {
-		cache = &dev->srCache[i];
-		if (cache->object == obj &&
-		    cache->dirty)
+	ylist_for_each(i, &obj->cacheList) {
+		if (ylist_entry(i, yaffs_ChunkCache, objLink)->dirty)
 			return 1;
 	}
 
@@ -3880,52 +4193,35 @@ static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
+	struct ylist_head *i;
+	struct ylist_head *n;
 	yaffs_ChunkCache *cache;
-	int chunkWritten = 0;
-	int nCaches = obj->myDev->nShortOpCaches;
-
-	if (nCaches > 0) {
-		do {
-			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < nCaches; i++) {
-				if (dev->srCache[i].object == obj &&
-				    dev->srCache[i].dirty) {
-					if (!cache
-					    || dev->srCache[i].chunkId <
-					    lowest) {
-						cache = &dev->srCache[i];
-						lowest = cache->chunkId;
-					}
-				}
-			}
+	int chunkWritten;
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+	if (!dev->srDirty)
+		return;
 
-				chunkWritten =
-				    yaffs_WriteChunkDataToObject(cache->object,
-								 cache->chunkId,
-								 cache->data,
-								 cache->nBytes,
-								 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+	/* Write the dirty chunks out in chunkId order and free them up */
+	ylist_for_each_safe(i, n, &obj->cacheList) {
+		cache = ylist_entry(i, yaffs_ChunkCache, objLink);
+		if (!cache->dirty || cache->locked)
+			continue;
 
-		} while (cache && chunkWritten > 0);
+		chunkWritten = yaffs_WriteChunkDataToObject(obj,
+							    cache->chunkId,
+							    cache->data,
+							    cache->nBytes,
+							    1);
+		dev->cacheFlushes++;
+		yaffs_ReleaseChunkCache(dev, cache);
 
-		if (cache) {
+		if (chunkWritten <= 0) {
 			/* Hoosterman, disk full while writing cache out. */
 			T(YAFFS_TRACE_ERROR,
 			  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
-
+			break;
 		}
 	}
-
 }
 
 /*yaffs_FlushEntireDeviceCache(dev)
@@ -3935,26 +4231,17 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 
 void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
 {
-	yaffs_Object *obj;
 	int nCaches = dev->nShortOpCaches;
 	int i;
 
-	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
+	/* Flushing an object writes out all of its dirty entries, so one
+	 * pass over the cache finds every dirty object.
 	 */
-	do {
-		obj = NULL;
-		for (i = 0; i < nCaches && !obj; i++) {
-			if (dev->srCache[i].object &&
-			    dev->srCache[i].dirty)
-				obj = dev->srCache[i].object;
-
-		}
-		if (obj)
-			yaffs_FlushFilesChunkCache(obj);
-
-	} while (obj);
-
+	for (i = 0; i < nCaches && dev->srDirty; i++) {
+		if (dev->srCache[i].object &&
+		    dev->srCache[i].dirty)
+			yaffs_FlushFilesChunkCache(dev->srCache[i].object);
+	}
 }
 
 
@@ -3965,13 +4252,13 @@ void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
  */
 static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
 {
-	int i;
+	yaffs_ChunkCache *cache;
 
 	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (!dev->srCache[i].object)
-				return &dev->srCache[i];
-		}
+		/* Free entries live at the front of the LRU */
+		cache = ylist_entry(dev->srLru.next, yaffs_ChunkCache, lruLink);
+		if (!cache->object)
+			return cache;
 	}
 
 	return NULL;
@@ -3980,10 +4267,7 @@ static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
 static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 {
 	yaffs_ChunkCache *cache;
-	yaffs_Object *theObj;
-	int usage;
-	int i;
-	int pushout;
+	struct ylist_head *i;
 
 	if (dev->nShortOpCaches > 0) {
 		/* Try find a non-dirty one... */
@@ -3991,33 +4275,24 @@ static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 		cache = yaffs_GrabChunkCacheWorker(dev);
 
 		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
+			/* None free, take the least recently used unlocked one.
+			 * If it is dirty, flush its object and try again.
 			 * NB what's here is not very accurate, we actually flush the object
 			 * the last recently used page.
 			 */
 
-			/* With locking we can't assume we can use entry zero */
-
-			theObj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
-
-			for (i = 0; i < dev->nShortOpCaches; i++) {
-				if (dev->srCache[i].object &&
-				    !dev->srCache[i].locked &&
-				    (dev->srCache[i].lastUse < usage || !cache)) {
-					usage = dev->srCache[i].lastUse;
-					theObj = dev->srCache[i].object;
-					cache = &dev->srCache[i];
-					pushout = i;
-				}
+			ylist_for_each(i, &dev->srLru) {
+				cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+				if (!cache->locked)
+					break;
+				cache = NULL;
 			}
 
-			if (!cache || cache->dirty) {
+			if (cache && !cache->dirty) {
+				yaffs_ReleaseChunkCache(dev, cache);
+			} else if (cache) {
 				/* Flush and try again */
-				yaffs_FlushFilesChunkCache(theObj);
+				yaffs_FlushFilesChunkCache(cache->object);
 				cache = yaffs_GrabChunkCacheWorker(dev);
 			}
 
@@ -4028,46 +4303,53 @@ static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 
 }
 
-/* Find a cached chunk */
-static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
+/* Find a cached chunk, without counting it as a cache hit or miss */
+static yaffs_ChunkCache *yaffs_LookupChunkCache(const yaffs_Object *obj,
 					      int chunkId)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
-	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (dev->srCache[i].object == obj &&
-			    dev->srCache[i].chunkId == chunkId) {
-				dev->cacheHits++;
+	struct ylist_head *i;
+	yaffs_ChunkCache *cache;
 
-				return &dev->srCache[i];
-			}
+	if (dev->nShortOpCaches > 0) {
+		ylist_for_each(i, &dev->srHash[yaffs_CacheHash(obj, chunkId)]) {
+			cache = ylist_entry(i, yaffs_ChunkCache, hashLink);
+			if (cache->object == obj &&
+			    cache->chunkId == chunkId)
+				return cache;
 		}
 	}
 	return NULL;
 }
 
+/* Find a cached chunk */
+static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
+					      int chunkId)
+{
+	yaffs_Device *dev = obj->myDev;
+	yaffs_ChunkCache *cache = NULL;
+
+	if (dev->nShortOpCaches > 0) {
+		cache = yaffs_LookupChunkCache(obj, chunkId);
+		if (cache)
+			dev->cacheHits++;
+		else
+			dev->cacheMisses++;
+	}
+	return cache;
+}
+
 /* Mark the chunk for the least recently used algorithym */
 static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
 				int isAWrite)
 {
 
 	if (dev->nShortOpCaches > 0) {
-		if (dev->srLastUse < 0 || dev->srLastUse > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->nShortOpCaches; i++)
-				dev->srCache[i].lastUse = 0;
-
-			dev->srLastUse = 0;
-		}
-
-		dev->srLastUse++;
-
-		cache->lastUse = dev->srLastUse;
+		ylist_del(&cache->lruLink);
+		ylist_add_tail(&cache->lruLink, &dev->srLru);
 
 		if (isAWrite)
-			cache->dirty = 1;
+			yaffs_SetCacheDirty(dev, cache, 1);
 	}
 }
 
@@ -4078,10 +4360,10 @@ static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
 static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 {
 	if (object->myDev->nShortOpCaches > 0) {
-		yaffs_ChunkCache *cache = yaffs_FindChunkCache(object, chunkId);
+		yaffs_ChunkCache *cache = yaffs_LookupChunkCache(object, chunkId);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_ReleaseChunkCache(object->myDev, cache);
 	}
 }
 
@@ -4090,20 +4372,107 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
  */
 static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 {
-	int i;
 	yaffs_Device *dev = in->myDev;
 
-	if (dev->nShortOpCaches > 0) {
-		/* Invalidate it. */
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (dev->srCache[i].object == in)
-				dev->srCache[i].object = NULL;
+	while (!ylist_empty(&in->cacheList))
+		yaffs_ReleaseChunkCache(dev, ylist_entry(in->cacheList.next,
+						yaffs_ChunkCache, objLink));
+}
+
+/*--------------------- Checkpointing --------------------*/
+
+/*
+ * Between saves the checkpoint is not thrown away. The first write after a
+ * save appends a STALE record, and the next save appends a DELTA record
+ * holding the device, the blocks, the objects and the tnodes that changed
+ * since, so a clean unmount costs a few pages instead of a full rewrite.
+ * Once the deltas take up as much room as a full checkpoint, or an append
+ * fails, the checkpoint is erased and written out in full again.
+ */
+
+static void yaffs_CheckpointSnapshot(yaffs_Device *dev)
+{
+	__u32 nBlocks = (dev->internalEndBlock - dev->internalStartBlock + 1);
+	struct ylist_head *lh;
+	yaffs_Object *obj;
+	int i;
+
+	/* Remember what was saved, so the next delta holds only what changed */
+	if (!dev->checkpointBlockInfo)
+		dev->checkpointBlockInfo =
+			YMALLOC_ALT(nBlocks * sizeof(yaffs_BlockInfo));
+	if (!dev->checkpointChunkBits)
+		dev->checkpointChunkBits =
+			YMALLOC_ALT(nBlocks * dev->chunkBitmapStride);
+
+	dev->checkpointAppendOk = (dev->checkpointBlockInfo &&
+				   dev->checkpointChunkBits) ? 1 : 0;
+	if (dev->checkpointAppendOk) {
+		memcpy(dev->checkpointBlockInfo, dev->blockInfo,
+			nBlocks * sizeof(yaffs_BlockInfo));
+		memcpy(dev->checkpointChunkBits, dev->chunkBits,
+			nBlocks * dev->chunkBitmapStride);
+	}
+
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+		ylist_for_each(lh, &dev->objectBucket[i].list) {
+			if (lh) {
+				obj = ylist_entry(lh, yaffs_Object, hashLink);
+				obj->checkpointDirty = 0;
+				if (obj->variantType == YAFFS_OBJECT_TYPE_FILE) {
+					obj->variant.fileVariant.checkpointLow = ~0;
+					obj->variant.fileVariant.checkpointHigh = 0;
+				}
+			}
 		}
 	}
+
+	dev->nCheckpointGone = 0;
 }
 
-/*--------------------- Checkpointing --------------------*/
+static void yaffs_CheckpointChunksChanged(yaffs_Object *obj, __u32 low,
+					__u32 high)
+{
+	yaffs_FileStructure *fStruct = &obj->variant.fileVariant;
+
+	obj->checkpointDirty = 1;
+
+	if (obj->variantType != YAFFS_OBJECT_TYPE_FILE)
+		return;
+
+	if (low < fStruct->checkpointLow)
+		fStruct->checkpointLow = low;
+	if (high > fStruct->checkpointHigh)
+		fStruct->checkpointHigh = high;
+}
+
+static void yaffs_CheckpointObjectGone(yaffs_Device *dev, __u32 objectId)
+{
+	__u32 *newGone;
+	int newSize;
+
+	if (!dev->checkpointAppendOk)
+		return;
+
+	if (dev->nCheckpointGone >= dev->checkpointGoneSize) {
+		newSize = dev->checkpointGoneSize * 2 + 64;
+		newGone = YMALLOC(newSize * sizeof(__u32));
+		if (!newGone) {
+			/* Can't keep track, so the next save is a full one */
+			dev->checkpointAppendOk = 0;
+			return;
+		}
+		if (dev->checkpointGone) {
+			memcpy(newGone, dev->checkpointGone,
+				dev->nCheckpointGone * sizeof(__u32));
+			YFREE(dev->checkpointGone);
+		}
+		dev->checkpointGone = newGone;
+		dev->checkpointGoneSize = newSize;
+	}
 
+	dev->checkpointGone[dev->nCheckpointGone++] = objectId;
+}
 
 static int yaffs_WriteCheckpointValidityMarker(yaffs_Device *dev, int head)
 {
@@ -4114,12 +4483,21 @@ static int yaffs_WriteCheckpointValidityMarker(yaffs_Device *dev, int head)
 	cp.structType = sizeof(cp);
 	cp.magic = YAFFS_MAGIC;
 	cp.version = YAFFS_CHECKPOINT_VERSION;
-	cp.head = (head) ? 1 : 0;
+	cp.head = head;
 
 	return (yaffs_CheckpointWrite(dev, &cp, sizeof(cp)) == sizeof(cp)) ?
 		1 : 0;
 }
 
+static int yaffs_CheckValidityMarker(const yaffs_CheckpointValidity *cp,
+					int head)
+{
+	return (cp->structType == sizeof(*cp)) &&
+	       (cp->magic == YAFFS_MAGIC) &&
+	       (cp->version == YAFFS_CHECKPOINT_VERSION) &&
+	       (cp->head == head);
+}
+
 static int yaffs_ReadCheckpointValidityMarker(yaffs_Device *dev, int head)
 {
 	yaffs_CheckpointValidity cp;
@@ -4128,10 +4506,7 @@ static int yaffs_ReadCheckpointValidityMarker(yaffs_Device *dev, int head)
 	ok = (yaffs_CheckpointRead(dev, &cp, sizeof(cp)) == sizeof(cp));
 
 	if (ok)
-		ok = (cp.structType == sizeof(cp)) &&
-		     (cp.magic == YAFFS_MAGIC) &&
-		     (cp.version == YAFFS_CHECKPOINT_VERSION) &&
-		     (cp.head == ((head) ? 1 : 0));
+		ok = yaffs_CheckValidityMarker(&cp, head);
 	return ok ? 1 : 0;
 }
 
@@ -4167,11 +4542,15 @@ static void yaffs_CheckpointDeviceToDevice(yaffs_Device *dev,
 }
 
 
-static int yaffs_WriteCheckpointDevice(yaffs_Device *dev)
+static int yaffs_WriteCheckpointDevice(yaffs_Device *dev, int delta)
 {
 	yaffs_CheckpointDevice cp;
 	__u32 nBytes;
 	__u32 nBlocks = (dev->internalEndBlock - dev->internalStartBlock + 1);
+	__u32 i;
+	__u32 endMarker = ~0;
+	yaffs_BlockInfo *bi;
+	__u8 *bits;
 
 	int ok;
 
@@ -4181,6 +4560,33 @@ static int yaffs_WriteCheckpointDevice(yaffs_Device *dev)
 
 	ok = (yaffs_CheckpointWrite(dev, &cp, sizeof(cp)) == sizeof(cp));
 
+	if (ok && delta) {
+		/* Write the blocks that changed, each with its index */
+		for (i = 0; ok && i < nBlocks; i++) {
+			bi = &dev->blockInfo[i];
+			bits = &dev->chunkBits[i * dev->chunkBitmapStride];
+
+			if (!memcmp(bi, &dev->checkpointBlockInfo[i],
+					sizeof(yaffs_BlockInfo)) &&
+			    !memcmp(bits,
+				&dev->checkpointChunkBits[i * dev->chunkBitmapStride],
+				dev->chunkBitmapStride))
+				continue;
+
+			ok = (yaffs_CheckpointWrite(dev, &i, sizeof(i)) == sizeof(i));
+			if (ok)
+				ok = (yaffs_CheckpointWrite(dev, bi, sizeof(yaffs_BlockInfo)) ==
+					sizeof(yaffs_BlockInfo));
+			if (ok)
+				ok = (yaffs_CheckpointWrite(dev, bits, dev->chunkBitmapStride) ==
+					dev->chunkBitmapStride);
+		}
+		if (ok)
+			ok = (yaffs_CheckpointWrite(dev, &endMarker, sizeof(endMarker)) ==
+				sizeof(endMarker));
+		return ok ? 1 : 0;
+	}
+
 	/* Write block info */
 	if (ok) {
 		nBytes = nBlocks * sizeof(yaffs_BlockInfo);
@@ -4196,11 +4602,12 @@ static int yaffs_WriteCheckpointDevice(yaffs_Device *dev)
 
 }
 
-static int yaffs_ReadCheckpointDevice(yaffs_Device *dev)
+static int yaffs_ReadCheckpointDevice(yaffs_Device *dev, int delta)
 {
 	yaffs_CheckpointDevice cp;
 	__u32 nBytes;
 	__u32 nBlocks = (dev->internalEndBlock - dev->internalStartBlock + 1);
+	__u32 i;
 
 	int ok;
 
@@ -4214,6 +4621,25 @@ static int yaffs_ReadCheckpointDevice(yaffs_Device *dev)
 
 	yaffs_CheckpointDeviceToDevice(dev, &cp);
 
+	if (delta) {
+		ok = (yaffs_CheckpointRead(dev, &i, sizeof(i)) == sizeof(i));
+		while (ok && (~i)) {
+			if (i >= nBlocks)
+				return 0;
+			ok = (yaffs_CheckpointRead(dev, &dev->blockInfo[i],
+					sizeof(yaffs_BlockInfo)) ==
+				sizeof(yaffs_BlockInfo));
+			if (ok)
+				ok = (yaffs_CheckpointRead(dev,
+					&dev->chunkBits[i * dev->chunkBitmapStride],
+					dev->chunkBitmapStride) ==
+					dev->chunkBitmapStride);
+			if (ok)
+				ok = (yaffs_CheckpointRead(dev, &i, sizeof(i)) == sizeof(i));
+		}
+		return ok ? 1 : 0;
+	}
+
 	nBytes = nBlocks * sizeof(yaffs_BlockInfo);
 
 	ok = (yaffs_CheckpointRead(dev, dev->blockInfo, nBytes) == nBytes);
@@ -4308,8 +4734,21 @@ static int yaffs_CheckpointObjectToObject(yaffs_Object *obj, yaffs_CheckpointObj
 
 
 
+/* Does the tnode at this level and offset cover any chunk from low to high? */
+static int yaffs_TnodeInRange(__u32 level, int chunkOffset,
+				__u32 low, __u32 high)
+{
+	__u32 shift = YAFFS_TNODES_LEVEL0_BITS +
+			level * YAFFS_TNODES_INTERNAL_BITS;
+	__u32 first = ((__u32) chunkOffset) << shift;
+	__u32 last = first + ((1 << shift) - 1);
+
+	return (first <= high && last >= low) ? 1 : 0;
+}
+
 static int yaffs_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
-					__u32 level, int chunkOffset)
+					__u32 level, int chunkOffset,
+					__u32 low, __u32 high)
 {
 	int i;
 	yaffs_Device *dev = in->myDev;
@@ -4320,7 +4759,7 @@ static int yaffs_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
 		tnodeSize = sizeof(yaffs_Tnode);
 
 
-	if (tn) {
+	if (tn && yaffs_TnodeInRange(level, chunkOffset, low, high)) {
 		if (level > 0) {
 
 			for (i = 0; i < YAFFS_NTNODES_INTERNAL && ok; i++) {
@@ -4328,7 +4767,8 @@ static int yaffs_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
 					ok = yaffs_CheckpointTnodeWorker(in,
 							tn->internal[i],
 							level - 1,
-							(chunkOffset<<YAFFS_TNODES_INTERNAL_BITS) + i);
+							(chunkOffset<<YAFFS_TNODES_INTERNAL_BITS) + i,
+							low, high);
 				}
 			}
 		} else if (level == 0) {
@@ -4343,16 +4783,43 @@ static int yaffs_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
 
 }
 
-static int yaffs_WriteCheckpointTnodes(yaffs_Object *obj)
+/* Zero the tnode entries from low to high, leaving the chunks alone */
+static void yaffs_CheckpointClearWorker(yaffs_Object *in, yaffs_Tnode *tn,
+					__u32 level, int chunkOffset,
+					__u32 low, __u32 high)
 {
-	__u32 endMarker = ~0;
-	int ok = 1;
+	int i;
+	__u32 chunkInInode;
 
-	if (obj->variantType == YAFFS_OBJECT_TYPE_FILE) {
-		ok = yaffs_CheckpointTnodeWorker(obj,
-					    obj->variant.fileVariant.top,
-					    obj->variant.fileVariant.topLevel,
-					    0);
+	if (tn && yaffs_TnodeInRange(level, chunkOffset, low, high)) {
+		if (level > 0) {
+			for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++)
+				yaffs_CheckpointClearWorker(in, tn->internal[i],
+					level - 1,
+					(chunkOffset << YAFFS_TNODES_INTERNAL_BITS) + i,
+					low, high);
+		} else {
+			for (i = 0; i < YAFFS_NTNODES_LEVEL0; i++) {
+				chunkInInode = (chunkOffset <<
+						YAFFS_TNODES_LEVEL0_BITS) + i;
+				if (chunkInInode >= low && chunkInInode <= high)
+					yaffs_PutLevel0Tnode(in->myDev, tn, i, 0);
+			}
+		}
+	}
+}
+
+static int yaffs_WriteCheckpointTnodes(yaffs_Object *obj, __u32 low,
+					__u32 high)
+{
+	__u32 endMarker = ~0;
+	int ok = 1;
+
+	if (obj->variantType == YAFFS_OBJECT_TYPE_FILE) {
+		ok = yaffs_CheckpointTnodeWorker(obj,
+					    obj->variant.fileVariant.top,
+					    obj->variant.fileVariant.topLevel,
+					    0, low, high);
 		if (ok)
 			ok = (yaffs_CheckpointWrite(obj->myDev, &endMarker, sizeof(endMarker)) ==
 				sizeof(endMarker));
@@ -4406,24 +4873,108 @@ static int yaffs_ReadCheckpointTnodes(yaffs_Object *obj)
 }
 
 
-static int yaffs_WriteCheckpointObjects(yaffs_Device *dev)
+static int yaffs_ReadCheckpointTnodeChanges(yaffs_Object *obj)
+{
+	yaffs_Device *dev = obj->myDev;
+	yaffs_FileStructure *fStruct = &obj->variant.fileVariant;
+	__u32 range[2];
+	int ok;
+
+	/* The delta holds every tnode that covers the range that changed */
+	ok = (yaffs_CheckpointRead(dev, range, sizeof(range)) == sizeof(range));
+
+	if (ok && range[0] <= range[1])
+		yaffs_CheckpointClearWorker(obj, fStruct->top,
+					fStruct->topLevel, 0,
+					range[0], range[1]);
+	if (ok)
+		ok = yaffs_ReadCheckpointTnodes(obj);
+
+	if (ok && fStruct->top)
+		yaffs_PruneFileStructure(dev, fStruct);
+
+	return ok ? 1 : 0;
+}
+
+/*
+ * Throw away an object that has gone since the checkpoint it was restored
+ * from. Its chunks were given back when it went, so they are only dropped
+ * from the tree here.
+ */
+static void yaffs_CheckpointDropObject(yaffs_Object *obj)
+{
+	yaffs_Device *dev = obj->myDev;
+	yaffs_FileStructure *fStruct;
+	struct ylist_head *i;
+	struct ylist_head *n;
+	yaffs_Object *l;
+
+	switch (obj->variantType) {
+	case YAFFS_OBJECT_TYPE_FILE:
+		fStruct = &obj->variant.fileVariant;
+		if (fStruct->top) {
+			yaffs_CheckpointClearWorker(obj, fStruct->top,
+						fStruct->topLevel, 0, 0, ~0);
+			yaffs_PruneFileStructure(dev, fStruct);
+			yaffs_FreeTnode(dev, fStruct->top);
+			fStruct->top = NULL;
+		}
+		break;
+	case YAFFS_OBJECT_TYPE_DIRECTORY:
+		ylist_for_each_safe(i, n,
+			&obj->variant.directoryVariant.children) {
+			l = ylist_entry(i, yaffs_Object, siblings);
+			yaffs_AddObjectToDirectory(dev->lostNFoundDir, l);
+		}
+		break;
+	case YAFFS_OBJECT_TYPE_SYMLINK:
+		if (obj->variant.symLinkVariant.alias)
+			YFREE(obj->variant.symLinkVariant.alias);
+		obj->variant.symLinkVariant.alias = NULL;
+		break;
+	default:
+		break;
+	}
+
+	if (obj->variantType == YAFFS_OBJECT_TYPE_HARDLINK) {
+		ylist_del_init(&obj->hardLinks);
+	} else {
+		/* Any links left pointing at it are fixed up later */
+		ylist_for_each_safe(i, n, &obj->hardLinks) {
+			l = ylist_entry(i, yaffs_Object, hardLinks);
+			l->variant.hardLinkVariant.equivalentObject = NULL;
+			ylist_del_init(i);
+		}
+	}
+
+	if (obj->parent)
+		yaffs_RemoveObjectFromDirectory(obj);
+
+	obj->hdrChunk = 0;
+	yaffs_FreeObject(obj);
+}
+
+static int yaffs_WriteCheckpointObjects(yaffs_Device *dev, int delta)
 {
 	yaffs_Object *obj;
 	yaffs_CheckpointObject cp;
 	int i;
 	int ok = 1;
 	struct ylist_head *lh;
+	__u32 range[2];
 
 
 	/* Iterate through the objects in each hash entry,
 	 * dumping them to the checkpointing stream.
+	 * A delta only holds the objects that changed.
 	 */
 
 	for (i = 0; ok &&  i <  YAFFS_NOBJECT_BUCKETS; i++) {
 		ylist_for_each(lh, &dev->objectBucket[i].list) {
 			if (lh) {
 				obj = ylist_entry(lh, yaffs_Object, hashLink);
-				if (!obj->deferedFree) {
+				if (!obj->deferedFree &&
+				    (!delta || obj->checkpointDirty)) {
 					yaffs_ObjectToCheckpointObject(&cp, obj);
 					cp.structType = sizeof(cp);
 
@@ -4433,8 +4984,20 @@ static int yaffs_WriteCheckpointObjects(yaffs_Device *dev)
 
 					ok = (yaffs_CheckpointWrite(dev, &cp, sizeof(cp)) == sizeof(cp));
 
-					if (ok && obj->variantType == YAFFS_OBJECT_TYPE_FILE)
-						ok = yaffs_WriteCheckpointTnodes(obj);
+					if (ok && obj->variantType == YAFFS_OBJECT_TYPE_FILE) {
+						if (delta) {
+							range[0] = obj->variant.fileVariant.checkpointLow;
+							range[1] = obj->variant.fileVariant.checkpointHigh;
+							ok = (yaffs_CheckpointWrite(dev, range, sizeof(range)) ==
+								sizeof(range));
+						} else {
+							range[0] = 0;
+							range[1] = ~0;
+						}
+						if (ok)
+							ok = yaffs_WriteCheckpointTnodes(obj,
+									range[0], range[1]);
+					}
 				}
 			}
 		}
@@ -4450,7 +5013,7 @@ static int yaffs_WriteCheckpointObjects(yaffs_Device *dev)
 	return ok ? 1 : 0;
 }
 
-static int yaffs_ReadCheckpointObjects(yaffs_Device *dev)
+static int yaffs_ReadCheckpointObjects(yaffs_Device *dev, int delta)
 {
 	yaffs_Object *obj;
 	yaffs_CheckpointObject cp;
@@ -4478,8 +5041,12 @@ static int yaffs_ReadCheckpointObjects(yaffs_Device *dev)
 				if (!ok)
 					break;
 				if (obj->variantType == YAFFS_OBJECT_TYPE_FILE) {
-					ok = yaffs_ReadCheckpointTnodes(obj);
+					if (delta)
+						ok = yaffs_ReadCheckpointTnodeChanges(obj);
+					else
+						ok = yaffs_ReadCheckpointTnodes(obj);
 				} else if (obj->variantType == YAFFS_OBJECT_TYPE_HARDLINK) {
+					ylist_del_init(&obj->hardLinks);
 					obj->hardLinks.next =
 						(struct ylist_head *) hardList;
 					hardList = obj;
@@ -4495,6 +5062,40 @@ static int yaffs_ReadCheckpointObjects(yaffs_Device *dev)
 	return ok ? 1 : 0;
 }
 
+static int yaffs_WriteCheckpointGone(yaffs_Device *dev)
+{
+	__u32 endMarker = ~0;
+	int nBytes = dev->nCheckpointGone * sizeof(__u32);
+	int ok = 1;
+
+	if (nBytes > 0)
+		ok = (yaffs_CheckpointWrite(dev, dev->checkpointGone, nBytes) == nBytes);
+	if (ok)
+		ok = (yaffs_CheckpointWrite(dev, &endMarker, sizeof(endMarker)) ==
+			sizeof(endMarker));
+
+	return ok ? 1 : 0;
+}
+
+static int yaffs_ReadCheckpointGone(yaffs_Device *dev)
+{
+	yaffs_Object *obj;
+	__u32 objectId;
+	int ok;
+
+	ok = (yaffs_CheckpointRead(dev, &objectId, sizeof(objectId)) == sizeof(objectId));
+
+	while (ok && (~objectId)) {
+		obj = yaffs_FindObjectByNumber(dev, objectId);
+		if (obj && !obj->fake)
+			yaffs_CheckpointDropObject(obj);
+
+		ok = (yaffs_CheckpointRead(dev, &objectId, sizeof(objectId)) == sizeof(objectId));
+	}
+
+	return ok ? 1 : 0;
+}
+
 static int yaffs_WriteCheckpointSum(yaffs_Device *dev)
 {
 	__u32 checkpointSum;
@@ -4544,19 +5145,19 @@ static int yaffs_WriteCheckpointData(yaffs_Device *dev)
 
 	if (ok) {
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("write checkpoint validity" TENDSTR)));
-		ok = yaffs_WriteCheckpointValidityMarker(dev, 1);
+		ok = yaffs_WriteCheckpointValidityMarker(dev, YAFFS_CHECKPOINT_START);
 	}
 	if (ok) {
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("write checkpoint device" TENDSTR)));
-		ok = yaffs_WriteCheckpointDevice(dev);
+		ok = yaffs_WriteCheckpointDevice(dev, 0);
 	}
 	if (ok) {
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("write checkpoint objects" TENDSTR)));
-		ok = yaffs_WriteCheckpointObjects(dev);
+		ok = yaffs_WriteCheckpointObjects(dev, 0);
 	}
 	if (ok) {
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("write checkpoint validity" TENDSTR)));
-		ok = yaffs_WriteCheckpointValidityMarker(dev, 0);
+		ok = yaffs_WriteCheckpointValidityMarker(dev, YAFFS_CHECKPOINT_END);
 	}
 
 	if (ok)
@@ -4573,9 +5174,68 @@ static int yaffs_WriteCheckpointData(yaffs_Device *dev)
 	return dev->isCheckpointed;
 }
 
+static int yaffs_WriteCheckpointDelta(yaffs_Device *dev)
+{
+	int ok = 1;
+
+	/* Deltas may take up as much room as a full checkpoint, no more */
+	if (dev->skipCheckpointWrite || !dev->isYaffs2 ||
+	    !dev->checkpointAppendOk ||
+	    dev->blocksInCheckpoint < 1 ||
+	    dev->blocksInCheckpoint >= yaffs_CalcCheckpointBlocksRequired(dev))
+		return 0;
+
+	if (!yaffs_CheckpointOpenAppend(dev))
+		return 0;
+
+	T(YAFFS_TRACE_CHECKPOINT, (TSTR("write checkpoint delta" TENDSTR)));
+
+	ok = yaffs_WriteCheckpointValidityMarker(dev, YAFFS_CHECKPOINT_DELTA);
+	if (ok)
+		ok = yaffs_WriteCheckpointDevice(dev, 1);
+	if (ok)
+		ok = yaffs_WriteCheckpointGone(dev);
+	if (ok)
+		ok = yaffs_WriteCheckpointObjects(dev, 1);
+	if (ok)
+		ok = yaffs_WriteCheckpointValidityMarker(dev, YAFFS_CHECKPOINT_END);
+	if (ok)
+		ok = yaffs_WriteCheckpointSum(dev);
+
+	if (!yaffs_CheckpointClose(dev))
+		ok = 0;
+
+	dev->isCheckpointed = ok;
+
+	return ok;
+}
+
+static int yaffs_ReadCheckpointDelta(yaffs_Device *dev)
+{
+	int ok;
+
+	T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint delta" TENDSTR)));
+
+	ok = yaffs_ReadCheckpointDevice(dev, 1);
+	if (ok)
+		ok = yaffs_ReadCheckpointGone(dev);
+	if (ok)
+		ok = yaffs_ReadCheckpointObjects(dev, 1);
+	if (ok)
+		ok = yaffs_ReadCheckpointValidityMarker(dev, YAFFS_CHECKPOINT_END);
+	if (ok)
+		ok = yaffs_ReadCheckpointSum(dev);
+
+	return ok ? 1 : 0;
+}
+
 static int yaffs_ReadCheckpointData(yaffs_Device *dev)
 {
+	yaffs_CheckpointValidity cp;
+	yaffs_CheckpointPosition end;
 	int ok = 1;
+	int stale = 0;
+	int partial = 0;
 
 	if (dev->skipCheckpointRead || !dev->isYaffs2) {
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("skipping checkpoint read" TENDSTR)));
@@ -4587,19 +5247,19 @@ static int yaffs_ReadCheckpointData(yaffs_Device *dev)
 
 	if (ok) {
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint validity" TENDSTR)));
-		ok = yaffs_ReadCheckpointValidityMarker(dev, 1);
+		ok = yaffs_ReadCheckpointValidityMarker(dev, YAFFS_CHECKPOINT_START);
 	}
 	if (ok) {
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint device" TENDSTR)));
-		ok = yaffs_ReadCheckpointDevice(dev);
+		ok = yaffs_ReadCheckpointDevice(dev, 0);
 	}
 	if (ok) {
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint objects" TENDSTR)));
-		ok = yaffs_ReadCheckpointObjects(dev);
+		ok = yaffs_ReadCheckpointObjects(dev, 0);
 	}
 	if (ok) {
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint validity" TENDSTR)));
-		ok = yaffs_ReadCheckpointValidityMarker(dev, 0);
+		ok = yaffs_ReadCheckpointValidityMarker(dev, YAFFS_CHECKPOINT_END);
 	}
 
 	if (ok) {
@@ -4607,10 +5267,44 @@ static int yaffs_ReadCheckpointData(yaffs_Device *dev)
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint checksum %d" TENDSTR), ok));
 	}
 
+	/* Apply the records appended since. The stream ends at the first
+	 * page that holds no marker; the flash is then rolled forward from
+	 * the last good record if it was followed by a STALE one (or by
+	 * nothing we can read). A record that breaks off after its marker
+	 * fails the restore, and the mount scans instead.
+	 */
+	if (ok)
+		yaffs_CheckpointTell(dev, &end);
+
+	while (ok) {
+		yaffs_CheckpointSeek(dev, &end);
+		if (yaffs_CheckpointRead(dev, &cp, sizeof(cp)) != sizeof(cp))
+			break;
+		partial = 1;
+		if (yaffs_CheckValidityMarker(&cp, YAFFS_CHECKPOINT_STALE)) {
+			if (!yaffs_ReadCheckpointSum(dev))
+				break;
+			stale = 1;
+		} else if (yaffs_CheckValidityMarker(&cp, YAFFS_CHECKPOINT_DELTA)) {
+			ok = yaffs_ReadCheckpointDelta(dev);
+			stale = 0;
+		} else
+			break;
+		partial = 0;
+		if (ok)
+			yaffs_CheckpointTell(dev, &end);
+	}
+
+	if (ok)
+		yaffs_CheckpointSeek(dev, &end);
+
+	T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint ok %d stale %d partial %d" TENDSTR),
+		ok, stale, partial));
+
 	if (!yaffs_CheckpointClose(dev))
 		ok = 0;
 
-	if (ok)
+	if (ok && !stale && !partial)
 		dev->isCheckpointed = 1;
 	else
 		dev->isCheckpointed = 0;
@@ -4621,6 +5315,8 @@ static int yaffs_ReadCheckpointData(yaffs_Device *dev)
 
 static void yaffs_InvalidateCheckpoint(yaffs_Device *dev)
 {
+	dev->checkpointAppendOk = 0;
+
 	if (dev->isCheckpointed ||
 			dev->blocksInCheckpoint > 0) {
 		dev->isCheckpointed = 0;
@@ -4630,6 +5326,33 @@ static void yaffs_InvalidateCheckpoint(yaffs_Device *dev)
 	}
 }
 
+/* The flash is about to change: note that the checkpoint no longer
+ * matches it, rather than throwing the checkpoint away.
+ */
+static void yaffs_MarkCheckpointStale(yaffs_Device *dev)
+{
+	int ok;
+
+	if (!dev->isCheckpointed)
+		return;
+
+	dev->isCheckpointed = 0;
+
+	ok = dev->checkpointAppendOk && yaffs_CheckpointOpenAppend(dev);
+	if (ok) {
+		ok = yaffs_WriteCheckpointValidityMarker(dev, YAFFS_CHECKPOINT_STALE);
+		if (ok)
+			ok = yaffs_WriteCheckpointSum(dev);
+		if (!yaffs_CheckpointClose(dev))
+			ok = 0;
+	}
+
+	if (!ok)
+		yaffs_InvalidateCheckpoint(dev);
+	else if (dev->superBlock && dev->markSuperBlockDirty)
+		dev->markSuperBlockDirty(dev->superBlock);
+}
+
 
 int yaffs_CheckpointSave(yaffs_Device *dev)
 {
@@ -4641,8 +5364,12 @@ int yaffs_CheckpointSave(yaffs_Device *dev)
 	yaffs_VerifyFreeChunks(dev);
 
 	if (!dev->isCheckpointed) {
-		yaffs_InvalidateCheckpoint(dev);
-		yaffs_WriteCheckpointData(dev);
+		if (!yaffs_WriteCheckpointDelta(dev)) {
+			yaffs_InvalidateCheckpoint(dev);
+			yaffs_WriteCheckpointData(dev);
+		}
+		if (dev->isCheckpointed)
+			yaffs_CheckpointSnapshot(dev);
 	}
 
 	T(YAFFS_TRACE_ALWAYS, (TSTR("save exit: isCheckpointed %d"TENDSTR), dev->isCheckpointed));
@@ -4653,11 +5380,56 @@ int yaffs_CheckpointSave(yaffs_Device *dev)
 int yaffs_CheckpointRestore(yaffs_Device *dev)
 {
 	int retval;
+	int appendable;
+	int blk;
+	yaffs_BlockInfo *bi;
+
 	T(YAFFS_TRACE_CHECKPOINT, (TSTR("restore entry: isCheckpointed %d"TENDSTR), dev->isCheckpointed));
 
+	dev->checkpointAppendOk = 0;
+
 	retval = yaffs_ReadCheckpointData(dev);
 
-	if (dev->isCheckpointed) {
+	if (retval) {
+		/* Appending carries on from where the stream ended, so the
+		 * page there has to be erased.
+		 */
+		appendable = !dev->skipCheckpointWrite &&
+			(dev->checkpointCurrentBlock < 0 ||
+			 yaffs_CheckChunkErased(dev,
+				dev->checkpointCurrentBlock * dev->nChunksPerBlock +
+				dev->checkpointCurrentChunk) == YAFFS_OK);
+
+		yaffs_CheckpointSnapshot(dev);
+		if (!appendable)
+			dev->checkpointAppendOk = 0;
+
+		if (!dev->isCheckpointed)
+			retval = yaffs_CheckpointRollForward(dev);
+	}
+
+	if (retval) {
+		/* The counts saved are from before the checkpoint took its
+		 * blocks and before any roll forward.
+		 */
+		dev->nErasedBlocks = 0;
+		for (blk = dev->internalStartBlock; blk <= dev->internalEndBlock; blk++) {
+			bi = yaffs_GetBlockInfo(dev, blk);
+			if (bi->blockState == YAFFS_BLOCK_STATE_EMPTY)
+				dev->nErasedBlocks++;
+			else if (bi->blockState == YAFFS_BLOCK_STATE_COLLECTING) {
+				/* gc doesn't carry on with a block across a
+				 * mount, so give it back to be picked again.
+				 * gc cleared its shrink header flag when it
+				 * started on it, so assume the worst.
+				 */
+				bi->blockState = YAFFS_BLOCK_STATE_FULL;
+				bi->hasShrinkHeader = 1;
+			}
+		}
+		dev->nFreeChunks = yaffs_CountFreeChunks(dev);
+		dev->oldestDirtySequence = 0;
+
 		yaffs_VerifyObjects(dev);
 		yaffs_VerifyBlocks(dev);
 		yaffs_VerifyFreeChunks(dev);
@@ -4678,6 +5450,55 @@ int yaffs_CheckpointRestore(yaffs_Device *dev)
  * Curve-balls: the first chunk might also be the last chunk.
  */
 
+/*
+ * Unlocked reads.
+ *
+ * Readers of whole chunks do not take grossLock, so they run alongside
+ * writers and garbage collection. The caller notes nBlockErasures, finds
+ * the chunk with yaffs_FindChunkForUnlockedRead(), which only holds
+ * treeLock for reading while it looks in the chunk cache and the tnode
+ * tree, reads it with yaffs_ReadChunkUnlocked() and then trusts the data
+ * only if no block was erased in the meantime. A chunk that gc moved or a
+ * writer replaced still holds the old data until its block is erased, and
+ * the count goes up before the erase is started.
+ *
+ * Only whole, uncached yaffs2 chunks without inband tags or chunk groups
+ * qualify: these are found without reading tags and read without them,
+ * so the driver does not touch the device's spare buffer or ECC counters.
+ * Anything else goes through yaffs_ReadDataFromFile() under grossLock.
+ */
+int yaffs_FindChunkForUnlockedRead(yaffs_Object *in, loff_t offset, int nBytes)
+{
+	yaffs_Device *dev = in->myDev;
+	int chunk;
+	__u32 start;
+	int chunkInNAND = -1;
+
+	if (!dev->isYaffs2 || dev->inbandTags ||
+	    !dev->readChunkWithTagsFromNAND || dev->chunkGroupSize != 1 ||
+	    nBytes != dev->nDataBytesPerChunk)
+		return -1;
+
+	yaffs_AddrToChunk(dev, offset, &chunk, &start);
+	chunk++;
+
+	if (start != 0)
+		return -1;
+
+	yaffs_TreeReadLock(dev);
+	if (!yaffs_LookupChunkCache(in, chunk))
+		chunkInNAND = yaffs_FindChunkInFile(in, chunk, NULL);
+	yaffs_TreeReadUnlock(dev);
+
+	return chunkInNAND;
+}
+
+int yaffs_ReadChunkUnlocked(yaffs_Device *dev, int chunkInNAND, __u8 *buffer)
+{
+	return dev->readChunkWithTagsFromNAND(dev, chunkInNAND - dev->chunkOffset,
+					      buffer, NULL);
+}
+
 int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 			int nBytes)
 {
@@ -4720,10 +5541,7 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 
 				if (!cache) {
 					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_AttachChunkCache(dev, cache, in, chunk);
 					yaffs_ReadChunkDataFromObject(in, chunk,
 								      cache->
 								      data);
@@ -4850,10 +5668,7 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 				    && yaffs_CheckSpaceForAllocation(in->
 								     myDev)) {
 					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_AttachChunkCache(dev, cache, in, chunk);
 					yaffs_ReadChunkDataFromObject(in, chunk,
 								      cache->
 								      data);
@@ -4885,7 +5700,7 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 						     cache->chunkId,
 						     cache->data, cache->nBytes,
 						     1);
-						cache->dirty = 0;
+						yaffs_SetCacheDirty(dev, cache, 0);
 					}
 
 				} else {
@@ -4942,8 +5757,10 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 
 	/* Update file object */
 
-	if ((startOfWrite + nDone) > in->variant.fileVariant.fileSize)
+	if ((startOfWrite + nDone) > in->variant.fileVariant.fileSize) {
 		in->variant.fileVariant.fileSize = (startOfWrite + nDone);
+		in->checkpointDirty = 1;
+	}
 
 	in->dirty = 1;
 
@@ -5016,6 +5833,8 @@ int yaffs_ResizeFile(yaffs_Object *in, loff_t newSize)
 	if (newSize == oldFileSize)
 		return YAFFS_OK;
 
+	in->checkpointDirty = 1;
+
 	if (newSize < oldFileSize) {
 
 		yaffs_PruneResizedChunks(in, newSize);
@@ -5040,7 +5859,9 @@ int yaffs_ResizeFile(yaffs_Object *in, loff_t newSize)
 
 		in->variant.fileVariant.fileSize = newSize;
 
+		yaffs_TreeLock(dev);
 		yaffs_PruneFileStructure(dev, &in->variant.fileVariant);
+		yaffs_TreeUnlock(dev);
 	} else {
 		/* newsSize > oldFileSize */
 		in->variant.fileVariant.fileSize = newSize;
@@ -5150,6 +5971,7 @@ static int yaffs_UnlinkFileIfNeeded(yaffs_Object *in)
 		  (TSTR("yaffs: immediate deletion of file %d" TENDSTR),
 		   in->objectId));
 		in->deleted = 1;
+		in->checkpointDirty = 1;
 		in->myDev->nDeletedFiles++;
 		if (1 || in->myDev->isYaffs2)
 			yaffs_ResizeFile(in, 0);
@@ -5180,6 +6002,7 @@ int yaffs_DeleteFile(yaffs_Object *in)
 
 		if (retVal == YAFFS_OK && in->unlinked && !in->deleted) {
 			in->deleted = 1;
+			in->checkpointDirty = 1;
 			deleted = 1;
 			in->myDev->nDeletedFiles++;
 			yaffs_SoftDeleteFile(in);
@@ -5187,8 +6010,10 @@ int yaffs_DeleteFile(yaffs_Object *in)
 		return deleted ? YAFFS_OK : YAFFS_FAIL;
 	} else {
 		/* The file has no data chunks so we toss it immediately */
+		yaffs_TreeLock(in->myDev);
 		yaffs_FreeTnode(in->myDev, in->variant.fileVariant.top);
 		in->variant.fileVariant.top = NULL;
+		yaffs_TreeUnlock(in->myDev);
 		yaffs_DoGenericObjectDeletion(in);
 
 		return YAFFS_OK;
@@ -5294,6 +6119,8 @@ static int yaffs_UnlinkWorker(yaffs_Object *obj)
 
 		ylist_del_init(&hl->hardLinks);
 		ylist_del_init(&hl->siblings);
+		ylist_del_init(&hl->nameLink);
+		hl->nameIndexed = 0;
 
 		yaffs_GetObjectName(hl, name, YAFFS_MAX_NAME_LENGTH + 1);
 
@@ -5896,6 +6723,9 @@ static int yaffs_Scan(yaffs_Device *dev)
 						YINIT_LIST_HEAD(&parent->variant.
 								directoryVariant.
 								children);
+						YINIT_LIST_HEAD(&parent->variant.
+								directoryVariant.
+								unindexed);
 					} else if (!parent || parent->variantType !=
 						   YAFFS_OBJECT_TYPE_DIRECTORY) {
 						/* Hoosterman, another problem....
@@ -6118,6 +6948,7 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	yaffs_BlockIndex *blockIndex = NULL;
 	int altBlockIndex = 0;
+	yaffs_ExtendedTags *blockTags;
 
 	if (!dev->isYaffs2) {
 		T(YAFFS_TRACE_SCAN,
@@ -6146,6 +6977,18 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 		return YAFFS_FAIL;
 	}
 
+	/* Tags are read a block at a time */
+	blockTags = YMALLOC(dev->nChunksPerBlock * sizeof(yaffs_ExtendedTags));
+	if (!blockTags) {
+		T(YAFFS_TRACE_SCAN,
+		  (TSTR("yaffs_Scan() could not allocate block tags!" TENDSTR)));
+		if (altBlockIndex)
+			YFREE_ALT(blockIndex);
+		else
+			YFREE(blockIndex);
+		return YAFFS_FAIL;
+	}
+
 	dev->blocksInCheckpoint = 0;
 
 	chunkData = yaffs_GetTempBuffer(dev, __LINE__);
@@ -6265,6 +7108,10 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 		deleted = 0;
 
+		if (state == YAFFS_BLOCK_STATE_NEEDS_SCANNING ||
+		    state == YAFFS_BLOCK_STATE_ALLOCATING)
+			yaffs_ReadBlockTagsFromNAND(dev, blk, blockTags);
+
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
 		for (c = dev->nChunksPerBlock - 1;
@@ -6277,8 +7124,7 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			tags = blockTags[c];
 
 			/* Let's have a good look at this chunk... */
 
@@ -6626,6 +7472,9 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 						YINIT_LIST_HEAD(&parent->variant.
 							directoryVariant.
 							children);
+						YINIT_LIST_HEAD(&parent->variant.
+							directoryVariant.
+							unindexed);
 					} else if (!parent || parent->variantType !=
 						   YAFFS_OBJECT_TYPE_DIRECTORY) {
 						/* Hoosterman, another problem....
@@ -6732,6 +7581,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	else
 		YFREE(blockIndex);
 
+	YFREE(blockTags);
+
 	/* Ok, we've done all the scanning.
 	 * Fix up the hard link chains.
 	 * We should now have scanned all the objects, now it's time to add these
@@ -6750,6 +7601,558 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	return YAFFS_OK;
 }
 
+/*
+ * Rolling a checkpoint forward.
+ *
+ * A stale checkpoint was saved before the flash was last written. Rather
+ * than scan everything, check which blocks changed since and bring the
+ * restored state up to date from them:
+ * - Blocks that were erased (or reused) since lose whatever the checkpoint
+ *   had in them.
+ * - Blocks written since, and the end of the block that was being
+ *   allocated from, are replayed in sequence order, the way they were
+ *   written.
+ * Anything the checkpoint can't explain makes the mount fall back to a
+ * full scan.
+ */
+
+static void yaffs_RollForwardPurgeWorker(yaffs_Object *in, yaffs_Tnode *tn,
+					__u32 level, int chunkOffset,
+					const __u8 *purge)
+{
+	yaffs_Device *dev = in->myDev;
+	int i;
+	__u32 theChunk;
+	__u32 chunkInInode;
+
+	if (!tn)
+		return;
+
+	if (level > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++)
+			yaffs_RollForwardPurgeWorker(in, tn->internal[i],
+				level - 1,
+				(chunkOffset << YAFFS_TNODES_INTERNAL_BITS) + i,
+				purge);
+	} else {
+		for (i = 0; i < YAFFS_NTNODES_LEVEL0; i++) {
+			theChunk = yaffs_GetChunkGroupBase(dev, tn, i);
+			if (theChunk &&
+			    purge[theChunk / dev->nChunksPerBlock -
+				  dev->internalStartBlock]) {
+				chunkInInode = (chunkOffset <<
+						YAFFS_TNODES_LEVEL0_BITS) + i;
+				yaffs_PutLevel0Tnode(dev, tn, i, 0);
+				in->nDataChunks--;
+				yaffs_CheckpointChunksChanged(in, chunkInInode,
+							chunkInInode);
+			}
+		}
+	}
+}
+
+/* Forget everything the checkpoint had in the purged blocks */
+static void yaffs_RollForwardPurge(yaffs_Device *dev, const __u8 *purge)
+{
+	struct ylist_head *lh;
+	yaffs_Object *obj;
+	int i;
+
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+		ylist_for_each(lh, &dev->objectBucket[i].list) {
+			if (!lh)
+				continue;
+			obj = ylist_entry(lh, yaffs_Object, hashLink);
+
+			if (obj->hdrChunk > 0 &&
+			    purge[obj->hdrChunk / dev->nChunksPerBlock -
+				  dev->internalStartBlock]) {
+				obj->hdrChunk = 0;
+				obj->checkpointDirty = 1;
+			}
+
+			if (obj->variantType == YAFFS_OBJECT_TYPE_FILE &&
+			    obj->variant.fileVariant.top) {
+				yaffs_RollForwardPurgeWorker(obj,
+					obj->variant.fileVariant.top,
+					obj->variant.fileVariant.topLevel,
+					0, purge);
+				yaffs_PruneFileStructure(dev,
+					&obj->variant.fileVariant);
+			}
+		}
+	}
+}
+
+static void yaffs_RollForwardTruncateWorker(yaffs_Object *in,
+					yaffs_Tnode *tn, __u32 level,
+					int chunkOffset, int startDel)
+{
+	yaffs_Device *dev = in->myDev;
+	int i;
+	int chunkInInode;
+	int chunkId;
+
+	if (!tn)
+		return;
+
+	if (level > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++)
+			yaffs_RollForwardTruncateWorker(in, tn->internal[i],
+				level - 1,
+				(chunkOffset << YAFFS_TNODES_INTERNAL_BITS) + i,
+				startDel);
+	} else {
+		for (i = 0; i < YAFFS_NTNODES_LEVEL0; i++) {
+			chunkInInode = (chunkOffset <<
+					YAFFS_TNODES_LEVEL0_BITS) + i;
+			if (chunkInInode < startDel ||
+			    !yaffs_GetChunkGroupBase(dev, tn, i))
+				continue;
+			chunkId = yaffs_FindAndDeleteChunkInFile(in,
+						chunkInInode, NULL);
+			if (chunkId > 0) {
+				in->nDataChunks--;
+				yaffs_DeleteChunk(dev, chunkId, 1, __LINE__);
+			}
+		}
+	}
+}
+
+/* Drop the chunks a shrink header cut off. Unlike
+ * yaffs_PruneResizedChunks() this walks the whole tree: a header that gc
+ * copied forward may already have set the size below chunks the file
+ * still holds.
+ */
+static void yaffs_RollForwardTruncate(yaffs_Object *in, __u32 newSize)
+{
+	yaffs_Device *dev = in->myDev;
+	int startDel = 1 + (newSize + dev->nDataBytesPerChunk - 1) /
+	    dev->nDataBytesPerChunk;
+
+	if (!in->variant.fileVariant.top)
+		return;
+
+	yaffs_RollForwardTruncateWorker(in, in->variant.fileVariant.top,
+					in->variant.fileVariant.topLevel,
+					0, startDel);
+	yaffs_PruneFileStructure(dev, &in->variant.fileVariant);
+}
+
+/* Give back what an object that went since still holds, then drop it */
+static void yaffs_RollForwardDropObject(yaffs_Object *obj)
+{
+	if (obj->variantType == YAFFS_OBJECT_TYPE_FILE &&
+	    obj->variant.fileVariant.top)
+		yaffs_DeleteWorker(obj, obj->variant.fileVariant.top,
+				obj->variant.fileVariant.topLevel, 0, NULL);
+
+	yaffs_DeleteChunk(obj->myDev, obj->hdrChunk, 1, __LINE__);
+	yaffs_CheckpointDropObject(obj);
+}
+
+static int yaffs_RollForwardHeader(yaffs_Device *dev, yaffs_BlockInfo *bi,
+				int chunk, const yaffs_ExtendedTags *tags,
+				__u8 *chunkData)
+{
+	yaffs_ObjectHeader *oh;
+	yaffs_Object *in;
+	yaffs_Object *parent;
+	yaffs_Object *shadowed;
+	int itsUnlinked;
+	__u32 fileSize;
+
+	yaffs_ReadChunkWithTagsFromNAND(dev, chunk, chunkData, NULL);
+
+	oh = (yaffs_ObjectHeader *) chunkData;
+
+	if (dev->inbandTags) {
+		/* Fix up the header if they got corrupted by inband tags */
+		oh->shadowsObject = oh->inbandShadowsObject;
+		oh->isShrink = oh->inbandIsShrink;
+	}
+
+	if (oh->isShrink) {
+		/* Mark the block as having a shrinkHeader */
+		bi->hasShrinkHeader = 1;
+	}
+
+	itsUnlinked = (oh->parentObjectId == YAFFS_OBJECTID_DELETED ||
+		       oh->parentObjectId == YAFFS_OBJECTID_UNLINKED);
+
+	/* An object of another type, or one that was deleted, has gone
+	 * and its number was handed out again. One that was only unlinked
+	 * may come back: a rename over a file with hard links shadows it
+	 * and then moves it to the name of one of its links.
+	 */
+	in = yaffs_FindObjectByNumber(dev, tags->objectId);
+	if (in && !in->fake &&
+	    (in->variantType != oh->type ||
+	     (in->deleted && !itsUnlinked))) {
+		yaffs_RollForwardDropObject(in);
+		in = NULL;
+	}
+
+	if (!in)
+		in = yaffs_FindOrCreateObjectByNumber(dev, tags->objectId,
+						oh->type);
+	if (!in)
+		return 0;
+
+	yaffs_DeleteChunk(dev, in->hdrChunk, 1, __LINE__);
+	in->hdrChunk = chunk;
+	in->serial = tags->serialNumber;
+	in->checkpointDirty = 1;
+
+	in->yst_mode = oh->yst_mode;
+#ifdef CONFIG_YAFFS_WINCE
+	in->win_atime[0] = oh->win_atime[0];
+	in->win_ctime[0] = oh->win_ctime[0];
+	in->win_mtime[0] = oh->win_mtime[0];
+	in->win_atime[1] = oh->win_atime[1];
+	in->win_ctime[1] = oh->win_ctime[1];
+	in->win_mtime[1] = oh->win_mtime[1];
+#else
+	in->yst_uid = oh->yst_uid;
+	in->yst_gid = oh->yst_gid;
+	in->yst_atime = oh->yst_atime;
+	in->yst_mtime = oh->yst_mtime;
+	in->yst_ctime = oh->yst_ctime;
+	in->yst_rdev = oh->yst_rdev;
+#endif
+
+	if (in->fake) {
+		/* We only load some info, don't fiddle with directory structure */
+		return 1;
+	}
+
+	yaffs_SetObjectName(in, oh->name);
+	in->lazyLoaded = 0;
+
+	parent = yaffs_FindOrCreateObjectByNumber(dev, oh->parentObjectId,
+						YAFFS_OBJECT_TYPE_DIRECTORY);
+	if (!parent)
+		return 0;
+
+	if (parent->variantType == YAFFS_OBJECT_TYPE_UNKNOWN) {
+		/* Set up as a directory */
+		parent->variantType = YAFFS_OBJECT_TYPE_DIRECTORY;
+		YINIT_LIST_HEAD(&parent->variant.directoryVariant.children);
+		YINIT_LIST_HEAD(&parent->variant.directoryVariant.unindexed);
+	} else if (parent->variantType != YAFFS_OBJECT_TYPE_DIRECTORY) {
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs tragedy: attempting to use non-directory as"
+			" a directory in roll forward. Put in lost+found."
+			TENDSTR)));
+		parent = dev->lostNFoundDir;
+	}
+
+	if (!itsUnlinked)
+		in->unlinked = 0;
+	yaffs_AddObjectToDirectory(parent, in);
+
+	if (oh->shadowsObject > 0) {
+		/* A rename replaced this one, it goes once mounted */
+		shadowed = yaffs_FindObjectByNumber(dev, oh->shadowsObject);
+		if (shadowed && shadowed != in && !shadowed->fake)
+			yaffs_AddObjectToDirectory(dev->unlinkedDir, shadowed);
+	}
+
+	switch (in->variantType) {
+	case YAFFS_OBJECT_TYPE_FILE:
+		/* As with a scan, only a shrink header (or a deletion) drops
+		 * the chunks past the new size.
+		 */
+		fileSize = itsUnlinked ? 0 : oh->fileSize;
+		if (oh->isShrink || itsUnlinked)
+			yaffs_RollForwardTruncate(in, fileSize);
+		in->variant.fileVariant.fileSize = fileSize;
+		in->variant.fileVariant.scannedFileSize = fileSize;
+		break;
+	case YAFFS_OBJECT_TYPE_HARDLINK:
+		/* Chained up once all the blocks are replayed */
+		in->variant.hardLinkVariant.equivalentObjectId =
+			oh->equivalentObjectId;
+		break;
+	case YAFFS_OBJECT_TYPE_SYMLINK:
+		if (in->variant.symLinkVariant.alias)
+			YFREE(in->variant.symLinkVariant.alias);
+		in->variant.symLinkVariant.alias = yaffs_CloneString(oh->alias);
+		if (!in->variant.symLinkVariant.alias)
+			return 0;
+		break;
+	default:
+		break;
+	}
+
+	return 1;
+}
+
+static int yaffs_RollForwardBlock(yaffs_Device *dev, int blk, int startPage,
+				__u32 newestSequence,
+				yaffs_ExtendedTags *blockTags,
+				__u8 *chunkData)
+{
+	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blk);
+	yaffs_ExtendedTags *tags;
+	yaffs_Object *in;
+	int lastUsed = startPage - 1;
+	unsigned int endpos;
+	int chunk;
+	int c;
+	int ok = 1;
+
+	yaffs_ReadBlockTagsFromNAND(dev, blk, blockTags);
+
+	for (c = startPage; ok && c < dev->nChunksPerBlock; c++) {
+		tags = &blockTags[c];
+		chunk = blk * dev->nChunksPerBlock + c;
+
+		if (!tags->chunkUsed)
+			continue;
+
+		lastUsed = c;
+
+		if (tags->eccResult == YAFFS_ECC_RESULT_UNFIXED) {
+			T(YAFFS_TRACE_SCAN,
+			  (TSTR(" Unfixed ECC in chunk(%d:%d), chunk ignored"TENDSTR),
+			  blk, c));
+			continue;
+		}
+
+		yaffs_SetChunkBit(dev, blk, c);
+		bi->pagesInUse++;
+
+		if (tags->chunkId > 0) {
+			/* A data chunk replaces what the file had there */
+			in = yaffs_FindOrCreateObjectByNumber(dev,
+						tags->objectId,
+						YAFFS_OBJECT_TYPE_FILE);
+			if (!in) {
+				ok = 0;
+			} else if (in->variantType != YAFFS_OBJECT_TYPE_FILE) {
+				yaffs_DeleteChunk(dev, chunk, 1, __LINE__);
+			} else {
+				ok = yaffs_PutChunkIntoFile(in, tags->chunkId,
+							chunk, 1);
+				endpos = (tags->chunkId - 1) *
+					dev->nDataBytesPerChunk +
+					tags->byteCount;
+				if (in->variant.fileVariant.fileSize < endpos)
+					in->variant.fileVariant.fileSize = endpos;
+			}
+		} else {
+			ok = yaffs_RollForwardHeader(dev, bi, chunk, tags,
+						chunkData);
+		}
+	}
+
+	if (lastUsed < dev->nChunksPerBlock - 1) {
+		if (bi->sequenceNumber == newestSequence) {
+			/* this is the block being allocated from */
+			bi->blockState = YAFFS_BLOCK_STATE_ALLOCATING;
+			dev->allocationBlock = blk;
+			dev->allocationPage = lastUsed + 1;
+			dev->allocationBlockFinder = blk;
+		} else {
+			/* A partially written block that is not the
+			 * current allocation block must have had a write
+			 * failure.
+			 */
+			bi->blockState = YAFFS_BLOCK_STATE_FULL;
+			bi->gcPrioritise = 1;
+		}
+	} else {
+		bi->blockState = YAFFS_BLOCK_STATE_FULL;
+	}
+
+	if (bi->pagesInUse == 0 &&
+	    !bi->hasShrinkHeader &&
+	    bi->blockState == YAFFS_BLOCK_STATE_FULL)
+		yaffs_BlockBecameDirty(dev, blk);
+
+	return ok;
+}
+
+static int yaffs_CheckpointRollForward(yaffs_Device *dev)
+{
+	int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
+	__u32 checkpointSequence = dev->sequenceNumber;
+	__u32 newestSequence = dev->sequenceNumber;
+	int allocationBlock = dev->allocationBlock;
+	int allocationPage = dev->allocationPage;
+	yaffs_BlockIndex *blockIndex;
+	yaffs_ExtendedTags *blockTags;
+	yaffs_BlockInfo *bi;
+	yaffs_BlockState state;
+	yaffs_Object *hardList = NULL;
+	yaffs_Object *obj;
+	struct ylist_head *lh;
+	struct ylist_head *n;
+	__u32 sequenceNumber;
+	__u8 *purge;
+	__u8 *chunkData;
+	int nBlocksToReplay = 0;
+	int nPurged = 0;
+	int hadData;
+	int replay;
+	int blk;
+	int i;
+	int ok = 1;
+
+	T(YAFFS_TRACE_SCAN,
+	  (TSTR("yaffs: rolling checkpoint forward from sequence %d" TENDSTR),
+	   checkpointSequence));
+
+	blockIndex = YMALLOC_ALT(nBlocks * sizeof(yaffs_BlockIndex));
+	purge = YMALLOC_ALT(nBlocks);
+	blockTags = YMALLOC(dev->nChunksPerBlock * sizeof(yaffs_ExtendedTags));
+
+	if (!blockIndex || !purge || !blockTags)
+		ok = 0;
+	else
+		memset(purge, 0, nBlocks);
+
+	/* Find the blocks that changed since the checkpoint */
+	for (blk = dev->internalStartBlock; ok && blk <= dev->internalEndBlock; blk++) {
+		bi = yaffs_GetBlockInfo(dev, blk);
+
+		if (bi->blockState == YAFFS_BLOCK_STATE_CHECKPOINT ||
+		    bi->blockState == YAFFS_BLOCK_STATE_DEAD)
+			continue;
+
+		yaffs_QueryInitialBlockState(dev, blk, &state, &sequenceNumber);
+
+		hadData = (bi->blockState != YAFFS_BLOCK_STATE_EMPTY);
+		replay = 0;
+
+		if (sequenceNumber == YAFFS_SEQUENCE_CHECKPOINT_DATA) {
+			/* Left behind by an append that was cut short */
+			state = YAFFS_BLOCK_STATE_CHECKPOINT;
+			dev->blocksInCheckpoint++;
+			dev->checkpointAppendOk = 0;
+		} else if (sequenceNumber == YAFFS_SEQUENCE_BAD_BLOCK) {
+			state = YAFFS_BLOCK_STATE_DEAD;
+		} else if (state == YAFFS_BLOCK_STATE_NEEDS_SCANNING) {
+			if (hadData && sequenceNumber == bi->sequenceNumber) {
+				/* Unchanged, but for the block that was being
+				 * allocated from.
+				 */
+				if (blk != allocationBlock)
+					continue;
+				replay = 1;
+			} else if (sequenceNumber > checkpointSequence &&
+				   sequenceNumber < YAFFS_HIGHEST_SEQUENCE_NUMBER) {
+				replay = 1;
+			} else {
+				T(YAFFS_TRACE_SCAN,
+				  (TSTR("yaffs: block %d sequence %d is older than the checkpoint"
+					TENDSTR), blk, sequenceNumber));
+				ok = 0;
+				break;
+			}
+		} else if (state == YAFFS_BLOCK_STATE_EMPTY && !hadData) {
+			continue;
+		}
+
+		if (hadData && !(replay && blk == allocationBlock &&
+				 sequenceNumber == bi->sequenceNumber)) {
+			purge[blk - dev->internalStartBlock] = 1;
+			nPurged++;
+			bi->pagesInUse = 0;
+			bi->softDeletions = 0;
+			bi->hasShrinkHeader = 0;
+			bi->gcPrioritise = 0;
+			bi->needsRetiring = 0;
+			yaffs_ClearChunkBits(dev, blk);
+			if (blk == allocationBlock)
+				allocationBlock = -1;
+		}
+
+		if (replay) {
+			bi->blockState = (blk == allocationBlock) ?
+				YAFFS_BLOCK_STATE_ALLOCATING :
+				YAFFS_BLOCK_STATE_NEEDS_SCANNING;
+			bi->sequenceNumber = sequenceNumber;
+			blockIndex[nBlocksToReplay].seq = sequenceNumber;
+			blockIndex[nBlocksToReplay].block = blk;
+			nBlocksToReplay++;
+			if (sequenceNumber > newestSequence)
+				newestSequence = sequenceNumber;
+		} else {
+			bi->blockState = state;
+			bi->sequenceNumber = sequenceNumber;
+		}
+	}
+
+	if (ok && nPurged)
+		yaffs_RollForwardPurge(dev, purge);
+
+	if (ok && nBlocksToReplay > 0) {
+		yaffs_qsort(blockIndex, nBlocksToReplay,
+			sizeof(yaffs_BlockIndex), ybicmp);
+
+		dev->allocationBlock = -1;
+		dev->allocationPage = -1;
+		dev->sequenceNumber = newestSequence;
+
+		chunkData = yaffs_GetTempBuffer(dev, __LINE__);
+
+		for (i = 0; ok && i < nBlocksToReplay; i++) {
+			YYIELD();
+			blk = blockIndex[i].block;
+			ok = yaffs_RollForwardBlock(dev, blk,
+					(blk == allocationBlock) ? allocationPage : 0,
+					newestSequence, blockTags, chunkData);
+		}
+
+		yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
+	} else if (ok && allocationBlock < 0) {
+		dev->allocationBlock = -1;
+		dev->allocationPage = -1;
+	}
+
+	if (ok && (nPurged || nBlocksToReplay)) {
+		/* An object whose header went has gone itself */
+		for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+			ylist_for_each_safe(lh, n, &dev->objectBucket[i].list) {
+				obj = ylist_entry(lh, yaffs_Object, hashLink);
+				if (!obj->fake && obj->hdrChunk <= 0)
+					yaffs_RollForwardDropObject(obj);
+			}
+		}
+
+		/* Chain up the hard links again, as with a scan */
+		for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+			ylist_for_each(lh, &dev->objectBucket[i].list) {
+				obj = ylist_entry(lh, yaffs_Object, hashLink);
+				if (obj->variantType == YAFFS_OBJECT_TYPE_HARDLINK) {
+					ylist_del_init(&obj->hardLinks);
+					obj->hardLinks.next =
+						(struct ylist_head *) hardList;
+					hardList = obj;
+				}
+			}
+		}
+		yaffs_HardlinkFixup(dev, hardList);
+
+		dev->oldestDirtySequence = 0;
+	}
+
+	if (blockIndex)
+		YFREE_ALT(blockIndex);
+	if (purge)
+		YFREE_ALT(purge);
+	if (blockTags)
+		YFREE(blockTags);
+
+	T(YAFFS_TRACE_SCAN,
+	  (TSTR("yaffs: roll forward ok %d, %d blocks replayed, %d purged" TENDSTR),
+	   ok, nBlocksToReplay, nPurged));
+
+	return ok ? YAFFS_OK : YAFFS_FAIL;
+}
+
 /*------------------------------  Directory Functions ----------------------------- */
 
 static void yaffs_VerifyObjectInDirectory(yaffs_Object *obj)
@@ -6864,6 +8267,8 @@ static void yaffs_RemoveObjectFromDirectory(yaffs_Object *obj)
 
 
 	ylist_del_init(&obj->siblings);
+	ylist_del_init(&obj->nameLink);
+	obj->nameIndexed = 0;
 	obj->parent = NULL;
 	
 	yaffs_VerifyDirectory(parent);
@@ -6902,6 +8307,8 @@ static void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 	/* Now add it */
 	ylist_add(&obj->siblings, &directory->variant.directoryVariant.children);
 	obj->parent = directory;
+	obj->checkpointDirty = 1;
+	yaffs_IndexObjectName(obj);
 
 	if (directory == obj->myDev->unlinkedDir
 			|| directory == obj->myDev->deletedDir) {
@@ -6914,13 +8321,33 @@ static void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 	yaffs_VerifyObjectInDirectory(obj);
 }
 
+static int yaffs_ObjectNameMatches(yaffs_Object *l, const YCHAR *name, int sum)
+{
+	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
+
+	/* Special case for lost-n-found */
+	if (l->objectId == YAFFS_OBJECTID_LOSTNFOUND)
+		return yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) == 0;
+
+	if (yaffs_SumCompare(l->sum, sum) || l->hdrChunk <= 0) {
+		/* LostnFound chunk called Objxxx
+		 * Do a real check
+		 */
+		yaffs_GetObjectName(l, buffer, YAFFS_MAX_NAME_LENGTH + 1);
+		return yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0;
+	}
+
+	return 0;
+}
+
 yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 				     const YCHAR *name)
 {
 	int sum;
 
 	struct ylist_head *i;
-	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
+	struct ylist_head *n;
+	struct ylist_head *bucket;
 
 	yaffs_Object *l;
 
@@ -6944,29 +8371,28 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 
 	sum = yaffs_CalcNameSum(name);
 
-	ylist_for_each(i, &directory->variant.directoryVariant.children) {
-		if (i) {
-			l = ylist_entry(i, yaffs_Object, siblings);
+	/* Index the children that can be now, and check the rest by hand */
+	ylist_for_each_safe(i, n, &directory->variant.directoryVariant.unindexed) {
+		l = ylist_entry(i, yaffs_Object, nameLink);
 
-			if (l->parent != directory)
-				YBUG();
+		if (l->parent != directory)
+			YBUG();
 
-			yaffs_CheckObjectDetailsLoaded(l);
+		yaffs_CheckObjectDetailsLoaded(l);
 
-			/* Special case for lost-n-found */
-			if (l->objectId == YAFFS_OBJECTID_LOSTNFOUND) {
-				if (yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) == 0)
-					return l;
-			} else if (yaffs_SumCompare(l->sum, sum) || l->hdrChunk <= 0) {
-				/* LostnFound chunk called Objxxx
-				 * Do a real check
-				 */
-				yaffs_GetObjectName(l, buffer,
-						    YAFFS_MAX_NAME_LENGTH + 1);
-				if (yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
-					return l;
-			}
-		}
+		if (yaffs_NameIndexable(l))
+			yaffs_IndexObjectName(l);
+		else if (yaffs_ObjectNameMatches(l, name, sum))
+			return l;
+	}
+
+	bucket = &directory->myDev->nameBucket[yaffs_NameHashFunction(directory, sum)];
+	ylist_for_each_safe(i, n, bucket) {
+		l = ylist_entry(i, yaffs_Object, nameLink);
+
+		if (l->parent == directory && yaffs_SumCompare(l->sum, sum) &&
+		    yaffs_ObjectNameMatches(l, name, sum))
+			return l;
 	}
 
 	return NULL;
@@ -7289,6 +8715,7 @@ static int yaffs_CreateInitialDirectories(yaffs_Device *dev)
 int yaffs_GutsInitialise(yaffs_Device *dev)
 {
 	int init_failed = 0;
+	int restored = 0;
 	unsigned x;
 	int bits;
 
@@ -7438,7 +8865,6 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	/* More device initialisation */
 	dev->garbageCollections = 0;
 	dev->passiveGarbageCollections = 0;
-	dev->currentDirtyChecker = 0;
 	dev->bufferedBlock = -1;
 	dev->doingBufferedBlockRewrite = 0;
 	dev->nDeletedFiles = 0;
@@ -7465,11 +8891,13 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	    dev->nShortOpCaches > 0) {
 		int i;
 		void *buf;
-		int srCacheBytes = dev->nShortOpCaches * sizeof(yaffs_ChunkCache);
+		int srCacheBytes;
 
 		if (dev->nShortOpCaches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->nShortOpCaches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		srCacheBytes = dev->nShortOpCaches * sizeof(yaffs_ChunkCache);
+
 		dev->srCache =  YMALLOC(srCacheBytes);
 
 		buf = (__u8 *) dev->srCache;
@@ -7477,19 +8905,26 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		if (dev->srCache)
 			memset(dev->srCache, 0, srCacheBytes);
 
+		YINIT_LIST_HEAD(&dev->srLru);
+		for (i = 0; i < YAFFS_NCACHE_BUCKETS; i++)
+			YINIT_LIST_HEAD(&dev->srHash[i]);
+		dev->srDirty = 0;
+
 		for (i = 0; i < dev->nShortOpCaches && buf; i++) {
 			dev->srCache[i].object = NULL;
-			dev->srCache[i].lastUse = 0;
 			dev->srCache[i].dirty = 0;
+			YINIT_LIST_HEAD(&dev->srCache[i].hashLink);
+			YINIT_LIST_HEAD(&dev->srCache[i].objLink);
+			ylist_add_tail(&dev->srCache[i].lruLink, &dev->srLru);
 			dev->srCache[i].data = buf = YMALLOC_DMA(dev->totalBytesPerChunk);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->srLastUse = 0;
 	}
 
 	dev->cacheHits = 0;
+	dev->cacheMisses = 0;
+	dev->cacheFlushes = 0;
 
 	if (!init_failed) {
 		dev->gcCleanupList = YMALLOC(dev->nChunksPerBlock * sizeof(__u32));
@@ -7514,6 +8949,7 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		/* Now scan the flash. */
 		if (dev->isYaffs2) {
 			if (yaffs_CheckpointRestore(dev)) {
+				restored = 1;
 				yaffs_CheckObjectDetailsLoaded(dev->rootDir);
 				T(YAFFS_TRACE_ALWAYS,
 				  (TSTR("yaffs: restored from checkpoint" TENDSTR)));
@@ -7566,6 +9002,8 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		return YAFFS_FAIL;
 	}
 
+	yaffs_RebuildDirtyIndex(dev);
+
 	/* Zero out stats */
 	dev->nPageReads = 0;
 	dev->nPageWrites = 0;
@@ -7578,8 +9016,10 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	yaffs_VerifyFreeChunks(dev);
 	yaffs_VerifyBlocks(dev);
 
-	/* Clean up any aborted checkpoint data */
-	if (!dev->isCheckpointed && dev->blocksInCheckpoint > 0)
+	/* Clean up any aborted checkpoint data. A restored one is kept even
+	 * if it is stale, the next save appends to it.
+	 */
+	if (!restored && !dev->isCheckpointed && dev->blocksInCheckpoint > 0)
 		yaffs_InvalidateCheckpoint(dev);
 
 	T(YAFFS_TRACE_TRACING,
@@ -7656,7 +9096,6 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 	int nFree;
 	int nDirtyCacheChunks;
 	int blocksForCheckpoint;
-	int i;
 
 #if 1
 	nFree = dev->nFreeChunks;
@@ -7666,12 +9105,9 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 
 	nFree += dev->nDeletedFiles;
 
-	/* Now count the number of dirty chunks in the cache and subtract those */
+	/* Now subtract the number of dirty chunks in the cache */
 
-	for (nDirtyCacheChunks = 0, i = 0; i < dev->nShortOpCaches; i++) {
-		if (dev->srCache[i].dirty)
-			nDirtyCacheChunks++;
-	}
+	nDirtyCacheChunks = dev->srDirty;
 
 	nFree -= nDirtyCacheChunks;
 
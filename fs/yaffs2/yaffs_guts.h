@@ -59,11 +59,12 @@
 #define YAFFS_ALLOCATION_NLINKS		100
 
 #define YAFFS_NOBJECT_BUCKETS		256
+#define YAFFS_NNAME_BUCKETS		1024
 
 
 #define YAFFS_OBJECT_SPACE		0x40000
 
-#define YAFFS_CHECKPOINT_VERSION 	3
+#define YAFFS_CHECKPOINT_VERSION 	4
 
 #ifdef CONFIG_YAFFS_UNICODE
 #define YAFFS_MAX_NAME_LENGTH		127
@@ -88,7 +89,8 @@
 
 /* */
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	512
+#define YAFFS_NCACHE_BUCKETS		128
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -113,9 +115,11 @@
 
 /* ChunkCache is used for short read/write operations.*/
 typedef struct {
+	struct ylist_head hashLink;	/* in srHash, while object is set */
+	struct ylist_head lruLink;	/* in srLru, least recently used first */
+	struct ylist_head objLink;	/* in the object's cacheList */
 	struct yaffs_ObjectStruct *object;
 	int chunkId;
-	int lastUse;
 	int dirty;
 	int nBytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -383,10 +387,13 @@ typedef struct {
 	__u32 shrinkSize;
 	int topLevel;
 	yaffs_Tnode *top;
+	__u32 checkpointLow;	/* chunks whose tnode entries changed since */
+	__u32 checkpointHigh;	/* the last checkpoint save */
 } yaffs_FileStructure;
 
 typedef struct {
 	struct ylist_head children;     /* list of child links */
+	struct ylist_head unindexed;    /* children not in the name hash */
 } yaffs_DirectoryStructure;
 
 typedef struct {
@@ -425,6 +432,8 @@ struct yaffs_ObjectStruct {
 				 */
 	__u8 beingCreated:1;	/* This object is still being created so skip some checks. */
 	__u8 isShadowed:1;      /* This object is shadowed on the way to being renamed. */
+	__u8 nameIndexed:1;	/* nameLink is in the device's name hash */
+	__u8 checkpointDirty:1;	/* changed since the last checkpoint save */
 
 	__u8 serial;		/* serial number of chunk in NAND. Cached here */
 	__u16 sum;		/* sum of the name to speed searching */
@@ -440,6 +449,12 @@ struct yaffs_ObjectStruct {
 	struct yaffs_ObjectStruct *parent;
 	struct ylist_head siblings;
 
+	/* name hash bucket, or the parent's unindexed list */
+	struct ylist_head nameLink;
+
+	/* short op cache entries holding our chunks, in chunkId order */
+	struct ylist_head cacheList;
+
 	/* Where's my object header in NAND? */
 	int hdrChunk;
 
@@ -590,6 +605,9 @@ struct yaffs_DeviceStruct {
 	int (*markNANDBlockBad) (struct yaffs_DeviceStruct *dev, int blockNo);
 	int (*queryNANDBlock) (struct yaffs_DeviceStruct *dev, int blockNo,
 			       yaffs_BlockState *state, __u32 *sequenceNumber);
+	/* Optional: tags of all the chunks in a block in one go */
+	int (*readBlockTagsFromNAND) (struct yaffs_DeviceStruct *dev,
+				      int blockNo, yaffs_ExtendedTags *tags);
 #endif
 
 	int isYaffs2;
@@ -638,11 +656,18 @@ struct yaffs_DeviceStruct {
 	struct semaphore sem;	/* Semaphore for waiting on erasure.*/
 	struct semaphore grossLock;	/* Gross locking semaphore */
 	struct rw_semaphore dirLock; /* Lock the directory structure */
+	struct rw_semaphore treeLock;	/* File trees and chunk cache, for readers */
+	atomic_t nUnlockedReads;
+	atomic_t nUnlockedReadRetries;
 	__u8 *spareBuffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 
 				 */
 	void (*putSuperFunc) (struct super_block *sb);
+	struct task_struct *gcThread;	/* background gc */
+	unsigned long lastForegroundOp;	/* jiffies of last VFS call */
+	int gcIdle;		/* gc thread is waiting for a write */
+	int gcIdleWrites;	/* nPageWrites when it started waiting */
         struct ylist_head searchContexts;
 
 #endif
@@ -673,6 +698,15 @@ struct yaffs_DeviceStruct {
 	int checkpointMaxBlocks;
 	__u32 checkpointSum;
 	__u32 checkpointXor;
+	int checkpointOpenBlocks;	/* blocksInCheckpoint when the stream was opened */
+
+	/* Incremental checkpointing: what changed since the last save */
+	int checkpointAppendOk;		/* a delta may be appended to the checkpoint */
+	yaffs_BlockInfo *checkpointBlockInfo;	/* blockInfo as saved */
+	__u8 *checkpointChunkBits;	/* chunkBits as saved */
+	__u32 *checkpointGone;		/* ids of objects freed since */
+	int nCheckpointGone;
+	int checkpointGoneSize;
 
 	int nCheckpointBlocksRequired; /* Number of blocks needed to store current checkpoint set */
 
@@ -681,6 +715,7 @@ struct yaffs_DeviceStruct {
 	__u8 *chunkBits;	/* bitmap of chunks in use */
 	unsigned blockInfoAlt:1;	/* was allocated using alternative strategy */
 	unsigned chunkBitsAlt:1;	/* was allocated using alternative strategy */
+	unsigned dirtyLinksAlt:1;	/* was allocated using alternative strategy */
 	int chunkBitmapStride;	/* Number of bytes of chunkBits per block.
 				 * Must be consistent with nChunksPerBlock.
 				 */
@@ -699,6 +734,8 @@ struct yaffs_DeviceStruct {
 	int isDoingGC;
 	int gcBlock;
 	int gcChunk;
+	int backgroundGC;	/* erased blocks a background gc thread keeps
+				 * spare, 0 if there is no thread */
 
 	int nObjectsCreated;
 	yaffs_Object *freeObjects;
@@ -710,9 +747,17 @@ struct yaffs_DeviceStruct {
 
 	yaffs_ObjectBucket objectBucket[YAFFS_NOBJECT_BUCKETS];
 
+	/* Directory entries, hashed on parent and name sum */
+	struct ylist_head nameBucket[YAFFS_NNAME_BUCKETS];
+
 	int nFreeChunks;
 
-	int currentDirtyChecker;	/* Used to find current dirtiest block */
+	/* FULL blocks by live (in use and not soft deleted) chunk count.
+	 * Entries are checked when used, so a block that has left the
+	 * FULL state may still be linked.
+	 */
+	struct ylist_head *dirtyBuckets;	/* nChunksPerBlock + 1 */
+	struct ylist_head *dirtyLinks;		/* one per block */
 
 	__u32 *gcCleanupList;	/* objects to delete at the end of a GC. */
 	int nonAggressiveSkip;	/* GC state/mode */
@@ -725,6 +770,7 @@ struct yaffs_DeviceStruct {
 	int nGCCopies;
 	int garbageCollections;
 	int passiveGarbageCollections;
+	int backgroundGarbageCollections;
 	int nRetriedWrites;
 	int nRetiredBlocks;
 	int eccFixed;
@@ -749,9 +795,13 @@ struct yaffs_DeviceStruct {
 	int doingBufferedBlockRewrite;
 
 	yaffs_ChunkCache *srCache;
-	int srLastUse;
+	struct ylist_head srLru;	/* free entries are kept at the front */
+	struct ylist_head srHash[YAFFS_NCACHE_BUCKETS];
+	int srDirty;			/* number of dirty entries */
 
 	int cacheHits;
+	int cacheMisses;
+	int cacheFlushes;
 
 	/* Stuff for background deletion and unlinked files.*/
 	yaffs_Object *unlinkedDir;	/* Directory where unlinked and deleted files live. */
@@ -816,12 +866,33 @@ typedef struct {
 	__u32 head;
 } yaffs_CheckpointValidity;
 
+/* Validity marker heads. A checkpoint is a full record (START ... END)
+ * followed by any number of DELTA ... END records, each holding what
+ * changed since the record before it. A STALE record says the flash was
+ * written after the record before it was saved.
+ */
+#define YAFFS_CHECKPOINT_END		0
+#define YAFFS_CHECKPOINT_START		1
+#define YAFFS_CHECKPOINT_DELTA		2
+#define YAFFS_CHECKPOINT_STALE		3
+
+/* Where the checkpoint stream stands between two records */
+typedef struct {
+	int currentBlock;
+	int currentChunk;
+	int nextBlock;
+	int pageSequence;
+	int nBlocks;
+} yaffs_CheckpointPosition;
+
 
 /*----------------------- YAFFS Functions -----------------------*/
 
 int yaffs_GutsInitialise(yaffs_Device *dev);
 void yaffs_Deinitialise(yaffs_Device *dev);
 
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, int nSpareBlocks);
+
 int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev);
 
 int yaffs_RenameObject(yaffs_Object *oldDir, const YCHAR *oldName,
@@ -840,6 +911,9 @@ int yaffs_SetAttributes(yaffs_Object *obj, struct iattr *attr);
 int yaffs_GetAttributes(yaffs_Object *obj, struct iattr *attr);
 
 /* File operations */
+int yaffs_FindChunkForUnlockedRead(yaffs_Object *obj, loff_t offset,
+			int nBytes);
+int yaffs_ReadChunkUnlocked(yaffs_Device *dev, int chunkInNAND, __u8 *buffer);
 int yaffs_ReadDataFromFile(yaffs_Object *obj, __u8 *buffer, loff_t offset,
 				int nBytes);
 int yaffs_WriteDataToFile(yaffs_Object *obj, const __u8 *buffer, loff_t offset,
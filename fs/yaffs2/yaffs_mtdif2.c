@@ -187,6 +187,59 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		return YAFFS_FAIL;
 }
 
+/* Read the tags of a whole block with one read_oob call. The nand layer
+ * then streams the spare areas of consecutive pages rather than setting up
+ * a read for each chunk, which is where most of a mount scan goes.
+ */
+int nandmtd2_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockNo,
+				   yaffs_ExtendedTags *tags)
+{
+#if (MTD_VERSION_CODE > MTD_VERSION(2, 6, 17))
+	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
+	struct mtd_oob_ops ops;
+	int oobavail;
+	int retval;
+	int i;
+	__u8 *buf;
+	yaffs_PackedTags2 pt;
+	loff_t addr = ((loff_t) blockNo) * dev->nChunksPerBlock *
+			dev->totalBytesPerChunk;
+
+	T(YAFFS_TRACE_MTD,
+	  (TSTR("nandmtd2_ReadBlockTagsFromNAND block %d" TENDSTR), blockNo));
+
+	if (!mtd->ecclayout || mtd->ecclayout->oobavail < sizeof(pt))
+		return YAFFS_FAIL;
+
+	oobavail = mtd->ecclayout->oobavail;
+
+	buf = YMALLOC(oobavail * dev->nChunksPerBlock);
+	if (!buf)
+		return YAFFS_FAIL;
+
+	ops.mode = MTD_OOB_AUTO;
+	ops.ooblen = oobavail * dev->nChunksPerBlock;
+	ops.len = 0;
+	ops.ooboffs = 0;
+	ops.datbuf = NULL;
+	ops.oobbuf = buf;
+	retval = mtd->read_oob(mtd, addr, &ops);
+
+	if (retval == 0) {
+		for (i = 0; i < dev->nChunksPerBlock; i++) {
+			memcpy(&pt, &buf[i * oobavail], sizeof(pt));
+			yaffs_UnpackTags2(&tags[i], &pt);
+		}
+	}
+
+	YFREE(buf);
+
+	return (retval == 0) ? YAFFS_OK : YAFFS_FAIL;
+#else
+	return YAFFS_FAIL;
+#endif
+}
+
 int nandmtd2_MarkNANDBlockBad(struct yaffs_DeviceStruct *dev, int blockNo)
 {
 	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
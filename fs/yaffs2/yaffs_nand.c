@@ -53,6 +53,36 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 	return result;
 }
 
+/* Read the tags of every chunk in a block into tags[nChunksPerBlock],
+ * using the driver's batched read if it has one.
+ */
+int yaffs_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockInNAND,
+				yaffs_ExtendedTags *tags)
+{
+	int i;
+	int chunk = blockInNAND * dev->nChunksPerBlock;
+	yaffs_BlockInfo *bi;
+
+	if (dev->readBlockTagsFromNAND && !dev->inbandTags &&
+	    dev->readBlockTagsFromNAND(dev, blockInNAND - dev->blockOffset,
+				       tags) == YAFFS_OK) {
+		dev->nPageReads += dev->nChunksPerBlock;
+
+		for (i = 0; i < dev->nChunksPerBlock; i++) {
+			if (tags[i].eccResult > YAFFS_ECC_RESULT_NO_ERROR) {
+				bi = yaffs_GetBlockInfo(dev, blockInNAND);
+				yaffs_HandleChunkError(dev, bi);
+			}
+		}
+		return YAFFS_OK;
+	}
+
+	for (i = 0; i < dev->nChunksPerBlock; i++)
+		yaffs_ReadChunkWithTagsFromNAND(dev, chunk + i, NULL, &tags[i]);
+
+	return YAFFS_OK;
+}
+
 int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						   int chunkInNAND,
 						   const __u8 *buffer,
@@ -0,0 +1,75 @@
+#ifndef _LINUX_CCACHE_H
+#define _LINUX_CCACHE_H
+
+/*
+ * Compressed cache for clean page cache pages, see mm/ccache.c
+ */
+
+#include <linux/types.h>
+
+struct address_space;
+struct page;
+struct ccache_entry;
+
+#ifdef CONFIG_CCACHE
+
+extern int sysctl_ccache_percent;
+
+extern struct ccache_entry *ccache_prepare(struct address_space *mapping,
+					   struct page *page);
+extern void ccache_store(struct address_space *mapping,
+			 struct ccache_entry *entry);
+extern void ccache_abort(struct ccache_entry *entry);
+extern int ccache_readpage(struct page *page);
+extern int ccache_contains(struct address_space *mapping, pgoff_t index);
+extern void ccache_invalidate_page(struct address_space *mapping,
+				   pgoff_t index);
+extern void ccache_invalidate_range(struct address_space *mapping,
+				    pgoff_t start, pgoff_t end);
+extern void ccache_invalidate_mapping(struct address_space *mapping);
+
+#else
+
+static inline struct ccache_entry *ccache_prepare(
+		struct address_space *mapping, struct page *page)
+{
+	return NULL;
+}
+
+static inline void ccache_store(struct address_space *mapping,
+				struct ccache_entry *entry)
+{
+}
+
+static inline void ccache_abort(struct ccache_entry *entry)
+{
+}
+
+static inline int ccache_readpage(struct page *page)
+{
+	return -ENODATA;
+}
+
+static inline int ccache_contains(struct address_space *mapping,
+				  pgoff_t index)
+{
+	return 0;
+}
+
+static inline void ccache_invalidate_page(struct address_space *mapping,
+					  pgoff_t index)
+{
+}
+
+static inline void ccache_invalidate_range(struct address_space *mapping,
+					   pgoff_t start, pgoff_t end)
+{
+}
+
+static inline void ccache_invalidate_mapping(struct address_space *mapping)
+{
+}
+
+#endif /* CONFIG_CCACHE */
+
+#endif /* _LINUX_CCACHE_H */
@@ -0,0 +1,89 @@
+#ifndef _LINUX_COMPACTION_H
+#define _LINUX_COMPACTION_H
+
+/*
+ * Memory compaction, see mm/compaction.c
+ */
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+
+struct ctl_table;
+struct file;
+
+/* Return values for compact_zone() and try_to_compact_pages() */
+#define COMPACT_SKIPPED		0	/* not possible, or reclaim is better */
+#define COMPACT_CONTINUE	1	/* carry on with the next pageblock */
+#define COMPACT_PARTIAL		2	/* stopped early, a suitable page is free */
+#define COMPACT_COMPLETE	3	/* the whole zone was compacted */
+
+/* The maximum number of times compaction is deferred after a failure */
+#define COMPACT_MAX_DEFER_SHIFT 6
+
+extern int fragmentation_index(struct zone *zone, unsigned int order);
+
+#ifdef CONFIG_COMPACTION
+
+extern int sysctl_compact_memory;
+extern int sysctl_compaction_handler(struct ctl_table *table, int write,
+			struct file *file, void __user *buffer, size_t *length,
+			loff_t *ppos);
+extern int sysctl_extfrag_threshold;
+
+extern unsigned long try_to_compact_pages(struct zonelist *zonelist,
+			int order, gfp_t gfp_mask, nodemask_t *nodemask);
+
+/*
+ * Compaction is deferred when it fails, backing off exponentially so a
+ * zone that can't be compacted doesn't stall every high-order allocation.
+ */
+static inline void defer_compaction(struct zone *zone)
+{
+	zone->compact_considered = 0;
+	if (++zone->compact_defer_shift > COMPACT_MAX_DEFER_SHIFT)
+		zone->compact_defer_shift = COMPACT_MAX_DEFER_SHIFT;
+}
+
+/* Returns true if compaction should be skipped this time */
+static inline int compaction_deferred(struct zone *zone)
+{
+	unsigned long defer_limit = 1UL << zone->compact_defer_shift;
+
+	/* Avoid possible overflow */
+	if (++zone->compact_considered > defer_limit)
+		zone->compact_considered = defer_limit;
+
+	return zone->compact_considered < defer_limit;
+}
+
+/* A success resets the backoff */
+static inline void compaction_succeeded(struct zone *zone)
+{
+	zone->compact_considered = 0;
+	zone->compact_defer_shift = 0;
+}
+
+#else
+
+static inline unsigned long try_to_compact_pages(struct zonelist *zonelist,
+			int order, gfp_t gfp_mask, nodemask_t *nodemask)
+{
+	return COMPACT_SKIPPED;
+}
+
+static inline void defer_compaction(struct zone *zone)
+{
+}
+
+static inline int compaction_deferred(struct zone *zone)
+{
+	return 1;
+}
+
+static inline void compaction_succeeded(struct zone *zone)
+{
+}
+
+#endif /* CONFIG_COMPACTION */
+
+#endif /* _LINUX_COMPACTION_H */
@@ -41,6 +41,10 @@ extern int __delayacct_add_tsk(struct taskstats *, struct task_struct *);
 extern __u64 __delayacct_blkio_ticks(struct task_struct *);
 extern void __delayacct_freepages_start(void);
 extern void __delayacct_freepages_end(void);
+extern void __delayacct_compact_start(void);
+extern void __delayacct_compact_end(void);
+extern void __delayacct_dirty_start(void);
+extern void __delayacct_dirty_end(void);
 
 static inline int delayacct_is_task_waiting_on_io(struct task_struct *p)
 {
@@ -121,6 +125,30 @@ static inline void delayacct_freepages_end(void)
 		__delayacct_freepages_end();
 }
 
+static inline void delayacct_compact_start(void)
+{
+	if (current->delays)
+		__delayacct_compact_start();
+}
+
+static inline void delayacct_compact_end(void)
+{
+	if (current->delays)
+		__delayacct_compact_end();
+}
+
+static inline void delayacct_dirty_start(void)
+{
+	if (current->delays)
+		__delayacct_dirty_start();
+}
+
+static inline void delayacct_dirty_end(void)
+{
+	if (current->delays)
+		__delayacct_dirty_end();
+}
+
 #else
 static inline void delayacct_set_flag(int flag)
 {}
@@ -147,6 +175,14 @@ static inline void delayacct_freepages_start(void)
 {}
 static inline void delayacct_freepages_end(void)
 {}
+static inline void delayacct_compact_start(void)
+{}
+static inline void delayacct_compact_end(void)
+{}
+static inline void delayacct_dirty_start(void)
+{}
+static inline void delayacct_dirty_end(void)
+{}
 
 #endif /* CONFIG_TASK_DELAY_ACCT */
 
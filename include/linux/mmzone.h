@@ -327,6 +327,10 @@ struct zone {
 		struct list_head list;
 		unsigned long nr_scan;
 	} lru[NR_LRU_LISTS];
+	/* pages reclaim isolates per lru_lock hold, see mm/vmscan.c */
+	unsigned int		lru_batch;
+	/* pages reclaim has taken off the LRU lists, under lru_lock */
+	unsigned long		lru_isolated;
 
 	struct zone_reclaim_stat reclaim_stat;
 
@@ -357,6 +361,15 @@ struct zone {
 	 */
 	unsigned int inactive_ratio;
 
+#ifdef CONFIG_COMPACTION
+	/*
+	 * After a direct compaction failure, the next 1<<compact_defer_shift
+	 * attempts on this zone are skipped.  compact_considered counts the
+	 * attempts skipped since the last failure.
+	 */
+	unsigned int		compact_considered;
+	unsigned int		compact_defer_shift;
+#endif
 
 	ZONE_PADDING(_pad2_)
 	/* Rarely used or read-mostly fields */
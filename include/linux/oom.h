@@ -13,6 +13,7 @@
 
 struct zonelist;
 struct notifier_block;
+struct task_struct;
 
 /*
  * Types of limitations to the nodes from which allocations may occur
@@ -30,5 +31,20 @@ extern void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask, int order);
 extern int register_oom_notifier(struct notifier_block *nb);
 extern int unregister_oom_notifier(struct notifier_block *nb);
 
+/*
+ * The Android low memory killer keeps every process on a list per oomkilladj
+ * value so it can find a victim without walking the whole task list. These
+ * keep the lists up to date as processes come and go or change oom_adj.
+ */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_task_add(struct task_struct *p);
+extern void lowmem_task_del(struct task_struct *p);
+extern void lowmem_task_adj(struct task_struct *p);
+#else
+static inline void lowmem_task_add(struct task_struct *p) { }
+static inline void lowmem_task_del(struct task_struct *p) { }
+static inline void lowmem_task_adj(struct task_struct *p) { }
+#endif
+
 #endif /* __KERNEL__*/
 #endif /* _INCLUDE_LINUX_OOM_H */
@@ -719,6 +719,14 @@ struct task_delay_info {
 	struct timespec freepages_start, freepages_end;
 	u64 freepages_delay;	/* wait for memory reclaim */
 	u32 freepages_count;	/* total count of memory reclaim */
+
+	struct timespec compact_start, compact_end;
+	u64 compact_delay;	/* wait for memory compaction */
+	u32 compact_count;	/* total count of memory compaction */
+
+	struct timespec dirty_start, dirty_end;
+	u64 dirty_delay;	/* wait for dirty page writeback throttling */
+	u32 dirty_count;	/* total count of writeback throttling */
 };
 #endif	/* CONFIG_TASK_DELAY_ACCT */
 
@@ -1136,6 +1144,9 @@ struct task_struct {
 #ifdef CONFIG_BLK_DEV_IO_TRACE
 	unsigned int btrace_seq;
 #endif
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct list_head lowmem_node;	/* low memory killer oomkilladj bucket */
+#endif
 
 	unsigned int policy;
 	cpumask_t cpus_allowed;
@@ -33,7 +33,7 @@
  */
 
 
-#define TASKSTATS_VERSION	7
+#define TASKSTATS_VERSION	8
 #define TS_COMM_LEN		32	/* should be >= TASK_COMM_LEN
 					 * in linux/sched.h */
 
@@ -163,6 +163,11 @@ struct taskstats {
 	/* Delay waiting for memory reclaim */
 	__u64	freepages_count;
 	__u64	freepages_delay_total;
+	/* v8: Delay waiting for memory compaction and dirty throttling */
+	__u64	compact_count;
+	__u64	compact_delay_total;
+	__u64	dirty_count;
+	__u64	dirty_delay_total;
 };
 
 
@@ -38,6 +38,7 @@ enum vm_event_item { PGPGIN, PGPGOUT, PSWPIN, PSWPOUT,
 		FOR_ALL_ZONES(PGSCAN_DIRECT),
 		PGINODESTEAL, SLABS_SCANNED, KSWAPD_STEAL, KSWAPD_INODESTEAL,
 		PAGEOUTRUN, ALLOCSTALL, PGROTATED,
+		LRU_LOCK_CONTENDED, LRU_LOCK_WAIT_US, DIRECT_RECLAIM_US,
 #ifdef CONFIG_HUGETLB_PAGE
 		HTLB_BUDDY_PGALLOC, HTLB_BUDDY_PGALLOC_FAIL,
 #endif
@@ -50,10 +51,30 @@ enum vm_event_item { PGPGIN, PGPGOUT, PSWPIN, PSWPOUT,
 		UNEVICTABLE_PGCLEARED,	/* on COW, page truncate */
 		UNEVICTABLE_PGSTRANDED,	/* unable to isolate on unlock */
 		UNEVICTABLE_MLOCKFREED,
+#endif
+#ifdef CONFIG_CCACHE
+		CCACHE_HIT, CCACHE_MISS, CCACHE_STORE, CCACHE_REJECT,
+		CCACHE_DROP, CCACHE_INVALIDATE,
+#endif
+#ifdef CONFIG_COMPACTION
+		COMPACTBLOCKS, COMPACTPAGES, COMPACTPAGEFAILED,
+		COMPACTSTALL, COMPACTFAIL, COMPACTSUCCESS,
 #endif
 		NR_VM_EVENT_ITEMS
 };
 
+/* Tasks stalled on memory, with a latency histogram each in /proc/memstall */
+enum mm_stall_item {
+	MM_STALL_RECLAIM,	/* direct reclaim for an order-0 allocation */
+	MM_STALL_LUMPY,		/* direct (lumpy) reclaim for a higher order */
+	MM_STALL_COMPACT,	/* direct compaction */
+	MM_STALL_CONGESTION,	/* page allocator waiting to retry */
+	MM_STALL_DIRTY,		/* throttled in balance_dirty_pages() */
+	NR_MM_STALL_ITEMS
+};
+
+extern void mm_stall_account(enum mm_stall_item item, s64 us);
+
 extern int sysctl_stat_interval;
 
 #ifdef CONFIG_VM_EVENT_COUNTERS
@@ -0,0 +1,34 @@
+#ifndef _TRACE_BINDER_H
+#define _TRACE_BINDER_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Binder transactions are identified by their debug_id, the same id that
+ * shows up in /proc/binder/transaction_log. Latencies are in nanoseconds
+ * and are measured from the BC_TRANSACTION of the call.
+ */
+
+DECLARE_TRACE(binder_transaction,
+	TPPROTO(int debug_id, int reply, int to_proc, int to_node,
+		unsigned int code, unsigned int flags),
+		TPARGS(debug_id, reply, to_proc, to_node, code, flags));
+
+DECLARE_TRACE(binder_transaction_queued,
+	TPPROTO(int debug_id, int to_proc, int to_thread),
+		TPARGS(debug_id, to_proc, to_thread));
+
+DECLARE_TRACE(binder_transaction_received,
+	TPPROTO(int debug_id, s64 latency),
+		TPARGS(debug_id, latency));
+
+DECLARE_TRACE(binder_reply,
+	TPPROTO(int debug_id, int in_reply_to, s64 latency),
+		TPARGS(debug_id, in_reply_to, latency));
+
+DECLARE_TRACE(binder_buffer_free,
+	TPPROTO(int proc, int debug_id, size_t data_size, size_t offsets_size),
+		TPARGS(proc, debug_id, data_size, offsets_size));
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _TRACE_VMSCAN_H
+#define _TRACE_VMSCAN_H
+
+#include <linux/mmzone.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Page reclaim.  Times are in nanoseconds for the lru_lock and in
+ * microseconds for a whole direct reclaim.
+ */
+
+DECLARE_TRACE(mm_vmscan_lru_isolate,
+	TPPROTO(struct zone *zone, int order, unsigned long nr_requested,
+		unsigned long nr_scanned, unsigned long nr_taken, int file),
+		TPARGS(zone, order, nr_requested, nr_scanned, nr_taken, file));
+
+DECLARE_TRACE(mm_vmscan_lru_lock_contended,
+	TPPROTO(struct zone *zone, u64 wait),
+		TPARGS(zone, wait));
+
+DECLARE_TRACE(mm_vmscan_direct_reclaim_begin,
+	TPPROTO(int order, gfp_t gfp_mask),
+		TPARGS(order, gfp_mask));
+
+DECLARE_TRACE(mm_vmscan_direct_reclaim_end,
+	TPPROTO(unsigned long nr_reclaimed, s64 latency),
+		TPARGS(nr_reclaimed, latency));
+
+#endif
@@ -150,6 +150,12 @@ int __delayacct_add_tsk(struct taskstats *d, struct task_struct *tsk)
 	d->blkio_count += tsk->delays->blkio_count;
 	d->swapin_count += tsk->delays->swapin_count;
 	d->freepages_count += tsk->delays->freepages_count;
+	tmp = d->compact_delay_total + tsk->delays->compact_delay;
+	d->compact_delay_total = (tmp < d->compact_delay_total) ? 0 : tmp;
+	d->compact_count += tsk->delays->compact_count;
+	tmp = d->dirty_delay_total + tsk->delays->dirty_delay;
+	d->dirty_delay_total = (tmp < d->dirty_delay_total) ? 0 : tmp;
+	d->dirty_count += tsk->delays->dirty_count;
 	spin_unlock_irqrestore(&tsk->delays->lock, flags);
 
 done:
@@ -181,3 +187,28 @@ void __delayacct_freepages_end(void)
 			&current->delays->freepages_count);
 }
 
+void __delayacct_compact_start(void)
+{
+	delayacct_start(&current->delays->compact_start);
+}
+
+void __delayacct_compact_end(void)
+{
+	delayacct_end(&current->delays->compact_start,
+			&current->delays->compact_end,
+			&current->delays->compact_delay,
+			&current->delays->compact_count);
+}
+
+void __delayacct_dirty_start(void)
+{
+	delayacct_start(&current->delays->dirty_start);
+}
+
+void __delayacct_dirty_end(void)
+{
+	delayacct_end(&current->delays->dirty_start,
+			&current->delays->dirty_end,
+			&current->delays->dirty_delay,
+			&current->delays->dirty_count);
+}
@@ -34,6 +34,7 @@
 #include <linux/delayacct.h>
 #include <linux/freezer.h>
 #include <linux/cgroup.h>
+#include <linux/oom.h>
 #include <linux/syscalls.h>
 #include <linux/signal.h>
 #include <linux/posix-timers.h>
@@ -77,6 +78,7 @@ static void __unhash_process(struct task_struct *p)
 		list_del_rcu(&p->tasks);
 		__get_cpu_var(process_counts)--;
 	}
+	lowmem_task_del(p);
 	list_del_rcu(&p->thread_group);
 	list_del_init(&p->sibling);
 }
@@ -60,6 +60,7 @@
 #include <linux/tty.h>
 #include <linux/proc_fs.h>
 #include <linux/blkdev.h>
+#include <linux/oom.h>
 #include <trace/sched.h>
 
 #include <asm/pgtable.h>
@@ -1251,6 +1252,7 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 			list_add_tail_rcu(&p->tasks, &init_task.tasks);
 			__get_cpu_var(process_counts)++;
 		}
+		lowmem_task_add(p);
 		attach_pid(p, PIDTYPE_PID, pid);
 		nr_threads++;
 	}
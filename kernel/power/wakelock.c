@@ -38,13 +38,22 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 #define WAKE_LOCK_INITIALIZED            (1U << 8)
 #define WAKE_LOCK_ACTIVE                 (1U << 9)
 #define WAKE_LOCK_AUTO_EXPIRE            (1U << 10)
-#define WAKE_LOCK_PREVENTING_SUSPEND     (1U << 11)
 
 #define TOO_MAY_LOCKS_WARNING		"\n\ntoo many wakelocks!!!\n"
 
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
+/*
+ * Active locks without a timeout are only counted, so has_wake_lock can bail
+ * out without taking list_lock. Active locks with a timeout are also kept in
+ * a tree per type sorted by expiry, with both ends cached: the first is the
+ * next to expire and the last tells how long until they all have.
+ */
+static atomic_t active_count[WAKE_LOCK_TYPE_COUNT];
+static struct rb_root expire_tree[WAKE_LOCK_TYPE_COUNT];
+static struct rb_node *expire_first[WAKE_LOCK_TYPE_COUNT];
+static struct rb_node *expire_last[WAKE_LOCK_TYPE_COUNT];
 static int current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct wake_lock main_wake_lock;
@@ -53,9 +62,25 @@ static struct wake_lock unknown_wakeup;
 
 #ifdef CONFIG_WAKELOCK_STAT
 static struct wake_lock deleted_wake_locks;
-static ktime_t last_sleep_time_update;
 static int wait_for_wakeup;
 
+/*
+ * The sleep wait clock only runs while main_wake_lock is released, so the
+ * time a suspend lock prevented suspend is the difference between the clock
+ * when the lock was taken and when it was released or expired.
+ */
+static ktime_t sleep_wait_total;
+static ktime_t sleep_wait_start;
+static int sleep_waiting;
+
+static ktime_t sleep_wait_clock(ktime_t now)
+{
+	if (sleep_waiting && now.tv64 > sleep_wait_start.tv64)
+		return ktime_add(sleep_wait_total,
+				 ktime_sub(now, sleep_wait_start));
+	return sleep_wait_total;
+}
+
 int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 {
 	struct timespec ts;
@@ -105,9 +130,10 @@ static int print_lock_stat(char *buf, int len, struct wake_lock *lock)
 		else
 			expire_count++;
 		total_time = ktime_add(total_time, add_time);
-		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND)
+		if ((lock->flags & WAKE_LOCK_TYPE_MASK) == WAKE_LOCK_SUSPEND)
 			prevent_suspend_time = ktime_add(prevent_suspend_time,
-					ktime_sub(now, last_sleep_time_update));
+					ktime_sub(sleep_wait_clock(now),
+					lock->stat.prevent_suspend_start));
 		if (add_time.tv64 > max_time.tv64)
 			max_time = add_time;
 	}
@@ -174,47 +200,96 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 	if (ktime_to_ns(duration) > ktime_to_ns(lock->stat.max_time))
 		lock->stat.max_time = duration;
 	lock->stat.last_time = ktime_get();
-	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-		duration = ktime_sub(now, last_sleep_time_update);
+	if ((lock->flags & WAKE_LOCK_TYPE_MASK) == WAKE_LOCK_SUSPEND) {
+		duration = ktime_sub(sleep_wait_clock(now),
+				     lock->stat.prevent_suspend_start);
 		lock->stat.prevent_suspend_time = ktime_add(
 			lock->stat.prevent_suspend_time, duration);
-		lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
 	}
 }
 
+static void wake_lock_stat_start_locked(struct wake_lock *lock)
+{
+	lock->stat.last_time = ktime_get();
+	lock->stat.prevent_suspend_start =
+		sleep_wait_clock(lock->stat.last_time);
+}
+
+/* Called when main_wake_lock is taken (done) or released (!done) */
 static void update_sleep_wait_stats_locked(int done)
 {
-	struct wake_lock *lock;
-	ktime_t now, etime, elapsed, add;
-	int expired;
-
-	now = ktime_get();
-	elapsed = ktime_sub(now, last_sleep_time_update);
-	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link) {
-		expired = get_expired_time(lock, &etime);
-		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-			if (expired)
-				add = ktime_sub(etime, last_sleep_time_update);
-			else
-				add = elapsed;
-			lock->stat.prevent_suspend_time = ktime_add(
-				lock->stat.prevent_suspend_time, add);
-		}
-		if (done || expired)
-			lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
-		else
-			lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
+	ktime_t now = ktime_get();
+
+	if (done && sleep_waiting) {
+		sleep_wait_total = sleep_wait_clock(now);
+		sleep_waiting = 0;
+	} else if (!done && !sleep_waiting) {
+		sleep_wait_start = now;
+		sleep_waiting = 1;
 	}
-	last_sleep_time_update = now;
 }
 #endif
 
+/* Caller must acquire the list_lock spinlock */
+static void expire_tree_add(struct wake_lock *lock, int type)
+{
+	struct rb_node **p = &expire_tree[type].rb_node;
+	struct rb_node *parent = NULL;
+	int leftmost = 1;
+	int rightmost = 1;
+
+	while (*p) {
+		struct wake_lock *entry;
+
+		parent = *p;
+		entry = rb_entry(parent, struct wake_lock, expire_node);
+		if (time_before(lock->expires, entry->expires)) {
+			p = &parent->rb_left;
+			rightmost = 0;
+		} else {
+			p = &parent->rb_right;
+			leftmost = 0;
+		}
+	}
+	rb_link_node(&lock->expire_node, parent, p);
+	rb_insert_color(&lock->expire_node, &expire_tree[type]);
+	if (leftmost)
+		expire_first[type] = &lock->expire_node;
+	if (rightmost)
+		expire_last[type] = &lock->expire_node;
+}
+
+/* Caller must acquire the list_lock spinlock */
+static void expire_tree_del(struct wake_lock *lock, int type)
+{
+	if (expire_first[type] == &lock->expire_node)
+		expire_first[type] = rb_next(&lock->expire_node);
+	if (expire_last[type] == &lock->expire_node)
+		expire_last[type] = rb_prev(&lock->expire_node);
+	rb_erase(&lock->expire_node, &expire_tree[type]);
+}
+
+/*
+ * Drop an active lock from the active count or expire tree, before its
+ * flags are changed. Caller must acquire the list_lock spinlock.
+ */
+static void active_del_locked(struct wake_lock *lock, int type)
+{
+	if (!(lock->flags & WAKE_LOCK_ACTIVE))
+		return;
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		expire_tree_del(lock, type);
+	else
+		atomic_dec(&active_count[type]);
+}
+
 
 static void expire_wake_lock(struct wake_lock *lock)
 {
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 1);
 #endif
+	active_del_locked(lock, lock->flags & WAKE_LOCK_TYPE_MASK);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -243,27 +318,32 @@ static void print_active_locks(int type)
 
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct wake_lock *lock;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	if (atomic_read(&active_count[type]))
+		return -1;
+	while (expire_first[type]) {
+		lock = rb_entry(expire_first[type], struct wake_lock,
+				expire_node);
+		if ((long)(lock->expires - jiffies) > 0)
+			break;
+		expire_wake_lock(lock);
 	}
-	return max_timeout;
+	if (!expire_last[type])
+		return 0;
+	lock = rb_entry(expire_last[type], struct wake_lock, expire_node);
+	return lock->expires - jiffies;
 }
 
 long has_wake_lock(int type)
 {
 	long ret;
 	unsigned long irqflags;
+
+	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
+	if (atomic_read(&active_count[type]))
+		return -1;
 	spin_lock_irqsave(&list_lock, irqflags);
 	ret = has_wake_lock_locked(type);
 	spin_unlock_irqrestore(&list_lock, irqflags);
@@ -391,6 +471,8 @@ void wake_lock_destroy(struct wake_lock *lock)
 				  lock->stat.max_time);
 	}
 #endif
+	active_del_locked(lock, lock->flags & WAKE_LOCK_TYPE_MASK);
+	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
@@ -417,13 +499,14 @@ static void wake_lock_internal(
 	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
 	    (long)(lock->expires - jiffies) <= 0) {
 		wake_unlock_stat_locked(lock, 0);
-		lock->stat.last_time = ktime_get();
+		wake_lock_stat_start_locked(lock);
 	}
 #endif
+	active_del_locked(lock, type);
 	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
 		lock->flags |= WAKE_LOCK_ACTIVE;
 #ifdef CONFIG_WAKELOCK_STAT
-		lock->stat.last_time = ktime_get();
+		wake_lock_stat_start_locked(lock);
 #endif
 	}
 	list_del(&lock->link);
@@ -435,20 +518,20 @@ static void wake_lock_internal(
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
 		list_add_tail(&lock->link, &active_wake_locks[type]);
+		expire_tree_add(lock, type);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
 		lock->expires = LONG_MAX;
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
 		list_add(&lock->link, &active_wake_locks[type]);
+		atomic_inc(&active_count[type]);
 	}
 	if (type == WAKE_LOCK_SUSPEND) {
 		current_event_num++;
 #ifdef CONFIG_WAKELOCK_STAT
 		if (lock == &main_wake_lock)
 			update_sleep_wait_stats_locked(1);
-		else if (!wake_lock_active(&main_wake_lock))
-			update_sleep_wait_stats_locked(0);
 #endif
 		if (has_timeout)
 			expire_in = has_wake_lock_locked(type);
@@ -494,6 +577,7 @@ void wake_unlock(struct wake_lock *lock)
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
+	active_del_locked(lock, type);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -535,8 +619,10 @@ static int __init wakelocks_init(void)
 	int ret;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
+	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++) {
 		INIT_LIST_HEAD(&active_wake_locks[i]);
+		expire_tree[i] = RB_ROOT;
+	}
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
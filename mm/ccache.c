@@ -0,0 +1,466 @@
+/*
+ * mm/ccache.c - compressed cache for clean page cache pages
+ *
+ * When reclaim drops a clean page cache page, reading it back means I/O
+ * to flash and, for squashfs, decompressing it again.  The compressed
+ * cache keeps an LZO compressed copy of each such page, up to
+ * vm.ccache_percent of RAM, and the page cache miss paths look it up
+ * before starting any I/O.
+ *
+ * Entries are keyed by (mapping, index).  An entry is only ever created
+ * by shrink_page_list() as it takes the page out of the page cache, under
+ * the mapping's tree_lock, so it always holds what was on disk at that
+ * time.  It stays valid for as long as the page is out of the page cache:
+ * every other way a page leaves the page cache drops the entry, and
+ * truncate, invalidation and direct I/O writes drop the entries of their
+ * whole range, since these may also cover pages that weren't in the page
+ * cache.  clear_inode() drops all entries of the inode, even if it has no
+ * pages left, before its address_space can be reused for another file.
+ * A hit consumes the entry, the page is back in the page cache.
+ *
+ * That only holds if the file can't change behind the kernel's back, so
+ * the cache is limited to filesystems on a local block device.  Network
+ * filesystems revalidate by invalidating the pages they have cached, and
+ * skip that altogether for a file with no pages left.
+ *
+ * Entries are kept on an LRU, and are dropped from its tail when the cache
+ * grows past its limit or the ccache shrinker is called.  The limit applies
+ * to the memory the entries really take, kmalloc() rounding included.
+ *
+ * Lock ordering: mapping->tree_lock => ccache_lock.  As the tree_lock is
+ * taken from interrupts, ccache_lock must be taken with interrupts off.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/hash.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/swap.h>
+#include <linux/vmstat.h>
+#include <linux/backing-dev.h>
+#include <linux/lzo.h>
+#include <linux/ccache.h>
+
+#define CCACHE_HASH_BITS	12
+#define CCACHE_INODE_HASH_BITS	8
+/* pages that don't compress to half their size aren't worth keeping */
+#define CCACHE_MAX_SIZE		(PAGE_SIZE / 2)
+
+/*
+ * ccache_inode - the entries of one mapping, so that truncate and
+ * invalidation can find them
+ */
+struct ccache_inode {
+	struct hlist_node hash;
+	struct address_space *mapping;
+	struct list_head entries;
+};
+
+struct ccache_entry {
+	struct hlist_node hash;
+	struct list_head inode_list;	/* on ci->entries */
+	struct list_head lru;
+	/* the mapping's ccache_inode, or a spare one until stored */
+	struct ccache_inode *ci;
+	pgoff_t index;
+	unsigned int size;
+	unsigned char data[0];
+};
+
+int sysctl_ccache_percent = 10;
+
+static DEFINE_SPINLOCK(ccache_lock);
+static struct hlist_head ccache_hash[1 << CCACHE_HASH_BITS];
+static struct hlist_head ccache_inode_hash[1 << CCACHE_INODE_HASH_BITS];
+static LIST_HEAD(ccache_lru);
+static unsigned long ccache_nr_entries;
+static unsigned long ccache_size;	/* bytes allocated, see ksize() */
+
+/* lzo workspace and output buffer, used with preemption disabled */
+static DEFINE_PER_CPU(void *, ccache_workmem);
+static DEFINE_PER_CPU(void *, ccache_buffer);
+static int ccache_ready;
+
+static struct hlist_head *ccache_bucket(struct address_space *mapping,
+					pgoff_t index)
+{
+	return &ccache_hash[hash_long((unsigned long)mapping + index,
+				      CCACHE_HASH_BITS)];
+}
+
+static struct hlist_head *ccache_inode_bucket(struct address_space *mapping)
+{
+	return &ccache_inode_hash[hash_ptr(mapping, CCACHE_INODE_HASH_BITS)];
+}
+
+static struct ccache_inode *ccache_find_inode(struct address_space *mapping)
+{
+	struct ccache_inode *ci;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(ci, node, ccache_inode_bucket(mapping), hash)
+		if (ci->mapping == mapping)
+			return ci;
+	return NULL;
+}
+
+static struct ccache_entry *ccache_find(struct address_space *mapping,
+					pgoff_t index)
+{
+	struct ccache_entry *entry;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(entry, node, ccache_bucket(mapping, index), hash)
+		if (entry->index == index && entry->ci->mapping == mapping)
+			return entry;
+	return NULL;
+}
+
+/*
+ * Take an entry out of the cache.  Its ccache_inode is left in place, even
+ * if empty, see ccache_put_inode().  Called with ccache_lock held.
+ */
+static void ccache_unlink(struct ccache_entry *entry)
+{
+	hlist_del(&entry->hash);
+	list_del(&entry->inode_list);
+	list_del(&entry->lru);
+	ccache_nr_entries--;
+	ccache_size -= ksize(entry);
+}
+
+/* Free a ccache_inode with no entries left.  Called with ccache_lock held. */
+static void ccache_put_inode(struct ccache_inode *ci)
+{
+	if (list_empty(&ci->entries)) {
+		hlist_del(&ci->hash);
+		ccache_size -= ksize(ci);
+		kfree(ci);
+	}
+}
+
+static void ccache_drop(struct ccache_entry *entry)
+{
+	struct ccache_inode *ci = entry->ci;
+
+	ccache_unlink(entry);
+	ccache_put_inode(ci);
+	kfree(entry);
+}
+
+/* Drop entries from the LRU tail.  Called with ccache_lock held. */
+static void ccache_evict(unsigned long nr, unsigned long max_size)
+{
+	struct ccache_entry *entry;
+
+	while (!list_empty(&ccache_lru) && (nr || ccache_size > max_size)) {
+		entry = list_entry(ccache_lru.prev, struct ccache_entry, lru);
+		ccache_drop(entry);
+		count_vm_event(CCACHE_DROP);
+		if (nr)
+			nr--;
+	}
+}
+
+static unsigned long ccache_max_size(void)
+{
+	return (totalram_pages / 100 * sysctl_ccache_percent) << PAGE_SHIFT;
+}
+
+/**
+ * ccache_prepare - compress a clean page that reclaim is about to drop
+ * @mapping: the page's mapping
+ * @page: the locked page
+ *
+ * Returns an entry to hand to ccache_store() once the page is out of the
+ * page cache, or to ccache_abort() if it can't be freed after all.  Returns
+ * NULL if the page isn't worth caching.  Nobody can modify the page between
+ * here and its removal without either holding a reference or dirtying it,
+ * both of which stop __remove_mapping().
+ */
+struct ccache_entry *ccache_prepare(struct address_space *mapping,
+				    struct page *page)
+{
+	struct ccache_entry *entry;
+	struct ccache_inode *ci = NULL;
+	size_t clen;
+	void *src, *dst;
+	int ret;
+
+	if (!sysctl_ccache_percent || !ccache_ready || PageSwapCache(page) ||
+	    !PageUptodate(page) || PageDirty(page) || !mapping->host ||
+	    !mapping->host->i_sb->s_bdev || mapping_cap_swap_backed(mapping))
+		return NULL;
+
+	spin_lock_irq(&ccache_lock);
+	if (!ccache_find_inode(mapping)) {
+		spin_unlock_irq(&ccache_lock);
+		ci = kmalloc(sizeof(*ci), GFP_NOWAIT | __GFP_NORETRY |
+			     __GFP_NOMEMALLOC | __GFP_NOWARN);
+		if (!ci)
+			return NULL;
+	} else
+		spin_unlock_irq(&ccache_lock);
+
+	dst = per_cpu(ccache_buffer, get_cpu());
+	src = kmap_atomic(page, KM_USER0);
+	ret = lzo1x_1_compress(src, PAGE_SIZE, dst, &clen,
+			       __get_cpu_var(ccache_workmem));
+	kunmap_atomic(src, KM_USER0);
+
+	if (ret != LZO_E_OK || clen > CCACHE_MAX_SIZE) {
+		put_cpu();
+		count_vm_event(CCACHE_REJECT);
+		kfree(ci);
+		return NULL;
+	}
+
+	entry = kmalloc(sizeof(*entry) + clen, GFP_NOWAIT | __GFP_NORETRY |
+			__GFP_NOMEMALLOC | __GFP_NOWARN);
+	if (entry)
+		memcpy(entry->data, dst, clen);
+	put_cpu();
+	if (!entry) {
+		kfree(ci);
+		return NULL;
+	}
+
+	entry->ci = ci;
+	entry->index = page->index;
+	entry->size = clen;
+	return entry;
+}
+
+/**
+ * ccache_store - add a prepared entry to the cache
+ * @mapping: the mapping the page was removed from
+ * @entry: the entry from ccache_prepare(), may be NULL
+ *
+ * Called under @mapping's tree_lock, right after the page was taken out of
+ * the page cache.
+ */
+void ccache_store(struct address_space *mapping, struct ccache_entry *entry)
+{
+	struct ccache_inode *ci;
+
+	if (!entry)
+		return;
+
+	spin_lock(&ccache_lock);
+	ci = ccache_find_inode(mapping);
+	if (!ci) {
+		ci = entry->ci;
+		if (!ci) {
+			/* the mapping's entries were dropped meanwhile */
+			spin_unlock(&ccache_lock);
+			kfree(entry);
+			return;
+		}
+		ci->mapping = mapping;
+		INIT_LIST_HEAD(&ci->entries);
+		hlist_add_head(&ci->hash, ccache_inode_bucket(mapping));
+		ccache_size += ksize(ci);
+	} else
+		kfree(entry->ci);
+
+	entry->ci = ci;
+	hlist_add_head(&entry->hash, ccache_bucket(mapping, entry->index));
+	list_add(&entry->inode_list, &ci->entries);
+	list_add(&entry->lru, &ccache_lru);
+	ccache_nr_entries++;
+	ccache_size += ksize(entry);
+	ccache_evict(0, ccache_max_size());
+	spin_unlock(&ccache_lock);
+
+	count_vm_event(CCACHE_STORE);
+}
+
+void ccache_abort(struct ccache_entry *entry)
+{
+	if (entry) {
+		kfree(entry->ci);
+		kfree(entry);
+	}
+}
+
+/**
+ * ccache_readpage - fill a page from the compressed cache
+ * @page: the locked page, in the page cache and not uptodate
+ *
+ * Returns 0 if the page was filled, in which case it's uptodate and
+ * unlocked, like after a successful ->readpage().  Otherwise the page is
+ * left alone for ->readpage().  Pages that have been partly written are
+ * never filled.
+ */
+int ccache_readpage(struct page *page)
+{
+	struct address_space *mapping = page->mapping;
+	struct ccache_entry *entry;
+	struct ccache_inode *ci;
+	size_t len = PAGE_SIZE;
+	void *dst;
+	int ret;
+
+	if (!ccache_nr_entries)
+		return -ENODATA;
+	if (PageUptodate(page) || PageDirty(page) || PagePrivate(page))
+		return -EBUSY;
+
+	spin_lock_irq(&ccache_lock);
+	entry = ccache_find(mapping, page->index);
+	if (entry) {
+		ci = entry->ci;
+		ccache_unlink(entry);
+		ccache_put_inode(ci);
+	}
+	spin_unlock_irq(&ccache_lock);
+
+	if (!entry) {
+		count_vm_event(CCACHE_MISS);
+		return -ENODATA;
+	}
+
+	dst = kmap_atomic(page, KM_USER0);
+	ret = lzo1x_decompress_safe(entry->data, entry->size, dst, &len);
+	kunmap_atomic(dst, KM_USER0);
+	kfree(entry);
+
+	if (ret != LZO_E_OK || len != PAGE_SIZE) {
+		count_vm_event(CCACHE_MISS);
+		return -EIO;
+	}
+
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+	unlock_page(page);
+	count_vm_event(CCACHE_HIT);
+	return 0;
+}
+
+/*
+ * Used by readahead to pick out the pages to fill from the cache rather
+ * than pass to ->readpages().
+ */
+int ccache_contains(struct address_space *mapping, pgoff_t index)
+{
+	int ret;
+
+	if (!ccache_nr_entries)
+		return 0;
+
+	spin_lock_irq(&ccache_lock);
+	ret = ccache_find(mapping, index) != NULL;
+	spin_unlock_irq(&ccache_lock);
+	return ret;
+}
+
+/*
+ * Called by __remove_from_page_cache() under the tree_lock, so that no
+ * entry outlives a page it doesn't match.
+ */
+void ccache_invalidate_page(struct address_space *mapping, pgoff_t index)
+{
+	struct ccache_entry *entry;
+
+	if (!ccache_nr_entries)
+		return;
+
+	spin_lock(&ccache_lock);
+	entry = ccache_find(mapping, index);
+	if (entry) {
+		ccache_drop(entry);
+		count_vm_event(CCACHE_INVALIDATE);
+	}
+	spin_unlock(&ccache_lock);
+}
+
+/*
+ * Drop the entries of @mapping in [@start, @end], after truncation or
+ * invalidation of the range.  Not called under the tree_lock, so check the
+ * cache under ccache_lock rather than rely on an unlocked read.
+ */
+void ccache_invalidate_range(struct address_space *mapping, pgoff_t start,
+			     pgoff_t end)
+{
+	struct ccache_entry *entry, *next;
+	struct ccache_inode *ci;
+
+	spin_lock_irq(&ccache_lock);
+	ci = ccache_find_inode(mapping);
+	if (ci) {
+		list_for_each_entry_safe(entry, next, &ci->entries,
+					 inode_list) {
+			if (entry->index < start || entry->index > end)
+				continue;
+			ccache_unlink(entry);
+			kfree(entry);
+			count_vm_event(CCACHE_INVALIDATE);
+		}
+		ccache_put_inode(ci);
+	}
+	spin_unlock_irq(&ccache_lock);
+}
+
+/*
+ * Called by clear_inode(), so that no entry outlives the address_space it
+ * is keyed by, which may be reused for another file.  A mapping can only
+ * gain entries while it has pages, and this one has none left, so there is
+ * no need to take ccache_lock if the cache is empty.
+ */
+void ccache_invalidate_mapping(struct address_space *mapping)
+{
+	if (!ccache_nr_entries)
+		return;
+
+	ccache_invalidate_range(mapping, 0, ULONG_MAX);
+}
+
+static int ccache_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	spin_lock_irq(&ccache_lock);
+	if (nr_to_scan)
+		ccache_evict(nr_to_scan, ULONG_MAX);
+	spin_unlock_irq(&ccache_lock);
+
+	return ccache_nr_entries;
+}
+
+static struct shrinker ccache_shrinker = {
+	.shrink = ccache_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static int __init ccache_init(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		per_cpu(ccache_workmem, cpu) = kmalloc(LZO1X_MEM_COMPRESS,
+						       GFP_KERNEL);
+		per_cpu(ccache_buffer, cpu) =
+			kmalloc(lzo1x_worst_compress(PAGE_SIZE), GFP_KERNEL);
+		if (!per_cpu(ccache_workmem, cpu) ||
+		    !per_cpu(ccache_buffer, cpu))
+			goto out_free;
+	}
+
+	register_shrinker(&ccache_shrinker);
+	ccache_ready = 1;
+	return 0;
+
+out_free:
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(ccache_workmem, cpu));
+		kfree(per_cpu(ccache_buffer, cpu));
+	}
+	printk(KERN_ERR "ccache: failed to allocate compression buffers\n");
+	return -ENOMEM;
+}
+module_init(ccache_init);
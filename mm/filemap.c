@@ -34,6 +34,7 @@
 #include <linux/hardirq.h> /* for BUG_ON(!in_atomic()) only */
 #include <linux/memcontrol.h>
 #include <linux/mm_inline.h> /* for page_is_file_cache() */
+#include <linux/ccache.h>
 #include "internal.h"
 
 /*
@@ -117,6 +118,7 @@ void __remove_from_page_cache(struct page *page)
 	struct address_space *mapping = page->mapping;
 
 	radix_tree_delete(&mapping->page_tree, page->index);
+	ccache_invalidate_page(mapping, page->index);
 	page->mapping = NULL;
 	mapping->nrpages--;
 	__dec_zone_page_state(page, NR_FILE_PAGES);
@@ -1139,8 +1141,13 @@ page_not_up_to_date_locked:
 		}
 
 readpage:
-		/* Start the actual read. The read will unlock the page. */
-		error = mapping->a_ops->readpage(filp, page);
+		/*
+		 * Start the actual read, unless the page can be filled from
+		 * the ccache. Either way the page ends up unlocked.
+		 */
+		error = 0;
+		if (ccache_readpage(page))
+			error = mapping->a_ops->readpage(filp, page);
 
 		if (unlikely(error)) {
 			if (error == AOP_TRUNCATED_PAGE) {
@@ -1422,7 +1429,7 @@ static int page_cache_read(struct file *file, pgoff_t offset)
 			return -ENOMEM;
 
 		ret = add_to_page_cache_lru(page, mapping, offset, GFP_KERNEL);
-		if (ret == 0)
+		if (ret == 0 && ccache_readpage(page))
 			ret = mapping->a_ops->readpage(file, page);
 		else if (ret == -EEXIST)
 			ret = 0; /* losing race to add is OK */
@@ -2115,6 +2122,8 @@ generic_file_direct_write(struct kiocb *iocb, const struct iovec *iov,
 		invalidate_inode_pages2_range(mapping,
 					      pos >> PAGE_CACHE_SHIFT, end);
 	}
+	/* pages reclaimed before the write may still be in the ccache */
+	ccache_invalidate_range(mapping, pos >> PAGE_CACHE_SHIFT, end);
 
 	if (written > 0) {
 		loff_t end = pos + written;
@@ -51,6 +51,9 @@ extern void putback_lru_page(struct page *page);
  */
 extern unsigned long highest_memmap_pfn;
 extern void __free_pages_bootmem(struct page *page, unsigned int order);
+#ifdef CONFIG_COMPACTION
+extern int split_free_page(struct page *page);
+#endif
 
 /*
  * function for dealing with page's order in buddy system.
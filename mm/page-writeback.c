@@ -34,6 +34,8 @@
 #include <linux/syscalls.h>
 #include <linux/buffer_head.h>
 #include <linux/pagevec.h>
+#include <linux/delayacct.h>
+#include <linux/ktime.h>
 
 /*
  * The maximum number of pages to writeout in a single bdflush/kupdate
@@ -498,6 +500,8 @@ static void balance_dirty_pages(struct address_space *mapping)
 	unsigned long bdi_thresh;
 	unsigned long pages_written = 0;
 	unsigned long write_chunk = sync_writeback_pages();
+	int throttled = 0;
+	ktime_t start;
 
 	struct backing_dev_info *bdi = mapping->backing_dev_info;
 
@@ -535,6 +539,13 @@ static void balance_dirty_pages(struct address_space *mapping)
 		if (!bdi->dirty_exceeded)
 			bdi->dirty_exceeded = 1;
 
+		/* From here on the task is throttled, account for it */
+		if (!throttled) {
+			throttled = 1;
+			delayacct_dirty_start();
+			start = ktime_get();
+		}
+
 		/* Note: nr_reclaimable denotes nr_dirty + nr_unstable.
 		 * Unstable writes are a feature of certain networked
 		 * filesystems (i.e. NFS) in which data may have been
@@ -574,6 +585,12 @@ static void balance_dirty_pages(struct address_space *mapping)
 		congestion_wait(WRITE, HZ/10);
 	}
 
+	if (throttled) {
+		mm_stall_account(MM_STALL_DIRTY,
+				 ktime_us_delta(ktime_get(), start));
+		delayacct_dirty_end();
+	}
+
 	if (bdi_nr_reclaimable + bdi_nr_writeback < bdi_thresh &&
 			bdi->dirty_exceeded)
 		bdi->dirty_exceeded = 0;
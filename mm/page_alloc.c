@@ -46,6 +46,9 @@
 #include <linux/page-isolation.h>
 #include <linux/page_cgroup.h>
 #include <linux/debugobjects.h>
+#include <linux/compaction.h>
+#include <linux/delayacct.h>
+#include <linux/ktime.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
@@ -1058,6 +1061,49 @@ void split_page(struct page *page, unsigned int order)
 		set_page_refcounted(page + i);
 }
 
+#ifdef CONFIG_COMPACTION
+/*
+ * Similar to split_page except the page is already free.  As this is only
+ * being used for migration, the migratetype of the block also changes.
+ * Returns the number of pages split, 0 if the zone would drop below its
+ * low watermark.  The caller holds zone->lock.
+ */
+int split_free_page(struct page *page)
+{
+	unsigned int order;
+	unsigned long watermark;
+	struct zone *zone;
+
+	BUG_ON(!PageBuddy(page));
+
+	zone = page_zone(page);
+	order = page_order(page);
+
+	/* Obey watermarks as if the page was being allocated */
+	watermark = zone->pages_low + (1 << order);
+	if (!zone_watermark_ok(zone, 0, watermark, 0, 0))
+		return 0;
+
+	/* Remove page from free list */
+	list_del(&page->lru);
+	zone->free_area[order].nr_free--;
+	rmv_page_order(page);
+	__mod_zone_page_state(zone, NR_FREE_PAGES, -(1UL << order));
+
+	/* Split into individual pages */
+	set_page_refcounted(page);
+	split_page(page, order);
+
+	if (order >= pageblock_order - 1) {
+		struct page *endpage = page + (1 << order) - 1;
+		for (; page < endpage; page += pageblock_nr_pages)
+			set_pageblock_migratetype(page, MIGRATE_MOVABLE);
+	}
+
+	return 1 << order;
+}
+#endif
+
 /*
  * Really, prep_compound_page() should be called from __rmqueue_bulk().  But
  * we cheat by calling it from here, in the order > 0 path.  Saves a branch
@@ -1461,6 +1507,82 @@ try_next_zone:
 	return page;
 }
 
+/*
+ * Wait for writeback to make progress before the allocator retries, and
+ * account the wait as a congestion stall.
+ */
+static void alloc_congestion_wait(void)
+{
+	ktime_t start = ktime_get();
+
+	congestion_wait(WRITE, HZ/50);
+	mm_stall_account(MM_STALL_CONGESTION,
+			 ktime_us_delta(ktime_get(), start));
+}
+
+#ifdef CONFIG_COMPACTION
+/* Try memory compaction for high-order allocations before reclaim */
+static struct page *
+__alloc_pages_direct_compact(gfp_t gfp_mask, unsigned int order,
+	struct zonelist *zonelist, enum zone_type high_zoneidx,
+	nodemask_t *nodemask, int alloc_flags)
+{
+	struct zone *preferred_zone;
+	struct page *page;
+	unsigned long compact_result;
+	ktime_t start;
+
+	if (!order)
+		return NULL;
+
+	(void)first_zones_zonelist(zonelist, high_zoneidx, nodemask,
+							&preferred_zone);
+	if (!preferred_zone || compaction_deferred(preferred_zone))
+		return NULL;
+
+	delayacct_compact_start();
+	start = ktime_get();
+	current->flags |= PF_MEMALLOC;
+	compact_result = try_to_compact_pages(zonelist, order, gfp_mask,
+							nodemask);
+	current->flags &= ~PF_MEMALLOC;
+	mm_stall_account(MM_STALL_COMPACT,
+			 ktime_us_delta(ktime_get(), start));
+	delayacct_compact_end();
+	if (compact_result == COMPACT_SKIPPED)
+		return NULL;
+
+	/* Pages freed by migration are on the per-cpu lists */
+	drain_all_pages();
+
+	page = get_page_from_freelist(gfp_mask, nodemask, order, zonelist,
+					high_zoneidx, alloc_flags);
+	if (page) {
+		compaction_succeeded(preferred_zone);
+		count_vm_event(COMPACTSUCCESS);
+		return page;
+	}
+
+	/*
+	 * It's bad if compaction run occurs and fails.  The most likely
+	 * reason is that pages exist, but not enough to satisfy watermarks.
+	 */
+	count_vm_event(COMPACTFAIL);
+	defer_compaction(preferred_zone);
+
+	cond_resched();
+	return NULL;
+}
+#else
+static inline struct page *
+__alloc_pages_direct_compact(gfp_t gfp_mask, unsigned int order,
+	struct zonelist *zonelist, enum zone_type high_zoneidx,
+	nodemask_t *nodemask, int alloc_flags)
+{
+	return NULL;
+}
+#endif /* CONFIG_COMPACTION */
+
 /*
  * This is the 'heart' of the zoned buddy allocator.
  */
@@ -1559,7 +1681,7 @@ nofail_alloc:
 			if (page)
 				goto got_pg;
 			if (gfp_mask & __GFP_NOFAIL) {
-				congestion_wait(WRITE, HZ/50);
+				alloc_congestion_wait();
 				goto nofail_alloc;
 			}
 		}
@@ -1572,6 +1694,12 @@ nofail_alloc:
 
 	cond_resched();
 
+	/* Try to make a free block of the right order by compaction */
+	page = __alloc_pages_direct_compact(gfp_mask, order, zonelist,
+					high_zoneidx, nodemask, alloc_flags);
+	if (page)
+		goto got_pg;
+
 	/* We now go into synchronous reclaim */
 	cpuset_memory_pressure_bump();
 	/*
@@ -1656,7 +1784,7 @@ nofail_alloc:
 			do_retry = 1;
 	}
 	if (do_retry) {
-		congestion_wait(WRITE, HZ/50);
+		alloc_congestion_wait();
 		goto rebalance;
 	}
 
@@ -3551,6 +3679,8 @@ static void __paginginit free_area_init_core(struct pglist_data *pgdat,
 		zone->name = zone_names[j];
 		spin_lock_init(&zone->lock);
 		spin_lock_init(&zone->lru_lock);
+		zone->lru_batch = SWAP_CLUSTER_MAX;
+		zone->lru_isolated = 0;
 		zone_seqlock_init(zone);
 		zone->zone_pgdat = pgdat;
 
@@ -16,6 +16,7 @@
 #include <linux/task_io_accounting_ops.h>
 #include <linux/pagevec.h>
 #include <linux/pagemap.h>
+#include <linux/ccache.h>
 
 void default_unplug_io_fn(struct backing_dev_info *bdi, struct page *page)
 {
@@ -85,9 +86,26 @@ EXPORT_SYMBOL(read_cache_pages);
 static int read_pages(struct address_space *mapping, struct file *filp,
 		struct list_head *pages, unsigned nr_pages)
 {
+	struct page *page, *next;
 	unsigned page_idx;
 	int ret;
 
+	/*
+	 * Fill the pages held in the ccache from there, ->readpages() only
+	 * gets the ones that need I/O.
+	 */
+	list_for_each_entry_safe(page, next, pages, lru) {
+		if (!ccache_contains(mapping, page->index))
+			continue;
+		list_del(&page->lru);
+		nr_pages--;
+		if (!add_to_page_cache_lru(page, mapping,
+					page->index, GFP_KERNEL) &&
+		    ccache_readpage(page))
+			mapping->a_ops->readpage(filp, page);
+		page_cache_release(page);
+	}
+
 	if (mapping->a_ops->readpages) {
 		ret = mapping->a_ops->readpages(filp, mapping, pages, nr_pages);
 		/* Clean up the remaining pages */
@@ -96,7 +114,7 @@ static int read_pages(struct address_space *mapping, struct file *filp,
 	}
 
 	for (page_idx = 0; page_idx < nr_pages; page_idx++) {
-		struct page *page = list_to_page(pages);
+		page = list_to_page(pages);
 		list_del(&page->lru);
 		if (!add_to_page_cache_lru(page, mapping,
 					page->index, GFP_KERNEL)) {
@@ -38,6 +38,7 @@ int page_cluster;
 
 static DEFINE_PER_CPU(struct pagevec[NR_LRU_LISTS], lru_add_pvecs);
 static DEFINE_PER_CPU(struct pagevec, lru_rotate_pvecs);
+static DEFINE_PER_CPU(struct pagevec, lru_putback_pvecs);
 
 /*
  * This path almost never happens for VM activity - pages are normally
@@ -224,6 +225,65 @@ void __lru_cache_add(struct page *page, enum lru_list lru)
 	put_cpu_var(lru_add_pvecs);
 }
 
+/*
+ * Put pages that reclaim isolated but did not free back on their LRU lists,
+ * then drop the isolation references.  Unlike ____pagevec_lru_add(), which
+ * is for pages new to the LRU, the pages keep PG_active and are not counted
+ * as scanned again: reclaim did that when it isolated them.
+ */
+static void pagevec_lru_putback(struct pagevec *pvec)
+{
+	int i;
+	struct zone *zone = NULL;
+
+	for (i = 0; i < pagevec_count(pvec); i++) {
+		struct page *page = pvec->pages[i];
+		struct zone *pagezone = page_zone(page);
+		struct zone_reclaim_stat *memcg_reclaim_stat;
+		int file;
+
+		if (pagezone != zone) {
+			if (zone)
+				spin_unlock_irq(&zone->lru_lock);
+			zone = pagezone;
+			spin_lock_irq(&zone->lru_lock);
+		}
+		VM_BUG_ON(PageLRU(page));
+		SetPageLRU(page);
+		add_page_to_lru_list(zone, page, page_lru(page));
+		if (!PageActive(page))
+			continue;
+
+		file = !!page_is_file_cache(page);
+		zone->reclaim_stat.recent_rotated[file]++;
+		memcg_reclaim_stat = mem_cgroup_get_reclaim_stat_from_page(page);
+		if (memcg_reclaim_stat)
+			memcg_reclaim_stat->recent_rotated[file]++;
+	}
+	if (zone)
+		spin_unlock_irq(&zone->lru_lock);
+	release_pages(pvec->pages, pvec->nr, pvec->cold);
+	pagevec_reinit(pvec);
+}
+
+/**
+ * lru_putback_page - return an isolated page to the LRU
+ * @page: the evictable page, still holding the reference from isolation
+ *
+ * The page goes back with the next PAGEVEC_SIZE pages reclaim puts back on
+ * this CPU, so that putting back a batch takes each zone's lru_lock once
+ * per pagevec rather than holding it across the whole batch.  The
+ * reference is dropped once the page is back on its list.
+ */
+void lru_putback_page(struct page *page)
+{
+	struct pagevec *pvec = &get_cpu_var(lru_putback_pvecs);
+
+	if (!pagevec_add(pvec, page))
+		pagevec_lru_putback(pvec);
+	put_cpu_var(lru_putback_pvecs);
+}
+
 /**
  * lru_cache_add_lru - add a page to a page list
  * @page: the page to be added to the LRU.
@@ -281,6 +341,10 @@ static void drain_cpu_pagevecs(int cpu)
 			____pagevec_lru_add(pvec, lru);
 	}
 
+	pvec = &per_cpu(lru_putback_pvecs, cpu);
+	if (pagevec_count(pvec))
+		pagevec_lru_putback(pvec);
+
 	pvec = &per_cpu(lru_rotate_pvecs, cpu);
 	if (pagevec_count(pvec)) {
 		unsigned long flags;
@@ -438,47 +502,6 @@ void ____pagevec_lru_add(struct pagevec *pvec, enum lru_list lru)
 
 EXPORT_SYMBOL(____pagevec_lru_add);
 
-/*
- * Try to drop buffers from the pages in a pagevec
- */
-void pagevec_strip(struct pagevec *pvec)
-{
-	int i;
-
-	for (i = 0; i < pagevec_count(pvec); i++) {
-		struct page *page = pvec->pages[i];
-
-		if (PagePrivate(page) && trylock_page(page)) {
-			if (PagePrivate(page))
-				try_to_release_page(page, 0);
-			unlock_page(page);
-		}
-	}
-}
-
-/**
- * pagevec_swap_free - try to free swap space from the pages in a pagevec
- * @pvec: pagevec with swapcache pages to free the swap space of
- *
- * The caller needs to hold an extra reference to each page and
- * not hold the page lock on the pages.  This function uses a
- * trylock on the page lock so it may not always free the swap
- * space associated with a page.
- */
-void pagevec_swap_free(struct pagevec *pvec)
-{
-	int i;
-
-	for (i = 0; i < pagevec_count(pvec); i++) {
-		struct page *page = pvec->pages[i];
-
-		if (PageSwapCache(page) && trylock_page(page)) {
-			try_to_free_swap(page);
-			unlock_page(page);
-		}
-	}
-}
-
 /**
  * pagevec_lookup - gang pagecache lookup
  * @pvec:	Where the resulting pages are placed
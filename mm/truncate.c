@@ -16,6 +16,7 @@
 #include <linux/highmem.h>
 #include <linux/pagevec.h>
 #include <linux/task_io_accounting_ops.h>
+#include <linux/ccache.h>
 #include <linux/buffer_head.h>	/* grr. try_to_release_page,
 				   do_invalidatepage */
 #include "internal.h"
@@ -169,7 +170,7 @@ void truncate_inode_pages_range(struct address_space *mapping,
 	int i;
 
 	if (mapping->nrpages == 0)
-		return;
+		goto out;
 
 	BUG_ON((lend & (PAGE_CACHE_SIZE - 1)) != (PAGE_CACHE_SIZE - 1));
 	end = (lend >> PAGE_CACHE_SHIFT);
@@ -251,6 +252,13 @@ void truncate_inode_pages_range(struct address_space *mapping,
 		}
 		pagevec_release(&pvec);
 	}
+out:
+	/*
+	 * Pages that were out of the page cache may still have ccache
+	 * entries, including the partial page.
+	 */
+	ccache_invalidate_range(mapping, lstart >> PAGE_CACHE_SHIFT,
+				lend >> PAGE_CACHE_SHIFT);
 }
 EXPORT_SYMBOL(truncate_inode_pages_range);
 
@@ -312,6 +320,7 @@ unlock:
 		if (likely(!be_atomic))
 			cond_resched();
 	}
+	ccache_invalidate_range(mapping, start, end);
 	return ret;
 }
 
@@ -453,6 +462,7 @@ int invalidate_inode_pages2_range(struct address_space *mapping,
 		pagevec_release(&pvec);
 		cond_resched();
 	}
+	ccache_invalidate_range(mapping, start, end);
 	return ret;
 }
 EXPORT_SYMBOL_GPL(invalidate_inode_pages2_range);
@@ -38,8 +38,11 @@
 #include <linux/kthread.h>
 #include <linux/freezer.h>
 #include <linux/memcontrol.h>
+#include <linux/ccache.h>
 #include <linux/delayacct.h>
 #include <linux/sysctl.h>
+#include <linux/ktime.h>
+#include <trace/vmscan.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
@@ -115,6 +118,22 @@ struct scan_control {
 #define prefetchw_prev_lru_page(_page, _base, _field) do { } while (0)
 #endif
 
+/*
+ * Reclaim takes up to zone->lru_batch pages off an LRU list per lru_lock
+ * hold.  The batch grows when reclaimers find the lock contended, so that
+ * they come back for it less often, and is capped at LRU_BATCH_MAX to bound
+ * how long the lock is held.  Since every contending reclaimer then holds
+ * a larger batch off the LRU, the batch is only used while the pages all of
+ * them hold, zone->lru_isolated, stay a small part of the inactive lists,
+ * see reclaim_batch().
+ */
+#define LRU_BATCH_MAX	(4 * SWAP_CLUSTER_MAX)
+
+DEFINE_TRACE(mm_vmscan_lru_isolate);
+DEFINE_TRACE(mm_vmscan_lru_lock_contended);
+DEFINE_TRACE(mm_vmscan_direct_reclaim_begin);
+DEFINE_TRACE(mm_vmscan_direct_reclaim_end);
+
 /*
  * From 0 .. 100.  Higher means more swappy.
  */
@@ -415,9 +434,11 @@ static pageout_t pageout(struct page *page, struct address_space *mapping,
 
 /*
  * Same as remove_mapping, but if the page is removed from the mapping, it
- * gets returned with a refcount of 0.
+ * gets returned with a refcount of 0.  A ccache entry prepared for the page
+ * is stored once it's out of the page cache.
  */
-static int __remove_mapping(struct address_space *mapping, struct page *page)
+static int __remove_mapping(struct address_space *mapping, struct page *page,
+			    struct ccache_entry *centry)
 {
 	BUG_ON(!PageLocked(page));
 	BUG_ON(mapping != page_mapping(page));
@@ -463,6 +484,7 @@ static int __remove_mapping(struct address_space *mapping, struct page *page)
 		swap_free(swap);
 	} else {
 		__remove_from_page_cache(page);
+		ccache_store(mapping, centry);
 		spin_unlock_irq(&mapping->tree_lock);
 	}
 
@@ -481,7 +503,7 @@ cannot_free:
  */
 int remove_mapping(struct address_space *mapping, struct page *page)
 {
-	if (__remove_mapping(mapping, page)) {
+	if (__remove_mapping(mapping, page, NULL)) {
 		/*
 		 * Unfreezing the refcount with 1 rather than 2 effectively
 		 * drops the pagecache ref for us without requiring another
@@ -587,6 +609,7 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 	pagevec_init(&freed_pvec, 1);
 	while (!list_empty(page_list)) {
 		struct address_space *mapping;
+		struct ccache_entry *centry;
 		struct page *page;
 		int may_enter_fs;
 		int referenced;
@@ -741,9 +764,19 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 			}
 		}
 
-		if (!mapping || !__remove_mapping(mapping, page))
+		if (!mapping)
 			goto keep_locked;
 
+		/*
+		 * Compress a clean file page into the ccache before dropping
+		 * it, so that a later miss can be served without I/O.
+		 */
+		centry = ccache_prepare(mapping, page);
+		if (!__remove_mapping(mapping, page, centry)) {
+			ccache_abort(centry);
+			goto keep_locked;
+		}
+
 		/*
 		 * At this point, we have no other references and there is
 		 * no way to pick any more up (removed from LRU, removed
@@ -1036,6 +1069,87 @@ int isolate_lru_page(struct page *page)
 	return ret;
 }
 
+/*
+ * Take zone->lru_lock on behalf of reclaim, with interrupts already disabled,
+ * and adapt the zone's isolation batch to how contended the lock is.
+ */
+static void reclaim_lock_lru(struct zone *zone)
+{
+	unsigned int batch;
+	u64 start, wait;
+
+	if (spin_trylock(&zone->lru_lock)) {
+		batch = zone->lru_batch;
+		if (batch > SWAP_CLUSTER_MAX)
+			zone->lru_batch = max_t(unsigned int, batch - batch / 8,
+						SWAP_CLUSTER_MAX);
+		return;
+	}
+
+	start = cpu_clock(smp_processor_id());
+	spin_lock(&zone->lru_lock);
+	wait = cpu_clock(smp_processor_id()) - start;
+
+	zone->lru_batch = min_t(unsigned int, zone->lru_batch * 2,
+				LRU_BATCH_MAX);
+	__count_vm_event(LRU_LOCK_CONTENDED);
+	__count_vm_events(LRU_LOCK_WAIT_US, div_u64(wait, NSEC_PER_USEC));
+	trace_mm_vmscan_lru_lock_contended(zone, wait);
+}
+
+static inline void reclaim_lock_lru_irq(struct zone *zone)
+{
+	local_irq_disable();
+	reclaim_lock_lru(zone);
+}
+
+/*
+ * How many pages to scan next, at most @nr_left.  Lumpy reclaim takes up to
+ * 1 << order pages for each page it scans, so it sticks to swap_cluster_max,
+ * as do all reclaimers once too much of the zone is isolated.
+ */
+static unsigned long reclaim_batch(struct zone *zone, struct scan_control *sc,
+				   unsigned long nr_left)
+{
+	unsigned long batch = sc->swap_cluster_max;
+	unsigned long inactive;
+
+	if (!sc->order && zone->lru_batch > batch) {
+		inactive = zone_page_state(zone, NR_INACTIVE_ANON) +
+			   zone_page_state(zone, NR_INACTIVE_FILE);
+		if (zone->lru_isolated + zone->lru_batch <= inactive / 8)
+			batch = zone->lru_batch;
+	}
+	return min(batch, nr_left);
+}
+
+/*
+ * Drop the isolation reference of a page that was just put back on the
+ * LRU, under zone->lru_lock.  Should that be the last reference, the page
+ * comes off the LRU again and goes on @pages_to_free, to be freed with
+ * free_page_list() once the lock is dropped.  Unlike releasing a pagevec,
+ * this doesn't need to drop the lock every PAGEVEC_SIZE pages.
+ */
+static void putback_drop_ref(struct zone *zone, struct page *page,
+			     struct list_head *pages_to_free)
+{
+	if (put_page_testzero(page)) {
+		__ClearPageLRU(page);
+		del_page_from_lru(zone, page);
+		list_add(&page->lru, pages_to_free);
+	}
+}
+
+static void free_page_list(struct list_head *pages_to_free)
+{
+	struct page *page, *next;
+
+	list_for_each_entry_safe(page, next, pages_to_free, lru) {
+		list_del(&page->lru);
+		free_cold_page(page);
+	}
+}
+
 /*
  * shrink_inactive_list() is a helper for shrink_zone().  It returns the number
  * of reclaimed pages
@@ -1045,17 +1159,16 @@ static unsigned long shrink_inactive_list(unsigned long max_scan,
 			int priority, int file)
 {
 	LIST_HEAD(page_list);
-	struct pagevec pvec;
 	unsigned long nr_scanned = 0;
 	unsigned long nr_reclaimed = 0;
 	struct zone_reclaim_stat *reclaim_stat = get_reclaim_stat(zone, sc);
 
-	pagevec_init(&pvec, 1);
-
 	lru_add_drain();
-	spin_lock_irq(&zone->lru_lock);
+	reclaim_lock_lru_irq(zone);
 	do {
 		struct page *page;
+		unsigned long nr_batch = reclaim_batch(zone, sc,
+						       max_scan - nr_scanned);
 		unsigned long nr_taken;
 		unsigned long nr_scan;
 		unsigned long nr_freed;
@@ -1075,9 +1188,11 @@ static unsigned long shrink_inactive_list(unsigned long max_scan,
 		else if (sc->order && priority < DEF_PRIORITY - 2)
 			mode = ISOLATE_BOTH;
 
-		nr_taken = sc->isolate_pages(sc->swap_cluster_max,
+		nr_taken = sc->isolate_pages(nr_batch,
 			     &page_list, &nr_scan, sc->order, mode,
 				zone, sc->mem_cgroup, 0, file);
+		trace_mm_vmscan_lru_isolate(zone, sc->order, nr_batch,
+					    nr_scan, nr_taken, file);
 		nr_active = clear_active_flags(&page_list, count);
 		__count_vm_events(PGDEACTIVATE, nr_active);
 
@@ -1092,6 +1207,7 @@ static unsigned long shrink_inactive_list(unsigned long max_scan,
 
 		if (scanning_global_lru(sc))
 			zone->pages_scanned += nr_scan;
+		zone->lru_isolated += nr_taken;
 
 		reclaim_stat->recent_scanned[0] += count[LRU_INACTIVE_ANON];
 		reclaim_stat->recent_scanned[0] += count[LRU_ACTIVE_ANON];
@@ -1125,6 +1241,22 @@ static unsigned long shrink_inactive_list(unsigned long max_scan,
 		}
 
 		nr_reclaimed += nr_freed;
+
+		/*
+		 * Put back any unfreeable pages.  Evictable ones go through
+		 * this CPU's putback pagevec, which takes lru_lock for
+		 * PAGEVEC_SIZE pages at a time.
+		 */
+		while (!list_empty(&page_list)) {
+			page = lru_to_page(&page_list);
+			VM_BUG_ON(PageLRU(page));
+			list_del(&page->lru);
+			if (unlikely(!page_evictable(page, NULL)))
+				putback_lru_page(page);
+			else
+				lru_putback_page(page);
+		}
+
 		local_irq_disable();
 		if (current_is_kswapd()) {
 			__count_zone_vm_events(PGSCAN_KSWAPD, zone, nr_scan);
@@ -1137,39 +1269,12 @@ static unsigned long shrink_inactive_list(unsigned long max_scan,
 		if (nr_taken == 0)
 			goto done;
 
-		spin_lock(&zone->lru_lock);
-		/*
-		 * Put back any unfreeable pages.
-		 */
-		while (!list_empty(&page_list)) {
-			int lru;
-			page = lru_to_page(&page_list);
-			VM_BUG_ON(PageLRU(page));
-			list_del(&page->lru);
-			if (unlikely(!page_evictable(page, NULL))) {
-				spin_unlock_irq(&zone->lru_lock);
-				putback_lru_page(page);
-				spin_lock_irq(&zone->lru_lock);
-				continue;
-			}
-			SetPageLRU(page);
-			lru = page_lru(page);
-			add_page_to_lru_list(zone, page, lru);
-			if (PageActive(page)) {
-				int file = !!page_is_file_cache(page);
-				reclaim_stat->recent_rotated[file]++;
-			}
-			if (!pagevec_add(&pvec, page)) {
-				spin_unlock_irq(&zone->lru_lock);
-				__pagevec_release(&pvec);
-				spin_lock_irq(&zone->lru_lock);
-			}
-		}
+		reclaim_lock_lru(zone);
+		zone->lru_isolated -= nr_taken;
   	} while (nr_scanned < max_scan);
 	spin_unlock(&zone->lru_lock);
 done:
 	local_irq_enable();
-	pagevec_release(&pvec);
 	return nr_reclaimed;
 }
 
@@ -1210,20 +1315,23 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 			struct scan_control *sc, int priority, int file)
 {
 	unsigned long pgmoved;
-	int pgdeactivate = 0;
 	unsigned long pgscanned;
+	unsigned long nr_taken;
 	LIST_HEAD(l_hold);	/* The pages which were snipped off */
 	LIST_HEAD(l_inactive);
+	LIST_HEAD(l_free);	/* Pages put back but no longer in use */
 	struct page *page;
-	struct pagevec pvec;
 	enum lru_list lru;
 	struct zone_reclaim_stat *reclaim_stat = get_reclaim_stat(zone, sc);
+	int swap_full = vm_swap_full();
 
 	lru_add_drain();
-	spin_lock_irq(&zone->lru_lock);
+	reclaim_lock_lru_irq(zone);
 	pgmoved = sc->isolate_pages(nr_pages, &l_hold, &pgscanned, sc->order,
 					ISOLATE_ACTIVE, zone,
 					sc->mem_cgroup, 1, file);
+	trace_mm_vmscan_lru_isolate(zone, sc->order, nr_pages, pgscanned,
+				    pgmoved, file);
 	/*
 	 * zone->pages_scanned is used for detect zone's oom
 	 * mem_cgroup remembers nr_scan by itself.
@@ -1231,6 +1339,8 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 	if (scanning_global_lru(sc)) {
 		zone->pages_scanned += pgscanned;
 	}
+	nr_taken = pgmoved;
+	zone->lru_isolated += nr_taken;
 	reclaim_stat->recent_scanned[!!file] += pgmoved;
 
 	if (file)
@@ -1255,16 +1365,31 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 		    page_referenced(page, 0, sc->mem_cgroup))
 			pgmoved++;
 
+		/*
+		 * Drop buffers and swap space now, while we hold a reference
+		 * and not the lru_lock.
+		 */
+		if (unlikely(buffer_heads_over_limit) &&
+		    PagePrivate(page) && trylock_page(page)) {
+			if (PagePrivate(page))
+				try_to_release_page(page, 0);
+			unlock_page(page);
+		}
+		if (swap_full && PageSwapCache(page) && trylock_page(page)) {
+			try_to_free_swap(page);
+			unlock_page(page);
+		}
+
 		list_add(&page->lru, &l_inactive);
 	}
 
 	/*
 	 * Move the pages to the [file or anon] inactive list.
 	 */
-	pagevec_init(&pvec, 1);
 	lru = LRU_BASE + file * LRU_FILE;
 
-	spin_lock_irq(&zone->lru_lock);
+	reclaim_lock_lru_irq(zone);
+	zone->lru_isolated -= nr_taken;
 	/*
 	 * Count referenced pages from currently used mappings as
 	 * rotated, even though they are moved to the inactive list.
@@ -1285,31 +1410,14 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 		list_move(&page->lru, &zone->lru[lru].list);
 		mem_cgroup_add_lru_list(page, lru);
 		pgmoved++;
-		if (!pagevec_add(&pvec, page)) {
-			__mod_zone_page_state(zone, NR_LRU_BASE + lru, pgmoved);
-			spin_unlock_irq(&zone->lru_lock);
-			pgdeactivate += pgmoved;
-			pgmoved = 0;
-			if (buffer_heads_over_limit)
-				pagevec_strip(&pvec);
-			__pagevec_release(&pvec);
-			spin_lock_irq(&zone->lru_lock);
-		}
+		putback_drop_ref(zone, page, &l_free);
 	}
 	__mod_zone_page_state(zone, NR_LRU_BASE + lru, pgmoved);
-	pgdeactivate += pgmoved;
-	if (buffer_heads_over_limit) {
-		spin_unlock_irq(&zone->lru_lock);
-		pagevec_strip(&pvec);
-		spin_lock_irq(&zone->lru_lock);
-	}
 	__count_zone_vm_events(PGREFILL, zone, pgscanned);
-	__count_vm_events(PGDEACTIVATE, pgdeactivate);
+	__count_vm_events(PGDEACTIVATE, pgmoved);
 	spin_unlock_irq(&zone->lru_lock);
-	if (vm_swap_full())
-		pagevec_swap_free(&pvec);
 
-	pagevec_release(&pvec);
+	free_page_list(&l_free);
 }
 
 static int inactive_anon_is_low_global(struct zone *zone)
@@ -1489,7 +1597,7 @@ static void shrink_zone(int priority, struct zone *zone,
 					nr[LRU_INACTIVE_FILE]) {
 		for_each_evictable_lru(l) {
 			if (nr[l]) {
-				nr_to_scan = min(nr[l], swap_cluster_max);
+				nr_to_scan = reclaim_batch(zone, sc, nr[l]);
 				nr[l] -= nr_to_scan;
 
 				nr_reclaimed += shrink_list(l, nr_to_scan,
@@ -1700,8 +1808,21 @@ unsigned long try_to_free_pages(struct zonelist *zonelist, int order,
 		.mem_cgroup = NULL,
 		.isolate_pages = isolate_pages_global,
 	};
+	unsigned long nr_reclaimed;
+	ktime_t start;
+	s64 latency;
 
-	return do_try_to_free_pages(zonelist, &sc);
+	trace_mm_vmscan_direct_reclaim_begin(order, gfp_mask);
+	start = ktime_get();
+
+	nr_reclaimed = do_try_to_free_pages(zonelist, &sc);
+
+	latency = ktime_us_delta(ktime_get(), start);
+	count_vm_events(DIRECT_RECLAIM_US, latency);
+	mm_stall_account(order ? MM_STALL_LUMPY : MM_STALL_RECLAIM, latency);
+	trace_mm_vmscan_direct_reclaim_end(nr_reclaimed, latency);
+
+	return nr_reclaimed;
 }
 
 #ifdef CONFIG_CGROUP_MEM_RES_CTLR
@@ -15,6 +15,8 @@
 #include <linux/cpu.h>
 #include <linux/vmstat.h>
 #include <linux/sched.h>
+#include <linux/math64.h>
+#include <linux/compaction.h>
 
 #ifdef CONFIG_VM_EVENT_COUNTERS
 DEFINE_PER_CPU(struct vm_event_state, vm_event_states) = {{0}};
@@ -69,6 +71,30 @@ void vm_events_fold_cpu(int cpu)
 
 #endif /* CONFIG_VM_EVENT_COUNTERS */
 
+/*
+ * Memory stall histograms, bucket 0 counts stalls below
+ * 1 << MM_STALL_SHIFT us, bucket n stalls in
+ * [1 << (MM_STALL_SHIFT + n - 1), 1 << (MM_STALL_SHIFT + n)) us
+ * and the last bucket everything slower.
+ */
+#define MM_STALL_SHIFT		5
+#define MM_STALL_BUCKETS	18
+
+static atomic_t mm_stall_hist[NR_MM_STALL_ITEMS][MM_STALL_BUCKETS];
+
+void mm_stall_account(enum mm_stall_item item, s64 us)
+{
+	int bucket;
+
+	if (us < 0)
+		us = 0;
+	us >>= MM_STALL_SHIFT;
+	bucket = us > INT_MAX ? MM_STALL_BUCKETS - 1 : fls(us);
+	if (bucket >= MM_STALL_BUCKETS)
+		bucket = MM_STALL_BUCKETS - 1;
+	atomic_inc(&mm_stall_hist[item][bucket]);
+}
+
 /*
  * Manage combined zone based / global counters
  *
@@ -383,6 +409,88 @@ void zone_statistics(struct zone *preferred_zone, struct zone *z)
 }
 #endif
 
+#if defined(CONFIG_PROC_FS) || defined(CONFIG_COMPACTION)
+struct contig_page_info {
+	unsigned long free_pages;
+	unsigned long free_blocks_total;
+	unsigned long free_blocks_suitable;
+};
+
+/*
+ * Calculate the number of free pages in a zone, how many contiguous
+ * pages are free and how many are large enough to satisfy an allocation of
+ * the target size.  Note that this function makes no attempt to estimate
+ * how many suitable free blocks there *might* be if MOVABLE pages were
+ * migrated.  Calculating that is possible, but expensive and can be
+ * figured out from userspace
+ */
+static void fill_contig_page_info(struct zone *zone,
+				unsigned int suitable_order,
+				struct contig_page_info *info)
+{
+	unsigned int order;
+
+	info->free_pages = 0;
+	info->free_blocks_total = 0;
+	info->free_blocks_suitable = 0;
+
+	for (order = 0; order < MAX_ORDER; order++) {
+		unsigned long blocks;
+
+		/* Count number of free blocks */
+		blocks = zone->free_area[order].nr_free;
+		info->free_blocks_total += blocks;
+
+		/* Count free base pages */
+		info->free_pages += blocks << order;
+
+		/* Count the suitable free blocks */
+		if (order >= suitable_order)
+			info->free_blocks_suitable += blocks <<
+						(order - suitable_order);
+	}
+}
+
+/*
+ * A fragmentation index only makes sense if an allocation of a requested
+ * size would fail.  If that is true, the fragmentation index indicates
+ * whether external fragmentation or a lack of memory was the problem.
+ * The value can be used to determine if page reclaim or compaction
+ * should be used
+ */
+static int __fragmentation_index(unsigned int order,
+				struct contig_page_info *info)
+{
+	unsigned long requested = 1UL << order;
+
+	if (!info->free_blocks_total)
+		return 0;
+
+	/* Fragmentation index only makes sense when a request would fail */
+	if (info->free_blocks_suitable)
+		return -1000;
+
+	/*
+	 * Index is between 0 and 1 so return within 3 decimal places
+	 *
+	 * 0 => allocation would fail due to lack of memory
+	 * 1 => allocation would fail due to fragmentation
+	 */
+	return 1000 - div_u64((1000 + div_u64(info->free_pages * 1000ULL,
+						requested)),
+			      info->free_blocks_total);
+}
+
+/* Same as __fragmentation_index but allocs contig_page_info on stack */
+int fragmentation_index(struct zone *zone, unsigned int order)
+{
+	struct contig_page_info info;
+
+	fill_contig_page_info(zone, order, &info);
+	return __fragmentation_index(order, &info);
+}
+#endif
+
 #ifdef CONFIG_PROC_FS
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
@@ -458,6 +566,36 @@ static int frag_show(struct seq_file *m, void *arg)
 	return 0;
 }
 
+static void extfrag_show_print(struct seq_file *m, pg_data_t *pgdat,
+						struct zone *zone)
+{
+	unsigned int order;
+	int index;
+	struct contig_page_info info;
+
+	seq_printf(m, "Node %d, zone %8s ", pgdat->node_id, zone->name);
+	for (order = 0; order < MAX_ORDER; ++order) {
+		fill_contig_page_info(zone, order, &info);
+		index = __fragmentation_index(order, &info);
+		seq_printf(m, "%s%d.%03d ", index < 0 ? "-" : " ",
+			   abs(index) / 1000, abs(index) % 1000);
+	}
+	seq_putc(m, '\n');
+}
+
+/*
+ * Display the fragmentation index for each order: how much an allocation
+ * of that order failing would be due to fragmentation (towards 1.000)
+ * rather than to lack of memory (towards 0.000).  -1.000 means the
+ * allocation would succeed.
+ */
+static int extfrag_show(struct seq_file *m, void *arg)
+{
+	pg_data_t *pgdat = (pg_data_t *)arg;
+	walk_zones_in_node(m, pgdat, extfrag_show_print);
+	return 0;
+}
+
 static void pagetypeinfo_showfree_print(struct seq_file *m,
 					pg_data_t *pgdat, struct zone *zone)
 {
@@ -600,6 +738,63 @@ static const struct file_operations fragmentation_file_operations = {
 	.release	= seq_release,
 };
 
+static const struct seq_operations extfrag_op = {
+	.start	= frag_start,
+	.next	= frag_next,
+	.stop	= frag_stop,
+	.show	= extfrag_show,
+};
+
+static int extfrag_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &extfrag_op);
+}
+
+static const struct file_operations extfrag_file_operations = {
+	.open		= extfrag_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release,
+};
+
+static const char * const mm_stall_names[NR_MM_STALL_ITEMS] = {
+	"direct_reclaim",
+	"lumpy_reclaim",
+	"compaction",
+	"congestion_wait",
+	"dirty_throttle",
+};
+
+static int memstall_show(struct seq_file *m, void *arg)
+{
+	int i, j;
+
+	seq_printf(m, "memory stalls, bucket limits in us:");
+	for (j = 0; j < MM_STALL_BUCKETS - 1; j++)
+		seq_printf(m, " %d", 1 << (MM_STALL_SHIFT + j));
+	seq_printf(m, " inf\n");
+
+	for (i = 0; i < NR_MM_STALL_ITEMS; i++) {
+		seq_printf(m, "%s:", mm_stall_names[i]);
+		for (j = 0; j < MM_STALL_BUCKETS; j++)
+			seq_printf(m, " %d", atomic_read(&mm_stall_hist[i][j]));
+		seq_putc(m, '\n');
+	}
+	return 0;
+}
+
+static int memstall_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, memstall_show, NULL);
+}
+
+static const struct file_operations memstall_file_operations = {
+	.open		= memstall_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static const struct seq_operations pagetypeinfo_op = {
 	.start	= frag_start,
 	.next	= frag_next,
@@ -701,6 +896,9 @@ static const char * const vmstat_text[] = {
 	"allocstall",
 
 	"pgrotated",
+	"lru_lock_contended",
+	"lru_lock_wait_us",
+	"direct_reclaim_us",
 #ifdef CONFIG_HUGETLB_PAGE
 	"htlb_buddy_alloc_success",
 	"htlb_buddy_alloc_fail",
@@ -715,6 +913,22 @@ static const char * const vmstat_text[] = {
 	"unevictable_pgs_stranded",
 	"unevictable_pgs_mlockfreed",
 #endif
+#ifdef CONFIG_CCACHE
+	"ccache_hit",
+	"ccache_miss",
+	"ccache_store",
+	"ccache_reject",
+	"ccache_drop",
+	"ccache_invalidate",
+#endif
+#ifdef CONFIG_COMPACTION
+	"compact_blocks_moved",
+	"compact_pages_moved",
+	"compact_pagemigrate_failed",
+	"compact_stall",
+	"compact_fail",
+	"compact_success",
+#endif
 #endif
 };
 
@@ -960,6 +1174,8 @@ static int __init setup_vmstat(void)
 #endif
 #ifdef CONFIG_PROC_FS
 	proc_create("buddyinfo", S_IRUGO, NULL, &fragmentation_file_operations);
+	proc_create("extfrag_index", S_IRUGO, NULL, &extfrag_file_operations);
+	proc_create("memstall", S_IRUGO, NULL, &memstall_file_operations);
 	proc_create("pagetypeinfo", S_IRUGO, NULL, &pagetypeinfo_file_ops);
 	proc_create("vmstat", S_IRUGO, NULL, &proc_vmstat_file_operations);
 	proc_create("zoneinfo", S_IRUGO, NULL, &proc_zoneinfo_file_operations);
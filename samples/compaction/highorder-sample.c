@@ -0,0 +1,80 @@
+/*
+ * highorder-sample.c
+ *
+ * Measures high-order allocation success and latency, for testing memory
+ * compaction.  On load, it allocates nr blocks of 2^order pages the way a
+ * driver allocating a DMA buffer opportunistically would, and reports how
+ * many it got and how long the allocations took.  The blocks are held
+ * until the module is removed, so that loading it again keeps eating into
+ * the free blocks.
+ *
+ * Load it while memory is fragmented, e.g. by
+ * Documentation/vm/compaction-test.c, and compare the results with
+ * compaction triggered and without:
+ *
+ *	insmod highorder-sample.ko order=3 nr=64
+ *	dmesg | tail -1
+ *	rmmod highorder-sample
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+
+static unsigned int order = 3;
+module_param(order, uint, S_IRUGO);
+MODULE_PARM_DESC(order, "order of the blocks to allocate");
+
+static unsigned int nr = 64;
+module_param(nr, uint, S_IRUGO);
+MODULE_PARM_DESC(nr, "number of blocks to allocate");
+
+static struct page **blocks;
+static unsigned int nr_blocks;
+
+static int __init highorder_init(void)
+{
+	s64 ns, total = 0, max = 0;
+	struct page *page;
+	ktime_t start;
+	unsigned int i;
+
+	if (order >= MAX_ORDER || !nr)
+		return -EINVAL;
+	blocks = kcalloc(nr, sizeof(*blocks), GFP_KERNEL);
+	if (!blocks)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		start = ktime_get();
+		page = alloc_pages(GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN,
+				   order);
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		total += ns;
+		if (ns > max)
+			max = ns;
+		if (page)
+			blocks[nr_blocks++] = page;
+	}
+
+	printk(KERN_INFO "highorder: %u of %u order-%u allocations succeeded,"
+	       " avg %lld us, max %lld us\n", nr_blocks, nr, order,
+	       (long long)div_s64(total, nr * 1000),
+	       (long long)div_s64(max, 1000));
+	return 0;
+}
+
+static void __exit highorder_exit(void)
+{
+	while (nr_blocks)
+		__free_pages(blocks[--nr_blocks], order);
+	kfree(blocks);
+}
+
+module_init(highorder_init)
+module_exit(highorder_exit)
+MODULE_LICENSE("GPL");